@@ -8,8 +8,17 @@
  * Entry point for the de-multiplexer application.
  */
 
+#include <iostream>
+#include <stdexcept>
+
 #include <seqan/arg_parse.h>
 
+#ifdef SCTOOLS_TRACK_ALLOCATIONS
+#include "sctools/allocation_hooks.h"
+#endif
+
+#include "sctools/job_server.h"
+
 #include "functions.h"
 #include "settings.h"
 
@@ -37,6 +46,23 @@ main (int argc,
 		{
 			return 0;
 		}
+		else if (!settings.submitSocketPath.empty())
+		{
+			// Let the resident service run the job, resolving relative paths
+			// against the current directory.
+			sctools::JobServer::Request request;
+
+			if (settings.memoryReport)
+			{
+				throw std::invalid_argument("--memory-report cannot be used along with --submit");
+			}
+			request.workingDirPath = fs::current_path().string();
+			request.arguments.assign(argv + 1,
+			                         argv + argc);
+			sctools::JobServer::submit(settings.submitSocketPath,
+			                           request,
+			                           std::cout);
+		}
 		else
 		{
 			demultiplexPipeline(settings);
@@ -44,6 +70,7 @@ main (int argc,
 	}
 	catch (std::exception& e)
 	{
+		std::cerr << "sctools_demultiplex: " << e.what() << std::endl;
 		return -1;
 	}
 
@@ -0,0 +1,102 @@
+/**
+ * \file   apps/demultiplex/demultiplexd.cpp
+ * \author Elena Grassi
+ * \author Marilisa Montemurro
+ * \author Emanuele Parisi
+ * \date   February, 2019
+ *
+ * Entry point for the resident de-multiplexing service.
+ */
+
+#include <csignal>
+#include <iostream>
+
+#include <seqan/arg_parse.h>
+
+#ifdef SCTOOLS_TRACK_ALLOCATIONS
+#include "sctools/allocation_hooks.h"
+#endif
+
+#include "sctools/job_server.h"
+
+#include "service.h"
+#include "service_settings.h"
+
+using namespace sctools::demultiplex;
+
+/**
+ * Server stopped by the termination signals.
+ */
+static sctools::JobServer* activeServer = nullptr;
+
+/**
+ * \brief Stop accepting jobs, letting the running ones end.
+ *
+ * \param signal is the received signal.
+ */
+extern "C" void
+stopService (int signal)
+{
+	(void) signal;
+	if (activeServer != nullptr)
+	{
+		activeServer->stop();
+	}
+}
+
+/**
+ * Entry point of the resident de-multiplexing service.
+ *
+ * \param argc is the number of arguments provided on the command line.
+ * \param argv is the values of the arguments provided on the command line.
+ * \return the code 0 if the service stops gracefully; otherwise, it returns -1.
+ */
+int
+main (int argc,
+      char** argv)
+{
+	seqan::ArgumentParser::ParseResult parseResult;
+	ServiceSettings                    settings;
+	sctools::JobServer                 server;
+	sctools::ThreadBudget              budget;
+	WhitelistCache                     whitelists;
+
+	try
+	{
+		parseResult = settings.parseCommandLine(argc,
+		                                        argv);
+		if (parseResult != seqan::ArgumentParser::PARSE_OK)
+		{
+			return 0;
+		}
+		budget.configure(settings.threadsCount);
+		whitelists.configure(settings.maxWhitelists);
+		server.configure(settings.socketPath,
+		                 settings.maxJobs);
+
+		// Serve jobs until interrupted or terminated.
+		activeServer = &server;
+		std::signal(SIGINT,
+		            stopService);
+		std::signal(SIGTERM,
+		            stopService);
+		std::cout << "sctools_demultiplexd: serving " << settings.socketPath.string() << std::endl;
+		server.serve([&whitelists, &budget] (const sctools::JobServer::Request& request,
+		                                     std::ostream& out)
+		             {
+			             runServiceJob(request,
+			                           whitelists,
+			                           budget,
+			                           out);
+		             });
+		activeServer = nullptr;
+	}
+	catch (std::exception& e)
+	{
+		activeServer = nullptr;
+		std::cerr << "sctools_demultiplexd: " << e.what() << std::endl;
+		return -1;
+	}
+
+	return 0;
+}
@@ -12,12 +12,26 @@
 #ifndef SCTOOLS_APPS_DEMULTIPLEX_FUNCTIONS_H
 #define SCTOOLS_APPS_DEMULTIPLEX_FUNCTIONS_H
 
+#include <algorithm>
+#include <cmath>
+#include <fstream>
 #include <iostream>
+#include <string>
 #include <unordered_map>
+#include <utility>
+#include <vector>
 
-#include "sctools/alignments_reader.h"
-#include "sctools/alignments_writer.h"
-#include "sctools/cell_metrics_record.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "sctools/cell_index.h"
+#include "sctools/coverage_sink.h"
+#include "sctools/demultiplexer.h"
+#include "sctools/file_sink.h"
+#include "sctools/gene_count_sink.h"
+#include "sctools/memory_tracker.h"
+#include "sctools/shard_sink.h"
 
 #include "settings.h"
 
@@ -27,319 +41,617 @@ namespace demultiplex
 {
 
 /**
- * \brief Prepare the output for the barcodes to be de-multiplexed.
+ * \brief Build the configuration of the de-multiplexer from the command line
+ * arguments.
  *
- * This function creates a file in the output directory for every barcode to be
- * de-multiplexed, and reports the BAM header of the source alignment file to
- * each of them. Additionally, it initializes the map associating each target
- * barcode with is own output path and counter.
+ * \param settings is the class representing the de-multiplexer application command line
+ * arguments specified by the user.
+ * \param loadBarcodes is false if the barcodes of the CSV file are set by the
+ * caller, rather than loaded here.
+ * \return the configuration of the de-multiplexer.
+ */
+inline DemultiplexerConfig
+buildDemultiplexerConfig (const Settings& settings,
+                          bool loadBarcodes = true)
+{
+	DemultiplexerConfig config;
+
+	// Parse the CSV file reporting the per-cell summary metrics and extract
+	// the list of barcodes to be de-multiplexed, along with their total number
+	// of reads.
+	config.alignmentsFilePaths = settings.alignmentsFilePaths;
+	config.coordinateMerge     = settings.coordinateMerge;
+	config.batchSize           = settings.maxAlignmentBatchSize;
+	config.filterExpression    = settings.filterExpression;
+	config.minMappingQuality   = settings.minMappingQuality;
+	config.forbiddenTags       = settings.forbiddenTags;
+	config.targetReadsPerCell  = settings.targetReadsPerCell;
+	config.downsamplingSeed    = settings.downsamplingSeed;
+	config.compressionBackend  = settings.compressionBackend;
+	config.referenceFilePath   = settings.referenceFilePath;
+	config.correctBarcodes     = settings.correctBarcodes;
+	config.sampleMemory        = settings.memoryReport;
+	config.deduplicateUmis     = settings.deduplicateUmis;
+	config.mergeUmiNeighbours  = settings.mergeUmiNeighbours;
+	if (settings.noiseTopCount == 0)
+	{
+		config.noiseSketchCapacity = 0;
+	}
+	if (!settings.barcodeCSVFilePath.empty() && loadBarcodes)
+	{
+		config.loadBarcodes(settings.barcodeCSVFilePath);
+	}
+	if (!settings.cells.empty())
+	{
+		config.barcodes     = settings.cells;
+		config.useCellIndex = true;
+	}
+
+	return config;
+}
+
+/**
+ * \brief Report the most frequent barcodes of noise records.
  *
- * \param barcodeCSVPath is the CSV file containign the barcodes tto be
- * de-multiplexed as first column, ended by the "-1" string.
- * \param outputDirPath is the path to the output directory where
- * de-multiplexed files will be stored.
- * \param outputExtension is the extension of every output file, copied from
- * the input one.
- * \param reader is the interface used for fetching alignment records from the
- * source file.
- * \param outputDataMap is the map associating each barcode to its output path
- * and counter.
- * \param noisePath is the path to the file which will store the alignment
- * records whose barcode is not in the list read from the input CSV file.
+ * \param sketch is the summary of the noise barcodes.
+ * \param n is the maximum number of barcodes reported.
+ * \param out is the stream the report is written to.
  */
 inline void
-initializeOutputFiles (const fs::path& barcodeCSVPath,
-                       const fs::path& outputDirPath,
-                       const fs::path& outputExtension,
-                       const AlignmentsReader& reader,
-                       std::unordered_map<std::string,
-                                          std::pair<fs::path,
-                                                    uint64_t>>& outputDataMap,
-                       fs::path& noisePath) noexcept
+reportNoiseBarcodes (const BarcodeSketch& sketch,
+                     uint64_t n,
+                     std::ostream& out)
 {
-	std::vector<CellMetricsRecord> records;
-	fs::path                       outputBamFile;
-	AlignmentsWriter               writer;
-
-	// Create an output file for every different target barcode in the input
-	// CSV file.
-	records = CellMetricsRecord::readRecords(barcodeCSVPath);
-	for (auto&& r : records)
+	if (!sketch.isEnabled())
 	{
-		std::string rawBarcode = r.get<CellMetricsRecord::BARCODE>();
-		uint64_t    dashIndex  = rawBarcode.find_first_of('-');
-		std::string barcode    = std::string(rawBarcode.begin(),
-		                                     rawBarcode.begin() + dashIndex);
-
-		// Build the current output file path and initialize its writer.
-		outputBamFile = outputDirPath / barcode;
-		outputBamFile += outputExtension;
-		AlignmentsWriter::forwardHeader(outputBamFile, reader);
-		//writer.configure(outputBamFile,
-		//                 reader,
-		//                 false);
-
-		// Create the output data map entry corresponding to the current
-		// barcode.
-		outputDataMap.emplace(barcode,
-		                      std::make_pair(outputBamFile,
-		                                     0));
+		return;
 	}
 
-	// Create a dummy 'noise.bam' file for de-multiplexing records whose
-	// barcode is not among the target ones.
-	noisePath = outputDirPath / "noise";
-	noisePath += outputExtension;
-	AlignmentsWriter::forwardHeader(noisePath, reader);
-	//writer.configure(noisePath,
-	//                 reader,
-	//                 false);
+	// Counts are upper bounds, exceeding the true ones by at most the
+	// reported error.
+	out << "NOISE report" << std::endl;
+	out << "distinct barcodes\t: ~" << std::llround(sketch.estimateDistinct()) << std::endl;
+	for (const auto& e : sketch.top(n))
+	{
+		out << e.barcode << "\t: " << e.count << " (error <= " << e.error << ")" << std::endl;
+	}
 }
 
 /**
- * \brief Extract the barcode from an alignment record.
+ * \brief Report how raw barcodes have been corrected.
  *
- * The barcode of an alignment record is assumed to be the value of the 'CB' tag. If the
- * 'CB' tag is not present, the 'CR' tag is looked for. It is assumed that at least one
- * among those two tags is always present in every alignment record.
+ * \param settings is the class representing the de-multiplexer application command line
+ * arguments specified by the user.
+ * \param corrected is the number of corrected records.
+ * \param ambiguous is the number of records close to several target barcodes.
+ * \param uncorrectable is the number of records close to no target barcode.
+ * \param out is the stream the report is written to.
+ */
+inline void
+reportCorrections (const Settings& settings,
+                   uint64_t corrected,
+                   uint64_t ambiguous,
+                   uint64_t uncorrectable,
+                   std::ostream& out)
+{
+	if (!settings.correctBarcodes)
+	{
+		return;
+	}
+	out << "CORRECTION report" << std::endl;
+	out << "corrected\t: " << corrected << std::endl;
+	out << "ambiguous\t: " << ambiguous << std::endl;
+	out << "uncorrectable\t: " << uncorrectable << std::endl;
+}
+
+/**
+ * \brief Report the memory used by the process.
+ *
+ * The peak resident memory and the samples taken during the run are always
+ * reported; the heap allocations of every subsystem only if they have been
+ * tracked.
  *
- * \param bamRecord is the alignment record the barcode is extracted from.
- * \return a string representing the extracted barcode.
+ * \param settings is the class representing the de-multiplexer application command line
+ * arguments specified by the user.
+ * \param out is the stream the report is written to.
  */
-inline std::string
-extractBarcode (const seqan::BamAlignmentRecord& bamRecord) noexcept
+inline void
+reportMemory (const Settings& settings,
+              std::ostream& out)
 {
-	uint64_t            tagIdx = 0;
-	std::string         barcode;
-	seqan::String<char> seqanBarcode;
-	seqan::BamTagsDict  tagsDict(bamRecord.tags);
-
-	if (seqan::findTagKey(tagIdx,
-	                      tagsDict,
-	                      "CB"))
+	if (!settings.memoryReport)
 	{
-		uint64_t dashIndex = 0;
-
-		extractTagValue(seqanBarcode,
-		                tagsDict,
-		                tagIdx);
-		barcode   = seqan::toCString(seqanBarcode);
-		dashIndex = barcode.find_first_of('-');
-		barcode   = std::string(barcode.begin(),
-		                        barcode.begin() + dashIndex);
+		return;
 	}
-	else if (findTagKey(tagIdx,
-	                    tagsDict,
-	                    "CR"))
+	out << "MEMORY report" << std::endl;
+	out << "peak RSS\t: " << MemoryTracker::readPeakRss() << " KiB" << std::endl;
+	for (const auto& s : MemoryTracker::getSamples())
 	{
-		extractTagValue(seqanBarcode,
-		                tagsDict,
-		                tagIdx);
-		barcode = seqan::toCString(seqanBarcode);
+		out << s.label << "\t: " << s.rssKiB << " KiB";
+		if (MemoryTracker::ENABLED)
+		{
+			out << " (" << s.liveBytes << " heap bytes)";
+		}
+		out << std::endl;
+	}
+	if (!MemoryTracker::ENABLED)
+	{
+		out << "allocations\t: not tracked" << std::endl;
+		return;
+	}
+	for (auto i = 0u; i < static_cast<uint32_t>(MemorySubsystem::COUNT); i++)
+	{
+		auto subsystem = static_cast<MemorySubsystem>(i);
+		auto usage     = MemoryTracker::getUsage(subsystem);
+
+		out << MemoryTracker::getName(subsystem) << "\t: "
+		    << usage.allocations << " allocations, "
+		    << usage.allocatedBytes << " bytes allocated, "
+		    << usage.peakBytes << " bytes peak, "
+		    << usage.liveBytes << " bytes live" << std::endl;
 	}
-
-	return barcode;
 }
 
 /**
- * \brief Check if the record given as input has to be de-multiplexed, or if it has to be
- * filtered away.
+ * \brief Entry point of the count-only process.
  *
- * \param record is the alignment record to be analyzed.
- * \param forbiddenTags is the list of tags that cause the analyzed record to be excluded
- * immediately, if any of them is present.
- * \param minMapQuality is the minimum mapping quality score for which the record is
- * considered valid.
- * \return true if the record is valid, false otherwise.
+ * Records are counted per barcode without being written. The counts of the
+ * target barcodes and the records rejected by every filter predicate are
+ * reported, while the counts of all the barcodes are written to the
+ * barcode_counts.tsv file of the output directory, by decreasing count.
+ *
+ * \param settings is the class representing the de-multiplexer application command line
+ * arguments specified by the user.
+ * \param config is the configuration of the de-multiplexer.
+ * \param out is the stream the reports are written to.
  */
-inline bool
-filterAlignmentRecord (const seqan::BamAlignmentRecord& record,
-                       const std::vector<std::string>& forbiddenTags,
-                       uint64_t minMapQuality) noexcept
+inline void
+countPipeline (const Settings& settings,
+               const DemultiplexerConfig& config,
+               std::ostream& out)
 {
-	bool isValid = true;
+	Demultiplexer demultiplexer;
+
+	demultiplexer.configure(config);
 
-	// Check if the mapping quality is sufficiently high for the record to be considered.
-	if (record.mapQ < minMapQuality)
+	const auto& statistics = demultiplexer.count();
+
+	// Report the details related to how many times each valid barcode would
+	// be de-multiplexed.
+	out << "BARCODE count report" << std::endl;
+	for (auto i = 0ul; i < config.barcodes.size(); i++)
 	{
-		isValid = false;
+		out << config.barcodes[i] << "\t: " << statistics.cellCounts[i] << std::endl;
+	}
+	out << "noise\t: " << statistics.noiseCount << std::endl;
+	out << "no barcode\t: " << statistics.missingBarcodeCount << std::endl;
+	out << "sampled out\t: " << statistics.sampledOut << std::endl;
+	reportCorrections(settings,
+	                  statistics.correctedCount,
+	                  statistics.ambiguousCount,
+	                  statistics.uncorrectableCount,
+	                  out);
+	reportNoiseBarcodes(demultiplexer.getNoiseSketch(),
+	                    settings.noiseTopCount,
+	                    out);
+
+	// Report which filter predicates reject records.
+	out << "FILTER report" << std::endl;
+	out << "records\t: " << statistics.recordsCount << std::endl;
+	out << "filtered\t: " << statistics.filteredCount << std::endl;
+	for (const auto& r : statistics.filterReasons)
+	{
+		out << r.first << "\t: " << r.second << std::endl;
 	}
 
-	// Check if the alignment record to be analyzed contains any of the exclude records.
-	// If so, it is not considered valid.
-	for (auto i = 0ul; i < forbiddenTags.size() && isValid; i++)
+	// Write the counts of all the barcodes.
+	std::vector<std::pair<std::string, uint64_t>> barcodeCounts(statistics.barcodeCounts.begin(),
+	                                                            statistics.barcodeCounts.end());
+	std::ofstream                                 countsWriter(settings.outputDirPath / "barcode_counts.tsv");
+
+	std::sort(barcodeCounts.begin(),
+	          barcodeCounts.end(),
+	          [] (const std::pair<std::string, uint64_t>& lhs,
+	              const std::pair<std::string, uint64_t>& rhs)
+	          {
+		          return lhs.second > rhs.second || (lhs.second == rhs.second && lhs.first < rhs.first);
+	          });
+	for (const auto& b : barcodeCounts)
+	{
+		countsWriter << b.first << "\t" << b.second << "\n";
+	}
+	if (!countsWriter)
 	{
-		seqan::BamTagsDict tagsDict(record.tags);
-		uint64_t           tagIndex = 0;
+		throw std::runtime_error("cannot write the barcode counts file");
+	}
+	reportMemory(settings,
+	             out);
+}
 
-		if (seqan::findTagKey(tagIndex,
-		                      tagsDict,
-		                      forbiddenTags[i].data()))
+/**
+ * \brief Entry point of the indexing process.
+ *
+ * The cell index of every input BAM file is written next to it, and its size
+ * is reported.
+ *
+ * \param settings is the class representing the de-multiplexer application command line
+ * arguments specified by the user.
+ * \param out is the stream the reports are written to.
+ */
+inline void
+indexPipeline (const Settings& settings,
+               std::ostream& out)
+{
+	out << "INDEX report" << std::endl;
+	for (const auto& p : settings.alignmentsFilePaths)
+	{
+		CellIndex index;
+		auto      indexPath = CellIndex::getSidecarPath(p);
+
+		if (p.extension() != ".bam")
 		{
-			isValid = false;
+			throw std::invalid_argument("cannot index '" +
+			                            p.string() +
+			                            "', as it is not a BAM file");
 		}
+		index.build(p,
+		            settings.compressionBackend,
+		            [] (const BamRecordView& record,
+		                std::string& barcode)
+		            {
+			            Demultiplexer::extractBarcode(record,
+			                                          barcode);
+		            });
+		index.save(indexPath);
+		out << indexPath.string() << "\t: " << index.getBarcodesCount() << " barcodes, "
+		    << index.getBlocksCount() << " blocks, "
+		    << fs::file_size(indexPath) << " bytes" << std::endl;
+	}
+	reportMemory(settings,
+	             out);
+}
+
+/**
+ * \brief Report how much of the input files has been read to extract the
+ * listed cells.
+ *
+ * \param settings is the class representing the de-multiplexer application command line
+ * arguments specified by the user.
+ * \param demultiplexer is the de-multiplexer, after its run.
+ * \param out is the stream the report is written to.
+ */
+inline void
+reportExtraction (const Settings& settings,
+                  const Demultiplexer& demultiplexer,
+                  std::ostream& out)
+{
+	uint64_t totalBytes = 0;
+	uint64_t readBytes  = demultiplexer.getCompressedBytesRead();
+
+	if (settings.cells.empty())
+	{
+		return;
 	}
+	for (const auto& p : settings.alignmentsFilePaths)
+	{
+		totalBytes += fs::file_size(p);
+	}
+	out << "EXTRACTION report" << std::endl;
+	out << "input bytes\t: " << totalBytes << std::endl;
+	out << "read bytes\t: " << readBytes << " ("
+	    << (totalBytes == 0 ? 0.0 : 100.0 * readBytes / totalBytes) << "%)" << std::endl;
+}
+
+/**
+ * \brief Report how many records have been de-multiplexed to every target
+ * barcode.
+ *
+ * \param settings is the class representing the de-multiplexer application command line
+ * arguments specified by the user.
+ * \param demultiplexer is the de-multiplexer, after its run.
+ * \param out is the stream the report is written to.
+ */
+inline void
+reportBarcodes (const Settings& settings,
+                const Demultiplexer& demultiplexer,
+                std::ostream& out)
+{
+	const auto& statistics = demultiplexer.getStatistics();
+	const auto& barcodes   = demultiplexer.getBarcodes();
+
+	out << "BARCODE count report" << std::endl;
+	for (auto i = 0ul; i < barcodes.size(); i++)
+	{
+		out << barcodes[i] << "\t: " << statistics.cellCounts[i] << std::endl;
+	}
+	reportCorrections(settings,
+	                  statistics.correctedCount,
+	                  statistics.ambiguousCount,
+	                  statistics.uncorrectableCount,
+	                  out);
+	reportNoiseBarcodes(demultiplexer.getNoiseSketch(),
+	                    settings.noiseTopCount,
+	                    out);
+
+	// Report how many reads have been collapsed into their molecules.
+	if (settings.deduplicateUmis)
+	{
+		out << "DEDUPLICATION report" << std::endl;
+		out << "duplicates\t: " << statistics.duplicatesCount << std::endl;
+		out << "no UMI\t: " << statistics.missingUmiCount << std::endl;
+	}
+}
+
+/**
+ * \brief Report how output writes have been issued.
+ *
+ * \param scheduler is the scheduler output writes have been issued through.
+ * \param out is the stream the report is written to.
+ */
+inline void
+reportOutput (const OutputScheduler& scheduler,
+              std::ostream& out)
+{
+	out << "OUTPUT report" << std::endl;
+	out << "mode\t: "
+	    << (scheduler.usesIoUring() ?
+	        (scheduler.usesRegisteredBuffers() ? "io_uring (registered buffers)" : "io_uring") :
+	        "pwrite")
+	    << std::endl;
+	out << "syscalls\t: " << scheduler.getStatistics().syscalls << std::endl;
+	out << "writes\t: " << scheduler.getStatistics().writes << std::endl;
+	out << "batches\t: " << scheduler.getStatistics().batches << std::endl;
+	out << "max in-flight\t: " << scheduler.getStatistics().maxInFlight << std::endl;
+}
+
+/**
+ * \brief De-multiplex the records to a sink, computing the coverage tracks
+ * and counting the records of every gene along the way if requested.
+ *
+ * \param settings is the class representing the de-multiplexer application command line
+ * arguments specified by the user.
+ * \param demultiplexer is the configured de-multiplexer.
+ * \param sink is the sink de-multiplexed records are written to.
+ * \param groups is the map associating barcodes with their group.
+ * \param out is the stream the report is written to.
+ */
+inline void
+runPipeline (const Settings& settings,
+             Demultiplexer& demultiplexer,
+             RecordSink& sink,
+             const std::unordered_map<std::string, std::string>& groups,
+             std::ostream& out)
+{
+	CoverageSinkConfig coverageConfig;
+	CoverageSink       coverageSink;
+	AnnotationIndex    annotation;
+	GeneCountSink      geneCountSink;
+	RecordSink*        head = &sink;
+
+	// Coverage tracks follow the outputs of the sink, so that barcodes of
+	// the same group share their track.
+	if (settings.writeCoverage)
+	{
+		coverageConfig.outputDirPath = settings.outputDirPath;
+		coverageConfig.format        = settings.coverageFormat;
+		coverageConfig.groups        = groups;
+		coverageSink.configure(coverageConfig,
+		                       head);
+		head = &coverageSink;
+	}
+
+	// Genes are counted in the same pass, after every filter.
+	if (!settings.annotationFilePath.empty())
+	{
+		annotation.load(settings.annotationFilePath);
+		geneCountSink.configure(annotation,
+		                        settings.outputDirPath,
+		                        head);
+		head = &geneCountSink;
+	}
+	demultiplexer.run(*head);
 
-	return isValid;
+	if (!settings.annotationFilePath.empty())
+	{
+		out << "GENE COUNT report" << std::endl;
+		out << "genes\t: " << annotation.getGenesCount() << std::endl;
+		out << "assigned\t: " << geneCountSink.getAssignedCount() << std::endl;
+		out << "no feature\t: " << geneCountSink.getNoFeatureCount() << std::endl;
+		out << "ambiguous\t: " << geneCountSink.getAmbiguousCount() << std::endl;
+		out << "skipped\t: " << geneCountSink.getSkippedCount() << std::endl;
+		out << "non-zero entries\t: " << geneCountSink.getEntriesCount() << std::endl;
+	}
 }
 
 /**
- * \brief The function which actually implement the de-multiplexing loop over
- * the records read from the input alignment file.
+ * \brief De-multiplex the records to a fixed number of shard files.
  *
- * \param bamInputReader is the source of the alignment records to be
- * de-multiplexed.
- * \param outputDataMap is the map which associates each barcode to be
- * de-multiplexed with its own output file, along with a counter storing how
- * many times each barcode has been de-multiplexed.
- * \param noisePath is the path to the file storing the alignment records whose
- * barcode is not in the list provided by the user via the input CSV file.
- * \param batchSize is the maximum number of records read from the input file
- * for every iteration.
- * \param forbiddenTags is the list of alignment record tags that causes any
- * record to be excluded, if present.
- * \param minMapQuality is the minimum mapping quality for which a record is
- * considered.
+ * \param settings is the class representing the de-multiplexer application command line
+ * arguments specified by the user.
+ * \param demultiplexer is the configured de-multiplexer.
+ * \param out is the stream the reports are written to.
  */
 inline void
-demultiplexCore (AlignmentsReader& bamInputReader,
-                 std::unordered_map<std::string,
-                                    std::pair<fs::path,
-                                              uint64_t>>& outputDataMap,
-                 fs::path& noisePath,
-                 uint64_t batchSize,
-                 const std::vector<std::string>& forbiddenTags,
-                 uint64_t minMapQuality,
-				 const bool writeBed) noexcept
+shardPipeline (const Settings& settings,
+               Demultiplexer& demultiplexer,
+               std::ostream& out)
 {
-	std::vector<seqan::BamAlignmentRecord> buffer;
-	uint64_t                               loadedRecords = 0;
-	AlignmentsWriter                       noiseWriter;
-
-	// Initialize the noise writer.
-	noiseWriter.configure(noisePath,
-	                      bamInputReader,
-						  true,
-	                      writeBed);
-
-	// Start main de-multiplex core loop.
-	buffer.resize(batchSize);
-	do
+	ShardSinkConfig sinkConfig;
+	ShardSink       sink;
+
+	// Target barcodes are spread over the shard files, and the byte ranges
+	// of every barcode are listed in the manifest.
+	sinkConfig.outputDirPath      = settings.outputDirPath;
+	sinkConfig.shardsCount        = settings.shardsCount;
+	sinkConfig.bufferedRecords    = settings.maxAlignmentBatchSize;
+	sinkConfig.compressionBackend = settings.compressionBackend;
+	sinkConfig.compressionLevel   = settings.compressionLevel;
+	sinkConfig.outputQueueDepth   = settings.outputQueueDepth;
+	sinkConfig.useIoUring         = settings.useIoUring;
+	sink.configure(sinkConfig);
+	runPipeline(settings,
+	            demultiplexer,
+	            sink,
+	            {},
+	            out);
+
+	reportBarcodes(settings,
+	               demultiplexer,
+	               out);
+	reportExtraction(settings,
+	                 demultiplexer,
+	                 out);
+	reportOutput(sink.getScheduler(),
+	             out);
+	reportMemory(settings,
+	             out);
+}
+
+/**
+ * \brief De-multiplex the records to one file per target barcode or group.
+ *
+ * \param settings is the class representing the de-multiplexer application command line
+ * arguments specified by the user.
+ * \param demultiplexer is the configured de-multiplexer.
+ * \param out is the stream the reports are written to.
+ */
+inline void
+filePipeline (const Settings& settings,
+              Demultiplexer& demultiplexer,
+              std::ostream& out)
+{
+	FileSinkConfig sinkConfig;
+	FileSink       sink;
+
+	// Every target barcode is written to its own file in the output
+	// directory, or to the file of its group.
+	sinkConfig.outputDirPath      = settings.outputDirPath;
+	sinkConfig.writeBed           = settings.writeBed;
+	sinkConfig.compressionBackend = settings.compressionBackend;
+	sinkConfig.compressionLevel   = settings.compressionLevel;
+	sinkConfig.emptyOutputPolicy  = settings.emptyOutputPolicy;
+	sinkConfig.outputQueueDepth   = settings.outputQueueDepth;
+	sinkConfig.maxOpenFiles       = settings.maxOpenFiles;
+	sinkConfig.useIoUring         = settings.useIoUring;
+	sinkConfig.writeCram          = settings.writeCram;
+	sinkConfig.referenceFilePath  = settings.referenceFilePath;
+	sinkConfig.sortOrder          = settings.sortOrder;
+	sinkConfig.sortMemory         = settings.sortMemory << 20;
+	if (!settings.groupsFilePath.empty())
+	{
+		sinkConfig.loadGroups(settings.groupsFilePath);
+	}
+	sink.configure(sinkConfig);
+	runPipeline(settings,
+	            demultiplexer,
+	            sink,
+	            sinkConfig.groups,
+	            out);
+
+	reportBarcodes(settings,
+	               demultiplexer,
+	               out);
+	reportExtraction(settings,
+	                 demultiplexer,
+	                 out);
+
+	// Report how many records have been written to every group.
+	if (!sinkConfig.groups.empty())
 	{
-		std::unordered_map<std::string,
-		                   std::vector<seqan::BamAlignmentRecord>> recordsMap;
-		std::vector<seqan::BamAlignmentRecord>                     noiseBuffer;
-
-		// Load a batch of BAM alignment records from the source file and
-		// store them in the records map.
-		recordsMap.clear();
-		noiseBuffer.clear();
-		loadedRecords = bamInputReader.read(buffer.begin(),
-		                                    buffer.end());
-		std::cout << buffer[0].tags << std::endl;
-		for (auto i = 0ull; i < loadedRecords; i++)
+		const auto&           statistics = demultiplexer.getStatistics();
+		std::vector<uint64_t> outputCounts(sink.getOutputsCount(),
+		                                   0);
+
+		for (auto i = 0ul; i < statistics.cellCounts.size(); i++)
 		{
-			if (filterAlignmentRecord(buffer[i],
-			                          forbiddenTags,
-			                          minMapQuality))
-			{
-				auto barcode  = extractBarcode(buffer[i]);
-				auto outMapIt = outputDataMap.find(barcode);
-
-				if (outMapIt != outputDataMap.end())
-				{
-					auto recordsMapIt = recordsMap.find(barcode);
-
-					// Increment the counter for the found barcode.
-					outMapIt->second.second += 1;
-
-					// If the barcode found has never been inserted into the
-					// records map, create a new entry; otherwise, append the
-					// current alignment record.
-					if (recordsMapIt != recordsMap.end())
-					{
-						recordsMapIt->second.emplace_back(buffer[i]);
-					}
-					else
-					{
-						recordsMap[barcode] = {buffer[i]};
-					};
-				}
-				else
-				{
-					noiseBuffer.emplace_back(buffer[i]);
-				}
-			}
+			outputCounts[sink.getOutputId(i)] += statistics.cellCounts[i];
 		}
-
-		// De-multiplex the records in the records map and store the remaining
-		// records in the noise file.
-		for (auto p : recordsMap)
+		out << "GROUP count report" << std::endl;
+		for (auto i = 0ul; i < outputCounts.size(); i++)
 		{
-			AlignmentsWriter mapWriter;
-
-			mapWriter.configure(outputDataMap[p.first].first,
-			                    bamInputReader,
-								true,
-			                    writeBed);
-			mapWriter.write(p.second.begin(),
-			                p.second.end());
+			out << sink.getOutputName(i) << "\t: " << outputCounts[i] << std::endl;
 		}
-
-		// init noise writer
-		noiseWriter.write(noiseBuffer.begin(),
-		                  noiseBuffer.end());
 	}
-	while (loadedRecords > 0);
+	reportOutput(sink.getScheduler(),
+	             out);
+	out << "writer threads\t: " << sink.getWritePool().getThreadsCount() << std::endl;
+	out << "stolen writes\t: " << sink.getWritePool().getStolenCount() << std::endl;
+	if (sinkConfig.sortOrder == SortOrder::QUERYNAME)
+	{
+		out << "spilled runs\t: " << sink.getSpilledRunsCount() << std::endl;
+	}
+	reportMemory(settings,
+	             out);
 }
 
 /**
  * \brief Entry point of the de-multiplexing process.
  *
+ * The de-multiplexer and its sink are configured from the command line
+ * arguments, then the per-barcode counts and the output statistics are
+ * reported.
+ *
  * \param settings is the class representing the de-multiplexer application command line
  * arguments specified by the user.
+ * \param config is the configuration of the de-multiplexer.
+ * \param out is the stream the reports are written to.
  */
 inline void
-demultiplexPipeline (const Settings& settings) noexcept
+demultiplexPipeline (const Settings& settings,
+                     const DemultiplexerConfig& config,
+                     std::ostream& out)
 {
-	AlignmentsReader                        bamInputReader;
-	std::unordered_map<std::string,
-	                   std::pair<fs::path,
-	                             uint64_t>> outputDataMap;
-	fs::path                                noisePath;
+	Demultiplexer demultiplexer;
 
-	// Initialize the reader class for accessing the BAM file containing the
-	// records to be de-multiplexed.
-	bamInputReader.configure(settings.alignmentsFilePath);
+#ifdef _OPENMP
+	omp_set_num_threads(settings.threadsCount);
+#endif
 
-	// Parse the CSV file reporting the per-cell summary metrics and extract
-	// the list of barcodes to be de-multiplexed. Then, create a file for every
-	// target barcode.
-	initializeOutputFiles(settings.barcodeCSVFilePath,
-	                      settings.outputDirPath,
-	                      settings.alignmentsFilePath.extension(),
-	                      bamInputReader,
-	                      outputDataMap,
-	                      noisePath);
+	if (settings.countOnly)
+	{
+		countPipeline(settings,
+		              config,
+		              out);
+		return;
+	}
+	if (settings.buildIndex)
+	{
+		indexPipeline(settings,
+		              out);
+		return;
+	}
 
 	// Start the de-multiplexing procedure.
-	demultiplexCore(bamInputReader,
-	                outputDataMap,
-	                noisePath,
-	                settings.maxAlignmentBatchSize,
-	                settings.forbiddenTags,
-	                settings.minMappingQuality,
-					settings.writeBed);
-
-	// Report the details related to how many times each valid barcode is
-	// de-multiplexed.
-	std::cout << "BARCODE count report" << std::endl;
-	for (const auto& p : outputDataMap)
+	demultiplexer.configure(config);
+	if (settings.shardsCount > 0)
+	{
+		shardPipeline(settings,
+		              demultiplexer,
+		              out);
+	}
+	else
 	{
-		std::cout << p.first << "\t: " << p.second.second << std::endl;
+		filePipeline(settings,
+		             demultiplexer,
+		             out);
 	}
 }
 
+/**
+ * \brief Entry point of the de-multiplexing process, reporting on the
+ * standard output.
+ *
+ * \param settings is the class representing the de-multiplexer application command line
+ * arguments specified by the user.
+ */
+inline void
+demultiplexPipeline (const Settings& settings)
+{
+	demultiplexPipeline(settings,
+	                    buildDemultiplexerConfig(settings),
+	                    std::cout);
+}
+
 } // demultiplex
 } // sctools
 
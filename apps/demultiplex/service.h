@@ -0,0 +1,339 @@
+/**
+ * \file   apps/demultiplex/service.h
+ * \author Elena Grassi
+ * \author Marilisa Montemurro
+ * \author Emanuele Parisi
+ * \date   February, 2019
+ *
+ * File containing the functions running the jobs submitted to the resident
+ * de-multiplexing service.
+ */
+
+#ifndef SCTOOLS_APPS_DEMULTIPLEX_SERVICE_H
+#define SCTOOLS_APPS_DEMULTIPLEX_SERVICE_H
+
+#include <cstdint>
+#include <experimental/filesystem>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "sctools/barcode_lookup.h"
+#include "sctools/demultiplexer.h"
+#include "sctools/job_server.h"
+
+#include "functions.h"
+#include "settings.h"
+
+namespace fs = std::experimental::filesystem;
+
+namespace sctools
+{
+namespace demultiplex
+{
+
+/**
+ * \brief Struct storing the barcodes loaded from a CSV file, along with their
+ * lookup structures.
+ */
+struct Whitelist
+{
+	/**
+	 * Barcodes to be de-multiplexed, without the "-1" suffix.
+	 */
+	std::vector<std::string>             barcodes;
+	/**
+	 * Total number of reads of every barcode.
+	 */
+	std::vector<uint64_t>                expectedReads;
+	/**
+	 * Lookup structures of the barcodes.
+	 */
+	std::shared_ptr<const BarcodeLookup> lookup;
+};
+
+/**
+ * \brief Class keeping the most recently used whitelists in memory, so that
+ * jobs de-multiplexing the same barcodes do not load them again.
+ *
+ * A whitelist is loaded again once its file changes size or modification
+ * time. Whitelists are loaded while the cache is locked, so that concurrent
+ * jobs never load the same file twice. Whitelists are shared read-only by
+ * the jobs using them, and stay alive until the last of these jobs ends,
+ * even if dropped from the cache.
+ */
+class WhitelistCache
+{
+
+public:
+
+	/**
+	 * Class constructor.
+	 */
+	WhitelistCache () = default;
+
+	/**
+	 * \brief Class copy constructor.
+	 *
+	 * \param other is the object the current instance is initialized from.
+	 */
+	WhitelistCache (const WhitelistCache& other) = delete;
+
+	/**
+	 * \brief Class copy assignment operator.
+	 *
+	 * \param other is the object the current instance is initialized from.
+	 * \return a reference to the assigned object.
+	 */
+	WhitelistCache&
+	operator= (const WhitelistCache& other) = delete;
+
+	/**
+	 * \brief Initialize the cache, with no whitelist loaded.
+	 *
+	 * \param capacity is the maximum number of whitelists kept in memory.
+	 */
+	inline void
+	configure (uint64_t capacity)
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+
+		if (capacity == 0)
+		{
+			throw std::invalid_argument("the whitelist cache capacity must be positive");
+		}
+		capacity_ = capacity;
+		entries_.clear();
+		clock_ = 0;
+	}
+
+	/**
+	 * \brief Access the whitelist of a CSV file, loading it if it is not in
+	 * memory yet.
+	 *
+	 * \param barcodeCSVPath is the absolute path of the CSV file.
+	 * \param correctBarcodes is true if the lookup structures must correct
+	 * raw barcodes.
+	 * \param hit is set to true if the whitelist was in memory already.
+	 * \return the whitelist.
+	 */
+	inline std::shared_ptr<const Whitelist>
+	get (const fs::path& barcodeCSVPath,
+	     bool correctBarcodes,
+	     bool& hit)
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		auto                        size      = fs::file_size(barcodeCSVPath);
+		auto                        writeTime = fs::last_write_time(barcodeCSVPath);
+		auto&                       entry     = entries_[barcodeCSVPath.string()];
+		bool                        needsCorrector;
+
+		// Reuse the whitelist in memory, provided its file did not change.
+		hit = entry.whitelist && entry.size == size && entry.writeTime == writeTime;
+		if (!hit)
+		{
+			DemultiplexerConfig config;
+			auto                whitelist = std::make_shared<Whitelist>();
+
+			config.loadBarcodes(barcodeCSVPath);
+			whitelist->barcodes      = std::move(config.barcodes);
+			whitelist->expectedReads = std::move(config.expectedReads);
+			whitelist->lookup        = BarcodeLookup::build(whitelist->barcodes,
+			                                                correctBarcodes);
+			entry.whitelist          = whitelist;
+			entry.size               = size;
+			entry.writeTime          = writeTime;
+		}
+
+		// Index the neighbours of the barcodes the first time a job corrects
+		// them, keeping the barcodes themselves.
+		needsCorrector = correctBarcodes &&
+		                 !entry.whitelist->barcodes.empty() &&
+		                 !entry.whitelist->lookup->corrector.isEnabled();
+		if (needsCorrector)
+		{
+			auto whitelist = std::make_shared<Whitelist>(*entry.whitelist);
+
+			whitelist->lookup = BarcodeLookup::build(whitelist->barcodes,
+			                                         true);
+			entry.whitelist   = whitelist;
+		}
+		entry.lastUse = ++clock_;
+		evict_();
+
+		return entry.whitelist;
+	}
+
+private:
+	/**
+	 * \brief Struct storing a whitelist in memory.
+	 */
+	struct Entry_
+	{
+		/**
+		 * Whitelist loaded from the CSV file.
+		 */
+		std::shared_ptr<const Whitelist> whitelist;
+		/**
+		 * Size of the CSV file when it has been loaded.
+		 */
+		uintmax_t                        size      = 0;
+		/**
+		 * Modification time of the CSV file when it has been loaded.
+		 */
+		fs::file_time_type               writeTime;
+		/**
+		 * Tick of the last job using the whitelist.
+		 */
+		uint64_t                         lastUse   = 0;
+	};
+
+	/**
+	 * Mutex guarding the whitelists.
+	 */
+	std::mutex                              mutex_;
+	/**
+	 * Whitelists in memory, by path of their CSV file.
+	 */
+	std::unordered_map<std::string, Entry_> entries_;
+	/**
+	 * Maximum number of whitelists in memory.
+	 */
+	uint64_t                                capacity_ = 1;
+	/**
+	 * Tick incremented whenever a whitelist is used.
+	 */
+	uint64_t                                clock_    = 0;
+
+	/**
+	 * \brief Drop the least recently used whitelists exceeding the capacity.
+	 */
+	inline void
+	evict_ ()
+	{
+		while (entries_.size() > capacity_)
+		{
+			auto oldestIt = entries_.begin();
+
+			for (auto entryIt = entries_.begin(); entryIt != entries_.end(); entryIt++)
+			{
+				if (entryIt->second.lastUse < oldestIt->second.lastUse)
+				{
+					oldestIt = entryIt;
+				}
+			}
+			entries_.erase(oldestIt);
+		}
+	}
+};
+
+/**
+ * \brief Run a job submitted to the resident service.
+ *
+ * The job arguments are those of sctools_demultiplex, relative paths being
+ * resolved against the directory the job has been submitted from. The job
+ * runs on the threads it asks for, or on the ones left in the budget if
+ * fewer, and its barcodes are taken from the whitelist cache. Memory reports
+ * are rejected, since the memory of the service is shared among its jobs.
+ *
+ * \param request is the submitted job.
+ * \param whitelists is the cache of the whitelists shared among the jobs.
+ * \param budget is the budget of threads shared among the jobs.
+ * \param out is the stream the reports are written to.
+ */
+inline void
+runServiceJob (const JobServer::Request& request,
+               WhitelistCache& whitelists,
+               ThreadBudget& budget,
+               std::ostream& out)
+{
+	Settings                           settings;
+	std::ostringstream                 errors;
+	std::vector<std::string>           arguments;
+	std::vector<char*>                 argv;
+	DemultiplexerConfig                config;
+	seqan::ArgumentParser::ParseResult parseResult;
+	uint64_t                           threadsCount;
+	bool                               cached = false;
+
+	// Parse the job arguments as if they were given on the command line.
+	arguments.emplace_back("sctools_demultiplex");
+	arguments.insert(arguments.end(),
+	                 request.arguments.begin(),
+	                 request.arguments.end());
+	for (auto& a : arguments)
+	{
+		argv.emplace_back(&a[0]);
+	}
+	argv.emplace_back(nullptr);
+	settings.workingDirPath = request.workingDirPath;
+	if (!settings.workingDirPath.is_absolute())
+	{
+		throw std::invalid_argument("the job working directory must be absolute");
+	}
+	parseResult = settings.parseCommandLine(arguments.size(),
+	                                        argv.data(),
+	                                        out,
+	                                        errors);
+	if (parseResult == seqan::ArgumentParser::PARSE_ERROR)
+	{
+		throw std::invalid_argument(errors.str());
+	}
+	if (parseResult != seqan::ArgumentParser::PARSE_OK)
+	{
+		return;
+	}
+
+	// Memory samples would mix the jobs sharing the service, and pile up
+	// for as long as it runs.
+	if (settings.memoryReport)
+	{
+		throw std::invalid_argument("--memory-report is not supported by jobs run by the service");
+	}
+
+	// Share the barcodes and their lookup structures with the other jobs.
+	config = buildDemultiplexerConfig(settings,
+	                                  false);
+	if (!settings.barcodeCSVFilePath.empty())
+	{
+		auto whitelist = whitelists.get(settings.barcodeCSVFilePath,
+		                                settings.correctBarcodes,
+		                                cached);
+
+		config.barcodes      = whitelist->barcodes;
+		config.expectedReads = whitelist->expectedReads;
+		config.barcodeLookup = whitelist->lookup;
+	}
+
+	// Run the job on its share of the thread budget.
+	threadsCount          = budget.acquire(settings.threadsCount);
+	settings.threadsCount = threadsCount;
+	out << "SERVICE report" << std::endl;
+	out << "threads\t: " << threadsCount << std::endl;
+	if (!settings.barcodeCSVFilePath.empty())
+	{
+		out << "whitelist\t: " << (cached ? "cached" : "loaded") << std::endl;
+	}
+	try
+	{
+		demultiplexPipeline(settings,
+		                    config,
+		                    out);
+	}
+	catch (...)
+	{
+		budget.release(threadsCount);
+		throw;
+	}
+	budget.release(threadsCount);
+}
+
+} // demultiplex
+} // sctools
+
+#endif // SCTOOLS_APPS_DEMULTIPLEX_SERVICE_H
@@ -0,0 +1,189 @@
+/**
+ * \file   apps/demultiplex/service_settings.h
+ * \author Elena Grassi
+ * \author Marilisa Montemurro
+ * \author Emanuele Parisi
+ * \date   February, 2019
+ *
+ * File containing facilities for specifying the arguments the resident
+ * de-multiplexing service accepts on the command line and for retrieving them
+ * at runtime.
+ */
+
+#ifndef SCTOOLS_APPS_DEMULTIPLEX_SERVICE_SETTINGS_H
+#define SCTOOLS_APPS_DEMULTIPLEX_SERVICE_SETTINGS_H
+
+#include <algorithm>
+#include <experimental/filesystem>
+#include <string>
+#include <thread>
+
+#include <seqan/arg_parse.h>
+
+namespace fs = std::experimental::filesystem;
+
+namespace sctools
+{
+namespace demultiplex
+{
+
+/**
+ * \brief Struct providing basic facilities for parsing the arguments the user provides
+ * to the resident service through the command line.
+ */
+class ServiceSettings
+{
+public:
+	/**
+	 * Path to the Unix domain socket jobs are submitted through.
+	 */
+	fs::path socketPath;
+	/**
+	 * Maximum number of jobs run concurrently.
+	 */
+	uint64_t maxJobs;
+	/**
+	 * Number of threads shared among the jobs being run.
+	 */
+	uint64_t threadsCount;
+	/**
+	 * Maximum number of barcode whitelists kept in memory between jobs.
+	 */
+	uint64_t maxWhitelists;
+
+	/**
+	 * \brief Class constructor.
+	 *
+	 * It specifies the arguments the resident service accepts on the command
+	 * line.
+	 */
+	ServiceSettings ()
+	{
+		// Set tool meta-data.
+		seqan::setAppName(parser_,
+		                  "sctools_demultiplexd");
+		seqan::setShortDescription(parser_,
+		                           "Resident alignment files de-multiplexing service.");
+		seqan::addDescription(parser_,
+		                      "sctools_demultiplexd runs the jobs submitted through "
+		                      "sctools_demultiplex --submit, keeping the parsed barcode "
+		                      "whitelists, their lookup structures and its threads warm "
+		                      "between jobs. Relative paths of a job are resolved "
+		                      "against the directory it has been submitted from.");
+		seqan::setCategory(parser_,
+		                   "SCTools suite");
+		seqan::setVersion(parser_,
+		                  SCTools_VERSION);
+		seqan::setDate(parser_,
+		               "2019");
+
+		// Socket jobs are submitted through.
+		seqan::addArgument(parser_,
+		                   seqan::ArgParseArgument(seqan::ArgParseArgument::STRING,
+		                                           "SOCKET"));
+		seqan::setHelpText(parser_,
+		                   0,
+		                   "Path of the Unix domain socket jobs are submitted "
+		                   "through. It is created accessible by the current user "
+		                   "only, and removed when the service stops.");
+
+		// Performance settings.
+		seqan::addSection(parser_,
+		                  "Performance options");
+		seqan::addOption(parser_,
+		                 seqan::ArgParseOption("j",
+		                                       "max-jobs",
+		                                       "Maximum number of jobs run "
+		                                       "concurrently. Further jobs wait for "
+		                                       "one of them to end.",
+		                                       seqan::ArgParseArgument::INTEGER,
+		                                       "JOBS"));
+		seqan::setMinValue(parser_,
+		                   "max-jobs",
+		                   "1");
+		seqan::setDefaultValue(parser_,
+		                       "max-jobs",
+		                       "2");
+
+		seqan::addOption(parser_,
+		                 seqan::ArgParseOption("t",
+		                                       "threads",
+		                                       "Number of threads shared among the "
+		                                       "jobs being run. A job runs on the "
+		                                       "threads it asks for through --threads, "
+		                                       "or on the ones left if fewer.",
+		                                       seqan::ArgParseArgument::INTEGER,
+		                                       "THREADS"));
+		seqan::setMinValue(parser_,
+		                   "threads",
+		                   "1");
+		seqan::setDefaultValue(parser_,
+		                       "threads",
+		                       std::to_string(std::max(std::thread::hardware_concurrency(),
+		                                               1u)));
+
+		seqan::addOption(parser_,
+		                 seqan::ArgParseOption("",
+		                                       "max-whitelists",
+		                                       "Maximum number of barcode whitelists "
+		                                       "kept in memory between jobs; the least "
+		                                       "recently used one is dropped first.",
+		                                       seqan::ArgParseArgument::INTEGER,
+		                                       "WHITELISTS"));
+		seqan::setMinValue(parser_,
+		                   "max-whitelists",
+		                   "1");
+		seqan::setDefaultValue(parser_,
+		                       "max-whitelists",
+		                       "8");
+	}
+
+	/**
+	 * \brief Trigger the parsing of the command line arguments the user provided.
+	 *
+	 * \param argc is the number of arguments present on the command line.
+	 * \param argv are the values of the arguments on the command line.
+	 * \return a code representing the outcome of the parse result.
+	 */
+	inline seqan::ArgumentParser::ParseResult
+	parseCommandLine (int argc,
+	                  char** argv)
+	{
+		seqan::ArgumentParser::ParseResult parseResult = seqan::parse(parser_,
+		                                                              argc,
+		                                                              argv);
+
+		if (parseResult == seqan::ArgumentParser::PARSE_OK)
+		{
+			std::string socketPathString;
+
+			seqan::getArgumentValue(socketPathString,
+			                        parser_,
+			                        0);
+			socketPath = socketPathString;
+			seqan::getOptionValue(maxJobs,
+			                      parser_,
+			                      "max-jobs");
+			seqan::getOptionValue(threadsCount,
+			                      parser_,
+			                      "threads");
+			seqan::getOptionValue(maxWhitelists,
+			                      parser_,
+			                      "max-whitelists");
+		}
+
+		return parseResult;
+	}
+
+private:
+	/**
+	 * Instance of the SeqAn2 argument parser class, providing the core argument
+	 * parsing capabilities.
+	 */
+	seqan::ArgumentParser parser_;
+};
+
+} // demultiplex
+} // sctools
+
+#endif // SCTOOLS_APPS_DEMULTIPLEX_SERVICE_SETTINGS_H
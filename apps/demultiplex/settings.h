@@ -13,9 +13,16 @@
 #define SCTOOLS_APPS_DEMULTIPLEX_SETTINGS_H
 
 #include <experimental/filesystem>
+#include <iostream>
 
+#include <seqan/arg_parse.h>
 #include <seqan/bam_io.h>
 
+#include "sctools/compression_backend.h"
+#include "sctools/coverage_sink.h"
+#include "sctools/cram_codec.h"
+#include "sctools/file_sink.h"
+
 namespace fs = std::experimental::filesystem;
 
 namespace sctools
@@ -31,15 +38,41 @@ class Settings
 {
 public:
 	/**
-	 * Path to the SAM or BAM file containing the alignment records to be de-multiplexed.
+	 * Paths to the SAM or BAM files containing the alignment records to be
+	 * de-multiplexed. All of them must share the same reference sequences.
 	 */
-	fs::path                 alignmentsFilePath;
+	std::vector<fs::path>    alignmentsFilePaths;
 	/**
 	 * Path to the CSV file containing the barcodes to be de-multiplexed. Notice that the
 	 * barcode is expected to be on the first column of the file, and is supposed to end
 	 * with "-1" string.
 	 */
 	fs::path                 barcodeCSVFilePath;
+	/**
+	 * Path to the file mapping barcodes to the groups their records are
+	 * written with, or the empty path if every barcode has its own file.
+	 */
+	fs::path                 groupsFilePath;
+	/**
+	 * Path to the GTF or BED annotation whose genes records are counted
+	 * against, or empty for not counting them.
+	 */
+	fs::path                 annotationFilePath;
+	/**
+	 * Barcodes extracted through the cell index of the input files, or an
+	 * empty list for de-multiplexing the barcodes of the CSV file.
+	 */
+	std::vector<std::string> cells;
+	/**
+	 * Boolean that records if the cell index of every input file is built,
+	 * instead of de-multiplexing its records.
+	 */
+	bool                     buildIndex;
+	/**
+	 * Number of shard files target barcodes are spread over, or 0 for writing
+	 * one file per barcode.
+	 */
+	uint64_t                 shardsCount;
 	/**
 	 * Path to the directory where the de-multiplexed files are stored.
 	 */
@@ -58,12 +91,128 @@ public:
 	 * de-multiplexing procedure.
 	 */
 	uint64_t                 minMappingQuality;
+	/**
+	 * Expression alignment records must satisfy for being de-multiplexed.
+	 */
+	std::string              filterExpression;
+	/**
+	 * Number of reads every cell is downsampled to, or 0 for keeping every
+	 * read.
+	 */
+	uint64_t                 targetReadsPerCell;
+	/**
+	 * Seed of the hash deciding which reads are kept when downsampling.
+	 */
+	uint64_t                 downsamplingSeed;
+	/**
+	 * Boolean that records if the records of multiple input files have to be merged
+	 * preserving their coordinate order.
+	 */
+	bool                     coordinateMerge;
+	/**
+	 * Maximum number of threads the de-multiplexer uses.
+	 */
+	uint64_t                 threadsCount;
+	/**
+	 * Compression level of the de-multiplexed BAM files, from 0 to 9.
+	 */
+	int                      compressionLevel;
+	/**
+	 * Deflate implementation used for reading and writing BAM files.
+	 */
+	CompressionBackendType   compressionBackend;
+	/**
+	 * Path to the FASTA file CRAM records are decoded and encoded against, or
+	 * the empty path for resolving it from the CRAM header.
+	 */
+	fs::path                 referenceFilePath;
+	/**
+	 * Boolean that records if the de-multiplexed files are CRAM files rather
+	 * than BAM files.
+	 */
+	bool                     writeCram;
+	/**
+	 * Maximum number of output writes submitted in a single batch.
+	 */
+	uint64_t                 outputQueueDepth;
+	/**
+	 * Maximum number of de-multiplexed files kept open at the same time.
+	 */
+	uint64_t                 maxOpenFiles;
+	/**
+	 * Boolean that records if output writes are submitted through io_uring,
+	 * when the running kernel supports it.
+	 */
+	bool                     useIoUring;
+	/**
+	 * Handling of the target barcodes no record is de-multiplexed to.
+	 */
+	EmptyOutputPolicy        emptyOutputPolicy;
+	/**
+	 * Order of the records in the de-multiplexed files.
+	 */
+	SortOrder                sortOrder;
+	/**
+	 * Maximum number of MiB of records buffered for sorting by name before
+	 * they are spilled to disk.
+	 */
+	uint64_t                 sortMemory;
+	/**
+	 * Boolean that records if records are only counted per barcode, without
+	 * writing any de-multiplexed file.
+	 */
+	bool                     countOnly;
+	/**
+	 * Number of most frequent noise barcodes reported, or 0 for not tracking
+	 * noise barcodes.
+	 */
+	uint64_t                 noiseTopCount;
+	/**
+	 * Boolean that records if raw barcodes differing by a single base from a
+	 * target barcode are corrected.
+	 */
+	bool                     correctBarcodes;
+	/**
+	 * Boolean that records if a single read is kept for every molecule of
+	 * every cell.
+	 */
+	bool                     deduplicateUmis;
+	/**
+	 * Boolean that records if UMIs differing by a single base are merged when
+	 * reads are deduplicated.
+	 */
+	bool                     mergeUmiNeighbours;
+	/**
+	 * Boolean that records if the resident memory is sampled during the run,
+	 * and reported along with the heap allocations of every subsystem.
+	 */
+	bool                     memoryReport;
+	/**
+	 * Boolean that records if the coverage track of every target barcode, or
+	 * group, is written.
+	 */
+	bool                     writeCoverage;
+	/**
+	 * Format of the coverage tracks.
+	 */
+	CoverageFormat           coverageFormat;
 
 	/**
      * Boolean that records if we need to output also bed entries with read coordinates
 	 * of every cell.
 	 */
 	 bool				 	 writeBed;
+	/**
+	 * Path to the socket of the resident service the job is submitted to, or
+	 * the empty path for running the job in the current process. It is
+	 * ignored by the resident service itself.
+	 */
+	fs::path                 submitSocketPath;
+	/**
+	 * Directory relative paths given on the command line are resolved
+	 * against, or the empty path for the current directory.
+	 */
+	fs::path                 workingDirPath;
 
 	/**
 	 * \brief Class constructor.
@@ -90,17 +239,27 @@ public:
 		seqan::setDate(parser_,
 		               "2019");
 
-		// Input SAM or BAM file containing the alignment records to be de-multiplexed.
+		// Input SAM or BAM files containing the alignment records to be de-multiplexed.
 		seqan::addArgument(parser_,
 		                   seqan::ArgParseArgument(seqan::ArgParseArgument::INPUT_FILE,
-		                                           "ALIGNMENTS"));
+		                                           "ALIGNMENTS",
+		                                           true));
 		seqan::setHelpText(parser_,
 		                   0,
-		                   "Path of the SAM or BAM file containing the "
-		                   "alignments records to be de-multiplexed.");
-		seqan::setValidValues(parser_,
-		                      0,
-		                      seqan::BamFileIn::getFileExtensions());
+		                   "Paths of the SAM, BAM or CRAM files containing the "
+		                   "alignments records to be de-multiplexed. When more than "
+		                   "one file is given, all of them must share the same "
+		                   "reference sequences, and their records are written to "
+		                   "a single set of de-multiplexed files. CRAM files can be "
+		                   "read only if SCTools is built with htslib.");
+		{
+			auto extensions = seqan::BamFileIn::getFileExtensions();
+
+			extensions.emplace_back(".cram");
+			seqan::setValidValues(parser_,
+			                      0,
+			                      extensions);
+		}
 
 		// Input/Output settings.
 		seqan::addSection(parser_,
@@ -108,15 +267,126 @@ public:
 		seqan::addOption(parser_,
 		                 seqan::ArgParseOption("",
 		                                       "barcodes-csv",
-		                                       "Path to the CSV file storing the "
-		                                       "barcodes to be de-multiplexed. Notice "
-		                                       "that the barcode value is expected to be "
-		                                       "found in first position.",
+		                                       "Path to the CSV or TSV file storing the "
+		                                       "barcodes to be de-multiplexed, possibly "
+		                                       "gzip-compressed. Per-cell metrics files "
+		                                       "are matched by the 'barcode' and "
+		                                       "'total_num_reads' columns of their "
+		                                       "header; files with no header, such as "
+		                                       "barcodes.tsv.gz, are expected to hold "
+		                                       "the barcode in first position. "
+		                                       "Required, unless --count-only, --cells "
+		                                       "or --build-index is set.",
 		                                       seqan::ArgParseArgument::INPUT_FILE,
 		                                       "INPUT"));
-		seqan::setRequired(parser_,
-		                   "barcodes-csv",
-		                   true);
+
+		seqan::addOption(parser_,
+		                 seqan::ArgParseOption("",
+		                                       "groups",
+		                                       "Path to the file mapping target "
+		                                       "barcodes to groups, with a barcode "
+		                                       "and its group on every line, "
+		                                       "separated by a tab or a comma. The "
+		                                       "records of all the barcodes of a group "
+		                                       "are written to a single file named "
+		                                       "after the group; barcodes without a "
+		                                       "group get their own file.",
+		                                       seqan::ArgParseArgument::INPUT_FILE,
+		                                       "GROUPS"));
+
+		seqan::addOption(parser_,
+		                 seqan::ArgParseOption("",
+		                                       "build-index",
+		                                       "Write the cell index of every input BAM "
+		                                       "file next to it, with the .sci "
+		                                       "extension, instead of de-multiplexing "
+		                                       "its records. The index maps every "
+		                                       "barcode to the BGZF blocks holding its "
+		                                       "records, and must be built again "
+		                                       "whenever the BAM file changes."));
+
+		seqan::addOption(parser_,
+		                 seqan::ArgParseOption("",
+		                                       "cells",
+		                                       "Comma-separated list of barcodes to be "
+		                                       "extracted, replacing the barcodes CSV "
+		                                       "file. Only the blocks of the input BAM "
+		                                       "files holding their records are read, "
+		                                       "as listed by their cell index; the "
+		                                       "records of other barcodes in the same "
+		                                       "blocks are written to the noise file.",
+		                                       seqan::ArgParseOption::STRING,
+		                                       "BARCODES"));
+
+		seqan::addOption(parser_,
+		                 seqan::ArgParseOption("",
+		                                       "annotation",
+		                                       "Path to a GTF or BED annotation. The "
+		                                       "reads of every target barcode "
+		                                       "overlapping a single gene, through the "
+		                                       "exons of GTF files or the intervals of "
+		                                       "BED files, are counted in the "
+		                                       "gene_counts directory of the output "
+		                                       "directory, as a Matrix Market matrix "
+		                                       "with genes as rows and barcodes as "
+		                                       "columns. Pairs count once, through "
+		                                       "their first read unless it is "
+		                                       "unmapped; secondary and supplementary "
+		                                       "alignments are not counted. BED files "
+		                                       "must have the .bed extension.",
+		                                       seqan::ArgParseArgument::INPUT_FILE,
+		                                       "ANNOTATION"));
+
+		seqan::addOption(parser_,
+		                 seqan::ArgParseOption("",
+		                                       "shards",
+		                                       "Spread the target barcodes over N "
+		                                       "BAM files, chosen by the hash of the "
+		                                       "barcode, instead of writing one file "
+		                                       "per barcode. The records of every "
+		                                       "barcode are stored in ranges of whole "
+		                                       "BGZF blocks, listed in the "
+		                                       "shards_manifest.tsv file of the output "
+		                                       "directory. 0 writes one file per "
+		                                       "barcode.",
+		                                       seqan::ArgParseArgument::INTEGER,
+		                                       "N"));
+		seqan::setMinValue(parser_,
+		                   "shards",
+		                   "0");
+		seqan::setDefaultValue(parser_,
+		                       "shards",
+		                       "0");
+
+		seqan::addOption(parser_,
+		                 seqan::ArgParseOption("",
+		                                       "correct-barcodes",
+		                                       "Assign the records with no 'CB' tag, "
+		                                       "whose raw 'CR' barcode differs by a "
+		                                       "single base from a target barcode, to "
+		                                       "that barcode. Raw barcodes close to "
+		                                       "several target barcodes are resolved "
+		                                       "with the base qualities of the 'CY' "
+		                                       "tag."));
+
+		seqan::addOption(parser_,
+		                 seqan::ArgParseOption("",
+		                                       "dedup-umis",
+		                                       "Keep a single read for every molecule "
+		                                       "of every target barcode, identified by "
+		                                       "its 'UB' UMI tag, or 'UR' if missing, "
+		                                       "its strand and its 5' end, clipped "
+		                                       "bases included. The read with the "
+		                                       "highest mapping quality is kept. "
+		                                       "Input files must be coordinate-sorted."));
+
+		seqan::addOption(parser_,
+		                 seqan::ArgParseOption("",
+		                                       "merge-umi-neighbours",
+		                                       "When deduplicating reads, merge the "
+		                                       "UMIs of the same position differing by "
+		                                       "a single base into the more frequent "
+		                                       "one, with the directional method."));
 
 		seqan::addOption(parser_,
 		                 seqan::ArgParseOption("o",
@@ -147,6 +417,255 @@ public:
 		// Issues about paired entries that should be both filtered.
 		// Better to have -B/-b to turn on bam/bed output?
 
+		seqan::addOption(parser_,
+		                 seqan::ArgParseOption("",
+		                                       "coverage",
+		                                       "Write the read depth of every target "
+		                                       "barcode, or group, to a coverage track "
+		                                       "in the output directory, as runs of "
+		                                       "equal depth rather than one entry per "
+		                                       "read as --bed does. Skipped regions "
+		                                       "are not covered. Input files must be "
+		                                       "coordinate-sorted.",
+		                                       seqan::ArgParseArgument::STRING,
+		                                       "FORMAT"));
+		seqan::setValidValues(parser_,
+		                      "coverage",
+		                      "none bedgraph bigwig");
+		seqan::setDefaultValue(parser_,
+		                       "coverage",
+		                       "none");
+
+		seqan::addOption(parser_,
+		                 seqan::ArgParseOption("",
+		                                       "coordinate-merge",
+		                                       "Merge the records of multiple input "
+		                                       "files by coordinate, so that "
+		                                       "de-multiplexed files stay "
+		                                       "coordinate-sorted. Every input file "
+		                                       "must be coordinate-sorted."));
+
+		seqan::addOption(parser_,
+		                 seqan::ArgParseOption("",
+		                                       "empty-outputs",
+		                                       "Handling of the target barcodes no "
+		                                       "record is de-multiplexed to: 'empty' "
+		                                       "creates a file holding only the "
+		                                       "header, 'skip' creates no file, "
+		                                       "'manifest' lists them in the "
+		                                       "empty_barcodes.txt file of the output "
+		                                       "directory.",
+		                                       seqan::ArgParseArgument::STRING,
+		                                       "POLICY"));
+		seqan::setValidValues(parser_,
+		                      "empty-outputs",
+		                      "empty skip manifest");
+		seqan::setDefaultValue(parser_,
+		                       "empty-outputs",
+		                       "empty");
+
+		seqan::addOption(parser_,
+		                 seqan::ArgParseOption("",
+		                                       "sort-order",
+		                                       "Order of the records in the "
+		                                       "de-multiplexed files: 'input' keeps "
+		                                       "the order of the input files, "
+		                                       "'queryname' groups the records of "
+		                                       "every read, sorting them by name. "
+		                                       "The noise file keeps the input order.",
+		                                       seqan::ArgParseArgument::STRING,
+		                                       "ORDER"));
+		seqan::setValidValues(parser_,
+		                      "sort-order",
+		                      "input queryname");
+		seqan::setDefaultValue(parser_,
+		                       "sort-order",
+		                       "input");
+
+		seqan::addOption(parser_,
+		                 seqan::ArgParseOption("",
+		                                       "count-only",
+		                                       "Only count how many records every "
+		                                       "barcode would get, and report the "
+		                                       "records rejected by each filter "
+		                                       "predicate, without writing any "
+		                                       "de-multiplexed file. The counts of all "
+		                                       "the barcodes are written to the "
+		                                       "barcode_counts.tsv file of the output "
+		                                       "directory."));
+
+		seqan::addOption(parser_,
+		                 seqan::ArgParseOption("",
+		                                       "noise-top",
+		                                       "Number of most frequent barcodes of "
+		                                       "noise records reported, along with the "
+		                                       "estimated number of distinct noise "
+		                                       "barcodes. Counts are approximated "
+		                                       "within a fixed amount of memory. 0 "
+		                                       "disables the report.",
+		                                       seqan::ArgParseArgument::INTEGER,
+		                                       "N"));
+		seqan::setMinValue(parser_,
+		                   "noise-top",
+		                   "0");
+		seqan::setMaxValue(parser_,
+		                   "noise-top",
+		                   "1000");
+		seqan::setDefaultValue(parser_,
+		                       "noise-top",
+		                       "10");
+
+		// Performance settings.
+		seqan::addSection(parser_,
+		                  "Performance options");
+		seqan::addOption(parser_,
+		                 seqan::ArgParseOption("t",
+		                                       "threads",
+		                                       "Maximum number of threads used for "
+		                                       "reading the input files.",
+		                                       seqan::ArgParseArgument::INTEGER,
+		                                       "THREADS"));
+		seqan::setMinValue(parser_,
+		                   "threads",
+		                   "1");
+		seqan::setDefaultValue(parser_,
+		                       "threads",
+		                       "1");
+
+		seqan::addOption(parser_,
+		                 seqan::ArgParseOption("",
+		                                       "compression-level",
+		                                       "Compression level of the "
+		                                       "de-multiplexed BAM files, from 0 (no "
+		                                       "compression) to 9 (best compression). "
+		                                       "Low levels are much faster, and fit "
+		                                       "intermediate files.",
+		                                       seqan::ArgParseArgument::INTEGER,
+		                                       "LEVEL"));
+		seqan::setMinValue(parser_,
+		                   "compression-level",
+		                   "0");
+		seqan::setMaxValue(parser_,
+		                   "compression-level",
+		                   "9");
+		seqan::setDefaultValue(parser_,
+		                       "compression-level",
+		                       "6");
+
+		seqan::addOption(parser_,
+		                 seqan::ArgParseOption("",
+		                                       "compression-backend",
+		                                       "Deflate implementation used for "
+		                                       "reading and writing BAM files. "
+		                                       "'libdeflate' is available only if "
+		                                       "SCTools is built with it.",
+		                                       seqan::ArgParseArgument::STRING,
+		                                       "BACKEND"));
+		seqan::setValidValues(parser_,
+		                      "compression-backend",
+		                      "zlib libdeflate");
+		seqan::setDefaultValue(parser_,
+		                       "compression-backend",
+		                       "zlib");
+
+		seqan::addOption(parser_,
+		                 seqan::ArgParseOption("",
+		                                       "reference",
+		                                       "Path to the indexed FASTA file of the "
+		                                       "reference sequences, which CRAM input "
+		                                       "files are decoded against and CRAM "
+		                                       "output files are encoded against. "
+		                                       "When omitted, the reference is "
+		                                       "resolved from the CRAM header and the "
+		                                       "REF_PATH environment variable.",
+		                                       seqan::ArgParseArgument::INPUT_FILE,
+		                                       "FASTA"));
+
+		seqan::addOption(parser_,
+		                 seqan::ArgParseOption("",
+		                                       "cram",
+		                                       "Write the de-multiplexed files as CRAM "
+		                                       "files rather than BAM files. Input files "
+		                                       "must be BAM or CRAM files, and SCTools "
+		                                       "must be built with htslib."));
+
+		seqan::addOption(parser_,
+		                 seqan::ArgParseOption("",
+		                                       "output-queue-depth",
+		                                       "Maximum number of writes to "
+		                                       "de-multiplexed BAM files submitted in a "
+		                                       "single batch. Every write holds up to "
+		                                       "256 KiB of compressed data.",
+		                                       seqan::ArgParseArgument::INTEGER,
+		                                       "DEPTH"));
+		seqan::setMinValue(parser_,
+		                   "output-queue-depth",
+		                   "1");
+		seqan::setDefaultValue(parser_,
+		                       "output-queue-depth",
+		                       "32");
+
+		seqan::addOption(parser_,
+		                 seqan::ArgParseOption("",
+		                                       "max-open-files",
+		                                       "Maximum number of de-multiplexed BAM "
+		                                       "files kept open at once; batches "
+		                                       "writing more files are split.",
+		                                       seqan::ArgParseArgument::INTEGER,
+		                                       "FILES"));
+		seqan::setMinValue(parser_,
+		                   "max-open-files",
+		                   "1");
+		seqan::setDefaultValue(parser_,
+		                       "max-open-files",
+		                       "512");
+
+		seqan::addOption(parser_,
+		                 seqan::ArgParseOption("",
+		                                       "sort-memory",
+		                                       "Maximum number of MiB of records "
+		                                       "buffered for sorting by name. When it "
+		                                       "is exceeded, sorted runs are spilled "
+		                                       "to the output directory and merged "
+		                                       "once every record has been read.",
+		                                       seqan::ArgParseArgument::INTEGER,
+		                                       "MIB"));
+		seqan::setMinValue(parser_,
+		                   "sort-memory",
+		                   "1");
+		seqan::setDefaultValue(parser_,
+		                       "sort-memory",
+		                       "1024");
+
+		seqan::addOption(parser_,
+		                 seqan::ArgParseOption("",
+		                                       "no-io-uring",
+		                                       "Write de-multiplexed BAM files with "
+		                                       "pwrite, even if io_uring is available."));
+
+		seqan::addOption(parser_,
+		                 seqan::ArgParseOption("",
+		                                       "memory-report",
+		                                       "Sample the resident memory after every "
+		                                       "batch of records, and report it along "
+		                                       "with the peak resident memory. Heap "
+		                                       "allocations are reported per subsystem "
+		                                       "if the tool has been built with "
+		                                       "allocation tracking. It cannot be "
+		                                       "used along with --submit."));
+
+		seqan::addOption(parser_,
+		                 seqan::ArgParseOption("",
+		                                       "submit",
+		                                       "Run the job in the sctools_demultiplexd "
+		                                       "service listening on SOCKET, which keeps "
+		                                       "barcode whitelists and threads warm "
+		                                       "between jobs, rather than in a new "
+		                                       "process. The reports are printed as "
+		                                       "usual.",
+		                                       seqan::ArgParseOption::STRING,
+		                                       "SOCKET"));
+
 		// Filter settings.
 		seqan::addSection(parser_,
 		                  "Filter options");
@@ -174,6 +693,63 @@ public:
 		seqan::setDefaultValue(parser_,
 		                       "min-mapq",
 		                       "0");
+
+		seqan::addOption(parser_,
+		                 seqan::ArgParseOption("",
+		                                       "filter",
+		                                       "Expression any alignment record must "
+		                                       "satisfy, to be considered for the "
+		                                       "purpose of the de-multiplexing "
+		                                       "procedure. Predicates 'mapq OP N', "
+		                                       "'flag & MASK', 'paired', 'proper', "
+		                                       "'unmapped', 'mate_unmapped', 'reverse', "
+		                                       "'mate_reverse', 'read1', 'read2', "
+		                                       "'secondary', 'qcfail', 'duplicate', "
+		                                       "'supplementary', 'contig == NAME', "
+		                                       "'contig in (NAME, ...)', "
+		                                       "'region(CONTIG:BEGIN-END, ...)', "
+		                                       "'has(TG)' and 'TG OP VALUE' are "
+		                                       "combined with '&&', '||', '!' and "
+		                                       "parentheses, where OP is one of '==', "
+		                                       "'!=', '<', '<=', '>', '>='. For "
+		                                       "instance: '!(secondary || duplicate) && "
+		                                       "NM <= 4'.",
+		                                       seqan::ArgParseOption::STRING,
+		                                       "EXPRESSION"));
+
+		// Downsampling settings.
+		seqan::addSection(parser_,
+		                  "Downsampling options");
+		seqan::addOption(parser_,
+		                 seqan::ArgParseOption("",
+		                                       "target-reads-per-cell",
+		                                       "Number of reads every cell is "
+		                                       "downsampled to. Each read is kept with "
+		                                       "probability TARGET / TOTAL_NUM_READS, "
+		                                       "where TOTAL_NUM_READS is read from the "
+		                                       "barcodes CSV file; all the records of "
+		                                       "a read are kept or dropped together. "
+		                                       "Requires --barcodes-csv; 0 disables "
+		                                       "downsampling.",
+		                                       seqan::ArgParseOption::INTEGER,
+		                                       "TARGET"));
+		seqan::setMinValue(parser_,
+		                   "target-reads-per-cell",
+		                   "0");
+		seqan::setDefaultValue(parser_,
+		                       "target-reads-per-cell",
+		                       "0");
+
+		seqan::addOption(parser_,
+		                 seqan::ArgParseOption("",
+		                                       "downsampling-seed",
+		                                       "Seed of the hash deciding which reads "
+		                                       "are kept when downsampling.",
+		                                       seqan::ArgParseOption::INTEGER,
+		                                       "SEED"));
+		seqan::setDefaultValue(parser_,
+		                       "downsampling-seed",
+		                       "0");
 	}
 
 	/**
@@ -181,43 +757,171 @@ public:
 	 *
 	 * \param argc is the number of arguments present on the command line.
 	 * \param argv are the values of the arguments on the command line.
+	 * \param outputStream receives the help and version messages.
+	 * \param errorStream receives the parse errors.
 	 * \return a code representing the outcome of the parse result.
 	 */
 	inline seqan::ArgumentParser::ParseResult
 	parseCommandLine (int argc,
-	                  char** argv)
+	                  char** argv,
+	                  std::ostream& outputStream = std::cout,
+	                  std::ostream& errorStream = std::cerr)
 	{
 		seqan::CharString                  tmpString;
 		std::string                        errorMsg;
 		seqan::ArgumentParser::ParseResult parseResult = seqan::parse(parser_,
 		                                                              argc,
-		                                                              argv);
+		                                                              argv,
+		                                                              outputStream,
+		                                                              errorStream);
 
 		if (parseResult == seqan::ArgumentParser::PARSE_OK)
 		{
-			// Retrieve alignments file path.
-			seqan::getArgumentValue(alignmentsFilePath,
-			                        parser_,
-			                        0);
+			// Retrieve alignments file paths.
+			alignmentsFilePaths.clear();
+			for (auto i = 0u; i < seqan::getArgumentValueCount(parser_,
+			                                                   0); i++)
+			{
+				std::string alignmentsFilePath;
+
+				seqan::getArgumentValue(alignmentsFilePath,
+				                        parser_,
+				                        0,
+				                        i);
+				alignmentsFilePaths.emplace_back(resolvePath_(alignmentsFilePath));
+			}
+
+			// Retrieve and validate csv file, which may be omitted only when
+			// records are just counted or indexed, or barcodes are listed.
+			countOnly = seqan::isSet(parser_,
+			                         "count-only");
+			barcodeCSVFilePath.clear();
+			if (seqan::isSet(parser_,
+			                 "barcodes-csv"))
+			{
+				seqan::getOptionValue(barcodeCSVFilePath,
+				                      parser_,
+				                      "barcodes-csv");
+				barcodeCSVFilePath = resolvePath_(barcodeCSVFilePath);
+				if (!fs::is_regular_file(barcodeCSVFilePath))
+				{
+					errorMsg = "barcode CSV path is not a regular file";
+					throw std::invalid_argument(errorMsg);
+				}
+				if (!barcodeCSVFilePath.is_absolute())
+				{
+					barcodeCSVFilePath = fs::current_path() / barcodeCSVFilePath;
+				}
+			}
+
+			// Retrieve if the cell index is built, or used for extracting a
+			// list of barcodes.
+			buildIndex = seqan::isSet(parser_,
+			                          "build-index");
+			cells.clear();
+			if (seqan::isSet(parser_,
+			                 "cells"))
+			{
+				std::string cellsString;
+
+				seqan::getOptionValue(cellsString,
+				                      parser_,
+				                      "cells");
+				parseList_(cellsString,
+				           cells);
+				for (auto& c : cells)
+				{
+					c = c.substr(0,
+					             c.find_first_of('-'));
+				}
+				if (!barcodeCSVFilePath.empty() || countOnly || buildIndex)
+				{
+					errorMsg = "--cells cannot be combined with --barcodes-csv, "
+					           "--count-only or --build-index";
+					throw std::invalid_argument(errorMsg);
+				}
+			}
+			if (barcodeCSVFilePath.empty() && cells.empty() && !countOnly && !buildIndex)
+			{
+				errorMsg = "the barcodes CSV file is required, unless --count-only, "
+				           "--cells or --build-index is set";
+				throw std::invalid_argument(errorMsg);
+			}
+
+			// Retrieve and validate the groups file, if any.
+			groupsFilePath.clear();
+			if (seqan::isSet(parser_,
+			                 "groups"))
+			{
+				seqan::getOptionValue(groupsFilePath,
+				                      parser_,
+				                      "groups");
+				groupsFilePath = resolvePath_(groupsFilePath);
+				if (!fs::is_regular_file(groupsFilePath))
+				{
+					errorMsg = "groups file path is not a regular file";
+					throw std::invalid_argument(errorMsg);
+				}
+			}
+
+			// Retrieve and validate the annotation, if any.
+			annotationFilePath.clear();
+			if (seqan::isSet(parser_,
+			                 "annotation"))
+			{
+				seqan::getOptionValue(annotationFilePath,
+				                      parser_,
+				                      "annotation");
+				annotationFilePath = resolvePath_(annotationFilePath);
+				if (!fs::is_regular_file(annotationFilePath))
+				{
+					errorMsg = "annotation file path is not a regular file";
+					throw std::invalid_argument(errorMsg);
+				}
+				if (countOnly)
+				{
+					errorMsg = "--annotation cannot be combined with --count-only";
+					throw std::invalid_argument(errorMsg);
+				}
+			}
 
-			// Retrieve and validate csv file.
-			seqan::getOptionValue(barcodeCSVFilePath,
+			// Retrieve the number of shards, which replace per-barcode and
+			// per-group files.
+			seqan::getOptionValue(shardsCount,
 			                      parser_,
-			                      "barcodes-csv");
-			if (!fs::is_regular_file(barcodeCSVFilePath))
+			                      "shards");
+			if (shardsCount > 0 && (!groupsFilePath.empty() || seqan::isSet(parser_,
+			                                                                 "bed")))
 			{
-				errorMsg = "barcode CSV path is not a regular file";
+				errorMsg = "--shards cannot be combined with --groups or --bed";
 				throw std::invalid_argument(errorMsg);
 			}
-			if (!barcodeCSVFilePath.is_absolute())
+
+			// Retrieve if raw barcodes are corrected.
+			correctBarcodes = seqan::isSet(parser_,
+			                               "correct-barcodes");
+
+			// Retrieve if reads are deduplicated by UMI.
+			deduplicateUmis    = seqan::isSet(parser_,
+			                                  "dedup-umis");
+			mergeUmiNeighbours = seqan::isSet(parser_,
+			                                  "merge-umi-neighbours");
+			if (mergeUmiNeighbours && !deduplicateUmis)
 			{
-				barcodeCSVFilePath = fs::current_path() / barcodeCSVFilePath;
+				errorMsg = "--merge-umi-neighbours requires --dedup-umis";
+				throw std::invalid_argument(errorMsg);
+			}
+			if (deduplicateUmis && countOnly)
+			{
+				errorMsg = "--dedup-umis cannot be combined with --count-only";
+				throw std::invalid_argument(errorMsg);
 			}
 
 			// Retrieve and validate output directory.
 			seqan::getOptionValue(outputDirPath,
 			                      parser_,
 			                      "output-directory");
+			outputDirPath = resolvePath_(outputDirPath);
 			if (!fs::is_directory(outputDirPath))
 			{
 				errorMsg = "Output directory path does not exists";
@@ -244,7 +948,8 @@ public:
 				seqan::getOptionValue(forbiddenTagsString,
 				                      parser_,
 				                      "forbidden-tags");
-				parseForbiddenTags_(forbiddenTagsString);
+				parseList_(forbiddenTagsString,
+				           forbiddenTags);
 			}
 
 			// Retrieve minimum map quality that, if not met, causes a record to be
@@ -253,8 +958,177 @@ public:
 			                      parser_,
 			                      "min-mapq");
 
+			// Retrieve the filter expression, which is compiled once the
+			// reference sequences are known.
+			filterExpression.clear();
+			if (seqan::isSet(parser_,
+			                 "filter"))
+			{
+				seqan::getOptionValue(filterExpression,
+				                      parser_,
+				                      "filter");
+			}
+
+			// Retrieve how cells are downsampled.
+			seqan::getOptionValue(targetReadsPerCell,
+			                      parser_,
+			                      "target-reads-per-cell");
+			seqan::getOptionValue(downsamplingSeed,
+			                      parser_,
+			                      "downsampling-seed");
+			if (targetReadsPerCell > 0 && barcodeCSVFilePath.empty())
+			{
+				errorMsg = "--target-reads-per-cell requires --barcodes-csv";
+				throw std::invalid_argument(errorMsg);
+			}
+
 			// Do we need to write also bed files?
 			writeBed = seqan::isSet(parser_, "bed");
+
+			// Retrieve how multiple input files are merged.
+			coordinateMerge = seqan::isSet(parser_,
+			                               "coordinate-merge");
+
+			// Retrieve if coverage tracks are written, which requires the
+			// records of every barcode to come in coordinate order.
+			{
+				std::string formatName;
+
+				seqan::getOptionValue(formatName,
+				                      parser_,
+				                      "coverage");
+				writeCoverage = formatName != "none";
+				if (writeCoverage)
+				{
+					coverageFormat = CoverageSinkConfig::parseFormat(formatName);
+				}
+			}
+			if (writeCoverage && countOnly)
+			{
+				errorMsg = "--coverage cannot be combined with --count-only";
+				throw std::invalid_argument(errorMsg);
+			}
+			if (writeCoverage && alignmentsFilePaths.size() > 1 && !coordinateMerge)
+			{
+				errorMsg = "--coverage with multiple input files requires --coordinate-merge";
+				throw std::invalid_argument(errorMsg);
+			}
+
+			// Retrieve how barcodes with no de-multiplexed record are handled.
+			{
+				std::string policyName;
+
+				seqan::getOptionValue(policyName,
+				                      parser_,
+				                      "empty-outputs");
+				if (policyName == "skip")
+				{
+					emptyOutputPolicy = EmptyOutputPolicy::SKIP;
+				}
+				else if (policyName == "manifest")
+				{
+					emptyOutputPolicy = EmptyOutputPolicy::MANIFEST;
+				}
+				else
+				{
+					emptyOutputPolicy = EmptyOutputPolicy::EMPTY_FILE;
+				}
+			}
+
+			// Retrieve the order of the records in the de-multiplexed files.
+			{
+				std::string orderName;
+
+				seqan::getOptionValue(orderName,
+				                      parser_,
+				                      "sort-order");
+				sortOrder = orderName == "queryname" ? SortOrder::QUERYNAME : SortOrder::INPUT;
+			}
+			seqan::getOptionValue(sortMemory,
+			                      parser_,
+			                      "sort-memory");
+			if (sortOrder == SortOrder::QUERYNAME && (countOnly || shardsCount > 0))
+			{
+				errorMsg = "--sort-order queryname cannot be combined with --count-only "
+				           "or --shards";
+				throw std::invalid_argument(errorMsg);
+			}
+
+			// Retrieve how many noise barcodes are reported.
+			seqan::getOptionValue(noiseTopCount,
+			                      parser_,
+			                      "noise-top");
+
+			// Retrieve the maximum number of threads.
+			seqan::getOptionValue(threadsCount,
+			                      parser_,
+			                      "threads");
+
+			// Retrieve how BAM files are compressed.
+			{
+				std::string backendName;
+
+				seqan::getOptionValue(compressionLevel,
+				                      parser_,
+				                      "compression-level");
+				seqan::getOptionValue(backendName,
+				                      parser_,
+				                      "compression-backend");
+				compressionBackend = CompressionBackend::parseType(backendName);
+			}
+
+			// Retrieve and validate the reference, and if CRAM files are
+			// written.
+			referenceFilePath.clear();
+			if (seqan::isSet(parser_,
+			                 "reference"))
+			{
+				seqan::getOptionValue(referenceFilePath,
+				                      parser_,
+				                      "reference");
+				referenceFilePath = resolvePath_(referenceFilePath);
+				if (!fs::is_regular_file(referenceFilePath))
+				{
+					errorMsg = "reference file path is not a regular file";
+					throw std::invalid_argument(errorMsg);
+				}
+			}
+			writeCram = seqan::isSet(parser_,
+			                         "cram");
+			if (writeCram && !Cram::isAvailable())
+			{
+				errorMsg = "--cram requires SCTools to be built with htslib";
+				throw std::invalid_argument(errorMsg);
+			}
+			if (writeCram && (countOnly || shardsCount > 0))
+			{
+				errorMsg = "--cram cannot be combined with --count-only or --shards";
+				throw std::invalid_argument(errorMsg);
+			}
+
+			// Retrieve how writes to the output files are batched.
+			seqan::getOptionValue(outputQueueDepth,
+			                      parser_,
+			                      "output-queue-depth");
+			seqan::getOptionValue(maxOpenFiles,
+			                      parser_,
+			                      "max-open-files");
+			useIoUring = !seqan::isSet(parser_,
+			                           "no-io-uring");
+
+			// Retrieve if memory usage is reported.
+			memoryReport = seqan::isSet(parser_,
+			                            "memory-report");
+
+			// Retrieve the service the job is submitted to, if any.
+			submitSocketPath.clear();
+			if (seqan::isSet(parser_,
+			                 "submit"))
+			{
+				seqan::getOptionValue(submitSocketPath,
+				                      parser_,
+				                      "submit");
+			}
 		}
 
 		return parseResult;
@@ -268,29 +1142,48 @@ private:
 	seqan::ArgumentParser parser_;
 
 	/**
-	 * \brief Parse the list of forbidden tags from the string passed by the user through
-	 * the command line.
+	 * \brief Resolve a path given on the command line against the working
+	 * directory.
+	 *
+	 * \param path is the path given on the command line.
+	 * \return the path, made absolute if a working directory is set.
+	 */
+	inline fs::path
+	resolvePath_ (const fs::path& path) const
+	{
+		if (workingDirPath.empty() || path.is_absolute())
+		{
+			return path;
+		}
+
+		return workingDirPath / path;
+	}
+
+	/**
+	 * \brief Parse a coma-separated list passed by the user through the command
+	 * line.
 	 *
-	 * \param forbiddenTagsString string representing a coma-separated list of forbidden
-	 * tags.
+	 * \param listString string representing a coma-separated list.
+	 * \param list is filled with the entries of the list.
 	 */
-	inline void
-	parseForbiddenTags_ (const std::string& forbiddenTagsString) noexcept
+	static inline void
+	parseList_ (const std::string& listString,
+	            std::vector<std::string>& list)
 	{
 		uint64_t previousComaIndex = 0;
-		uint64_t nextComaIndex     = forbiddenTagsString.find(',');
+		uint64_t nextComaIndex     = listString.find(',');
 
-		forbiddenTags.clear();
+		list.clear();
 		while (nextComaIndex != std::string::npos)
 		{
-			forbiddenTags.emplace_back(forbiddenTagsString.begin() + previousComaIndex,
-			                           forbiddenTagsString.begin() + nextComaIndex);
+			list.emplace_back(listString.begin() + previousComaIndex,
+			                  listString.begin() + nextComaIndex);
 			previousComaIndex = nextComaIndex + 1;
-			nextComaIndex     = forbiddenTagsString.find(',',
-			                                             previousComaIndex);
+			nextComaIndex     = listString.find(',',
+			                                    previousComaIndex);
 		}
-		forbiddenTags.emplace_back(forbiddenTagsString.begin() + previousComaIndex,
-		                           forbiddenTagsString.end());
+		list.emplace_back(listString.begin() + previousComaIndex,
+		                  listString.end());
 	};
 };
 
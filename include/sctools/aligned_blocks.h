@@ -0,0 +1,76 @@
+/**
+ * \file   include/sctools/aligned_blocks.h
+ * \author Elena Grassi
+ * \author Marilisa Montemurro
+ * \author Emanuele Parisi
+ * \date   February, 2019
+ *
+ * File containing the decomposition of alignment records into the reference
+ * ranges they cover.
+ */
+
+#ifndef SCTOOLS_INCLUDE_SCTOOLS_ALIGNED_BLOCKS_H
+#define SCTOOLS_INCLUDE_SCTOOLS_ALIGNED_BLOCKS_H
+
+#include <cstdint>
+
+#include <seqan/bam_io.h>
+
+namespace sctools
+{
+
+/**
+ * \brief Visit the reference ranges covered by an alignment record, merging
+ * the adjacent ones.
+ *
+ * Matches, mismatches and deletions cover the reference, skipped regions
+ * split the record into separate blocks, while insertions, clipping and
+ * padding do not consume the reference.
+ *
+ * \param record is the alignment record, which must be mapped.
+ * \param visitor is the callable invoked with the first position of every
+ * block, and the position following its last one.
+ */
+template <typename TVisitor>
+inline void
+forEachAlignedBlock (const seqan::BamAlignmentRecord& record,
+                     TVisitor&& visitor)
+{
+	int32_t position = record.beginPos;
+	int32_t start    = position;
+
+	for (auto i = 0ul; i < seqan::length(record.cigar); i++)
+	{
+		const auto& c = record.cigar[i];
+
+		switch (c.operation)
+		{
+		case 'M':
+		case '=':
+		case 'X':
+		case 'D':
+			position += c.count;
+			break;
+		case 'N':
+			if (position > start)
+			{
+				visitor(start,
+				        position);
+			}
+			position += c.count;
+			start     = position;
+			break;
+		default:
+			break;
+		}
+	}
+	if (position > start)
+	{
+		visitor(start,
+		        position);
+	}
+}
+
+} // sctools
+
+#endif // SCTOOLS_INCLUDE_SCTOOLS_ALIGNED_BLOCKS_H
@@ -0,0 +1,538 @@
+/**
+ * \file   include/sctools/alignments_merger.h
+ * \author Elena Grassi
+ * \author Marilisa Montemurro
+ * \author Emanuele Parisi
+ * \date   February, 2019
+ *
+ * File containing facilities for reading several SAM and BAM files as if they
+ * were a single alignment records source.
+ */
+
+#ifndef SCTOOLS_INCLUDE_SCTOOLS_ALIGNMENTS_MERGER_H
+#define SCTOOLS_INCLUDE_SCTOOLS_ALIGNMENTS_MERGER_H
+
+#include <algorithm>
+#include <exception>
+#include <experimental/filesystem>
+#include <memory>
+#include <queue>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <seqan/bam_io.h>
+
+#include "alignments_reader.h"
+
+namespace fs = std::experimental::filesystem;
+
+namespace sctools
+{
+
+/**
+ * \brief Class providing facilities for reading alignment records from several
+ * SAM and BAM files sharing the same reference sequences.
+ *
+ * Every input file is accessed through its own AlignmentsReader, and the
+ * readers are filled concurrently. Records are either concatenated in the
+ * order they are loaded, or k-way merged so that the coordinate order of the
+ * inputs is preserved in the output stream.
+ */
+class AlignmentsMerger
+{
+
+public:
+
+	/**
+	 * \brief Class constructor.
+	 */
+	AlignmentsMerger () = default;
+
+	/**
+	 * \brief Class copy constructor.
+	 *
+	 * \param other is the object the current instance is initialized from.
+	 */
+	AlignmentsMerger (const AlignmentsMerger& other) = delete;
+
+	/**
+	 * \brief Class copy assignment operator.
+	 *
+	 * \param other is the object the current instance is initialized from.
+	 * \return a reference to the assigned object.
+	 */
+	AlignmentsMerger&
+	operator= (const AlignmentsMerger& other) = delete;
+
+	/**
+	 * \brief Reset the status of the merger instance.
+	 */
+	inline void
+	reset () noexcept
+	{
+		readers_.clear();
+		buffers_.clear();
+		cursors_.clear();
+		loaded_.clear();
+		coordinateMerge_ = false;
+	}
+
+	/**
+	 * \brief Initialize the merger instance.
+	 *
+	 * All the source files must declare the same reference sequences, in the
+	 * same order, so that the reference identifiers of their records can be
+	 * shared by a single set of writers. When the coordinate order has to be
+	 * preserved, every source file must also be coordinate-sorted.
+	 *
+	 * \param sourcePaths is the list of paths to the files the current object
+	 * will read from.
+	 * \param coordinateMerge is a flag which k-way merges the records of the
+	 * different sources by coordinate, if it is true.
+	 * \param lookaheadSize is the number of records buffered for every source
+	 * when the coordinate order has to be preserved.
+	 * \param backendType is the deflate implementation used for decompressing
+	 * the records of BAM files.
+	 * \param referencePath is the FASTA file the records of CRAM files are
+	 * decoded against, or an empty path for resolving it from their header.
+	 */
+	inline void
+	configure (const std::vector<fs::path>& sourcePaths,
+	           bool coordinateMerge,
+	           uint64_t lookaheadSize,
+	           CompressionBackendType backendType = CompressionBackendType::ZLIB,
+	           const fs::path& referencePath = fs::path())
+	{
+		reset();
+		if (sourcePaths.empty())
+		{
+			throw std::invalid_argument("no alignment file to be read");
+		}
+
+		coordinateMerge_ = coordinateMerge;
+		for (const auto& p : sourcePaths)
+		{
+			readers_.emplace_back(new AlignmentsReader());
+			readers_.back()->configure(p,
+			                           backendType,
+			                           referencePath);
+			if (!compatibleHeaders_(*readers_.front(),
+			                        *readers_.back()))
+			{
+				throw std::invalid_argument("reference sequences of '" +
+				                            p.string() +
+				                            "' differ from the ones of '" +
+				                            sourcePaths.front().string() +
+				                            "'");
+			}
+			if (coordinateMerge_ && !isCoordinateSorted_(*readers_.back()))
+			{
+				throw std::invalid_argument("'" +
+				                            p.string() +
+				                            "' is not coordinate-sorted");
+			}
+		}
+
+		// Per-source look-ahead buffers are needed only when records have to
+		// be merged by coordinate.
+		if (coordinateMerge_)
+		{
+			buffers_.resize(readers_.size());
+			for (auto& b : buffers_)
+			{
+				b.resize(std::max<uint64_t>(lookaheadSize,
+				                            1));
+			}
+			cursors_.assign(readers_.size(),
+			                0);
+			loaded_.assign(readers_.size(),
+			               0);
+		}
+	}
+
+	/**
+	 * \brief Access the reader of the first source file.
+	 *
+	 * Since all the sources share the same reference sequences, the first
+	 * reader provides the header, the context and the format every output
+	 * file is initialized with.
+	 *
+	 * \return a reference to the first reader.
+	 */
+	inline const AlignmentsReader&
+	getReference () const noexcept
+	{
+		return *readers_.front();
+	}
+
+	/**
+	 * \brief Set the filter the records of every source are tested with,
+	 * before being decoded.
+	 *
+	 * \param filter is the compiled filter, which must outlive the merger, or
+	 * nullptr for accepting every record.
+	 */
+	inline void
+	setFilter (const RecordFilter* filter) noexcept
+	{
+		for (auto& r : readers_)
+		{
+			r->setFilter(filter);
+		}
+	}
+
+	/**
+	 * \brief Restrict the records read from a BAM source file to ranges.
+	 *
+	 * \param sourceIndex is the index of the source file, in the list given
+	 * at configuration time.
+	 * \param ranges are the ranges, sorted and disjoint.
+	 */
+	inline void
+	setRanges (uint64_t sourceIndex,
+	           std::vector<BgzfRange> ranges)
+	{
+		readers_.at(sourceIndex)->setRanges(std::move(ranges));
+	}
+
+	/**
+	 * \brief Access the number of compressed bytes read from the BAM source
+	 * files.
+	 *
+	 * \return the size of the BGZF blocks read so far from all the sources.
+	 */
+	inline uint64_t
+	getCompressedBytesRead () const noexcept
+	{
+		uint64_t readBytes = 0;
+
+		for (const auto& r : readers_)
+		{
+			readBytes += r->getCompressedBytesRead();
+		}
+
+		return readBytes;
+	}
+
+	/**
+	 * \brief Access the number of source files.
+	 *
+	 * \return the number of source files merged by the current object.
+	 */
+	inline uint64_t
+	getSourcesCount () const noexcept
+	{
+		return readers_.size();
+	}
+
+	/**
+	 * \brief Read a set of alignment records from the input source files.
+	 *
+	 * \param itBegin is the iterator to the first buffer entry to be filled.
+	 * \param itEnd is the iterator to the first buffer entry not to be filled.
+	 * \return the number of records read. Zero is returned only once every
+	 * source file has been completely read.
+	 */
+	inline uint64_t
+	read (std::vector<seqan::BamAlignmentRecord>::iterator itBegin,
+	      std::vector<seqan::BamAlignmentRecord>::iterator itEnd)
+	{
+		if (coordinateMerge_)
+		{
+			return readMerged_(itBegin,
+			                   itEnd);
+		}
+		else
+		{
+			return readConcatenated_(itBegin,
+			                         itEnd);
+		}
+	}
+
+private:
+	/**
+	 * Readers accessing the source files, one per file.
+	 */
+	std::vector<std::unique_ptr<AlignmentsReader>>      readers_;
+	/**
+	 * Look-ahead buffers used when merging records by coordinate.
+	 */
+	std::vector<std::vector<seqan::BamAlignmentRecord>> buffers_;
+	/**
+	 * Index of the first record not consumed yet in every look-ahead buffer.
+	 */
+	std::vector<uint64_t>                               cursors_;
+	/**
+	 * Number of valid records in every look-ahead buffer.
+	 */
+	std::vector<uint64_t>                               loaded_;
+	/**
+	 * Flag stating if records are merged by coordinate.
+	 */
+	bool                                                coordinateMerge_ = false;
+
+	/**
+	 * \brief Check if two readers declare the same reference sequences.
+	 *
+	 * \param lhs is the first reader to be compared.
+	 * \param rhs is the second reader to be compared.
+	 * \return true if names and lengths of the reference sequences match.
+	 */
+	static inline bool
+	compatibleHeaders_ (const AlignmentsReader& lhs,
+	                    const AlignmentsReader& rhs) noexcept
+	{
+		auto lhsContext = lhs.getContext();
+		auto rhsContext = rhs.getContext();
+		auto lhsNames   = seqan::contigNames(lhsContext);
+		auto rhsNames   = seqan::contigNames(rhsContext);
+		auto lhsLengths = seqan::contigLengths(lhsContext);
+		auto rhsLengths = seqan::contigLengths(rhsContext);
+
+		if (seqan::length(lhsNames) != seqan::length(rhsNames))
+		{
+			return false;
+		}
+		for (auto i = 0ul; i < seqan::length(lhsNames); i++)
+		{
+			if (std::string(seqan::toCString(lhsNames[i])) !=
+			    std::string(seqan::toCString(rhsNames[i])) ||
+			    lhsLengths[i] != rhsLengths[i])
+			{
+				return false;
+			}
+		}
+
+		return true;
+	}
+
+	/**
+	 * \brief Check if the header of a reader declares a coordinate sort order.
+	 *
+	 * \param reader is the reader whose header is inspected.
+	 * \return true if the '@HD' line reports the 'SO:coordinate' tag.
+	 */
+	static inline bool
+	isCoordinateSorted_ (const AlignmentsReader& reader) noexcept
+	{
+		auto header = reader.getHeader();
+
+		for (auto i = 0ul; i < seqan::length(header); i++)
+		{
+			if (header[i].type != seqan::BAM_HEADER_FIRST)
+			{
+				continue;
+			}
+			for (auto j = 0ul; j < seqan::length(header[i].tags); j++)
+			{
+				if (std::string(seqan::toCString(header[i].tags[j].i1)) == "SO")
+				{
+					return std::string(seqan::toCString(header[i].tags[j].i2)) ==
+					       "coordinate";
+				}
+			}
+		}
+
+		return false;
+	}
+
+	/**
+	 * \brief Propagate the first failure raised by a concurrent reader.
+	 *
+	 * Exceptions cannot leave a parallel region, so they are collected there
+	 * and re-thrown by the calling thread.
+	 *
+	 * \param errors is the list of failures, one per reader.
+	 */
+	static inline void
+	rethrowFirst_ (const std::vector<std::exception_ptr>& errors)
+	{
+		for (const auto& e : errors)
+		{
+			if (e != nullptr)
+			{
+				std::rethrow_exception(e);
+			}
+		}
+	}
+
+	/**
+	 * \brief Compute the coordinate sort key of an alignment record.
+	 *
+	 * Reference identifiers and positions are compared as unsigned values,
+	 * so that unmapped records, whose identifier is -1, come last.
+	 *
+	 * \param record is the alignment record the key is computed for.
+	 * \return the sort key of the record.
+	 */
+	static inline uint64_t
+	coordinateKey_ (const seqan::BamAlignmentRecord& record) noexcept
+	{
+		return (static_cast<uint64_t>(static_cast<uint32_t>(record.rID)) << 32) |
+		       static_cast<uint32_t>(record.beginPos);
+	}
+
+	/**
+	 * \brief Fill the output range with the records of all the sources, in
+	 * the order they are loaded.
+	 *
+	 * Every source which is not exhausted yet fills its own slice of the
+	 * output range concurrently, then the slices are compacted.
+	 *
+	 * \param itBegin is the iterator to the first buffer entry to be filled.
+	 * \param itEnd is the iterator to the first buffer entry not to be filled.
+	 * \return the number of records read.
+	 */
+	inline uint64_t
+	readConcatenated_ (std::vector<seqan::BamAlignmentRecord>::iterator itBegin,
+	                   std::vector<seqan::BamAlignmentRecord>::iterator itEnd)
+	{
+		std::vector<uint64_t>           active;
+		std::vector<uint64_t>           sliceLoaded;
+		std::vector<std::exception_ptr> sliceErrors;
+		uint64_t                        sliceSize = 0;
+		uint64_t                        loaded    = 0;
+
+		for (auto i = 0ul; i < readers_.size(); i++)
+		{
+			if (!readers_[i]->atEnd())
+			{
+				active.emplace_back(i);
+			}
+		}
+		if (active.empty() || itBegin == itEnd)
+		{
+			return 0;
+		}
+
+		sliceSize = std::max<uint64_t>((itEnd - itBegin) / active.size(),
+		                               1);
+		sliceLoaded.assign(active.size(),
+		                   0);
+		sliceErrors.assign(active.size(),
+		                   nullptr);
+		#pragma omp parallel for schedule(static, 1)
+		for (auto i = 0l; i < static_cast<int64_t>(active.size()); i++)
+		{
+			auto sliceBegin = itBegin + std::min<int64_t>(i * sliceSize,
+			                                              itEnd - itBegin);
+			auto sliceEnd   = (i + 1 == static_cast<int64_t>(active.size())) ?
+			                  itEnd :
+			                  itBegin + std::min<int64_t>((i + 1) * sliceSize,
+			                                              itEnd - itBegin);
+
+			try
+			{
+				sliceLoaded[i] = readers_[active[i]]->read(sliceBegin,
+				                                           sliceEnd);
+			}
+			catch (...)
+			{
+				sliceErrors[i] = std::current_exception();
+			}
+		}
+		rethrowFirst_(sliceErrors);
+
+		// Move the records of every slice right after the ones of the previous
+		// slices, so that the loaded records are contiguous.
+		for (auto i = 0ul; i < active.size(); i++)
+		{
+			auto sliceBegin = itBegin + std::min<int64_t>(i * sliceSize,
+			                                              itEnd - itBegin);
+
+			if (sliceBegin != itBegin + loaded)
+			{
+				std::swap_ranges(sliceBegin,
+				                 sliceBegin + sliceLoaded[i],
+				                 itBegin + loaded);
+			}
+			loaded += sliceLoaded[i];
+		}
+
+		return loaded;
+	}
+
+	/**
+	 * \brief Fill the output range merging the records of all the sources by
+	 * coordinate.
+	 *
+	 * Drained look-ahead buffers are refilled concurrently, then records are
+	 * merged until the output range is full or a look-ahead buffer of a source
+	 * which is not exhausted yet is drained.
+	 *
+	 * \param itBegin is the iterator to the first buffer entry to be filled.
+	 * \param itEnd is the iterator to the first buffer entry not to be filled.
+	 * \return the number of records read.
+	 */
+	inline uint64_t
+	readMerged_ (std::vector<seqan::BamAlignmentRecord>::iterator itBegin,
+	             std::vector<seqan::BamAlignmentRecord>::iterator itEnd)
+	{
+		using THeapEntry = std::pair<uint64_t,
+		                             uint64_t>;
+
+		std::priority_queue<THeapEntry,
+		                    std::vector<THeapEntry>,
+		                    std::greater<THeapEntry>> heap;
+		std::vector<std::exception_ptr>               refillErrors(readers_.size());
+		uint64_t                                      loaded = 0;
+
+		#pragma omp parallel for schedule(dynamic, 1)
+		for (auto i = 0l; i < static_cast<int64_t>(readers_.size()); i++)
+		{
+			if (cursors_[i] == loaded_[i])
+			{
+				try
+				{
+					cursors_[i] = 0;
+					loaded_[i]  = readers_[i]->read(buffers_[i].begin(),
+					                                buffers_[i].end());
+				}
+				catch (...)
+				{
+					loaded_[i]      = 0;
+					refillErrors[i] = std::current_exception();
+				}
+			}
+		}
+		rethrowFirst_(refillErrors);
+
+		// The heap is keyed on the coordinate of the next record of every
+		// source; ties are broken by source index, to keep the output stable.
+		for (auto i = 0ul; i < readers_.size(); i++)
+		{
+			if (cursors_[i] < loaded_[i])
+			{
+				heap.emplace(coordinateKey_(buffers_[i][cursors_[i]]),
+				             i);
+			}
+		}
+		for (auto it = itBegin; it != itEnd && !heap.empty(); it++)
+		{
+			auto source = heap.top().second;
+
+			heap.pop();
+			std::swap(*it,
+			          buffers_[source][cursors_[source]]);
+			cursors_[source] += 1;
+			loaded           += 1;
+			if (cursors_[source] < loaded_[source])
+			{
+				heap.emplace(coordinateKey_(buffers_[source][cursors_[source]]),
+				             source);
+			}
+			else if (!readers_[source]->atEnd())
+			{
+				break;
+			}
+		}
+
+		return loaded;
+	}
+};
+
+}
+
+#endif // SCTOOLS_INCLUDE_SCTOOLS_ALIGNMENTS_MERGER_H
@@ -5,23 +5,45 @@
  * \author Emanuele Parisi
  * \date   February, 2019
  *
- * File containing facilities for reading BAM and SAM files.
+ * File containing facilities for reading BAM, CRAM and SAM files.
  */
 
 #ifndef SCTOOLS_INCLUDE_SCTOOLS_ALIGNMENTS_READER_H
 #define SCTOOLS_INCLUDE_SCTOOLS_ALIGNMENTS_READER_H
 
+#include <cstring>
 #include <experimental/filesystem>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #include <seqan/bam_io.h>
 
+#include "bam_record_view.h"
+#include "bgzf.h"
+#include "compression_backend.h"
+#include "cram_codec.h"
+#include "record_filter.h"
+
 namespace fs = std::experimental::filesystem;
 
 namespace sctools
 {
 
 /**
- * \brief Class providing facilities for reading SAM and BAM files.
+ * \brief Class providing facilities for reading SAM, BAM and CRAM files.
+ *
+ * The header of the source file is parsed by SeqAn. The records of BAM files
+ * are then decompressed through the deflate backend chosen at configuration
+ * time, and decoded from their binary representation. CRAM files are decoded
+ * by htslib into the same binary representation, so they are read as BAM
+ * files from then on.
  */
 class AlignmentsReader
 {
@@ -60,22 +82,135 @@ public:
 		seqan::resize(bamHeader_,
 		              0,
 		              seqan::Exact());
+		isBinary_ = false;
+		isCram_   = false;
+		backend_.reset();
+#ifdef SCTOOLS_WITH_HTSLIB
+		cramStream_.reset();
+#endif
+		filter_   = nullptr;
+		ranges_.clear();
+		rangeIndex_ = 0;
+		hasRanges_  = false;
 	}
 
 	/**
 	 * \brief Initialize the reader instance.
 	 *
 	 * \param sourcePath is the path to the file the current object will read from.
+	 * \param backendType is the deflate implementation used for decompressing
+	 * the records of BAM files.
+	 * \param referencePath is the FASTA file CRAM records are decoded
+	 * against, or an empty path for resolving it from their header.
 	 */
 	inline void
-	configure (const fs::path& sourcePath) noexcept
+	configure (const fs::path& sourcePath,
+	           CompressionBackendType backendType = CompressionBackendType::ZLIB,
+	           const fs::path& referencePath = fs::path())
 	{
 		reset();
 		sourcePath_ = sourcePath;
-		seqan::open(sourceStream_,
-		            sourcePath_.generic_string().data());
+		if (Cram::isCramPath(sourcePath_))
+		{
+			configureCram_(referencePath);
+			return;
+		}
+		if (!seqan::open(sourceStream_,
+		                 sourcePath_.generic_string().data()))
+		{
+			throw std::runtime_error("cannot open '" +
+			                         sourcePath_.string() +
+			                         "'");
+		}
 		seqan::readHeader(bamHeader_,
 		                  sourceStream_);
+
+		// BAM records are read by a dedicated BGZF stream, positioned right
+		// after the binary header.
+		isBinary_ = sourcePath_.extension() == ".bam";
+		if (isBinary_)
+		{
+			backend_ = CompressionBackend::create(backendType,
+			                                      0);
+			recordsStream_.configure(sourcePath_,
+			                         *backend_);
+			skipBinaryHeader_();
+		}
+	}
+
+	/**
+	 * \brief Set the filter records are tested with before being decoded.
+	 *
+	 * Records rejected by the filter are skipped by read(), and do not count
+	 * among the records it returns.
+	 *
+	 * \param filter is the compiled filter, which must outlive the reader, or
+	 * nullptr for accepting every record.
+	 */
+	inline void
+	setFilter (const RecordFilter* filter) noexcept
+	{
+		filter_ = filter != nullptr && !filter->isEmpty() ? filter : nullptr;
+	}
+
+	/**
+	 * \brief Restrict reading to ranges of records of a BAM file.
+	 *
+	 * The records stream is moved to the first range, and from a range to
+	 * the next one once a record starts past its end.
+	 *
+	 * \param ranges are the ranges, sorted and disjoint.
+	 */
+	inline void
+	setRanges (std::vector<BgzfRange> ranges)
+	{
+		if (!isBinary_ || isCram_)
+		{
+			throw std::invalid_argument("records of '" +
+			                            sourcePath_.string() +
+			                            "' cannot be read by range, as it is not a "
+			                            "BAM file");
+		}
+		ranges_     = std::move(ranges);
+		rangeIndex_ = 0;
+		hasRanges_  = true;
+		if (!ranges_.empty())
+		{
+			recordsStream_.seek(ranges_.front().begin);
+		}
+	}
+
+	/**
+	 * \brief Access the number of compressed bytes read from a BAM file.
+	 *
+	 * \return the size of the BGZF blocks read so far, or 0 for other files.
+	 */
+	inline uint64_t
+	getCompressedBytesRead () const noexcept
+	{
+		return isBinary_ && !isCram_ ? recordsStream_.getReadBytes() : 0;
+	}
+
+	/**
+	 * \brief Check if the source file stores binary (BAM) records.
+	 *
+	 * \return true if the source file is a BAM or a CRAM file.
+	 */
+	inline bool
+	isBinary () const noexcept
+	{
+		return isBinary_;
+	}
+
+	/**
+	 * \brief Check if the source file is a CRAM file.
+	 *
+	 * \return true if the source file is a CRAM file.
+	 */
+	inline bool
+	isCram () const noexcept
+	{
+		return isCram_;
 	}
 
 	/**
@@ -110,6 +245,29 @@ public:
 		return bamHeader_;
 	}
 
+	/**
+	 * \brief Check if every alignment record of the input source file has been
+	 * read.
+	 *
+	 * \return true if the end of the source file has been reached.
+	 */
+	inline bool
+	atEnd ()
+	{
+#ifdef SCTOOLS_WITH_HTSLIB
+		if (isCram_)
+		{
+			return cramStream_.atEnd();
+		}
+#endif
+		if (isBinary_)
+		{
+			return hasRanges_ ? atRangesEnd_() : recordsStream_.atEnd();
+		}
+
+		return seqan::atEnd(sourceStream_);
+	}
+
 	/**
 	 * \brief Read a set of alignment records from the input source file.
 	 *
@@ -119,16 +277,55 @@ public:
 	 */
 	inline uint64_t
 	read (std::vector<seqan::BamAlignmentRecord>::iterator itBegin,
-	      std::vector<seqan::BamAlignmentRecord>::iterator itEnd) noexcept
+	      std::vector<seqan::BamAlignmentRecord>::iterator itEnd)
 	{
 		uint64_t loaded = 0;
 
 		for (auto it = itBegin;
-		     it != itEnd && !seqan::atEnd(sourceStream_);
-		     it++)
+		     it != itEnd && !atEnd();)
 		{
-			seqan::readRecord(*it,
-			                  sourceStream_);
+			if (isBinary_)
+			{
+				// Filter BAM records on their binary representation, so that
+				// rejected ones are never decoded.
+				readBinaryRecord_();
+				if (filter_ != nullptr &&
+				    !filter_->accept(BamRecordView::fromSized(seqan::begin(rawRecord_,
+				                                                           seqan::Standard()))))
+				{
+					continue;
+				}
+
+				auto rawIt = seqan::begin(rawRecord_,
+				                          seqan::Standard());
+
+				seqan::readRecord(*it,
+				                  seqan::context(sourceStream_),
+				                  rawIt,
+				                  seqan::Bam());
+			}
+			else
+			{
+				seqan::readRecord(*it,
+				                  sourceStream_);
+
+				// SAM records are encoded in their binary representation, so
+				// that the same filter program applies.
+				if (filter_ != nullptr)
+				{
+					seqan::clear(rawRecord_);
+					seqan::write(rawRecord_,
+					             *it,
+					             seqan::context(sourceStream_),
+					             seqan::Bam());
+					if (!filter_->accept(BamRecordView::fromSized(seqan::begin(rawRecord_,
+					                                                           seqan::Standard()))))
+					{
+						continue;
+					}
+				}
+			}
+			it++;
 			loaded++;
 		}
 
@@ -148,6 +345,194 @@ private:
 	 * Header retrieved from the input source.
 	 */
 	seqan::BamHeader bamHeader_;
+	/**
+	 * Flag stating if the source file is a BAM or a CRAM file.
+	 */
+	bool                                isBinary_   = false;
+	/**
+	 * Flag stating if the source file is a CRAM file.
+	 */
+	bool                                isCram_     = false;
+	/**
+	 * Deflate codec used for decompressing BAM records.
+	 */
+	std::unique_ptr<CompressionBackend> backend_;
+	/**
+	 * Stream BAM records are decompressed from.
+	 */
+	BgzfReader                          recordsStream_;
+#ifdef SCTOOLS_WITH_HTSLIB
+	/**
+	 * Stream CRAM records are decoded from.
+	 */
+	CramReader                          cramStream_;
+#endif
+	/**
+	 * Binary representation of the last BAM record read, size included.
+	 */
+	seqan::CharString                   rawRecord_;
+	/**
+	 * Filter records are tested with, if any.
+	 */
+	const RecordFilter*                 filter_     = nullptr;
+	/**
+	 * Ranges of records read from a BAM file, when not reading all of them.
+	 */
+	std::vector<BgzfRange>              ranges_;
+	/**
+	 * Index of the range records are read from.
+	 */
+	uint64_t                            rangeIndex_ = 0;
+	/**
+	 * Flag stating if records are read by range.
+	 */
+	bool                                hasRanges_  = false;
+
+	/**
+	 * \brief Read a little-endian 32 bits integer from the records stream.
+	 *
+	 * \return the integer read.
+	 */
+	inline int32_t
+	readInt32_ ()
+	{
+		char buffer[4];
+
+		if (recordsStream_.read(buffer,
+		                        4) != 4)
+		{
+			throw std::runtime_error("truncated BAM file '" +
+			                         sourcePath_.string() +
+			                         "'");
+		}
+
+		return static_cast<int32_t>(static_cast<uint8_t>(buffer[0]) |
+		                            (static_cast<uint8_t>(buffer[1]) << 8) |
+		                            (static_cast<uint8_t>(buffer[2]) << 16) |
+		                            (static_cast<uint32_t>(static_cast<uint8_t>(buffer[3])) << 24));
+	}
+
+	/**
+	 * \brief Check if every range of records has been read, moving to the
+	 * next range once the current one is over.
+	 *
+	 * \return true if no range is left.
+	 */
+	inline bool
+	atRangesEnd_ ()
+	{
+		while (rangeIndex_ < ranges_.size())
+		{
+			if (recordsStream_.atEnd())
+			{
+				return true;
+			}
+
+			auto position = recordsStream_.tell();
+
+			if (position < ranges_[rangeIndex_].end)
+			{
+				return false;
+			}
+			rangeIndex_ += 1;
+			if (rangeIndex_ < ranges_.size() && ranges_[rangeIndex_].begin > position)
+			{
+				recordsStream_.seek(ranges_[rangeIndex_].begin);
+			}
+		}
+
+		return true;
+	}
+
+	/**
+	 * \brief Move the records stream past the binary header, which has
+	 * already been parsed by SeqAn.
+	 */
+	inline void
+	skipBinaryHeader_ ()
+	{
+		int32_t referencesCount = 0;
+
+		recordsStream_.skip(4);
+		recordsStream_.skip(readInt32_());
+		referencesCount = readInt32_();
+		for (auto i = 0; i < referencesCount; i++)
+		{
+			recordsStream_.skip(readInt32_());
+			recordsStream_.skip(4);
+		}
+	}
+
+	/**
+	 * \brief Open a CRAM file, and parse its header with SeqAn.
+	 *
+	 * \param referencePath is the FASTA file records are decoded against, or
+	 * an empty path for resolving it from the header.
+	 */
+	inline void
+	configureCram_ (const fs::path& referencePath)
+	{
+		Cram::requireAvailable(sourcePath_);
+#ifdef SCTOOLS_WITH_HTSLIB
+#ifdef _OPENMP
+		cramStream_.configure(sourcePath_,
+		                      referencePath,
+		                      omp_get_max_threads());
+#else
+		cramStream_.configure(sourcePath_,
+		                      referencePath,
+		                      1);
+#endif
+
+		// The header comes as SAM text, which fills the context of the
+		// unopened SeqAn stream with the reference sequences.
+		seqan::CharString                                       headerText = cramStream_.getHeaderText();
+		seqan::Iterator<seqan::CharString, seqan::Rooted>::Type headerIt   = seqan::begin(headerText,
+		                                                                                  seqan::Rooted());
+
+		seqan::readHeader(bamHeader_,
+		                  seqan::context(sourceStream_),
+		                  headerIt,
+		                  seqan::Sam());
+		isBinary_ = true;
+		isCram_   = true;
+#else
+		(void) referencePath;
+#endif
+	}
+
+	/**
+	 * \brief Load the binary representation of the next BAM record, size
+	 * included, in the raw record buffer.
+	 */
+	inline void
+	readBinaryRecord_ ()
+	{
+#ifdef SCTOOLS_WITH_HTSLIB
+		if (isCram_)
+		{
+			cramStream_.read(rawRecord_);
+			return;
+		}
+#endif
+
+		int32_t blockSize = readInt32_();
+
+		seqan::resize(rawRecord_,
+		              blockSize + 4);
+		std::memcpy(seqan::begin(rawRecord_,
+		                         seqan::Standard()),
+		            &blockSize,
+		            4);
+		if (recordsStream_.read(seqan::begin(rawRecord_,
+		                                     seqan::Standard()) + 4,
+		                        blockSize) != static_cast<uint64_t>(blockSize))
+		{
+			throw std::runtime_error("truncated BAM file '" +
+			                         sourcePath_.string() +
+			                         "'");
+		}
+	}
 };
 
 }
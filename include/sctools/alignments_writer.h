@@ -11,14 +11,21 @@
 #ifndef SCTOOLS_INCLUDE_SCTOOLS_ALIGNMENTS_WRITER_H
 #define SCTOOLS_INCLUDE_SCTOOLS_ALIGNMENTS_WRITER_H
 
+#include <cstring>
 #include <experimental/filesystem>
 #include <fstream>
+#include <memory>
+#include <stdexcept>
 #include <string>
+#include <utility>
 
 #include <seqan/bam_io.h>
 #include <seqan/bed_io.h>
 
 #include "alignments_reader.h"
+#include "bgzf.h"
+#include "compression_backend.h"
+#include "output_scheduler.h"
 
 namespace fs = std::experimental::filesystem;
 
@@ -27,12 +34,86 @@ namespace sctools
 
 /**
  * \brief Class providing facilities for writing SAM and BAM files.
+ *
+ * BAM records are encoded by SeqAn and compressed into BGZF blocks through the
+ * deflate backend chosen at configuration time, at the requested compression
+ * level. SAM records are written by SeqAn directly.
  */
 class AlignmentsWriter
 {
 
 public:
 
+	/**
+	 * \brief Encode the header of the source alignment reader in the format of
+	 * the output files.
+	 *
+	 * For BAM files, the header is encoded and compressed into BGZF blocks,
+	 * without the end-of-file marker; for SAM files, it is encoded as text.
+	 * Since the blob only depends on the source header, it is built once and
+	 * copied verbatim at the beginning of every output file.
+	 *
+	 * \param reader is the alignment reader header is got from.
+	 * \param backendType is the deflate implementation used for compressing
+	 * BAM headers.
+	 * \param compressionLevel is the compression level of BAM headers.
+	 * \param sortOrder is the value the 'SO' tag of the '@HD' line is set to,
+	 * or the empty string for keeping the sort order of the source header.
+	 * \return the encoded header.
+	 */
+	static inline std::string
+	encodeHeader (const AlignmentsReader& reader,
+	              CompressionBackendType backendType = CompressionBackendType::ZLIB,
+	              int compressionLevel = DEFAULT_COMPRESSION_LEVEL,
+	              const std::string& sortOrder = std::string())
+	{
+		auto              context = reader.getContext();
+		auto              header  = reader.getHeader();
+		seqan::CharString rawHeader;
+		std::string       headerBlob;
+
+		if (!sortOrder.empty())
+		{
+			setSortOrder_(header,
+			              sortOrder);
+		}
+
+		if (reader.isBinary())
+		{
+			auto       backend = CompressionBackend::create(backendType,
+			                                                compressionLevel);
+			BgzfWriter compressor;
+
+			seqan::write(rawHeader,
+			             header,
+			             context,
+			             seqan::Bam());
+			compressor.configure(*backend,
+			                     [&headerBlob] (const char* block,
+			                                    uint64_t blockSize)
+			                     {
+				                     headerBlob.append(block,
+				                                       blockSize);
+			                     });
+			compressor.write(seqan::begin(rawHeader,
+			                              seqan::Standard()),
+			                 seqan::length(rawHeader));
+			compressor.close(false);
+		}
+		else
+		{
+			seqan::write(rawHeader,
+			             header,
+			             context,
+			             seqan::Sam());
+			headerBlob.assign(seqan::begin(rawHeader,
+			                               seqan::Standard()),
+			                  seqan::length(rawHeader));
+		}
+
+		return headerBlob;
+	}
+
 	/**
 	 * \brief Copy the header of the source alignment reader to the output file
 	 * path.
@@ -40,29 +121,57 @@ public:
 	 * \param outPath is the path to the file where the header will be
 	 * forwarded.
 	 * \param reader is the alignment reader header is got from.
+	 * \param backendType is the deflate implementation used for compressing
+	 * BAM headers.
+	 * \param compressionLevel is the compression level of BAM headers.
 	 */
 	static inline void
 	forwardHeader (const fs::path& outputFilePath,
-	               const AlignmentsReader& reader) noexcept
+	               const AlignmentsReader& reader,
+	               CompressionBackendType backendType = CompressionBackendType::ZLIB,
+	               int compressionLevel = DEFAULT_COMPRESSION_LEVEL)
 	{
-		std::ofstream     proxyWriterCore(outputFilePath,
-		                                  std::ios::binary);
-		seqan::BamFileOut proxyWriter;
-
-		seqan::open(proxyWriter,
-		            proxyWriterCore,
-		            reader.getFormat());
-		seqan::context(proxyWriter) = reader.getContext();
-		seqan::writeHeader(proxyWriter,
-		                   reader.getHeader());
-		seqan::close(proxyWriter);
+		std::ofstream proxyWriterCore(outputFilePath,
+		                              std::ios::binary);
+		std::string   headerBlob = encodeHeader(reader,
+		                                        backendType,
+		                                        compressionLevel);
+
+		proxyWriterCore.write(headerBlob.data(),
+		                      headerBlob.size());
+		if (reader.isBinary())
+		{
+			proxyWriterCore.write(Bgzf::eofBlock().data(),
+			                      Bgzf::eofBlock().size());
+		}
 	}
 
+	/**
+	 * Compression level used when none is specified, the same as zlib's.
+	 */
+	static constexpr int DEFAULT_COMPRESSION_LEVEL = 6;
+
 	/**
 	 * \brief Class constructor.
 	 */
 	AlignmentsWriter () = default;
 
+	/**
+	 * \brief Class destructor.
+	 *
+	 * Pending BAM records are compressed and flushed to the output file.
+	 */
+	~AlignmentsWriter ()
+	{
+		try
+		{
+			compressor_.close(true);
+		}
+		catch (...)
+		{
+		}
+	}
+
 	/**
 	 * \brief Class copy constructor.
 	 *
@@ -83,8 +192,11 @@ public:
 	 * \brief Reset the status of the writer instance.
 	 */
 	inline void
-	reset () noexcept
+	reset ()
 	{
+		compressor_.close(true);
+		blockSink_      = nullptr;
+		compressedSize_ = 0;
 		sinkPath_ = fs::path("");
 		sinkStreamCore_.close();
 		seqan::close(sinkStream_);
@@ -103,17 +215,89 @@ public:
 	 * instance.
 	 * \param configureAppend is a flag which append the new record to the
 	 * output file, if it true.
+	 * \param writeBed is a flag which mirrors every record to a BED file, if
+	 * it is true.
+	 * \param backendType is the deflate implementation used for compressing
+	 * BAM records.
+	 * \param compressionLevel is the compression level of BAM records, from 0
+	 * to 9.
+	 * \param scheduler is the scheduler compressed BAM blocks are handed to,
+	 * batched together with the ones of other writers. If it is null, blocks
+	 * are written to the output file directly.
 	 */
 	inline void
 	configure (const fs::path& sinkPath,
 	           const AlignmentsReader& bamReader,
 	           bool configureAppend,
-		   const bool writeBed) noexcept
+		   const bool writeBed,
+	           CompressionBackendType backendType = CompressionBackendType::ZLIB,
+	           int compressionLevel = DEFAULT_COMPRESSION_LEVEL,
+	           OutputScheduler* scheduler = nullptr)
+	{
+		BgzfWriter::TBlockSink blockSink;
+
+		if (bamReader.isBinary() && scheduler != nullptr)
+		{
+			auto fileId = scheduler->open(sinkPath,
+			                              configureAppend);
+
+			blockSink = [scheduler, fileId] (const char* block,
+			                                 uint64_t blockSize)
+			{
+				scheduler->submit(fileId,
+				                  block,
+				                  blockSize);
+			};
+		}
+		configure(sinkPath,
+		          bamReader,
+		          configureAppend,
+		          writeBed,
+		          backendType,
+		          compressionLevel,
+		          std::move(blockSink));
+	}
+
+	/**
+	 * \brief Initialize the writer instance, handing compressed BAM blocks to
+	 * a function rather than writing them to the output file.
+	 *
+	 * \param sinkPath is the path to the file the current object will write
+	 * to.
+	 * \param bamReader is the reader object used for initialize the writer
+	 * instance.
+	 * \param configureAppend is a flag which append the new record to the
+	 * output file, if it true.
+	 * \param writeBed is a flag which mirrors every record to a BED file, if
+	 * it is true.
+	 * \param backendType is the deflate implementation used for compressing
+	 * BAM records.
+	 * \param compressionLevel is the compression level of BAM records, from 0
+	 * to 9.
+	 * \param blockSink is the function every compressed BAM block, header
+	 * included, is handed to in place of the output file. If it is empty,
+	 * blocks are written to the output file directly. SAM records and BED
+	 * mirrors are always written to their files.
+	 */
+	inline void
+	configure (const fs::path& sinkPath,
+	           const AlignmentsReader& bamReader,
+	           bool configureAppend,
+	           bool writeBed,
+	           CompressionBackendType backendType,
+	           int compressionLevel,
+	           BgzfWriter::TBlockSink blockSink)
 	{
 		writeBed_ = writeBed;
 		reset();
 		sinkPath_ = sinkPath;
-		if (configureAppend)
+		isBinary_ = bamReader.isBinary();
+		if (isBinary_ && blockSink)
+		{
+			// The block sink owns the output file, which is not opened here.
+			blockSink_ = std::move(blockSink);
+		}
+		else if (configureAppend)
 		{
 			sinkStreamCore_.open(sinkPath_,
 			                     std::ios::app | std::ios::binary);
@@ -123,9 +307,46 @@ public:
 			sinkStreamCore_.open(sinkPath_,
 			                     std::ios::binary);
 		}
-		seqan::open(sinkStream_,
-		            sinkStreamCore_,
-		            bamReader.getFormat());
+		if (isBinary_)
+		{
+			if (!backend_ ||
+			    backendType_ != backendType ||
+			    compressionLevel_ != compressionLevel)
+			{
+				backend_          = CompressionBackend::create(backendType,
+				                                               compressionLevel);
+				backendType_      = backendType;
+				compressionLevel_ = compressionLevel;
+			}
+			if (blockSink_)
+			{
+				compressor_.configure(*backend_,
+				                      [this] (const char* block,
+				                              uint64_t blockSize)
+				                      {
+					                      blockSink_(block,
+					                                 blockSize);
+					                      compressedSize_ += blockSize;
+				                      });
+			}
+			else
+			{
+				compressor_.configure(*backend_,
+				                      [this] (const char* block,
+				                              uint64_t blockSize)
+				                      {
+					                      sinkStreamCore_.write(block,
+					                                            blockSize);
+					                      compressedSize_ += blockSize;
+				                      });
+			}
+		}
+		else
+		{
+			seqan::open(sinkStream_,
+			            sinkStreamCore_,
+			            bamReader.getFormat());
+		}
 		seqan::context(sinkStream_) = bamReader.getContext();
 		if (writeBed_) {
 			fs::path bedPath = fs::path(sinkPath);
@@ -133,12 +354,66 @@ public:
 			std::string bedName = bedPath.string();
 			// but configureAppend == FALSE makes sense here?
 			// where we aiming at more general classes and we should have a bed_writer?
-			sinkStreamBed_.open(bedPath, std::ios::app | std::ios::binary);
+			sinkStreamBed_.open(bedPath,
+			                    configureAppend ?
+			                    std::ios::app | std::ios::binary :
+			                    std::ios::binary);
 			//auto res = seqan::open(bedOut_,  bedName.c_str(), seqan::OPEN_WRONLY | seqan::OPEN_APPEND);
 			seqan::open(bedOut_,  sinkStreamBed_);
 		}
 	}
 
+	/**
+	 * \brief Write an encoded header at the current position of the output
+	 * file, bypassing record encoding and compression.
+	 *
+	 * It must be called right after the writer is configured for creating a
+	 * new file, before any record is written.
+	 *
+	 * \param headerBlob is the header built by encodeHeader().
+	 */
+	inline void
+	writeHeaderBlob (const std::string& headerBlob)
+	{
+		if (blockSink_)
+		{
+			blockSink_(headerBlob.data(),
+			           headerBlob.size());
+		}
+		else
+		{
+			sinkStreamCore_.write(headerBlob.data(),
+			                      headerBlob.size());
+		}
+		compressedSize_ += headerBlob.size();
+	}
+
+	/**
+	 * \brief Compress the buffered BAM records into a block, even if it is
+	 * not full, so that the next record starts a new block.
+	 */
+	inline void
+	flushBlock ()
+	{
+		compressor_.flush();
+	}
+
+	/**
+	 * \brief Access the number of BAM bytes handed to the output file since
+	 * the writer has been configured.
+	 *
+	 * Records still buffered for compression are not accounted for, so the
+	 * size is the offset of the next block only after flushBlock().
+	 *
+	 * \return the size of the compressed blocks written so far, header
+	 * included.
+	 */
+	inline uint64_t
+	getCompressedSize () const noexcept
+	{
+		return compressedSize_;
+	}
+
 	/**
 	 * \brief Write a set of alignment records to the output sink file.
 	 *
@@ -148,7 +423,7 @@ public:
 	 */
 	inline uint64_t
 	write (std::vector<seqan::BamAlignmentRecord>::iterator itBegin,
-	       std::vector<seqan::BamAlignmentRecord>::iterator itEnd) noexcept
+	       std::vector<seqan::BamAlignmentRecord>::iterator itEnd)
 	{
 		uint64_t written = 0;
 
@@ -156,23 +431,89 @@ public:
 		     it != itEnd;
 		     it++)
 		{
-			seqan::writeRecord(sinkStream_,
-			                   *it);
+			if (isBinary_)
+			{
+				seqan::clear(rawRecord_);
+				seqan::write(rawRecord_,
+				             *it,
+				             seqan::context(sinkStream_),
+				             seqan::Bam());
+				compressor_.write(seqan::begin(rawRecord_,
+				                               seqan::Standard()),
+				                  seqan::length(rawRecord_));
+			}
+			else
+			{
+				seqan::writeRecord(sinkStream_,
+				                   *it);
+			}
 			written += 1;
 			if (writeBed_) {
-				seqan::BedRecord<seqan::Bed3> record;
-				record.beginPos = (*it).beginPos;
-				record.endPos = seqan::getAlignmentLengthInRef(*it) + record.beginPos;
-				record.ref = seqan::getContigName(*it, sinkStream_);
-				//record. = (*it).qName; TODO FIXME
-				//seqan::writeRecord(bedOut_, seqan::BedRecord( *it)); // not automatic, need to build record?
-				seqan::writeRecord(bedOut_, record);
+				mirrorToBed_(*it);
 			}
 		}
 
 		return written;
 	}
 
+	/**
+	 * \brief Write a record given in its BAM binary representation.
+	 *
+	 * BAM records are compressed as they are, while SAM records and BED
+	 * mirrors are decoded first.
+	 *
+	 * \param rawRecord is the pointer to the block size of the record.
+	 */
+	inline void
+	writeRaw (const char* rawRecord)
+	{
+		uint32_t blockSize = 0;
+
+		std::memcpy(&blockSize,
+		            rawRecord,
+		            4);
+		if (isBinary_)
+		{
+			compressor_.write(rawRecord,
+			                  4 + blockSize);
+		}
+		if (!isBinary_ || writeBed_)
+		{
+			const char* rawIt = rawRecord;
+
+			seqan::readRecord(decodedRecord_,
+			                  seqan::context(sinkStream_),
+			                  rawIt,
+			                  seqan::Bam());
+			if (!isBinary_)
+			{
+				seqan::writeRecord(sinkStream_,
+				                   decodedRecord_);
+			}
+			if (writeBed_) {
+				mirrorToBed_(decodedRecord_);
+			}
+		}
+	}
+
+	/**
+	 * \brief Write SAM lines verbatim to the output SAM file, bypassing record
+	 * encoding.
+	 *
+	 * \param lines are the lines to be written, each one terminated by a
+	 * newline.
+	 */
+	inline void
+	writeText (const std::string& lines)
+	{
+		if (isBinary_)
+		{
+			throw std::logic_error("SAM lines cannot be written to a BAM file");
+		}
+		sinkStreamCore_.write(lines.data(),
+		                      lines.size());
+	}
+
 private:
 	/**
 	 * Path to the file data are written to.
@@ -183,9 +524,48 @@ private:
 	 */
 	std::ofstream sinkStreamCore_;
 	/**
-	 * Stream representing a SAM or BAM data sink.
+	 * Stream representing a SAM data sink. For BAM data sinks, it only
+	 * provides the context records are encoded with.
 	 */
 	seqan::BamFileOut sinkStream_;
+	/**
+	 * Flag stating if records are written in BAM format.
+	 */
+	bool                                isBinary_         = false;
+	/**
+	 * Deflate implementation of the current compression backend.
+	 */
+	CompressionBackendType              backendType_      = CompressionBackendType::ZLIB;
+	/**
+	 * Compression level of the current compression backend.
+	 */
+	int                                 compressionLevel_ = DEFAULT_COMPRESSION_LEVEL;
+	/**
+	 * Deflate codec used for compressing BAM records.
+	 */
+	std::unique_ptr<CompressionBackend> backend_;
+	/**
+	 * Stream compressing BAM records into BGZF blocks.
+	 */
+	BgzfWriter                          compressor_;
+	/**
+	 * Binary representation of the record being written.
+	 */
+	seqan::CharString                   rawRecord_;
+	/**
+	 * Record decoded from its binary representation, for SAM files and BED
+	 * mirrors.
+	 */
+	seqan::BamAlignmentRecord           decodedRecord_;
+	/**
+	 * Function compressed BAM blocks are handed to in place of the output
+	 * file, if any.
+	 */
+	BgzfWriter::TBlockSink              blockSink_;
+	/**
+	 * Number of BAM bytes handed to the output file since configuration.
+	 */
+	uint64_t                            compressedSize_   = 0;
 
 	/**
 	 * If and BedFile out where bam entries are mirrored.
@@ -193,6 +573,76 @@ private:
 	bool		  writeBed_; // std::optional not available?
 	std::ofstream	sinkStreamBed_;
 	seqan::BedFileOut bedOut_;
+
+	/**
+	 * \brief Set the sort order declared by a header.
+	 *
+	 * \param header is the header, which gets an '@HD' line if it has none.
+	 * \param sortOrder is the value of the 'SO' tag.
+	 */
+	static inline void
+	setSortOrder_ (seqan::BamHeader& header,
+	               const std::string& sortOrder)
+	{
+		seqan::Pair<seqan::CharString> tag;
+		seqan::BamHeaderRecord         first;
+		seqan::BamHeader               sortedHeader;
+
+		tag.i1 = "SO";
+		tag.i2 = sortOrder.c_str();
+		for (auto i = 0ul; i < seqan::length(header); i++)
+		{
+			if (header[i].type != seqan::BAM_HEADER_FIRST)
+			{
+				continue;
+			}
+			for (auto j = 0ul; j < seqan::length(header[i].tags); j++)
+			{
+				if (std::string(seqan::toCString(header[i].tags[j].i1)) == "SO")
+				{
+					header[i].tags[j].i2 = tag.i2;
+					return;
+				}
+			}
+			seqan::appendValue(header[i].tags,
+			                   tag);
+			return;
+		}
+
+		// The '@HD' line must come first, with the format version first.
+		first.type = seqan::BAM_HEADER_FIRST;
+		seqan::appendValue(first.tags,
+		                   seqan::Pair<seqan::CharString>());
+		first.tags[0].i1 = "VN";
+		first.tags[0].i2 = "1.6";
+		seqan::appendValue(first.tags,
+		                   tag);
+		seqan::appendValue(sortedHeader,
+		                   first);
+		for (auto i = 0ul; i < seqan::length(header); i++)
+		{
+			seqan::appendValue(sortedHeader,
+			                   header[i]);
+		}
+		header = sortedHeader;
+	}
+
+	/**
+	 * \brief Mirror a record to the BED file.
+	 *
+	 * \param alignment is the record, whose reference span is written.
+	 */
+	inline void
+	mirrorToBed_ (const seqan::BamAlignmentRecord& alignment)
+	{
+		seqan::BedRecord<seqan::Bed3> record;
+		record.beginPos = alignment.beginPos;
+		record.endPos = seqan::getAlignmentLengthInRef(alignment) + record.beginPos;
+		record.ref = seqan::getContigName(alignment, sinkStream_);
+		//record. = (*it).qName; TODO FIXME
+		//seqan::writeRecord(bedOut_, seqan::BedRecord( *it)); // not automatic, need to build record?
+		seqan::writeRecord(bedOut_, record);
+	}
 };
 
 }
@@ -0,0 +1,198 @@
+/**
+ * \file   include/sctools/allocation_hooks.h
+ * \author Elena Grassi
+ * \author Marilisa Montemurro
+ * \author Emanuele Parisi
+ * \date   February, 2019
+ *
+ * File replacing the global allocation functions, so that every heap
+ * allocation is accounted for by the memory tracker. It must be included in
+ * exactly one translation unit of a program, and only when the
+ * SCTOOLS_TRACK_ALLOCATIONS macro is defined.
+ */
+
+#ifndef SCTOOLS_INCLUDE_SCTOOLS_ALLOCATION_HOOKS_H
+#define SCTOOLS_INCLUDE_SCTOOLS_ALLOCATION_HOOKS_H
+
+#ifndef SCTOOLS_TRACK_ALLOCATIONS
+#error "allocation_hooks.h requires the SCTOOLS_TRACK_ALLOCATIONS macro"
+#endif
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+#include "memory_tracker.h"
+
+namespace sctools
+{
+namespace allocation_hooks
+{
+
+/**
+ * Size of the header prepended to every allocation, keeping the returned
+ * pointer aligned for any fundamental type.
+ */
+constexpr std::size_t HEADER_SIZE = 16;
+
+/**
+ * \brief Struct storing the header of an allocation.
+ */
+struct Header
+{
+	/**
+	 * Number of bytes requested.
+	 */
+	uint64_t        size;
+	/**
+	 * Subsystem the allocation is attributed to.
+	 */
+	MemorySubsystem subsystem;
+};
+
+static_assert(sizeof(Header) <= HEADER_SIZE,
+              "the allocation header does not fit its reserved space");
+
+/**
+ * \brief Allocate memory, recording its size and subsystem in its header.
+ *
+ * \param size is the number of bytes requested.
+ * \return a pointer to the allocated memory, or nullptr on failure.
+ */
+inline void*
+allocate (std::size_t size) noexcept
+{
+	auto* block = static_cast<char*>(std::malloc(size + HEADER_SIZE));
+
+	if (block == nullptr)
+	{
+		return nullptr;
+	}
+
+	auto* header = reinterpret_cast<Header*>(block);
+
+	header->size      = size;
+	header->subsystem = MemoryTracker::currentSubsystem();
+	MemoryTracker::recordAllocation(header->subsystem,
+	                                size);
+
+	return block + HEADER_SIZE;
+}
+
+/**
+ * \brief Allocate memory, following the failure policy of operator new.
+ *
+ * \param size is the number of bytes requested.
+ * \return a pointer to the allocated memory.
+ */
+inline void*
+allocateOrThrow (std::size_t size)
+{
+	void* pointer = nullptr;
+
+	while ((pointer = allocate(size)) == nullptr)
+	{
+		std::new_handler handler = std::get_new_handler();
+
+		if (handler == nullptr)
+		{
+			throw std::bad_alloc();
+		}
+		handler();
+	}
+
+	return pointer;
+}
+
+/**
+ * \brief Release memory obtained from allocate().
+ *
+ * \param pointer is the pointer returned by allocate(), or nullptr.
+ */
+inline void
+release (void* pointer) noexcept
+{
+	if (pointer == nullptr)
+	{
+		return;
+	}
+
+	auto* block  = static_cast<char*>(pointer) - HEADER_SIZE;
+	auto* header = reinterpret_cast<Header*>(block);
+
+	MemoryTracker::recordRelease(header->subsystem,
+	                             header->size);
+	std::free(block);
+}
+
+} // allocation_hooks
+} // sctools
+
+void*
+operator new (std::size_t size)
+{
+	return sctools::allocation_hooks::allocateOrThrow(size);
+}
+
+void*
+operator new[] (std::size_t size)
+{
+	return sctools::allocation_hooks::allocateOrThrow(size);
+}
+
+void*
+operator new (std::size_t size,
+              const std::nothrow_t&) noexcept
+{
+	return sctools::allocation_hooks::allocate(size);
+}
+
+void*
+operator new[] (std::size_t size,
+                const std::nothrow_t&) noexcept
+{
+	return sctools::allocation_hooks::allocate(size);
+}
+
+void
+operator delete (void* pointer) noexcept
+{
+	sctools::allocation_hooks::release(pointer);
+}
+
+void
+operator delete[] (void* pointer) noexcept
+{
+	sctools::allocation_hooks::release(pointer);
+}
+
+void
+operator delete (void* pointer,
+                 std::size_t) noexcept
+{
+	sctools::allocation_hooks::release(pointer);
+}
+
+void
+operator delete[] (void* pointer,
+                   std::size_t) noexcept
+{
+	sctools::allocation_hooks::release(pointer);
+}
+
+void
+operator delete (void* pointer,
+                 const std::nothrow_t&) noexcept
+{
+	sctools::allocation_hooks::release(pointer);
+}
+
+void
+operator delete[] (void* pointer,
+                   const std::nothrow_t&) noexcept
+{
+	sctools::allocation_hooks::release(pointer);
+}
+
+#endif // SCTOOLS_INCLUDE_SCTOOLS_ALLOCATION_HOOKS_H
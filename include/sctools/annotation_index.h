@@ -0,0 +1,575 @@
+/**
+ * \file   include/sctools/annotation_index.h
+ * \author Elena Grassi
+ * \author Marilisa Montemurro
+ * \author Emanuele Parisi
+ * \date   February, 2019
+ *
+ * File containing the index of the genes of a GTF or BED annotation, queried
+ * by reference range.
+ */
+
+#ifndef SCTOOLS_INCLUDE_SCTOOLS_ANNOTATION_INDEX_H
+#define SCTOOLS_INCLUDE_SCTOOLS_ANNOTATION_INDEX_H
+
+#include <algorithm>
+#include <cstdint>
+#include <experimental/filesystem>
+#include <fstream>
+#include <numeric>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace fs = std::experimental::filesystem;
+
+namespace sctools
+{
+
+/**
+ * \brief Class indexing the intervals of the genes of an annotation.
+ *
+ * The intervals of every contig are stored sorted by start, along with the
+ * running maximum of their ends, in separate arrays. Every interval before the
+ * first one whose running maximum exceeds a position ends before it, so that
+ * the first candidate interval of a query is found by binary search, or by
+ * moving a cursor forward when queries come in coordinate order. Candidate
+ * intervals are then scanned until one starts past the end of the query.
+ *
+ * GTF annotations contribute their exons, grouped by gene_id, or their genes
+ * if they list no exon. BED annotations contribute every line, grouped by
+ * name. Coordinates are stored 0-based and half-open.
+ */
+class AnnotationIndex
+{
+
+public:
+
+	/**
+	 * \brief Struct storing the position of a query in the index.
+	 */
+	struct Cursor
+	{
+		/**
+		 * Contig of the last query, or -1 before the first one.
+		 */
+		int64_t  contigId = -1;
+		/**
+		 * Position of the last query.
+		 */
+		int32_t  position = 0;
+		/**
+		 * Index of the first interval possibly overlapping the position.
+		 */
+		uint64_t first    = 0;
+	};
+
+	/**
+	 * Class constructor.
+	 */
+	AnnotationIndex () = default;
+
+	/**
+	 * \brief Class copy constructor.
+	 *
+	 * \param other is the object the current instance is initialized from.
+	 */
+	AnnotationIndex (const AnnotationIndex& other) = delete;
+
+	/**
+	 * \brief Class copy assignment operator.
+	 *
+	 * \param other is the object the current instance is initialized from.
+	 * \return a reference to the assigned object.
+	 */
+	AnnotationIndex&
+	operator= (const AnnotationIndex& other) = delete;
+
+	/**
+	 * \brief Load an annotation, replacing the current one.
+	 *
+	 * \param annotationFilePath is the path to the annotation, whose format
+	 * is BED if its extension is ".bed", and GTF otherwise.
+	 */
+	inline void
+	load (const fs::path& annotationFilePath)
+	{
+		std::ifstream annotationReader(annotationFilePath);
+
+		if (!annotationReader)
+		{
+			throw std::runtime_error("cannot open annotation file '" +
+			                         annotationFilePath.string() +
+			                         "'");
+		}
+		reset();
+		if (annotationFilePath.extension() == ".bed")
+		{
+			loadBed_(annotationReader,
+			         annotationFilePath);
+		}
+		else
+		{
+			loadGtf_(annotationReader,
+			         annotationFilePath);
+		}
+		for (auto& c : contigs_)
+		{
+			sortContig_(c);
+		}
+	}
+
+	/**
+	 * \brief Empty the index.
+	 */
+	inline void
+	reset () noexcept
+	{
+		contigs_.clear();
+		contigIds_.clear();
+		geneIds_.clear();
+		geneNames_.clear();
+		geneIndices_.clear();
+	}
+
+	/**
+	 * \brief Access the number of genes.
+	 *
+	 * \return the number of genes of the annotation.
+	 */
+	inline uint64_t
+	getGenesCount () const noexcept
+	{
+		return geneIds_.size();
+	}
+
+	/**
+	 * \brief Access the identifier of a gene.
+	 *
+	 * \param geneId is the index of the gene.
+	 * \return the gene_id of the gene, or the BED name.
+	 */
+	inline const std::string&
+	getGeneId (uint64_t geneId) const noexcept
+	{
+		return geneIds_[geneId];
+	}
+
+	/**
+	 * \brief Access the name of a gene.
+	 *
+	 * \param geneId is the index of the gene.
+	 * \return the gene_name of the gene, or its identifier if missing.
+	 */
+	inline const std::string&
+	getGeneName (uint64_t geneId) const noexcept
+	{
+		return geneNames_[geneId];
+	}
+
+	/**
+	 * \brief Find the contig of the index with a given name.
+	 *
+	 * \param name is the name of the contig.
+	 * \return the index of the contig, or -1 if it has no interval.
+	 */
+	inline int64_t
+	findContig (const std::string& name) const
+	{
+		auto contigIt = contigIds_.find(name);
+
+		return contigIt != contigIds_.end() ? static_cast<int64_t>(contigIt->second) : -1;
+	}
+
+	/**
+	 * \brief Move a cursor to a position, which further queries must not
+	 * start before.
+	 *
+	 * The cursor moves forward when the position follows the one of the
+	 * last query on the same contig, and is found by binary search
+	 * otherwise.
+	 *
+	 * \param cursor is the cursor.
+	 * \param contigId is the index of the contig.
+	 * \param position is the position.
+	 */
+	inline void
+	seek (Cursor& cursor,
+	      int64_t contigId,
+	      int32_t position) const
+	{
+		const auto& maxEnds = contigs_[contigId].maxEnds;
+
+		if (cursor.contigId != contigId || position < cursor.position)
+		{
+			cursor.first = std::upper_bound(maxEnds.begin(),
+			                                maxEnds.end(),
+			                                position) - maxEnds.begin();
+		}
+		else
+		{
+			while (cursor.first < maxEnds.size() && maxEnds[cursor.first] <= position)
+			{
+				cursor.first += 1;
+			}
+		}
+		cursor.contigId = contigId;
+		cursor.position = position;
+	}
+
+	/**
+	 * \brief Visit the genes of the intervals overlapping a range. A gene is
+	 * visited once for every interval of its overlapping the range.
+	 *
+	 * \param cursor is the cursor, moved to a position not after the start
+	 * of the range.
+	 * \param start is the first position of the range.
+	 * \param end is the position following the last one of the range.
+	 * \param visitor is the callable invoked with the index of every gene.
+	 */
+	template <typename TVisitor>
+	inline void
+	forEachOverlap (const Cursor& cursor,
+	                int32_t start,
+	                int32_t end,
+	                TVisitor&& visitor) const
+	{
+		const auto& contig = contigs_[cursor.contigId];
+
+		for (auto i = cursor.first; i < contig.starts.size() && contig.starts[i] < end; i++)
+		{
+			if (contig.ends[i] > start)
+			{
+				visitor(contig.genes[i]);
+			}
+		}
+	}
+
+private:
+	/**
+	 * \brief Struct storing the intervals of a contig.
+	 */
+	struct Contig_
+	{
+		/**
+		 * First position of every interval.
+		 */
+		std::vector<int32_t>  starts;
+		/**
+		 * Position following the last one of every interval.
+		 */
+		std::vector<int32_t>  ends;
+		/**
+		 * Largest end of the intervals up to every one.
+		 */
+		std::vector<int32_t>  maxEnds;
+		/**
+		 * Gene of every interval.
+		 */
+		std::vector<uint32_t> genes;
+	};
+
+	/**
+	 * Intervals of every contig.
+	 */
+	std::vector<Contig_>                      contigs_;
+	/**
+	 * Map associating contig names with their index.
+	 */
+	std::unordered_map<std::string, uint64_t> contigIds_;
+	/**
+	 * Identifier of every gene.
+	 */
+	std::vector<std::string>                  geneIds_;
+	/**
+	 * Name of every gene.
+	 */
+	std::vector<std::string>                  geneNames_;
+	/**
+	 * Map associating gene identifiers with their index.
+	 */
+	std::unordered_map<std::string, uint32_t> geneIndices_;
+
+	/**
+	 * \brief Append an interval to the index.
+	 *
+	 * \param contigName is the name of the contig of the interval.
+	 * \param start is the first position of the interval.
+	 * \param end is the position following the last one of the interval.
+	 * \param geneId is the identifier of the gene of the interval.
+	 * \param geneName is the name of the gene of the interval.
+	 */
+	inline void
+	addInterval_ (const std::string& contigName,
+	              int32_t start,
+	              int32_t end,
+	              const std::string& geneId,
+	              const std::string& geneName)
+	{
+		auto contigId = contigIds_.emplace(contigName,
+		                                   contigs_.size());
+		auto geneIt   = geneIndices_.emplace(geneId,
+		                                     geneIds_.size());
+
+		if (contigId.second)
+		{
+			contigs_.emplace_back();
+		}
+		if (geneIt.second)
+		{
+			geneIds_.emplace_back(geneId);
+			geneNames_.emplace_back(geneName.empty() ? geneId : geneName);
+		}
+
+		auto& contig = contigs_[contigId.first->second];
+
+		contig.starts.emplace_back(start);
+		contig.ends.emplace_back(end);
+		contig.genes.emplace_back(geneIt.first->second);
+	}
+
+	/**
+	 * \brief Sort the intervals of a contig by start, and compute the running
+	 * maximum of their ends.
+	 *
+	 * \param contig is the contig.
+	 */
+	static inline void
+	sortContig_ (Contig_& contig)
+	{
+		std::vector<uint64_t> order(contig.starts.size());
+		Contig_               sorted;
+
+		std::iota(order.begin(),
+		          order.end(),
+		          0);
+		std::sort(order.begin(),
+		          order.end(),
+		          [&contig] (uint64_t lhs,
+		                     uint64_t rhs)
+		          {
+			          return contig.starts[lhs] < contig.starts[rhs];
+		          });
+		for (auto i : order)
+		{
+			sorted.starts.emplace_back(contig.starts[i]);
+			sorted.ends.emplace_back(contig.ends[i]);
+			sorted.maxEnds.emplace_back(sorted.maxEnds.empty() ? contig.ends[i] : std::max(sorted.maxEnds.back(),
+			                                                                                contig.ends[i]));
+			sorted.genes.emplace_back(contig.genes[i]);
+		}
+		contig = std::move(sorted);
+	}
+
+	/**
+	 * \brief Split a line of an annotation into its tab-separated fields.
+	 *
+	 * \param line is the line.
+	 * \param fields are the fields of the line.
+	 */
+	static inline void
+	splitFields_ (const std::string& line,
+	              std::vector<std::string>& fields)
+	{
+		std::istringstream lineStream(line);
+		std::string        field;
+
+		fields.clear();
+		while (std::getline(lineStream,
+		                    field,
+		                    '\t'))
+		{
+			fields.emplace_back(field);
+		}
+	}
+
+	/**
+	 * \brief Extract the value of an attribute from the attributes of a GTF
+	 * line.
+	 *
+	 * \param attributes are the attributes, as in 'gene_id "A"; gene_name "B";'.
+	 * \param key is the name of the attribute.
+	 * \return the value of the attribute, or an empty string if missing.
+	 */
+	static inline std::string
+	findAttribute_ (const std::string& attributes,
+	                const std::string& key)
+	{
+		auto position = 0ul;
+
+		while ((position = attributes.find(key,
+		                                   position)) != std::string::npos)
+		{
+			auto valueStart = position + key.size();
+
+			// The key must be a whole attribute name.
+			if ((position == 0 || attributes[position - 1] == ' ' || attributes[position - 1] == ';') &&
+			    valueStart < attributes.size() && attributes[valueStart] == ' ')
+			{
+				valueStart = attributes.find_first_not_of(" \"",
+				                                          valueStart);
+
+				auto valueEnd = attributes.find_first_of("\";",
+				                                         valueStart);
+
+				return attributes.substr(valueStart,
+				                         valueEnd - valueStart);
+			}
+			position = valueStart;
+		}
+
+		return "";
+	}
+
+	/**
+	 * \brief Load the exons of a GTF annotation, or its genes if it lists no
+	 * exon.
+	 *
+	 * \param annotationReader is the stream of the annotation.
+	 * \param annotationFilePath is the path to the annotation.
+	 */
+	inline void
+	loadGtf_ (std::istream& annotationReader,
+	          const fs::path& annotationFilePath)
+	{
+		std::vector<std::string> fields;
+		std::vector<std::string> genes;
+		std::string              line;
+		uint64_t                 lineNumber = 0;
+		bool                     hasExons   = false;
+
+		while (std::getline(annotationReader,
+		                    line))
+		{
+			lineNumber += 1;
+			if (!line.empty() && line.back() == '\r')
+			{
+				line.pop_back();
+			}
+			if (line.empty() || line.front() == '#')
+			{
+				continue;
+			}
+			splitFields_(line,
+			             fields);
+			if (fields.size() < 9)
+			{
+				throw std::invalid_argument("malformed line " +
+				                            std::to_string(lineNumber) +
+				                            " of annotation file '" +
+				                            annotationFilePath.string() +
+				                            "'");
+			}
+			if (fields[2] != "exon" && fields[2] != "gene")
+			{
+				continue;
+			}
+
+			auto geneId = findAttribute_(fields[8],
+			                             "gene_id");
+
+			if (geneId.empty())
+			{
+				throw std::invalid_argument("line " +
+				                            std::to_string(lineNumber) +
+				                            " of annotation file '" +
+				                            annotationFilePath.string() +
+				                            "' has no gene_id");
+			}
+
+			// Genes are kept aside, in case no exon is listed.
+			if (fields[2] == "gene")
+			{
+				if (!hasExons)
+				{
+					genes.emplace_back(line);
+				}
+				continue;
+			}
+			hasExons = true;
+			genes.clear();
+			addInterval_(fields[0],
+			             std::stoi(fields[3]) - 1,
+			             std::stoi(fields[4]),
+			             geneId,
+			             findAttribute_(fields[8],
+			                            "gene_name"));
+		}
+		for (const auto& g : genes)
+		{
+			splitFields_(g,
+			             fields);
+			addInterval_(fields[0],
+			             std::stoi(fields[3]) - 1,
+			             std::stoi(fields[4]),
+			             findAttribute_(fields[8],
+			                            "gene_id"),
+			             findAttribute_(fields[8],
+			                            "gene_name"));
+		}
+	}
+
+	/**
+	 * \brief Load the intervals of a BED annotation.
+	 *
+	 * \param annotationReader is the stream of the annotation.
+	 * \param annotationFilePath is the path to the annotation.
+	 */
+	inline void
+	loadBed_ (std::istream& annotationReader,
+	          const fs::path& annotationFilePath)
+	{
+		std::vector<std::string> fields;
+		std::string              line;
+		uint64_t                 lineNumber = 0;
+
+		while (std::getline(annotationReader,
+		                    line))
+		{
+			lineNumber += 1;
+			if (!line.empty() && line.back() == '\r')
+			{
+				line.pop_back();
+			}
+			if (line.empty() || line.front() == '#')
+			{
+				continue;
+			}
+
+			// Track and browser lines only carry display settings.
+			if (line.compare(0,
+			                 6,
+			                 "track ") == 0 || line.compare(0,
+			                                                8,
+			                                                "browser ") == 0)
+			{
+				continue;
+			}
+			splitFields_(line,
+			             fields);
+			if (fields.size() < 3)
+			{
+				throw std::invalid_argument("malformed line " +
+				                            std::to_string(lineNumber) +
+				                            " of annotation file '" +
+				                            annotationFilePath.string() +
+				                            "'");
+			}
+
+			// Unnamed intervals are genes of their own.
+			auto name = fields.size() > 3 ? fields[3] : fields[0] + ":" + fields[1] + "-" + fields[2];
+
+			addInterval_(fields[0],
+			             std::stoi(fields[1]),
+			             std::stoi(fields[2]),
+			             name,
+			             name);
+		}
+	}
+};
+
+} // sctools
+
+#endif // SCTOOLS_INCLUDE_SCTOOLS_ANNOTATION_INDEX_H
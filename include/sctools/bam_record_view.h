@@ -0,0 +1,460 @@
+/**
+ * \file   include/sctools/bam_record_view.h
+ * \author Elena Grassi
+ * \author Marilisa Montemurro
+ * \author Emanuele Parisi
+ * \date   February, 2019
+ *
+ * File containing facilities for accessing the fields of binary BAM records
+ * without decoding them.
+ */
+
+#ifndef SCTOOLS_INCLUDE_SCTOOLS_BAM_RECORD_VIEW_H
+#define SCTOOLS_INCLUDE_SCTOOLS_BAM_RECORD_VIEW_H
+
+#include <cstdint>
+#include <cstring>
+
+namespace sctools
+{
+
+/**
+ * \brief Read-only view over the binary representation of a BAM record.
+ *
+ * The view refers to the bytes following the 4 bytes block size of the
+ * record, as laid out by the SAM/BAM specification. Fields are stored in
+ * little-endian order, which is assumed to be the host byte order.
+ */
+class BamRecordView
+{
+
+public:
+
+	/**
+	 * Flag bit set on reads which are paired in sequencing.
+	 */
+	static constexpr uint16_t FLAG_PAIRED        = 0x1;
+	/**
+	 * Flag bit set on reads mapped in a proper pair.
+	 */
+	static constexpr uint16_t FLAG_PROPER_PAIR   = 0x2;
+	/**
+	 * Flag bit set on unmapped reads.
+	 */
+	static constexpr uint16_t FLAG_UNMAPPED      = 0x4;
+	/**
+	 * Flag bit set on reads whose mate is unmapped.
+	 */
+	static constexpr uint16_t FLAG_MATE_UNMAPPED = 0x8;
+	/**
+	 * Flag bit set on reads mapped to the reverse strand.
+	 */
+	static constexpr uint16_t FLAG_REVERSE       = 0x10;
+	/**
+	 * Flag bit set on reads whose mate is mapped to the reverse strand.
+	 */
+	static constexpr uint16_t FLAG_MATE_REVERSE  = 0x20;
+	/**
+	 * Flag bit set on the first read of a pair.
+	 */
+	static constexpr uint16_t FLAG_READ1         = 0x40;
+	/**
+	 * Flag bit set on the second read of a pair.
+	 */
+	static constexpr uint16_t FLAG_READ2         = 0x80;
+	/**
+	 * Flag bit set on secondary alignments.
+	 */
+	static constexpr uint16_t FLAG_SECONDARY     = 0x100;
+	/**
+	 * Flag bit set on reads failing quality checks.
+	 */
+	static constexpr uint16_t FLAG_QC_FAIL       = 0x200;
+	/**
+	 * Flag bit set on PCR or optical duplicates.
+	 */
+	static constexpr uint16_t FLAG_DUPLICATE     = 0x400;
+	/**
+	 * Flag bit set on supplementary alignments.
+	 */
+	static constexpr uint16_t FLAG_SUPPLEMENTARY = 0x800;
+
+	/**
+	 * \brief Class constructor.
+	 *
+	 * \param data is the pointer to the first byte after the block size.
+	 * \param size is the block size of the record.
+	 */
+	BamRecordView (const char* data,
+	               uint32_t size) noexcept :
+		data_(data),
+		size_(size)
+	{
+	}
+
+	/**
+	 * \brief Build a view over a record stored along with its block size.
+	 *
+	 * \param rawRecord is the pointer to the block size of the record.
+	 * \return the view over the record.
+	 */
+	static inline BamRecordView
+	fromSized (const char* rawRecord) noexcept
+	{
+		return BamRecordView(rawRecord + 4,
+		                     load_<uint32_t>(rawRecord));
+	}
+
+	/**
+	 * \brief Access the reference sequence identifier of the record.
+	 *
+	 * \return the reference identifier, or -1 if the record is unplaced.
+	 */
+	inline int32_t
+	refId () const noexcept
+	{
+		return load_<int32_t>(data_);
+	}
+
+	/**
+	 * \brief Access the 0-based leftmost mapping position of the record.
+	 *
+	 * \return the position, or -1 if the record is unplaced.
+	 */
+	inline int32_t
+	position () const noexcept
+	{
+		return load_<int32_t>(data_ + 4);
+	}
+
+	/**
+	 * \brief Access the mapping quality of the record.
+	 *
+	 * \return the mapping quality.
+	 */
+	inline uint8_t
+	mapQuality () const noexcept
+	{
+		return static_cast<uint8_t>(data_[9]);
+	}
+
+	/**
+	 * \brief Access the bitwise flag of the record.
+	 *
+	 * \return the flag.
+	 */
+	inline uint16_t
+	flag () const noexcept
+	{
+		return load_<uint16_t>(data_ + 14);
+	}
+
+	/**
+	 * \brief Access the length of the read sequence.
+	 *
+	 * \return the number of bases of the read.
+	 */
+	inline int32_t
+	sequenceLength () const noexcept
+	{
+		return load_<int32_t>(data_ + 16);
+	}
+
+	/**
+	 * \brief Access the name of the read.
+	 *
+	 * \return the pointer to the NUL-terminated read name.
+	 */
+	inline const char*
+	readName () const noexcept
+	{
+		return data_ + 32;
+	}
+
+	/**
+	 * \brief Access the length of the name of the read.
+	 *
+	 * \return the length of the read name, NUL terminator excluded.
+	 */
+	inline uint32_t
+	readNameLength () const noexcept
+	{
+		return static_cast<uint8_t>(data_[8]) - 1;
+	}
+
+	/**
+	 * \brief Compute the 0-based exclusive end of the alignment on the
+	 * reference, walking the CIGAR operations.
+	 *
+	 * \return the end position; records consuming no reference base span a
+	 * single base.
+	 */
+	inline int64_t
+	referenceEnd () const noexcept
+	{
+		const char* cigar  = cigar_();
+		uint16_t    count  = cigarCount_();
+		int64_t     length = 0;
+
+		for (auto i = 0u; i < count; i++)
+		{
+			uint32_t operation = load_<uint32_t>(cigar + 4 * i);
+
+			// M, D, N, = and X consume reference bases.
+			switch (operation & 0xf)
+			{
+			case 0:
+			case 2:
+			case 3:
+			case 7:
+			case 8:
+				length += operation >> 4;
+				break;
+			default:
+				break;
+			}
+		}
+
+		return static_cast<int64_t>(position()) + (length > 0 ? length : 1);
+	}
+
+	/**
+	 * \brief Look for an optional field of the record.
+	 *
+	 * \param tag is the two characters name of the field.
+	 * \return the pointer to the type character of the field value, or
+	 * nullptr if the field is not present.
+	 */
+	inline const char*
+	findTag (const char* tag) const noexcept
+	{
+		const char* it  = tags_();
+		const char* end = data_ + size_;
+
+		while (it + 3 <= end)
+		{
+			if (it[0] == tag[0] && it[1] == tag[1])
+			{
+				return it + 2;
+			}
+
+			uint64_t valueSize = tagValueSize(it + 2,
+			                                  end);
+
+			if (valueSize == 0)
+			{
+				return nullptr;
+			}
+			it += 3 + valueSize;
+		}
+
+		return nullptr;
+	}
+
+	/**
+	 * \brief Compute the size of the value of an optional field.
+	 *
+	 * \param type is the pointer to the type character of the field value.
+	 * \param end is the pointer past the end of the record.
+	 * \return the size of the value following the type character, or 0 if the
+	 * field is malformed.
+	 */
+	static inline uint64_t
+	tagValueSize (const char* type,
+	              const char* end) noexcept
+	{
+		switch (*type)
+		{
+		case 'A':
+		case 'c':
+		case 'C':
+			return 1;
+		case 's':
+		case 'S':
+			return 2;
+		case 'i':
+		case 'I':
+		case 'f':
+			return 4;
+		case 'Z':
+		case 'H':
+		{
+			const void* nul = std::memchr(type + 1,
+			                              '\0',
+			                              end - type - 1);
+
+			return nul == nullptr ? 0 : static_cast<const char*>(nul) - type;
+		}
+		case 'B':
+		{
+			uint64_t elementSize = 0;
+
+			if (end - type < 6)
+			{
+				return 0;
+			}
+			switch (type[1])
+			{
+			case 'c':
+			case 'C':
+				elementSize = 1;
+				break;
+			case 's':
+			case 'S':
+				elementSize = 2;
+				break;
+			case 'i':
+			case 'I':
+			case 'f':
+				elementSize = 4;
+				break;
+			default:
+				return 0;
+			}
+
+			return 5 + elementSize * load_<uint32_t>(type + 2);
+		}
+		default:
+			return 0;
+		}
+	}
+
+	/**
+	 * \brief Decode a numeric optional field value.
+	 *
+	 * \param type is the pointer to the type character of the field value.
+	 * \param value is the decoded value.
+	 * \return true if the field is numeric, false otherwise.
+	 */
+	static inline bool
+	tagNumber (const char* type,
+	           double& value) noexcept
+	{
+		switch (*type)
+		{
+		case 'c':
+			value = load_<int8_t>(type + 1);
+			return true;
+		case 'C':
+			value = load_<uint8_t>(type + 1);
+			return true;
+		case 's':
+			value = load_<int16_t>(type + 1);
+			return true;
+		case 'S':
+			value = load_<uint16_t>(type + 1);
+			return true;
+		case 'i':
+			value = load_<int32_t>(type + 1);
+			return true;
+		case 'I':
+			value = load_<uint32_t>(type + 1);
+			return true;
+		case 'f':
+			value = load_<float>(type + 1);
+			return true;
+		default:
+			return false;
+		}
+	}
+
+	/**
+	 * \brief Access a string optional field value.
+	 *
+	 * \param type is the pointer to the type character of the field value.
+	 * \param value is the pointer to the value characters.
+	 * \param length is the number of characters of the value.
+	 * \return true if the field stores characters, false otherwise.
+	 */
+	static inline bool
+	tagString (const char* type,
+	           const char*& value,
+	           uint64_t& length) noexcept
+	{
+		switch (*type)
+		{
+		case 'A':
+			value  = type + 1;
+			length = 1;
+			return true;
+		case 'Z':
+		case 'H':
+			value  = type + 1;
+			length = std::strlen(value);
+			return true;
+		default:
+			return false;
+		}
+	}
+
+private:
+	/**
+	 * Pointer to the first byte after the block size.
+	 */
+	const char* data_;
+	/**
+	 * Block size of the record.
+	 */
+	uint32_t    size_;
+
+	/**
+	 * \brief Load a possibly unaligned little-endian value.
+	 *
+	 * \param source is the pointer to the value.
+	 * \return the loaded value.
+	 */
+	template <typename TValue>
+	static inline TValue
+	load_ (const char* source) noexcept
+	{
+		TValue value;
+
+		std::memcpy(&value,
+		            source,
+		            sizeof(TValue));
+
+		return value;
+	}
+
+	/**
+	 * \brief Access the number of CIGAR operations of the record.
+	 *
+	 * \return the number of CIGAR operations.
+	 */
+	inline uint16_t
+	cigarCount_ () const noexcept
+	{
+		return load_<uint16_t>(data_ + 12);
+	}
+
+	/**
+	 * \brief Access the CIGAR operations of the record.
+	 *
+	 * \return the pointer to the first CIGAR operation.
+	 */
+	inline const char*
+	cigar_ () const noexcept
+	{
+		return data_ + 32 + static_cast<uint8_t>(data_[8]);
+	}
+
+	/**
+	 * \brief Access the optional fields of the record.
+	 *
+	 * \return the pointer to the first optional field.
+	 */
+	inline const char*
+	tags_ () const noexcept
+	{
+		int32_t sequenceSize = sequenceLength();
+
+		return cigar_() +
+		       4 * cigarCount_() +
+		       (sequenceSize + 1) / 2 +
+		       sequenceSize;
+	}
+};
+
+} // sctools
+
+#endif // SCTOOLS_INCLUDE_SCTOOLS_BAM_RECORD_VIEW_H
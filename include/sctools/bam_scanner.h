@@ -0,0 +1,440 @@
+/**
+ * \file   include/sctools/bam_scanner.h
+ * \author Elena Grassi
+ * \author Marilisa Montemurro
+ * \author Emanuele Parisi
+ * \date   February, 2019
+ *
+ * File containing facilities for visiting the binary records of BAM files in
+ * parallel.
+ */
+
+#ifndef SCTOOLS_INCLUDE_SCTOOLS_BAM_SCANNER_H
+#define SCTOOLS_INCLUDE_SCTOOLS_BAM_SCANNER_H
+
+#include <algorithm>
+#include <cstring>
+#include <exception>
+#include <experimental/filesystem>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "bam_record_view.h"
+#include "bgzf.h"
+#include "compression_backend.h"
+
+namespace fs = std::experimental::filesystem;
+
+namespace sctools
+{
+
+/**
+ * \brief Class visiting every record of a BAM file on its binary
+ * representation, without decoding it.
+ *
+ * The file is processed in chunks of BGZF blocks. The blocks of a chunk are
+ * decompressed concurrently, each one at the offset given by the uncompressed
+ * sizes of the previous ones, then record boundaries are found by following
+ * the block size of every record, and records are visited concurrently. The
+ * bytes of a record spanning two chunks are carried over to the next chunk.
+ */
+class BamScanner
+{
+
+public:
+
+	/**
+	 * Default number of BGZF blocks decompressed at once.
+	 */
+	static constexpr uint64_t DEFAULT_CHUNK_BLOCKS = 256;
+
+	/**
+	 * Class constructor.
+	 */
+	BamScanner () = default;
+
+	/**
+	 * \brief Class copy constructor.
+	 *
+	 * \param other is the object the current instance is initialized from.
+	 */
+	BamScanner (const BamScanner& other) = delete;
+
+	/**
+	 * \brief Class copy assignment operator.
+	 *
+	 * \param other is the object the current instance is initialized from.
+	 * \return a reference to the assigned object.
+	 */
+	BamScanner&
+	operator= (const BamScanner& other) = delete;
+
+	/**
+	 * \brief Initialize the scanner.
+	 *
+	 * \param backendType is the deflate implementation used for decompressing.
+	 * \param chunkBlocks is the number of BGZF blocks decompressed at once.
+	 */
+	inline void
+	configure (CompressionBackendType backendType,
+	           uint64_t chunkBlocks = DEFAULT_CHUNK_BLOCKS)
+	{
+		if (chunkBlocks == 0)
+		{
+			throw std::invalid_argument("chunks must hold at least one block");
+		}
+		chunkBlocks_ = chunkBlocks;
+		backends_.clear();
+		for (auto i = 0ul; i < getThreadsCount(); i++)
+		{
+			backends_.emplace_back(CompressionBackend::create(backendType,
+			                                                  0));
+		}
+	}
+
+	/**
+	 * \brief Access the number of threads records may be visited by.
+	 *
+	 * \return the number of threads, which bounds the thread index passed to
+	 * visitors.
+	 */
+	static inline uint64_t
+	getThreadsCount () noexcept
+	{
+#ifdef _OPENMP
+		return omp_get_max_threads();
+#else
+		return 1;
+#endif
+	}
+
+	/**
+	 * \brief Visit every record of a BAM file.
+	 *
+	 * \param path is the path to the BAM file.
+	 * \param visitor is called as visitor(record, threadIndex) for every
+	 * record, concurrently from multiple threads; records of different chunks
+	 * are never visited at the same time.
+	 */
+	template <typename TVisitor>
+	inline void
+	scan (const fs::path& path,
+	      TVisitor&& visitor)
+	{
+		scanWithOffsets(path,
+		                [&visitor] (const BamRecordView& record,
+		                            uint64_t,
+		                            uint64_t threadIndex)
+		                {
+			                visitor(record,
+			                        threadIndex);
+		                });
+	}
+
+	/**
+	 * \brief Visit every record of a BAM file, along with its position.
+	 *
+	 * \param path is the path to the BAM file.
+	 * \param visitor is called as visitor(record, virtualOffset, threadIndex)
+	 * for every record, concurrently from multiple threads, where
+	 * virtualOffset is the BGZF virtual offset the record starts at. Records
+	 * of different chunks are never visited at the same time, and every
+	 * thread visits its records in file order.
+	 */
+	template <typename TVisitor>
+	inline void
+	scanWithOffsets (const fs::path& path,
+	                 TVisitor&& visitor)
+	{
+		std::ifstream                   source(path,
+		                                       std::ios::binary);
+		std::vector<char>               compressed;
+		std::vector<uint64_t>           blockOffsets;
+		std::vector<uint64_t>           payloadOffsets;
+		std::vector<char>               data;
+		std::vector<uint64_t>           recordOffsets;
+		std::vector<uint64_t>           virtualOffsets;
+		std::vector<std::exception_ptr> errors(getThreadsCount());
+		bool                            isHeaderSkipped = false;
+		uint64_t                        chunkOffset     = 0;
+		uint64_t                        nextChunkOffset = 0;
+		uint64_t                        carryOffset     = 0;
+
+		if (!source)
+		{
+			throw std::runtime_error("cannot open '" +
+			                         path.string() +
+			                         "'");
+		}
+		while (loadChunk_(source,
+		                  compressed,
+		                  blockOffsets,
+		                  payloadOffsets))
+		{
+			uint64_t carry  = data.size();
+			uint64_t cursor = 0;
+			uint64_t block  = 0;
+
+			// Positions in the data after the carried bytes are mapped to the
+			// block they are stored in, blocks being visited in order. The
+			// only record starting in the carried bytes is the carried one.
+			auto toVirtualOffset = [&] (uint64_t position)
+			{
+				if (position < carry)
+				{
+					return carryOffset;
+				}
+				while (payloadOffsets[block + 1] <= position - carry)
+				{
+					block += 1;
+				}
+
+				return ((chunkOffset + blockOffsets[block]) << 16) |
+				       (position - carry - payloadOffsets[block]);
+			};
+
+			chunkOffset      = nextChunkOffset;
+			nextChunkOffset += compressed.size();
+
+			// Decompress every block of the chunk after the bytes carried over
+			// from the previous one.
+			data.resize(carry + payloadOffsets.back());
+			#pragma omp parallel for schedule(dynamic, 1)
+			for (auto i = 0l; i < static_cast<int64_t>(blockOffsets.size()) - 1; i++)
+			{
+				try
+				{
+					Bgzf::inflate(*backends_[threadIndex_()],
+					              compressed.data() + blockOffsets[i],
+					              blockOffsets[i + 1] - blockOffsets[i],
+					              data.data() + carry + payloadOffsets[i],
+					              payloadOffsets[i + 1] - payloadOffsets[i]);
+				}
+				catch (...)
+				{
+					errors[threadIndex_()] = std::current_exception();
+				}
+			}
+			rethrowFirst_(errors);
+
+			// Skip the binary header, which may span several chunks.
+			if (!isHeaderSkipped)
+			{
+				cursor = binaryHeaderSize_(path,
+				                           data);
+				if (cursor == 0)
+				{
+					continue;
+				}
+				isHeaderSkipped = true;
+			}
+
+			// Find the records entirely stored in the current data, and visit
+			// them.
+			recordOffsets.clear();
+			virtualOffsets.clear();
+			while (cursor + 4 <= data.size())
+			{
+				uint32_t blockSize = 0;
+
+				std::memcpy(&blockSize,
+				            data.data() + cursor,
+				            4);
+				if (cursor + 4 + blockSize > data.size())
+				{
+					break;
+				}
+				recordOffsets.emplace_back(cursor);
+				virtualOffsets.emplace_back(toVirtualOffset(cursor));
+				cursor += 4 + blockSize;
+			}
+			#pragma omp parallel for schedule(static)
+			for (auto i = 0l; i < static_cast<int64_t>(recordOffsets.size()); i++)
+			{
+				try
+				{
+					visitor(BamRecordView::fromSized(data.data() + recordOffsets[i]),
+					        virtualOffsets[i],
+					        threadIndex_());
+				}
+				catch (...)
+				{
+					errors[threadIndex_()] = std::current_exception();
+				}
+			}
+			rethrowFirst_(errors);
+
+			// Carry the incomplete record over to the next chunk.
+			if (cursor < data.size())
+			{
+				carryOffset = toVirtualOffset(cursor);
+			}
+			data.erase(data.begin(),
+			           data.begin() + cursor);
+		}
+		if (!data.empty() || !isHeaderSkipped)
+		{
+			throw std::runtime_error("truncated BAM file '" +
+			                         path.string() +
+			                         "'");
+		}
+	}
+
+private:
+	/**
+	 * Number of BGZF blocks decompressed at once.
+	 */
+	uint64_t                                         chunkBlocks_ = DEFAULT_CHUNK_BLOCKS;
+	/**
+	 * Deflate codec of every thread.
+	 */
+	std::vector<std::unique_ptr<CompressionBackend>> backends_;
+
+	/**
+	 * \brief Access the index of the calling thread.
+	 *
+	 * \return the index of the thread within the current parallel region.
+	 */
+	static inline uint64_t
+	threadIndex_ () noexcept
+	{
+#ifdef _OPENMP
+		return omp_get_thread_num();
+#else
+		return 0;
+#endif
+	}
+
+	/**
+	 * \brief Rethrow the first exception raised by a thread, if any.
+	 *
+	 * \param errors are the exceptions raised by every thread.
+	 */
+	static inline void
+	rethrowFirst_ (std::vector<std::exception_ptr>& errors)
+	{
+		for (auto& e : errors)
+		{
+			if (e != nullptr)
+			{
+				auto error = e;
+
+				std::fill(errors.begin(),
+				          errors.end(),
+				          nullptr);
+				std::rethrow_exception(error);
+			}
+		}
+	}
+
+	/**
+	 * \brief Load the next chunk of compressed blocks.
+	 *
+	 * \param source is the stream blocks are read from.
+	 * \param compressed is the buffer blocks are stored in.
+	 * \param blockOffsets are the offsets of the blocks in the buffer, plus
+	 * the size of the buffer.
+	 * \param payloadOffsets are the offsets of the uncompressed blocks, plus
+	 * the total uncompressed size.
+	 * \return true if at least one block has been loaded.
+	 */
+	inline bool
+	loadChunk_ (std::ifstream& source,
+	            std::vector<char>& compressed,
+	            std::vector<uint64_t>& blockOffsets,
+	            std::vector<uint64_t>& payloadOffsets)
+	{
+		compressed.clear();
+		blockOffsets.assign(1,
+		                    0);
+		payloadOffsets.assign(1,
+		                      0);
+		while (blockOffsets.size() <= chunkBlocks_)
+		{
+			uint64_t offset    = compressed.size();
+			uint64_t blockSize = Bgzf::readBlock(source,
+			                                     compressed);
+
+			if (blockSize == 0)
+			{
+				break;
+			}
+			blockOffsets.emplace_back(compressed.size());
+			payloadOffsets.emplace_back(payloadOffsets.back() +
+			                            Bgzf::payloadSize(compressed.data() + offset,
+			                                              blockSize));
+		}
+
+		return blockOffsets.size() > 1;
+	}
+
+	/**
+	 * \brief Compute the size of the binary header at the beginning of the
+	 * uncompressed data.
+	 *
+	 * \param path is the path to the BAM file, for error reporting.
+	 * \param data is the uncompressed data.
+	 * \return the size of the header, or 0 if it is not entirely stored in
+	 * the data yet.
+	 */
+	static inline uint64_t
+	binaryHeaderSize_ (const fs::path& path,
+	                   const std::vector<char>& data)
+	{
+		uint64_t position        = 8;
+		uint32_t value           = 0;
+		uint32_t referencesCount = 0;
+
+		if (data.size() < 4)
+		{
+			return 0;
+		}
+		if (std::memcmp(data.data(),
+		                "BAM\1",
+		                4) != 0)
+		{
+			throw std::runtime_error("'" +
+			                         path.string() +
+			                         "' is not a BAM file");
+		}
+		if (data.size() < position + 4)
+		{
+			return 0;
+		}
+		std::memcpy(&value,
+		            data.data() + 4,
+		            4);
+		position += value;
+		if (data.size() < position + 4)
+		{
+			return 0;
+		}
+		std::memcpy(&referencesCount,
+		            data.data() + position,
+		            4);
+		position += 4;
+		for (auto i = 0u; i < referencesCount; i++)
+		{
+			if (data.size() < position + 4)
+			{
+				return 0;
+			}
+			std::memcpy(&value,
+			            data.data() + position,
+			            4);
+			position += 4 + value + 4;
+		}
+
+		return data.size() < position ? 0 : position;
+	}
+};
+
+} // sctools
+
+#endif // SCTOOLS_INCLUDE_SCTOOLS_BAM_SCANNER_H
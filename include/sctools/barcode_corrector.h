@@ -0,0 +1,422 @@
+/**
+ * \file   include/sctools/barcode_corrector.h
+ * \author Elena Grassi
+ * \author Marilisa Montemurro
+ * \author Emanuele Parisi
+ * \date   February, 2019
+ *
+ * File containing the correction of single sequencing errors in raw barcodes.
+ */
+
+#ifndef SCTOOLS_INCLUDE_SCTOOLS_BARCODE_CORRECTOR_H
+#define SCTOOLS_INCLUDE_SCTOOLS_BARCODE_CORRECTOR_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace sctools
+{
+
+/**
+ * \brief Class matching raw barcodes to the closest barcode of a whitelist,
+ * when they differ by a single base.
+ *
+ * Barcodes are packed as 2 bits per base, the first base in the lowest bits.
+ * When the corrector is configured, every barcode at Hamming distance 1 from
+ * a whitelist barcode is indexed, so that correcting a raw barcode takes a
+ * single lookup. Raw barcodes close to several whitelist barcodes are
+ * resolved by the quality of the mismatching bases: the whitelist barcode
+ * whose mismatch falls on the least reliable base is picked, provided its
+ * posterior probability is high enough.
+ */
+class BarcodeCorrector
+{
+
+public:
+
+	/**
+	 * Maximum length of the barcodes which can be corrected.
+	 */
+	static constexpr uint64_t MAX_LENGTH      = 32;
+	/**
+	 * Minimum posterior probability of the whitelist barcode an ambiguous
+	 * raw barcode is corrected to.
+	 */
+	static constexpr double   MIN_POSTERIOR   = 0.975;
+	/**
+	 * Base quality assumed when the qualities of a raw barcode are unknown.
+	 */
+	static constexpr int      DEFAULT_QUALITY = 30;
+
+	/**
+	 * \brief Enumeration of the outcomes of a correction.
+	 */
+	enum class Outcome
+	{
+		EXACT,
+		CORRECTED,
+		AMBIGUOUS,
+		UNCORRECTABLE
+	};
+
+	/**
+	 * Class constructor.
+	 */
+	BarcodeCorrector () = default;
+
+	/**
+	 * \brief Class copy constructor.
+	 *
+	 * \param other is the object the current instance is initialized from.
+	 */
+	BarcodeCorrector (const BarcodeCorrector& other) = delete;
+
+	/**
+	 * \brief Class copy assignment operator.
+	 *
+	 * \param other is the object the current instance is initialized from.
+	 * \return a reference to the assigned object.
+	 */
+	BarcodeCorrector&
+	operator= (const BarcodeCorrector& other) = delete;
+
+	/**
+	 * \brief Reset the corrector, so that it corrects no barcode.
+	 */
+	inline void
+	reset () noexcept
+	{
+		length_ = 0;
+		codes_.clear();
+		exact_.clear();
+		neighbours_.clear();
+		candidateLists_.clear();
+	}
+
+	/**
+	 * \brief Initialize the corrector, indexing the neighbours of every
+	 * whitelist barcode.
+	 *
+	 * \param whitelist are the barcodes raw barcodes are corrected to. They
+	 * must have the same length, at most MAX_LENGTH bases, and be made of
+	 * 'A', 'C', 'G' and 'T' only. The index of a barcode in the list is the
+	 * identifier returned by corrections.
+	 */
+	inline void
+	configure (const std::vector<std::string>& whitelist)
+	{
+		reset();
+		if (whitelist.empty())
+		{
+			return;
+		}
+		length_ = whitelist.front().size();
+		if (length_ == 0 || length_ > MAX_LENGTH)
+		{
+			throw std::invalid_argument("barcodes to be corrected must have from 1 to " +
+			                            std::to_string(MAX_LENGTH) +
+			                            " bases");
+		}
+
+		// Pack the whitelist barcodes.
+		for (auto i = 0ul; i < whitelist.size(); i++)
+		{
+			uint64_t code     = 0;
+			uint64_t position = 0;
+
+			if (whitelist[i].size() != length_ || !pack_(whitelist[i].data(),
+			                                             code,
+			                                             position))
+			{
+				throw std::invalid_argument("barcode '" +
+				                            whitelist[i] +
+				                            "' cannot be corrected: barcodes must "
+				                            "have the same length and only 'A', "
+				                            "'C', 'G' and 'T' bases");
+			}
+			codes_.emplace_back(code);
+			exact_.emplace(code,
+			               i);
+		}
+
+		// Index every barcode differing by one base from a whitelist barcode,
+		// unless it belongs to the whitelist itself.
+		neighbours_.reserve(codes_.size() * length_ * 3);
+		for (auto i = 0ul; i < codes_.size(); i++)
+		{
+			for (auto p = 0ul; p < length_; p++)
+			{
+				for (auto b = 1ull; b < 4; b++)
+				{
+					uint64_t neighbour = codes_[i] ^ (b << (2 * p));
+
+					if (exact_.count(neighbour) == 0)
+					{
+						addNeighbour_(neighbour,
+						              i);
+					}
+				}
+			}
+		}
+	}
+
+	/**
+	 * \brief Check if the corrector corrects any barcode.
+	 *
+	 * \return true if the corrector has been configured with a non-empty
+	 * whitelist.
+	 */
+	inline bool
+	isEnabled () const noexcept
+	{
+		return length_ > 0;
+	}
+
+	/**
+	 * \brief Match a raw barcode to the whitelist.
+	 *
+	 * \param barcode is the raw barcode.
+	 * \param length is the length of the raw barcode.
+	 * \param qualities are the Phred+33 qualities of the raw barcode bases,
+	 * or nullptr if they are unknown.
+	 * \param cellId is set to the index of the matching whitelist barcode,
+	 * if the outcome is EXACT or CORRECTED.
+	 * \return the outcome of the correction.
+	 */
+	inline Outcome
+	correct (const char* barcode,
+	         uint64_t length,
+	         const char* qualities,
+	         uint64_t& cellId) const
+	{
+		uint64_t code      = 0;
+		uint64_t nPosition = 0;
+
+		if (!isEnabled() || length != length_)
+		{
+			return Outcome::UNCORRECTABLE;
+		}
+
+		// A single unknown base can only be replaced by the whitelist
+		// barcodes matching the other ones.
+		if (!pack_(barcode,
+		           code,
+		           nPosition))
+		{
+			uint64_t matches = 0;
+
+			if (nPosition == length_)
+			{
+				return Outcome::UNCORRECTABLE;
+			}
+			for (auto b = 0ull; b < 4; b++)
+			{
+				auto exactIt = exact_.find(code | (b << (2 * nPosition)));
+
+				if (exactIt != exact_.end())
+				{
+					cellId   = exactIt->second;
+					matches += 1;
+				}
+			}
+
+			return matches == 0 ? Outcome::UNCORRECTABLE :
+			       matches == 1 ? Outcome::CORRECTED :
+			       Outcome::AMBIGUOUS;
+		}
+
+		auto exactIt = exact_.find(code);
+
+		if (exactIt != exact_.end())
+		{
+			cellId = exactIt->second;
+			return Outcome::EXACT;
+		}
+
+		auto neighbourIt = neighbours_.find(code);
+
+		if (neighbourIt == neighbours_.end())
+		{
+			return Outcome::UNCORRECTABLE;
+		}
+		if ((neighbourIt->second & CANDIDATE_LIST_FLAG) == 0)
+		{
+			cellId = neighbourIt->second;
+			return Outcome::CORRECTED;
+		}
+
+		// Weight every candidate by the probability that its mismatching base
+		// is a sequencing error.
+		const auto& candidates = candidateLists_[neighbourIt->second & ~CANDIDATE_LIST_FLAG];
+		double      bestWeight = 0.0;
+		double      sumWeights = 0.0;
+
+		for (auto c : candidates)
+		{
+			double weight = errorProbability_(qualities,
+			                                  mismatchPosition_(code,
+			                                                    codes_[c]));
+
+			sumWeights += weight;
+			if (weight > bestWeight)
+			{
+				bestWeight = weight;
+				cellId     = c;
+			}
+		}
+
+		return bestWeight >= MIN_POSTERIOR * sumWeights ? Outcome::CORRECTED : Outcome::AMBIGUOUS;
+	}
+
+private:
+	/**
+	 * Flag marking the neighbours shared by multiple whitelist barcodes,
+	 * whose value is an index in the candidate lists.
+	 */
+	static constexpr uint64_t              CANDIDATE_LIST_FLAG = 1ull << 63;
+
+	/**
+	 * Length of the whitelist barcodes.
+	 */
+	uint64_t                               length_ = 0;
+	/**
+	 * Packed whitelist barcodes.
+	 */
+	std::vector<uint64_t>                  codes_;
+	/**
+	 * Map associating every packed whitelist barcode with its index.
+	 */
+	std::unordered_map<uint64_t, uint64_t> exact_;
+	/**
+	 * Map associating every neighbour with the index of its whitelist
+	 * barcode, or with its candidate list.
+	 */
+	std::unordered_map<uint64_t, uint64_t> neighbours_;
+	/**
+	 * Whitelist barcodes of the neighbours shared by multiple ones.
+	 */
+	std::vector<std::vector<uint64_t>>     candidateLists_;
+
+	/**
+	 * \brief Pack a barcode as 2 bits per base.
+	 *
+	 * \param barcode is the barcode, as long as the whitelist barcodes.
+	 * \param code is set to the packed barcode, with 0 bits for an unknown
+	 * base.
+	 * \param unknownPosition is set to the position of the unknown base if
+	 * there is only one of them, or to the barcode length otherwise.
+	 * \return true if every base is known.
+	 */
+	inline bool
+	pack_ (const char* barcode,
+	       uint64_t& code,
+	       uint64_t& unknownPosition) const noexcept
+	{
+		uint64_t unknownCount = 0;
+
+		code            = 0;
+		unknownPosition = length_;
+		for (auto i = 0ul; i < length_; i++)
+		{
+			uint64_t base = 0;
+
+			switch (barcode[i])
+			{
+			case 'A':
+				base = 0;
+				break;
+			case 'C':
+				base = 1;
+				break;
+			case 'G':
+				base = 2;
+				break;
+			case 'T':
+				base = 3;
+				break;
+			default:
+				unknownCount   += 1;
+				unknownPosition = i;
+				continue;
+			}
+			code |= base << (2 * i);
+		}
+		if (unknownCount > 1)
+		{
+			unknownPosition = length_;
+		}
+
+		return unknownCount == 0;
+	}
+
+	/**
+	 * \brief Record that a neighbour belongs to a whitelist barcode.
+	 *
+	 * \param neighbour is the packed neighbour.
+	 * \param cellId is the index of the whitelist barcode.
+	 */
+	inline void
+	addNeighbour_ (uint64_t neighbour,
+	               uint64_t cellId)
+	{
+		auto neighbourIt = neighbours_.find(neighbour);
+
+		if (neighbourIt == neighbours_.end())
+		{
+			neighbours_.emplace(neighbour,
+			                    cellId);
+		}
+		else if ((neighbourIt->second & CANDIDATE_LIST_FLAG) == 0)
+		{
+			candidateLists_.push_back({neighbourIt->second,
+			                           cellId});
+			neighbourIt->second = (candidateLists_.size() - 1) | CANDIDATE_LIST_FLAG;
+		}
+		else
+		{
+			candidateLists_[neighbourIt->second & ~CANDIDATE_LIST_FLAG].emplace_back(cellId);
+		}
+	}
+
+	/**
+	 * \brief Find the only base two packed barcodes differ by.
+	 *
+	 * \param lhs is the first packed barcode.
+	 * \param rhs is the second packed barcode.
+	 * \return the position of the mismatching base.
+	 */
+	static inline uint64_t
+	mismatchPosition_ (uint64_t lhs,
+	                   uint64_t rhs) noexcept
+	{
+		return __builtin_ctzll(lhs ^ rhs) / 2;
+	}
+
+	/**
+	 * \brief Compute the probability that a base has been miscalled.
+	 *
+	 * \param qualities are the Phred+33 qualities of the barcode bases, or
+	 * nullptr if they are unknown.
+	 * \param position is the position of the base.
+	 * \return the error probability given by the base quality.
+	 */
+	static inline double
+	errorProbability_ (const char* qualities,
+	                   uint64_t position) noexcept
+	{
+		int quality = qualities == nullptr ? DEFAULT_QUALITY : qualities[position] - 33;
+
+		return std::pow(10.0,
+		                -std::max(quality,
+		                          0) / 10.0);
+	}
+};
+
+} // sctools
+
+#endif // SCTOOLS_INCLUDE_SCTOOLS_BARCODE_CORRECTOR_H
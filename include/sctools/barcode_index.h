@@ -0,0 +1,380 @@
+/**
+ * \file   include/sctools/barcode_index.h
+ * \author Elena Grassi
+ * \author Marilisa Montemurro
+ * \author Emanuele Parisi
+ * \date   February, 2019
+ *
+ * File containing the immutable index mapping target barcodes to their
+ * identifier.
+ */
+
+#ifndef SCTOOLS_INCLUDE_SCTOOLS_BARCODE_INDEX_H
+#define SCTOOLS_INCLUDE_SCTOOLS_BARCODE_INDEX_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <numeric>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace sctools
+{
+
+/**
+ * \brief Class mapping the barcodes of a whitelist to their index in it.
+ *
+ * When all the barcodes have the same length, up to 32 bases, and are made of
+ * 'A', 'C', 'G' and 'T' only, they are packed as 2 bits per base into a
+ * sorted array of integers, with the identifiers in a parallel array. The
+ * high bits of a packed barcode select a bucket of about two keys through a
+ * table of offsets, and the bucket is searched without branches, so that a
+ * lookup touches about two cache lines regardless of the whitelist size.
+ * Other whitelists fall back to a hash table.
+ */
+class BarcodeIndex
+{
+
+public:
+
+	/**
+	 * Maximum length of the barcodes which can be packed.
+	 */
+	static constexpr uint64_t MAX_PACKED_LENGTH = 32;
+
+	/**
+	 * Class constructor.
+	 */
+	BarcodeIndex () = default;
+
+	/**
+	 * \brief Class copy constructor.
+	 *
+	 * \param other is the object the current instance is initialized from.
+	 */
+	BarcodeIndex (const BarcodeIndex& other) = delete;
+
+	/**
+	 * \brief Class copy assignment operator.
+	 *
+	 * \param other is the object the current instance is initialized from.
+	 * \return a reference to the assigned object.
+	 */
+	BarcodeIndex&
+	operator= (const BarcodeIndex& other) = delete;
+
+	/**
+	 * \brief Empty the index.
+	 */
+	inline void
+	reset () noexcept
+	{
+		length_ = 0;
+		shift_  = 0;
+		keys_.clear();
+		cellIds_.clear();
+		buckets_.clear();
+		fallback_.clear();
+	}
+
+	/**
+	 * \brief Build the index of a whitelist.
+	 *
+	 * \param whitelist are the barcodes, whose index in the list is their
+	 * identifier. Every barcode must be listed once.
+	 */
+	inline void
+	configure (const std::vector<std::string>& whitelist)
+	{
+		std::vector<uint64_t> codes;
+		std::vector<uint64_t> order(whitelist.size());
+
+		reset();
+		if (whitelist.empty())
+		{
+			return;
+		}
+
+		// Pack the barcodes, unless any of them cannot be packed.
+		length_ = whitelist.front().size();
+		for (const auto& b : whitelist)
+		{
+			uint64_t code = 0;
+
+			if (length_ > MAX_PACKED_LENGTH || b.size() != length_ || !pack_(b.data(),
+			                                                                 b.size(),
+			                                                                 code))
+			{
+				configureFallback_(whitelist);
+				return;
+			}
+			codes.emplace_back(code);
+		}
+
+		// Sort the packed barcodes along with their identifiers.
+		std::iota(order.begin(),
+		          order.end(),
+		          0);
+		std::sort(order.begin(),
+		          order.end(),
+		          [&codes] (uint64_t lhs,
+		                    uint64_t rhs)
+		          {
+			          return codes[lhs] < codes[rhs];
+		          });
+		for (auto i : order)
+		{
+			if (!keys_.empty() && keys_.back() == codes[i])
+			{
+				throw std::invalid_argument("barcode '" +
+				                            whitelist[i] +
+				                            "' is listed twice");
+			}
+			keys_.emplace_back(codes[i]);
+			cellIds_.emplace_back(i);
+		}
+
+		// Split the keys into buckets by their highest bits, about two keys
+		// per bucket.
+		uint64_t bucketBits = 0;
+
+		while (bucketBits < 2 * length_ && (2ull << bucketBits) <= keys_.size())
+		{
+			bucketBits += 1;
+		}
+		shift_ = 2 * length_ - bucketBits;
+		buckets_.assign((1ull << bucketBits) + 1,
+		                0);
+		for (auto k : keys_)
+		{
+			buckets_[bucketOf_(k) + 1] += 1;
+		}
+		std::partial_sum(buckets_.begin(),
+		                 buckets_.end(),
+		                 buckets_.begin());
+	}
+
+	/**
+	 * \brief Look a barcode up.
+	 *
+	 * \param barcode is the barcode.
+	 * \param length is the length of the barcode.
+	 * \param cellId is set to the identifier of the barcode, if found.
+	 * \return true if the barcode belongs to the whitelist.
+	 */
+	inline bool
+	find (const char* barcode,
+	      uint64_t length,
+	      uint64_t& cellId) const
+	{
+		uint64_t code = 0;
+
+		if (!fallback_.empty())
+		{
+			auto cellIt = fallback_.find(std::string(barcode,
+			                                         length));
+
+			if (cellIt == fallback_.end())
+			{
+				return false;
+			}
+			cellId = cellIt->second;
+			return true;
+		}
+		if (keys_.empty() || length != length_ || !pack_(barcode,
+		                                                 length,
+		                                                 code))
+		{
+			return false;
+		}
+
+		// Halve the bucket with conditional moves rather than branches.
+		auto            bucket = bucketOf_(code);
+		const uint64_t* base   = keys_.data() + buckets_[bucket];
+		uint64_t        count  = buckets_[bucket + 1] - buckets_[bucket];
+
+		if (count == 0)
+		{
+			return false;
+		}
+		while (count > 1)
+		{
+			auto half = count / 2;
+
+			base   = base[half] <= code ? base + half : base;
+			count -= half;
+		}
+		if (*base != code)
+		{
+			return false;
+		}
+		cellId = cellIds_[base - keys_.data()];
+
+		return true;
+	}
+
+	/**
+	 * \brief Look a barcode up.
+	 *
+	 * \param barcode is the barcode.
+	 * \param cellId is set to the identifier of the barcode, if found.
+	 * \return true if the barcode belongs to the whitelist.
+	 */
+	inline bool
+	find (const std::string& barcode,
+	      uint64_t& cellId) const
+	{
+		return find(barcode.data(),
+		            barcode.size(),
+		            cellId);
+	}
+
+private:
+	/**
+	 * Word with every byte set to 1.
+	 */
+	static constexpr uint64_t                 ONES_   = 0x0101010101010101ull;
+
+	/**
+	 * Length of the packed barcodes.
+	 */
+	uint64_t                                  length_ = 0;
+	/**
+	 * Number of low bits of a packed barcode not selecting its bucket.
+	 */
+	uint64_t                                  shift_  = 0;
+	/**
+	 * Sorted packed barcodes.
+	 */
+	std::vector<uint64_t>                     keys_;
+	/**
+	 * Identifier of every packed barcode.
+	 */
+	std::vector<uint64_t>                     cellIds_;
+	/**
+	 * Offset of the first key of every bucket, followed by the number of
+	 * keys.
+	 */
+	std::vector<uint32_t>                     buckets_;
+	/**
+	 * Map associating barcodes with their identifier, for whitelists which
+	 * cannot be packed.
+	 */
+	std::unordered_map<std::string, uint64_t> fallback_;
+
+	/**
+	 * \brief Pack a barcode as 2 bits per base, the first base in the lowest
+	 * bits.
+	 *
+	 * Bases are packed 8 at a time, as the bytes of a word. Bits 1 and 2 of
+	 * the ASCII codes of 'A', 'C', 'G' and 'T' give their codes 0 to 3 once
+	 * xored, and a base is valid if decoding its code gives it back, so that
+	 * packing has no data-dependent branch.
+	 *
+	 * \param barcode is the barcode.
+	 * \param length is the length of the barcode, at most MAX_PACKED_LENGTH.
+	 * \param code is set to the packed barcode.
+	 * \return false if the barcode holds a base other than 'A', 'C', 'G' and
+	 * 'T'.
+	 */
+	static inline bool
+	pack_ (const char* barcode,
+	       uint64_t length,
+	       uint64_t& code) noexcept
+	{
+		uint64_t invalid = 0;
+		uint64_t word    = 0;
+		uint64_t i       = 0;
+
+		code = 0;
+		for (; i + 8 <= length; i += 8)
+		{
+			std::memcpy(&word,
+			            barcode + i,
+			            8);
+			code |= packWord_(word,
+			                  invalid) << (2 * i);
+		}
+
+		// Missing bases of the last word are 'A', whose code is 0.
+		if (i < length)
+		{
+			word = 'A' * ONES_;
+			std::memcpy(&word,
+			            barcode + i,
+			            length - i);
+			code |= packWord_(word,
+			                  invalid) << (2 * i);
+		}
+
+		return invalid == 0;
+	}
+
+	/**
+	 * \brief Pack 8 bases as 2 bits per base.
+	 *
+	 * \param word holds the bases, the first one in the lowest byte.
+	 * \param invalid gets non-zero bits if any base is not 'A', 'C', 'G' or
+	 * 'T'.
+	 * \return the packed bases.
+	 */
+	static inline uint64_t
+	packWord_ (uint64_t word,
+	           uint64_t& invalid) noexcept
+	{
+		auto bits = ((word >> 1) ^ (word >> 2)) & (3 * ONES_);
+		auto low  = bits & ONES_;
+		auto high = (bits >> 1) & ONES_;
+
+		invalid |= word ^ ('A' * ONES_ + 2 * low + 6 * high + 11 * (low & high));
+
+		// Gather the 2-bit codes of the bytes.
+		bits = (bits | (bits >> 6)) & 0x000f000f000f000full;
+		bits = (bits | (bits >> 12)) & 0x000000ff000000ffull;
+		bits = (bits | (bits >> 24)) & 0xffffull;
+
+		return bits;
+	}
+
+	/**
+	 * \brief Select the bucket of a packed barcode.
+	 *
+	 * \param code is the packed barcode.
+	 * \return the index of the bucket.
+	 */
+	inline uint64_t
+	bucketOf_ (uint64_t code) const noexcept
+	{
+		// A shift by 64 bits is undefined, and only happens when there is a
+		// single bucket.
+		return shift_ >= 64 ? 0 : code >> shift_;
+	}
+
+	/**
+	 * \brief Index a whitelist which cannot be packed in a hash table.
+	 *
+	 * \param whitelist are the barcodes.
+	 */
+	inline void
+	configureFallback_ (const std::vector<std::string>& whitelist)
+	{
+		reset();
+		for (auto i = 0ul; i < whitelist.size(); i++)
+		{
+			if (!fallback_.emplace(whitelist[i],
+			                       i).second)
+			{
+				throw std::invalid_argument("barcode '" +
+				                            whitelist[i] +
+				                            "' is listed twice");
+			}
+		}
+	}
+};
+
+} // sctools
+
+#endif // SCTOOLS_INCLUDE_SCTOOLS_BARCODE_INDEX_H
@@ -0,0 +1,75 @@
+/**
+ * \file   include/sctools/barcode_lookup.h
+ * \author Elena Grassi
+ * \author Marilisa Montemurro
+ * \author Emanuele Parisi
+ * \date   February, 2019
+ *
+ * File containing the lookup structures built from a list of target barcodes.
+ */
+
+#ifndef SCTOOLS_INCLUDE_SCTOOLS_BARCODE_LOOKUP_H
+#define SCTOOLS_INCLUDE_SCTOOLS_BARCODE_LOOKUP_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "barcode_corrector.h"
+#include "barcode_index.h"
+
+namespace sctools
+{
+
+/**
+ * \brief Struct bundling the structures target barcodes are looked up with.
+ *
+ * The lookup is immutable once built, so that several de-multiplexers can
+ * share it, even from different threads, without building it again.
+ */
+struct BarcodeLookup
+{
+	/**
+	 * Index associating every target barcode with its cell identifier.
+	 */
+	BarcodeIndex     cellIds;
+	/**
+	 * Corrector of the raw barcodes close to the target ones, enabled only if
+	 * the lookup has been built for correcting them.
+	 */
+	BarcodeCorrector corrector;
+	/**
+	 * Number of target barcodes the lookup has been built from.
+	 */
+	uint64_t         barcodesCount = 0;
+
+	/**
+	 * \brief Build the lookup structures of a list of target barcodes.
+	 *
+	 * \param barcodes is the list of target barcodes, the position of every
+	 * barcode being its cell identifier.
+	 * \param correctBarcodes is true if the neighbours of the target barcodes
+	 * are indexed for correcting raw barcodes.
+	 * \return the lookup, ready to be shared.
+	 */
+	static inline std::shared_ptr<const BarcodeLookup>
+	build (const std::vector<std::string>& barcodes,
+	       bool correctBarcodes)
+	{
+		auto lookup = std::make_shared<BarcodeLookup>();
+
+		lookup->cellIds.configure(barcodes);
+		lookup->barcodesCount = barcodes.size();
+		if (correctBarcodes)
+		{
+			lookup->corrector.configure(barcodes);
+		}
+
+		return lookup;
+	}
+};
+
+} // sctools
+
+#endif // SCTOOLS_INCLUDE_SCTOOLS_BARCODE_LOOKUP_H
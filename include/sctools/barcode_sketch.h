@@ -0,0 +1,438 @@
+/**
+ * \file   include/sctools/barcode_sketch.h
+ * \author Elena Grassi
+ * \author Marilisa Montemurro
+ * \author Emanuele Parisi
+ * \date   February, 2019
+ *
+ * File containing the fixed-memory summary of the barcodes of a record stream.
+ */
+
+#ifndef SCTOOLS_INCLUDE_SCTOOLS_BARCODE_SKETCH_H
+#define SCTOOLS_INCLUDE_SCTOOLS_BARCODE_SKETCH_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "hash.h"
+
+namespace sctools
+{
+
+/**
+ * \brief Class summarizing the barcodes of a record stream in fixed memory.
+ *
+ * The most frequent barcodes are tracked with the Space-Saving algorithm:
+ * a fixed number of counters is kept, and a barcode with no counter takes
+ * over the one with the lowest count. The count of a tracked barcode is
+ * therefore an upper bound of its true count, off by at most its error.
+ * The number of distinct barcodes is estimated with HyperLogLog.
+ */
+class BarcodeSketch
+{
+
+public:
+
+	/**
+	 * Default number of barcodes tracked at the same time.
+	 */
+	static constexpr uint64_t DEFAULT_CAPACITY = 4096;
+	/**
+	 * Number of hash bits selecting the HyperLogLog register, giving a
+	 * relative standard error of about 0.8%.
+	 */
+	static constexpr uint64_t HLL_PRECISION    = 14;
+
+	/**
+	 * \brief Struct storing a tracked barcode.
+	 */
+	struct Entry
+	{
+		/**
+		 * Value of the barcode.
+		 */
+		std::string barcode;
+		/**
+		 * Upper bound of the number of occurrences of the barcode.
+		 */
+		uint64_t    count = 0;
+		/**
+		 * Maximum overestimation of the count.
+		 */
+		uint64_t    error = 0;
+	};
+
+	/**
+	 * Class constructor.
+	 */
+	BarcodeSketch () = default;
+
+	/**
+	 * \brief Class copy constructor.
+	 *
+	 * \param other is the object the current instance is initialized from.
+	 */
+	BarcodeSketch (const BarcodeSketch& other) = delete;
+
+	/**
+	 * \brief Class copy assignment operator.
+	 *
+	 * \param other is the object the current instance is initialized from.
+	 * \return a reference to the assigned object.
+	 */
+	BarcodeSketch&
+	operator= (const BarcodeSketch& other) = delete;
+
+	/**
+	 * \brief Reset the sketch, so that it tracks no barcode.
+	 */
+	inline void
+	reset () noexcept
+	{
+		capacity_ = 0;
+		total_    = 0;
+		slots_.clear();
+		heap_.clear();
+		heapPositions_.clear();
+		slotIds_.clear();
+		registers_.clear();
+	}
+
+	/**
+	 * \brief Initialize the sketch.
+	 *
+	 * \param capacity is the number of barcodes tracked at the same time, or
+	 * 0 for disabling the sketch.
+	 */
+	inline void
+	configure (uint64_t capacity = DEFAULT_CAPACITY)
+	{
+		reset();
+		capacity_ = capacity;
+		if (capacity_ > 0)
+		{
+			slots_.reserve(capacity_);
+			heap_.reserve(capacity_);
+			heapPositions_.reserve(capacity_);
+			slotIds_.reserve(capacity_);
+			registers_.assign(1ull << HLL_PRECISION,
+			                  0);
+		}
+	}
+
+	/**
+	 * \brief Check if the sketch tracks any barcode.
+	 *
+	 * \return true if the sketch has been configured with a positive
+	 * capacity.
+	 */
+	inline bool
+	isEnabled () const noexcept
+	{
+		return capacity_ > 0;
+	}
+
+	/**
+	 * \brief Account for the occurrences of a barcode.
+	 *
+	 * \param barcode is the value of the barcode.
+	 * \param length is the length of the barcode.
+	 * \param weight is the number of occurrences.
+	 */
+	inline void
+	add (const char* barcode,
+	     uint64_t length,
+	     uint64_t weight = 1)
+	{
+		if (!isEnabled())
+		{
+			return;
+		}
+
+		uint64_t hash = hashBytes(barcode,
+		                          length);
+		uint64_t index = hash >> (64 - HLL_PRECISION);
+		uint8_t  rank  = __builtin_clzll((hash << HLL_PRECISION) | (1ull << (HLL_PRECISION - 1))) + 1;
+
+		registers_[index] = std::max(registers_[index],
+		                             rank);
+		total_ += weight;
+		key_.assign(barcode,
+		            length);
+		insert_(weight,
+		        0);
+	}
+
+	/**
+	 * \brief Account for one occurrence of a barcode.
+	 *
+	 * \param barcode is the value of the barcode.
+	 */
+	inline void
+	add (const std::string& barcode)
+	{
+		add(barcode.data(),
+		    barcode.size());
+	}
+
+	/**
+	 * \brief Add the barcodes summarized by another sketch.
+	 *
+	 * The error of the merged counts is the sum of the errors of both
+	 * sketches.
+	 *
+	 * \param other is the sketch to be merged, configured with the same
+	 * capacity.
+	 */
+	inline void
+	merge (const BarcodeSketch& other)
+	{
+		if (!isEnabled() || !other.isEnabled())
+		{
+			return;
+		}
+		for (auto i = 0ul; i < registers_.size(); i++)
+		{
+			registers_[i] = std::max(registers_[i],
+			                         other.registers_[i]);
+		}
+		total_ += other.total_;
+		for (const auto& s : other.slots_)
+		{
+			key_ = s.barcode;
+			insert_(s.count,
+			        s.error);
+		}
+	}
+
+	/**
+	 * \brief Access the total number of occurrences accounted for.
+	 *
+	 * \return the sum of the weights of all the added barcodes.
+	 */
+	inline uint64_t
+	getTotal () const noexcept
+	{
+		return total_;
+	}
+
+	/**
+	 * \brief Estimate the number of distinct barcodes accounted for.
+	 *
+	 * \return the HyperLogLog estimate, corrected by linear counting for
+	 * small cardinalities.
+	 */
+	inline double
+	estimateDistinct () const noexcept
+	{
+		if (!isEnabled())
+		{
+			return 0.0;
+		}
+
+		double   registersCount = static_cast<double>(registers_.size());
+		double   alpha          = 0.7213 / (1.0 + 1.079 / registersCount);
+		double   inverseSum     = 0.0;
+		uint64_t zeroRegisters  = 0;
+
+		for (auto r : registers_)
+		{
+			inverseSum += std::ldexp(1.0,
+			                         -static_cast<int>(r));
+			zeroRegisters += r == 0 ? 1 : 0;
+		}
+
+		double estimate = alpha * registersCount * registersCount / inverseSum;
+
+		if (estimate <= 2.5 * registersCount && zeroRegisters > 0)
+		{
+			estimate = registersCount * std::log(registersCount / static_cast<double>(zeroRegisters));
+		}
+
+		return estimate;
+	}
+
+	/**
+	 * \brief Access the most frequent barcodes.
+	 *
+	 * \param n is the maximum number of barcodes reported.
+	 * \return the tracked barcodes with the highest counts, by decreasing
+	 * count.
+	 */
+	inline std::vector<Entry>
+	top (uint64_t n) const
+	{
+		std::vector<Entry> entries(slots_);
+
+		std::sort(entries.begin(),
+		          entries.end(),
+		          [] (const Entry& lhs,
+		              const Entry& rhs)
+		          {
+			          return lhs.count > rhs.count || (lhs.count == rhs.count && lhs.barcode < rhs.barcode);
+		          });
+		if (entries.size() > n)
+		{
+			entries.resize(n);
+		}
+
+		return entries;
+	}
+
+private:
+	/**
+	 * Number of barcodes tracked at the same time.
+	 */
+	uint64_t                                  capacity_ = 0;
+	/**
+	 * Total number of occurrences accounted for.
+	 */
+	uint64_t                                  total_    = 0;
+	/**
+	 * Tracked barcodes, which never move once inserted.
+	 */
+	std::vector<Entry>                        slots_;
+	/**
+	 * Min-heap of the slots, ordered by count.
+	 */
+	std::vector<uint64_t>                     heap_;
+	/**
+	 * Position of every slot in the heap.
+	 */
+	std::vector<uint64_t>                     heapPositions_;
+	/**
+	 * Map associating every tracked barcode with its slot.
+	 */
+	std::unordered_map<std::string, uint64_t> slotIds_;
+	/**
+	 * HyperLogLog registers.
+	 */
+	std::vector<uint8_t>                      registers_;
+	/**
+	 * Buffer the barcode being inserted is copied to.
+	 */
+	std::string                               key_;
+
+	/**
+	 * \brief Add occurrences to the barcode stored in the key buffer, taking
+	 * over the lowest counter if it is not tracked and the sketch is full.
+	 *
+	 * \param count is the number of occurrences.
+	 * \param error is the maximum overestimation of the occurrences.
+	 */
+	inline void
+	insert_ (uint64_t count,
+	         uint64_t error)
+	{
+		auto slotIt = slotIds_.find(key_);
+		auto slotId = 0ul;
+
+		if (slotIt != slotIds_.end())
+		{
+			slotId = slotIt->second;
+			slots_[slotId].count += count;
+			slots_[slotId].error += error;
+		}
+		else if (slots_.size() < capacity_)
+		{
+			slotId = slots_.size();
+			slots_.emplace_back();
+			slots_[slotId].barcode = key_;
+			slots_[slotId].count   = count;
+			slots_[slotId].error   = error;
+			slotIds_.emplace(key_,
+			                 slotId);
+			heap_.emplace_back(slotId);
+			heapPositions_.emplace_back(heap_.size() - 1);
+			siftUp_(heap_.size() - 1);
+			return;
+		}
+		else
+		{
+			// The new barcode may have occurred at most as many times as the
+			// least frequent tracked one.
+			slotId = heap_.front();
+			slotIds_.erase(slots_[slotId].barcode);
+			slots_[slotId].barcode = key_;
+			slots_[slotId].error   = slots_[slotId].count + error;
+			slots_[slotId].count  += count;
+			slotIds_.emplace(key_,
+			                 slotId);
+		}
+		siftDown_(heapPositions_[slotId]);
+	}
+
+	/**
+	 * \brief Swap two elements of the heap.
+	 *
+	 * \param i is the position of the first element.
+	 * \param j is the position of the second element.
+	 */
+	inline void
+	swap_ (uint64_t i,
+	       uint64_t j) noexcept
+	{
+		std::swap(heap_[i],
+		          heap_[j]);
+		heapPositions_[heap_[i]] = i;
+		heapPositions_[heap_[j]] = j;
+	}
+
+	/**
+	 * \brief Move an element of the heap towards the root, until its parent
+	 * has a lower count.
+	 *
+	 * \param i is the position of the element.
+	 */
+	inline void
+	siftUp_ (uint64_t i) noexcept
+	{
+		while (i > 0 && slots_[heap_[(i - 1) / 2]].count > slots_[heap_[i]].count)
+		{
+			swap_(i,
+			      (i - 1) / 2);
+			i = (i - 1) / 2;
+		}
+	}
+
+	/**
+	 * \brief Move an element of the heap towards the leaves, until its
+	 * children have higher counts.
+	 *
+	 * \param i is the position of the element.
+	 */
+	inline void
+	siftDown_ (uint64_t i) noexcept
+	{
+		while (true)
+		{
+			uint64_t smallest = i;
+			uint64_t left     = 2 * i + 1;
+			uint64_t right    = 2 * i + 2;
+
+			if (left < heap_.size() && slots_[heap_[left]].count < slots_[heap_[smallest]].count)
+			{
+				smallest = left;
+			}
+			if (right < heap_.size() && slots_[heap_[right]].count < slots_[heap_[smallest]].count)
+			{
+				smallest = right;
+			}
+			if (smallest == i)
+			{
+				return;
+			}
+			swap_(i,
+			      smallest);
+			i = smallest;
+		}
+	}
+};
+
+} // sctools
+
+#endif // SCTOOLS_INCLUDE_SCTOOLS_BARCODE_SKETCH_H
@@ -0,0 +1,761 @@
+/**
+ * \file   include/sctools/bgzf.h
+ * \author Elena Grassi
+ * \author Marilisa Montemurro
+ * \author Emanuele Parisi
+ * \date   February, 2019
+ *
+ * File containing facilities for reading and writing BGZF compressed streams
+ * through a pluggable deflate backend.
+ */
+
+#ifndef SCTOOLS_INCLUDE_SCTOOLS_BGZF_H
+#define SCTOOLS_INCLUDE_SCTOOLS_BGZF_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <experimental/filesystem>
+#include <fstream>
+#include <functional>
+#include <istream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "compression_backend.h"
+
+namespace fs = std::experimental::filesystem;
+
+namespace sctools
+{
+
+/**
+ * \brief Struct describing the layout of a BGZF block, and providing
+ * facilities for reading and decompressing blocks.
+ */
+struct Bgzf
+{
+	/**
+	 * Maximum size of a BGZF block, header and footer included.
+	 */
+	static constexpr uint64_t MAX_BLOCK_SIZE   = 65536;
+	/**
+	 * Maximum number of uncompressed bytes stored in a single block. It is
+	 * small enough for a stored deflate block to always fit MAX_BLOCK_SIZE.
+	 */
+	static constexpr uint64_t MAX_PAYLOAD_SIZE = 0xff00;
+	/**
+	 * Size of the gzip header of the blocks written, whose extra field holds
+	 * the BC subfield only. No BGZF block header is shorter.
+	 */
+	static constexpr uint64_t HEADER_SIZE      = 18;
+	/**
+	 * Size of the fixed part of the gzip header, preceding the extra field.
+	 */
+	static constexpr uint64_t FIXED_SIZE       = 12;
+	/**
+	 * Size of the gzip footer of a BGZF block.
+	 */
+	static constexpr uint64_t FOOTER_SIZE      = 8;
+
+	/**
+	 * \brief Access the empty block marking the end of a BGZF file.
+	 *
+	 * \return the bytes of the end-of-file marker block.
+	 */
+	static inline const std::string&
+	eofBlock () noexcept
+	{
+		static const std::string eof("\x1f\x8b\x08\x04\x00\x00\x00\x00"
+		                             "\x00\xff\x06\x00\x42\x43\x02\x00"
+		                             "\x1b\x00\x03\x00\x00\x00\x00\x00"
+		                             "\x00\x00\x00\x00",
+		                             28);
+
+		return eof;
+	}
+
+	/**
+	 * \brief Compute the size of the header of a block, from its first
+	 * HEADER_SIZE bytes.
+	 *
+	 * \param header is the pointer to the header.
+	 * \return the size of the header, extra field included.
+	 */
+	static inline uint64_t
+	headerSize (const char* header)
+	{
+		uint64_t extraSize = load16_(header + 10);
+
+		// Every BGZF block is a gzip member with an extra field.
+		if (header[0] != '\x1f' ||
+		    header[1] != '\x8b' ||
+		    header[2] != '\x08' ||
+		    (header[3] & '\x04') == 0 ||
+		    extraSize < HEADER_SIZE - FIXED_SIZE)
+		{
+			throw std::runtime_error("malformed BGZF block header");
+		}
+
+		return FIXED_SIZE + extraSize;
+	}
+
+	/**
+	 * \brief Compute the size of a block from its header.
+	 *
+	 * The extra subfields are walked until the BC one, storing the block
+	 * size, is found.
+	 *
+	 * \param header is the pointer to the whole header, as long as reported
+	 * by headerSize().
+	 * \return the size of the block, header and footer included.
+	 */
+	static inline uint64_t
+	blockSize (const char* header)
+	{
+		uint64_t end    = headerSize(header);
+		uint64_t offset = FIXED_SIZE;
+
+		while (offset + 4 <= end)
+		{
+			uint64_t subfieldSize = load16_(header + offset + 2);
+
+			if (offset + 4 + subfieldSize > end)
+			{
+				break;
+			}
+			if (header[offset] == 'B' && header[offset + 1] == 'C' && subfieldSize == 2)
+			{
+				uint64_t size = load16_(header + offset + 4) + 1;
+
+				if (size < end + FOOTER_SIZE)
+				{
+					break;
+				}
+
+				return size;
+			}
+			offset += 4 + subfieldSize;
+		}
+
+		throw std::runtime_error("malformed BGZF block header");
+	}
+
+	/**
+	 * \brief Read the uncompressed size of a block from its footer.
+	 *
+	 * \param block is the pointer to the block.
+	 * \param blockSize is the size of the block.
+	 * \return the number of uncompressed bytes of the block.
+	 */
+	static inline uint64_t
+	payloadSize (const char* block,
+	             uint64_t blockSize)
+	{
+		uint64_t size = load32_(block + blockSize - 4);
+
+		if (size > MAX_BLOCK_SIZE)
+		{
+			throw std::runtime_error("malformed BGZF block footer");
+		}
+
+		return size;
+	}
+
+	/**
+	 * \brief Read a whole block from a stream.
+	 *
+	 * \param source is the stream the block is read from.
+	 * \param buffer is the buffer the block is appended to.
+	 * \return the size of the block, or 0 if the stream is at its end.
+	 */
+	static inline uint64_t
+	readBlock (std::istream& source,
+	           std::vector<char>& buffer)
+	{
+		uint64_t offset = buffer.size();
+		uint64_t header = 0;
+		uint64_t size   = 0;
+
+		buffer.resize(offset + HEADER_SIZE);
+		if (!source.read(buffer.data() + offset,
+		                 HEADER_SIZE))
+		{
+			buffer.resize(offset);
+			return 0;
+		}
+		header = headerSize(buffer.data() + offset);
+		buffer.resize(offset + header);
+		if (!source.read(buffer.data() + offset + HEADER_SIZE,
+		                 header - HEADER_SIZE))
+		{
+			throw std::runtime_error("truncated BGZF block");
+		}
+		size = blockSize(buffer.data() + offset);
+		buffer.resize(offset + size);
+		if (!source.read(buffer.data() + offset + header,
+		                 size - header))
+		{
+			throw std::runtime_error("truncated BGZF block");
+		}
+
+		return size;
+	}
+
+	/**
+	 * \brief Decompress a block, checking the uncompressed bytes against the
+	 * CRC32 and size stored in its footer.
+	 *
+	 * \param backend is the deflate codec used for decompressing.
+	 * \param block is the pointer to the block.
+	 * \param blockSize is the size of the block.
+	 * \param sink is the buffer the uncompressed bytes are written to.
+	 * \param payloadSize is the number of uncompressed bytes of the block, as
+	 * reported by payloadSize().
+	 */
+	static inline void
+	inflate (CompressionBackend& backend,
+	         const char* block,
+	         uint64_t blockSize,
+	         char* sink,
+	         uint64_t payloadSize)
+	{
+		uint64_t header = headerSize(block);
+
+		// The backends fail unless the stream inflates to exactly the
+		// expected size.
+		if (payloadSize > 0 &&
+		    !backend.decompress(block + header,
+		                        blockSize - header - FOOTER_SIZE,
+		                        sink,
+		                        payloadSize))
+		{
+			throw std::runtime_error("corrupted BGZF block");
+		}
+		if (backend.crc32(0,
+		                  sink,
+		                  payloadSize) != load32_(block + blockSize - FOOTER_SIZE))
+		{
+			throw std::runtime_error("BGZF block checksum mismatch");
+		}
+	}
+
+private:
+	/**
+	 * \brief Load a little-endian 16 bits integer.
+	 *
+	 * \param data is the pointer to the integer.
+	 * \return the integer.
+	 */
+	static inline uint64_t
+	load16_ (const char* data) noexcept
+	{
+		return static_cast<uint64_t>(static_cast<uint8_t>(data[0])) |
+		       (static_cast<uint64_t>(static_cast<uint8_t>(data[1])) << 8);
+	}
+
+	/**
+	 * \brief Load a little-endian 32 bits integer.
+	 *
+	 * \param data is the pointer to the integer.
+	 * \return the integer.
+	 */
+	static inline uint64_t
+	load32_ (const char* data) noexcept
+	{
+		return load16_(data) |
+		       (load16_(data + 2) << 16);
+	}
+};
+
+/**
+ * \brief Struct storing a range of records of a BGZF file.
+ */
+struct BgzfRange
+{
+	/**
+	 * Virtual offset of the first record of the range.
+	 */
+	uint64_t begin = 0;
+	/**
+	 * Virtual offset past the beginning of the last record of the range.
+	 */
+	uint64_t end   = 0;
+};
+
+/**
+ * \brief Class providing facilities for compressing a byte stream into BGZF
+ * blocks.
+ *
+ * Bytes are accumulated until a block is full, then the block is compressed
+ * and handed to the sink function given at configuration time.
+ */
+class BgzfWriter
+{
+
+public:
+
+	using TBlockSink = std::function<void(const char*,
+	                                      uint64_t)>;
+
+	/**
+	 * \brief Class constructor.
+	 */
+	BgzfWriter () = default;
+
+	/**
+	 * \brief Class copy constructor.
+	 *
+	 * \param other is the object the current instance is initialized from.
+	 */
+	BgzfWriter (const BgzfWriter& other) = delete;
+
+	/**
+	 * \brief Class copy assignment operator.
+	 *
+	 * \param other is the object the current instance is initialized from.
+	 * \return a reference to the assigned object.
+	 */
+	BgzfWriter&
+	operator= (const BgzfWriter& other) = delete;
+
+	/**
+	 * \brief Initialize the writer instance.
+	 *
+	 * \param backend is the deflate codec used for compressing blocks. It must
+	 * outlive the writer.
+	 * \param sink is the function every compressed block is handed to.
+	 */
+	inline void
+	configure (CompressionBackend& backend,
+	           TBlockSink sink) noexcept
+	{
+		backend_ = &backend;
+		sink_    = std::move(sink);
+		payload_.clear();
+		payload_.reserve(Bgzf::MAX_PAYLOAD_SIZE);
+		block_.resize(Bgzf::MAX_BLOCK_SIZE);
+	}
+
+	/**
+	 * \brief Append bytes to the compressed stream.
+	 *
+	 * \param data is the buffer to be appended.
+	 * \param size is the size of the buffer to be appended.
+	 */
+	inline void
+	write (const char* data,
+	       uint64_t size)
+	{
+		while (size > 0)
+		{
+			auto chunk = std::min(size,
+			                      Bgzf::MAX_PAYLOAD_SIZE - payload_.size());
+
+			payload_.insert(payload_.end(),
+			                data,
+			                data + chunk);
+			data += chunk;
+			size -= chunk;
+			if (payload_.size() == Bgzf::MAX_PAYLOAD_SIZE)
+			{
+				flush();
+			}
+		}
+	}
+
+	/**
+	 * \brief Compress the buffered bytes into a block, even if it is not
+	 * full.
+	 */
+	inline void
+	flush ()
+	{
+		uint64_t compressedSize = 0;
+
+		if (payload_.empty())
+		{
+			return;
+		}
+
+		compressedSize = backend_->compress(payload_.data(),
+		                                    payload_.size(),
+		                                    block_.data() + Bgzf::HEADER_SIZE,
+		                                    Bgzf::MAX_BLOCK_SIZE -
+		                                    Bgzf::HEADER_SIZE -
+		                                    Bgzf::FOOTER_SIZE);
+		if (compressedSize == 0)
+		{
+			compressedSize = store_(payload_.data(),
+			                        payload_.size(),
+			                        block_.data() + Bgzf::HEADER_SIZE);
+		}
+		finalizeBlock_(compressedSize);
+		sink_(block_.data(),
+		      Bgzf::HEADER_SIZE + compressedSize + Bgzf::FOOTER_SIZE);
+		payload_.clear();
+	}
+
+	/**
+	 * \brief Flush the buffered bytes and, optionally, terminate the stream.
+	 *
+	 * \param writeEof is a flag which appends the end-of-file marker block,
+	 * if it is true.
+	 */
+	inline void
+	close (bool writeEof)
+	{
+		if (backend_ == nullptr)
+		{
+			return;
+		}
+		flush();
+		if (writeEof)
+		{
+			sink_(Bgzf::eofBlock().data(),
+			      Bgzf::eofBlock().size());
+		}
+		backend_ = nullptr;
+	}
+
+private:
+	/**
+	 * Codec used for compressing blocks.
+	 */
+	CompressionBackend* backend_ = nullptr;
+	/**
+	 * Function every compressed block is handed to.
+	 */
+	TBlockSink          sink_;
+	/**
+	 * Bytes waiting to be compressed.
+	 */
+	std::vector<char>   payload_;
+	/**
+	 * Buffer the current block is assembled in.
+	 */
+	std::vector<char>   block_;
+
+	/**
+	 * \brief Encode a buffer as a single stored (uncompressed) deflate block.
+	 *
+	 * \param data is the buffer to be stored.
+	 * \param size is the size of the buffer, at most 65535 bytes.
+	 * \param sink is the buffer the deflate block is written to.
+	 * \return the size of the deflate block.
+	 */
+	static inline uint64_t
+	store_ (const char* data,
+	        uint64_t size,
+	        char* sink) noexcept
+	{
+		sink[0] = 0x01;
+		sink[1] = static_cast<char>(size & 0xff);
+		sink[2] = static_cast<char>((size >> 8) & 0xff);
+		sink[3] = static_cast<char>(~size & 0xff);
+		sink[4] = static_cast<char>((~size >> 8) & 0xff);
+		std::memcpy(sink + 5,
+		            data,
+		            size);
+
+		return size + 5;
+	}
+
+	/**
+	 * \brief Fill the header and the footer of the current block.
+	 *
+	 * \param compressedSize is the size of the deflate stream in the block.
+	 */
+	inline void
+	finalizeBlock_ (uint64_t compressedSize) noexcept
+	{
+		static const char header[Bgzf::HEADER_SIZE] = {
+			'\x1f', '\x8b', '\x08', '\x04', '\x00', '\x00', '\x00', '\x00', '\x00',
+			'\xff', '\x06', '\x00', '\x42', '\x43', '\x02', '\x00', '\x00', '\x00'
+		};
+		uint64_t blockSize = Bgzf::HEADER_SIZE + compressedSize + Bgzf::FOOTER_SIZE;
+		uint32_t crc       = backend_->crc32(0,
+		                                     payload_.data(),
+		                                     payload_.size());
+		char*    footer    = block_.data() + Bgzf::HEADER_SIZE + compressedSize;
+
+		std::memcpy(block_.data(),
+		            header,
+		            Bgzf::HEADER_SIZE);
+		block_[16] = static_cast<char>((blockSize - 1) & 0xff);
+		block_[17] = static_cast<char>(((blockSize - 1) >> 8) & 0xff);
+		for (auto i = 0; i < 4; i++)
+		{
+			footer[i]     = static_cast<char>((crc >> (8 * i)) & 0xff);
+			footer[i + 4] = static_cast<char>((payload_.size() >> (8 * i)) & 0xff);
+		}
+	}
+};
+
+/**
+ * \brief Class providing facilities for decompressing a BGZF file.
+ */
+class BgzfReader
+{
+
+public:
+
+	/**
+	 * \brief Class constructor.
+	 */
+	BgzfReader () = default;
+
+	/**
+	 * \brief Class copy constructor.
+	 *
+	 * \param other is the object the current instance is initialized from.
+	 */
+	BgzfReader (const BgzfReader& other) = delete;
+
+	/**
+	 * \brief Class copy assignment operator.
+	 *
+	 * \param other is the object the current instance is initialized from.
+	 * \return a reference to the assigned object.
+	 */
+	BgzfReader&
+	operator= (const BgzfReader& other) = delete;
+
+	/**
+	 * \brief Initialize the reader instance.
+	 *
+	 * \param sourcePath is the path to the BGZF file to be read.
+	 * \param backend is the deflate codec used for decompressing blocks. It
+	 * must outlive the reader.
+	 */
+	inline void
+	configure (const fs::path& sourcePath,
+	           CompressionBackend& backend)
+	{
+		backend_ = &backend;
+		stream_.close();
+		stream_.clear();
+		stream_.open(sourcePath,
+		             std::ios::binary);
+		if (!stream_.is_open())
+		{
+			throw std::runtime_error("cannot open '" +
+			                         sourcePath.string() +
+			                         "'");
+		}
+		compressed_.reserve(Bgzf::MAX_BLOCK_SIZE);
+		block_.clear();
+		blockCursor_     = 0;
+		blockOffset_     = 0;
+		nextBlockOffset_ = 0;
+		readBytes_       = 0;
+	}
+
+	/**
+	 * \brief Check if every byte of the stream has been read.
+	 *
+	 * \return true if no more bytes are available.
+	 */
+	inline bool
+	atEnd ()
+	{
+		while (blockCursor_ == block_.size())
+		{
+			if (!loadBlock_())
+			{
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	/**
+	 * \brief Read bytes from the decompressed stream.
+	 *
+	 * \param sink is the buffer the bytes are copied to.
+	 * \param size is the number of bytes to be read.
+	 * \return the number of bytes actually read, which is lower than the
+	 * requested one only at the end of the stream.
+	 */
+	inline uint64_t
+	read (char* sink,
+	      uint64_t size)
+	{
+		uint64_t readBytes = 0;
+
+		while (readBytes < size && !atEnd())
+		{
+			auto chunk = std::min(size - readBytes,
+			                      block_.size() - blockCursor_);
+
+			std::memcpy(sink + readBytes,
+			            block_.data() + blockCursor_,
+			            chunk);
+			blockCursor_ += chunk;
+			readBytes    += chunk;
+		}
+
+		return readBytes;
+	}
+
+	/**
+	 * \brief Skip bytes of the decompressed stream.
+	 *
+	 * \param size is the number of bytes to be skipped.
+	 * \return the number of bytes actually skipped.
+	 */
+	inline uint64_t
+	skip (uint64_t size)
+	{
+		uint64_t skippedBytes = 0;
+
+		while (skippedBytes < size && !atEnd())
+		{
+			auto chunk = std::min(size - skippedBytes,
+			                      block_.size() - blockCursor_);
+
+			blockCursor_  += chunk;
+			skippedBytes  += chunk;
+		}
+
+		return skippedBytes;
+	}
+
+	/**
+	 * \brief Access the position of the next byte of the decompressed stream.
+	 *
+	 * A position at the end of a block is reported as the beginning of the
+	 * next one, so that every position has a single virtual offset.
+	 *
+	 * \return the virtual offset of the next byte, with the offset of its
+	 * compressed block in the upper 48 bits and its offset in the
+	 * decompressed block in the lower 16 bits.
+	 */
+	inline uint64_t
+	tell ()
+	{
+		if (atEnd())
+		{
+			return nextBlockOffset_ << 16;
+		}
+
+		return (blockOffset_ << 16) | blockCursor_;
+	}
+
+	/**
+	 * \brief Move to a position of the decompressed stream.
+	 *
+	 * \param virtualOffset is the position, as returned by tell().
+	 */
+	inline void
+	seek (uint64_t virtualOffset)
+	{
+		uint64_t blockOffset = virtualOffset >> 16;
+		uint64_t blockCursor = virtualOffset & 0xffff;
+
+		// The current block is reloaded only if the position is elsewhere.
+		if (block_.empty() || blockOffset != blockOffset_)
+		{
+			stream_.clear();
+			if (!stream_.seekg(blockOffset))
+			{
+				throw std::runtime_error("cannot seek BGZF stream");
+			}
+			nextBlockOffset_ = blockOffset;
+			if (!loadBlock_())
+			{
+				throw std::runtime_error("virtual offset past the end of the BGZF stream");
+			}
+		}
+		if (blockCursor > block_.size())
+		{
+			throw std::runtime_error("virtual offset past the end of its BGZF block");
+		}
+		blockCursor_ = blockCursor;
+	}
+
+	/**
+	 * \brief Access the number of compressed bytes read so far.
+	 *
+	 * \return the size of all the blocks loaded since configuration.
+	 */
+	inline uint64_t
+	getReadBytes () const noexcept
+	{
+		return readBytes_;
+	}
+
+private:
+	/**
+	 * Codec used for decompressing blocks.
+	 */
+	CompressionBackend* backend_         = nullptr;
+	/**
+	 * Stream compressed blocks are read from.
+	 */
+	std::ifstream       stream_;
+	/**
+	 * Buffer the current compressed block is read into.
+	 */
+	std::vector<char>   compressed_;
+	/**
+	 * Decompressed content of the current block.
+	 */
+	std::vector<char>   block_;
+	/**
+	 * Index of the first byte of the current block not read yet.
+	 */
+	uint64_t            blockCursor_     = 0;
+	/**
+	 * Offset of the current block in the compressed file.
+	 */
+	uint64_t            blockOffset_     = 0;
+	/**
+	 * Offset of the block following the current one in the compressed file.
+	 */
+	uint64_t            nextBlockOffset_ = 0;
+	/**
+	 * Number of compressed bytes loaded since configuration.
+	 */
+	uint64_t            readBytes_       = 0;
+
+	/**
+	 * \brief Read and decompress the next block of the file.
+	 *
+	 * \return false if the end of the file has been reached.
+	 */
+	inline bool
+	loadBlock_ ()
+	{
+		uint64_t blockSize   = 0;
+		uint64_t payloadSize = 0;
+
+		compressed_.clear();
+		blockSize = Bgzf::readBlock(stream_,
+		                            compressed_);
+		if (blockSize == 0)
+		{
+			return false;
+		}
+		payloadSize = Bgzf::payloadSize(compressed_.data(),
+		                                blockSize);
+		block_.resize(payloadSize);
+		blockCursor_      = 0;
+		blockOffset_      = nextBlockOffset_;
+		nextBlockOffset_ += blockSize;
+		readBytes_       += blockSize;
+		Bgzf::inflate(*backend_,
+		              compressed_.data(),
+		              blockSize,
+		              block_.data(),
+		              payloadSize);
+
+		return true;
+	}
+};
+
+} // sctools
+
+#endif // SCTOOLS_INCLUDE_SCTOOLS_BGZF_H
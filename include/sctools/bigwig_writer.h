@@ -0,0 +1,807 @@
+/**
+ * \file   include/sctools/bigwig_writer.h
+ * \author Elena Grassi
+ * \author Marilisa Montemurro
+ * \author Emanuele Parisi
+ * \date   February, 2019
+ *
+ * File containing the streaming writer of coverage tracks in the bigWig
+ * format.
+ */
+
+#ifndef SCTOOLS_INCLUDE_SCTOOLS_BIGWIG_WRITER_H
+#define SCTOOLS_INCLUDE_SCTOOLS_BIGWIG_WRITER_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <experimental/filesystem>
+#include <fstream>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <zlib.h>
+
+namespace fs = std::experimental::filesystem;
+
+namespace sctools
+{
+
+/**
+ * \brief Class writing a coverage track to a bigWig file, run by run.
+ *
+ * Runs are grouped in bedGraph sections of up to ITEMS_PER_SECTION runs, each
+ * compressed with zlib as soon as it is full. Compressed sections are
+ * buffered and appended to the file when the buffer is large enough, so that
+ * the file is only open while it is written and many tracks can be written at
+ * the same time. When the writer is finished, the R-tree index of the
+ * sections is appended and the header is completed. No zoom level is
+ * written.
+ */
+class BigWigWriter
+{
+
+public:
+
+	/**
+	 * Maximum number of runs of a data section.
+	 */
+	static constexpr uint64_t ITEMS_PER_SECTION = 1024;
+	/**
+	 * Maximum number of children of a node of the indices.
+	 */
+	static constexpr uint64_t BLOCK_SIZE        = 256;
+
+	/**
+	 * Class constructor.
+	 */
+	BigWigWriter () = default;
+
+	/**
+	 * \brief Class copy constructor.
+	 *
+	 * \param other is the object the current instance is initialized from.
+	 */
+	BigWigWriter (const BigWigWriter& other) = delete;
+
+	/**
+	 * \brief Class copy assignment operator.
+	 *
+	 * \param other is the object the current instance is initialized from.
+	 * \return a reference to the assigned object.
+	 */
+	BigWigWriter&
+	operator= (const BigWigWriter& other) = delete;
+
+	/**
+	 * \brief Encode the chromosome B+ tree of a set of reference sequences.
+	 *
+	 * The tree is shared by every track of the same reference, so that it is
+	 * only encoded once.
+	 *
+	 * \param names are the names of the reference sequences, whose indices
+	 * are the chromosome identifiers of the runs.
+	 * \param lengths are the lengths of the reference sequences.
+	 * \return the encoded tree.
+	 */
+	static inline std::string
+	encodeChromTree (const std::vector<std::string>& names,
+	                 const std::vector<uint32_t>& lengths)
+	{
+		std::vector<uint32_t> order(names.size());
+		std::string           tree;
+		uint64_t              keySize   = 1;
+		uint64_t              blockSize = std::max<uint64_t>(std::min<uint64_t>(names.size(),
+		                                                                         BLOCK_SIZE),
+		                                                     1);
+		uint64_t              levels    = 1;
+
+		for (auto i = 0ul; i < names.size(); i++)
+		{
+			order[i] = i;
+			keySize  = std::max<uint64_t>(keySize,
+			                              names[i].size());
+		}
+		std::sort(order.begin(),
+		          order.end(),
+		          [&names] (uint32_t lhs,
+		                    uint32_t rhs)
+		          {
+			          return names[lhs] < names[rhs];
+		          });
+		for (auto n = names.size(); n > blockSize; n = (n + blockSize - 1) / blockSize)
+		{
+			levels += 1;
+		}
+
+		append_<uint32_t>(tree,
+		                  CHROM_TREE_MAGIC);
+		append_<uint32_t>(tree,
+		                  blockSize);
+		append_<uint32_t>(tree,
+		                  keySize);
+		append_<uint32_t>(tree,
+		                  8);
+		append_<uint64_t>(tree,
+		                  names.size());
+		append_<uint64_t>(tree,
+		                  0);
+
+		// Write the index levels from the root down, every slot pointing to
+		// the first key of its child.
+		uint64_t levelOffset = CHROM_TREE_OFFSET + tree.size();
+
+		for (auto level = levels - 1; level > 0; level--)
+		{
+			uint64_t slotItems       = 1;
+			uint64_t indexBlockBytes = 4 + blockSize * (keySize + 8);
+			uint64_t leafBlockBytes  = 4 + blockSize * (keySize + 8);
+
+			for (auto i = 0ul; i < level; i++)
+			{
+				slotItems *= blockSize;
+			}
+
+			uint64_t nodeItems  = slotItems * blockSize;
+			uint64_t nodesCount = (names.size() + nodeItems - 1) / nodeItems;
+			uint64_t nextChild  = levelOffset + nodesCount * indexBlockBytes;
+
+			for (auto i = 0ul; i < names.size(); i += nodeItems)
+			{
+				uint64_t end        = std::min<uint64_t>(i + nodeItems,
+				                                         names.size());
+				uint64_t slotsCount = (end - i + slotItems - 1) / slotItems;
+
+				append_<uint8_t>(tree,
+				                 0);
+				append_<uint8_t>(tree,
+				                 0);
+				append_<uint16_t>(tree,
+				                  slotsCount);
+				for (auto j = i; j < end; j += slotItems)
+				{
+					appendKey_(tree,
+					           names[order[j]],
+					           keySize);
+					append_<uint64_t>(tree,
+					                  nextChild);
+					nextChild += level == 1 ? leafBlockBytes : indexBlockBytes;
+				}
+				tree.append((blockSize - slotsCount) * (keySize + 8),
+				            '\0');
+			}
+			levelOffset += nodesCount * indexBlockBytes;
+		}
+
+		// Write the leaves, holding the identifier and the length of every
+		// reference sequence.
+		for (auto i = 0ul; i < names.size(); i += blockSize)
+		{
+			uint64_t end = std::min<uint64_t>(i + blockSize,
+			                                  names.size());
+
+			append_<uint8_t>(tree,
+			                 1);
+			append_<uint8_t>(tree,
+			                 0);
+			append_<uint16_t>(tree,
+			                  end - i);
+			for (auto j = i; j < end; j++)
+			{
+				appendKey_(tree,
+				           names[order[j]],
+				           keySize);
+				append_<uint32_t>(tree,
+				                  order[j]);
+				append_<uint32_t>(tree,
+				                  lengths[order[j]]);
+			}
+			tree.append((blockSize - (end - i)) * (keySize + 8),
+			            '\0');
+		}
+
+		return tree;
+	}
+
+	/**
+	 * \brief Initialize the writer, without creating the file yet.
+	 *
+	 * \param path is the path to the bigWig file.
+	 * \param chromTree is the tree returned by encodeChromTree(), which must
+	 * outlive the writer.
+	 * \param bufferedBytes is the number of compressed bytes buffered before
+	 * they are appended to the file.
+	 */
+	inline void
+	configure (const fs::path& path,
+	           const std::string* chromTree,
+	           uint64_t bufferedBytes)
+	{
+		path_             = path;
+		chromTree_        = chromTree;
+		bufferedBytes_    = bufferedBytes;
+		isCreated_        = false;
+		fileSize_         = dataOffset_() + 8;
+		maxSectionBytes_  = 0;
+		basesCovered_     = 0;
+		minValue_         = std::numeric_limits<double>::max();
+		maxValue_         = std::numeric_limits<double>::lowest();
+		sumValues_        = 0.0;
+		sumSquaredValues_ = 0.0;
+		buffer_.clear();
+		items_.clear();
+		sections_.clear();
+	}
+
+	/**
+	 * \brief Add a run of the track.
+	 *
+	 * Runs must be added in increasing order of position, contig by contig,
+	 * and must not overlap.
+	 *
+	 * \param chromId is the identifier of the reference sequence of the run.
+	 * \param start is the first position of the run, 0-based.
+	 * \param end is the position following the last one of the run.
+	 * \param value is the value of the track over the run.
+	 */
+	inline void
+	add (uint32_t chromId,
+	     uint32_t start,
+	     uint32_t end,
+	     float value)
+	{
+		if (!items_.empty() && (items_.size() == ITEMS_PER_SECTION || chromId_ != chromId))
+		{
+			closeSection_();
+		}
+		chromId_ = chromId;
+		items_.push_back({start,
+		                  end,
+		                  value});
+
+		double length = end - start;
+
+		basesCovered_     += end - start;
+		minValue_          = std::min<double>(minValue_,
+		                                      value);
+		maxValue_          = std::max<double>(maxValue_,
+		                                      value);
+		sumValues_        += length * value;
+		sumSquaredValues_ += length * value * value;
+	}
+
+	/**
+	 * \brief Complete the file, writing the buffered sections, the index and
+	 * the header.
+	 */
+	inline void
+	finish ()
+	{
+		closeSection_();
+
+		// Append the R-tree index of the sections and the closing magic.
+		uint64_t indexOffset = fileSize_ + buffer_.size();
+
+		appendIndex_(buffer_,
+		             indexOffset);
+		append_<uint32_t>(buffer_,
+		                  BIGWIG_MAGIC);
+		flushBuffer_();
+
+		// Fill the header, the summary and the number of sections in.
+		std::string header;
+
+		append_<uint32_t>(header,
+		                  BIGWIG_MAGIC);
+		append_<uint16_t>(header,
+		                  4);
+		append_<uint16_t>(header,
+		                  0);
+		append_<uint64_t>(header,
+		                  CHROM_TREE_OFFSET);
+		append_<uint64_t>(header,
+		                  dataOffset_());
+		append_<uint64_t>(header,
+		                  indexOffset);
+		append_<uint16_t>(header,
+		                  0);
+		append_<uint16_t>(header,
+		                  0);
+		append_<uint64_t>(header,
+		                  0);
+		append_<uint64_t>(header,
+		                  HEADER_SIZE);
+		append_<uint32_t>(header,
+		                  maxSectionBytes_);
+		append_<uint64_t>(header,
+		                  0);
+		append_<uint64_t>(header,
+		                  basesCovered_);
+		append_<double>(header,
+		                basesCovered_ > 0 ? minValue_ : 0.0);
+		append_<double>(header,
+		                basesCovered_ > 0 ? maxValue_ : 0.0);
+		append_<double>(header,
+		                sumValues_);
+		append_<double>(header,
+		                sumSquaredValues_);
+
+		std::fstream fileStream(path_,
+		                        std::ios::in | std::ios::out | std::ios::binary);
+		std::string  sectionsCount;
+
+		append_<uint64_t>(sectionsCount,
+		                  sections_.size());
+		fileStream.write(header.data(),
+		                 header.size());
+		fileStream.seekp(dataOffset_());
+		fileStream.write(sectionsCount.data(),
+		                 sectionsCount.size());
+		if (!fileStream)
+		{
+			throw std::runtime_error("cannot complete bigWig file " + path_.string());
+		}
+	}
+
+private:
+	/**
+	 * Magic number of bigWig files.
+	 */
+	static constexpr uint32_t BIGWIG_MAGIC      = 0x888FFC26;
+	/**
+	 * Magic number of the chromosome B+ tree.
+	 */
+	static constexpr uint32_t CHROM_TREE_MAGIC  = 0x78CA8C91;
+	/**
+	 * Magic number of the R-tree index of the sections.
+	 */
+	static constexpr uint32_t INDEX_MAGIC       = 0x2468ACE0;
+	/**
+	 * Size of the file header.
+	 */
+	static constexpr uint64_t HEADER_SIZE       = 64;
+	/**
+	 * Offset of the chromosome tree, following the header and the summary.
+	 */
+	static constexpr uint64_t CHROM_TREE_OFFSET = HEADER_SIZE + 40;
+
+	/**
+	 * \brief Struct storing a run of the current section.
+	 */
+	struct Item_
+	{
+		/**
+		 * First position of the run.
+		 */
+		uint32_t start;
+		/**
+		 * Position following the last one of the run.
+		 */
+		uint32_t end;
+		/**
+		 * Value of the run.
+		 */
+		float    value;
+	};
+
+	/**
+	 * \brief Struct storing the location of a written section.
+	 */
+	struct Section_
+	{
+		/**
+		 * Identifier of the reference sequence of the section.
+		 */
+		uint32_t chromId;
+		/**
+		 * First position covered by the section.
+		 */
+		uint32_t start;
+		/**
+		 * Position following the last one covered by the section.
+		 */
+		uint32_t end;
+		/**
+		 * Offset of the compressed section in the file.
+		 */
+		uint64_t offset;
+		/**
+		 * Size of the compressed section.
+		 */
+		uint64_t size;
+	};
+
+	/**
+	 * \brief Struct storing a node of the R-tree index.
+	 */
+	struct Node_
+	{
+		/**
+		 * Reference sequence of the first position covered by the node.
+		 */
+		uint32_t startChromId  = 0;
+		/**
+		 * First position covered by the node.
+		 */
+		uint32_t start         = 0;
+		/**
+		 * Reference sequence of the last position covered by the node.
+		 */
+		uint32_t endChromId    = 0;
+		/**
+		 * Position following the last one covered by the node.
+		 */
+		uint32_t end           = 0;
+		/**
+		 * Index of the first child in the level below, or of the first
+		 * section for leaves.
+		 */
+		uint64_t firstChild    = 0;
+		/**
+		 * Number of children.
+		 */
+		uint64_t childrenCount = 0;
+	};
+
+	/**
+	 * Path to the bigWig file.
+	 */
+	fs::path              path_;
+	/**
+	 * Encoded chromosome tree.
+	 */
+	const std::string*    chromTree_        = nullptr;
+	/**
+	 * Number of compressed bytes buffered before they are written.
+	 */
+	uint64_t              bufferedBytes_    = 0;
+	/**
+	 * Flag which is true once the file has been created.
+	 */
+	bool                  isCreated_        = false;
+	/**
+	 * Number of bytes of the file written so far, placeholders included.
+	 */
+	uint64_t              fileSize_         = 0;
+	/**
+	 * Size of the largest uncompressed section.
+	 */
+	uint64_t              maxSectionBytes_  = 0;
+	/**
+	 * Number of bases covered by the runs.
+	 */
+	uint64_t              basesCovered_     = 0;
+	/**
+	 * Lowest value of the runs.
+	 */
+	double                minValue_         = 0.0;
+	/**
+	 * Highest value of the runs.
+	 */
+	double                maxValue_         = 0.0;
+	/**
+	 * Sum of the values of every covered base.
+	 */
+	double                sumValues_        = 0.0;
+	/**
+	 * Sum of the squared values of every covered base.
+	 */
+	double                sumSquaredValues_ = 0.0;
+	/**
+	 * Reference sequence of the current section.
+	 */
+	uint32_t              chromId_          = 0;
+	/**
+	 * Runs of the current section.
+	 */
+	std::vector<Item_>    items_;
+	/**
+	 * Compressed sections waiting to be written.
+	 */
+	std::string           buffer_;
+	/**
+	 * Buffer sections are encoded in before compression.
+	 */
+	std::string           section_;
+	/**
+	 * Locations of the written sections.
+	 */
+	std::vector<Section_> sections_;
+
+	/**
+	 * \brief Append a little-endian value to a buffer.
+	 *
+	 * \param buffer is the buffer.
+	 * \param value is the value.
+	 */
+	template <typename T>
+	static inline void
+	append_ (std::string& buffer,
+	         T value)
+	{
+		buffer.append(reinterpret_cast<const char*>(&value),
+		              sizeof(value));
+	}
+
+	/**
+	 * \brief Append a key of the chromosome tree, padded with zeros.
+	 *
+	 * \param buffer is the buffer.
+	 * \param key is the name of the reference sequence.
+	 * \param keySize is the size of the keys.
+	 */
+	static inline void
+	appendKey_ (std::string& buffer,
+	            const std::string& key,
+	            uint64_t keySize)
+	{
+		buffer.append(key);
+		buffer.append(keySize - key.size(),
+		              '\0');
+	}
+
+	/**
+	 * \brief Compute the offset of the number of sections, which precedes
+	 * the sections.
+	 *
+	 * \return the offset of the data.
+	 */
+	inline uint64_t
+	dataOffset_ () const noexcept
+	{
+		return CHROM_TREE_OFFSET + chromTree_->size();
+	}
+
+	/**
+	 * \brief Compress the current section to the buffer.
+	 */
+	inline void
+	closeSection_ ()
+	{
+		if (items_.empty())
+		{
+			return;
+		}
+		section_.clear();
+		append_<uint32_t>(section_,
+		                  chromId_);
+		append_<uint32_t>(section_,
+		                  items_.front().start);
+		append_<uint32_t>(section_,
+		                  items_.back().end);
+		append_<uint32_t>(section_,
+		                  0);
+		append_<uint32_t>(section_,
+		                  0);
+		append_<uint8_t>(section_,
+		                 1);
+		append_<uint8_t>(section_,
+		                 0);
+		append_<uint16_t>(section_,
+		                  items_.size());
+		for (const auto& i : items_)
+		{
+			append_<uint32_t>(section_,
+			                  i.start);
+			append_<uint32_t>(section_,
+			                  i.end);
+			append_<float>(section_,
+			               i.value);
+		}
+
+		uLongf   compressedSize = compressBound(section_.size());
+		uint64_t offset         = buffer_.size();
+
+		buffer_.resize(offset + compressedSize);
+		if (compress2(reinterpret_cast<Bytef*>(&buffer_[offset]),
+		              &compressedSize,
+		              reinterpret_cast<const Bytef*>(section_.data()),
+		              section_.size(),
+		              Z_DEFAULT_COMPRESSION) != Z_OK)
+		{
+			throw std::runtime_error("cannot compress a bigWig section");
+		}
+		buffer_.resize(offset + compressedSize);
+		sections_.push_back({chromId_,
+		                     items_.front().start,
+		                     items_.back().end,
+		                     fileSize_ + offset,
+		                     compressedSize});
+		maxSectionBytes_ = std::max<uint64_t>(maxSectionBytes_,
+		                                      section_.size());
+		items_.clear();
+		if (buffer_.size() >= bufferedBytes_)
+		{
+			flushBuffer_();
+		}
+	}
+
+	/**
+	 * \brief Append the buffer to the file, creating it with placeholders
+	 * for the header, the summary and the number of sections if needed.
+	 */
+	inline void
+	flushBuffer_ ()
+	{
+		std::ofstream fileStream;
+
+		if (!isCreated_)
+		{
+			fileStream.open(path_,
+			                std::ios::binary | std::ios::trunc);
+			fileStream << std::string(CHROM_TREE_OFFSET,
+			                          '\0')
+			           << *chromTree_
+			           << std::string(8,
+			                          '\0');
+			isCreated_ = true;
+		}
+		else
+		{
+			fileStream.open(path_,
+			                std::ios::binary | std::ios::app);
+		}
+		fileStream.write(buffer_.data(),
+		                 buffer_.size());
+		if (!fileStream)
+		{
+			throw std::runtime_error("cannot write bigWig file " + path_.string());
+		}
+		fileSize_ += buffer_.size();
+		buffer_.clear();
+	}
+
+	/**
+	 * \brief Append the R-tree index of the sections to a buffer.
+	 *
+	 * Leaves list up to BLOCK_SIZE sections, and every upper level up to
+	 * BLOCK_SIZE nodes of the level below, up to a single root. Levels are
+	 * written from the root down.
+	 *
+	 * \param buffer is the buffer.
+	 * \param indexOffset is the offset of the index in the file.
+	 */
+	inline void
+	appendIndex_ (std::string& buffer,
+	              uint64_t indexOffset) const
+	{
+		std::vector<std::vector<Node_>> levels(1);
+
+		// Group the sections in leaves, then the nodes of every level in the
+		// nodes of the level above.
+		for (auto i = 0ul; i < sections_.size() || levels.front().empty(); i += BLOCK_SIZE)
+		{
+			Node_ node;
+
+			node.firstChild    = i;
+			node.childrenCount = std::min<uint64_t>(BLOCK_SIZE,
+			                                        sections_.size() - i);
+			if (node.childrenCount > 0)
+			{
+				node.startChromId = sections_[i].chromId;
+				node.start        = sections_[i].start;
+				node.endChromId   = sections_[i + node.childrenCount - 1].chromId;
+				node.end          = sections_[i + node.childrenCount - 1].end;
+			}
+			levels.front().emplace_back(node);
+		}
+		while (levels.back().size() > 1)
+		{
+			const auto         children = levels.back();
+			std::vector<Node_> parents;
+
+			for (auto i = 0ul; i < children.size(); i += BLOCK_SIZE)
+			{
+				Node_ node;
+
+				node.firstChild    = i;
+				node.childrenCount = std::min<uint64_t>(BLOCK_SIZE,
+				                                        children.size() - i);
+				node.startChromId  = children[i].startChromId;
+				node.start         = children[i].start;
+				node.endChromId    = children[i + node.childrenCount - 1].endChromId;
+				node.end           = children[i + node.childrenCount - 1].end;
+				parents.emplace_back(node);
+			}
+			levels.emplace_back(parents);
+		}
+
+		// Compute the offset of the first node of every level.
+		std::vector<uint64_t> levelOffsets(levels.size());
+		uint64_t              offset = indexOffset + 48;
+
+		for (auto l = levels.size(); l-- > 0;)
+		{
+			levelOffsets[l] = offset;
+			for (const auto& n : levels[l])
+			{
+				offset += 4 + n.childrenCount * (l == 0 ? 32 : 24);
+			}
+		}
+
+		const auto& root = levels.back().front();
+
+		append_<uint32_t>(buffer,
+		                  INDEX_MAGIC);
+		append_<uint32_t>(buffer,
+		                  BLOCK_SIZE);
+		append_<uint64_t>(buffer,
+		                  sections_.size());
+		append_<uint32_t>(buffer,
+		                  root.startChromId);
+		append_<uint32_t>(buffer,
+		                  root.start);
+		append_<uint32_t>(buffer,
+		                  root.endChromId);
+		append_<uint32_t>(buffer,
+		                  root.end);
+		append_<uint64_t>(buffer,
+		                  indexOffset);
+		append_<uint32_t>(buffer,
+		                  1);
+		append_<uint32_t>(buffer,
+		                  0);
+		for (auto l = levels.size(); l-- > 0;)
+		{
+			for (const auto& n : levels[l])
+			{
+				append_<uint8_t>(buffer,
+				                 l == 0 ? 1 : 0);
+				append_<uint8_t>(buffer,
+				                 0);
+				append_<uint16_t>(buffer,
+				                  n.childrenCount);
+				if (l == 0)
+				{
+					for (auto i = n.firstChild; i < n.firstChild + n.childrenCount; i++)
+					{
+						append_<uint32_t>(buffer,
+						                  sections_[i].chromId);
+						append_<uint32_t>(buffer,
+						                  sections_[i].start);
+						append_<uint32_t>(buffer,
+						                  sections_[i].chromId);
+						append_<uint32_t>(buffer,
+						                  sections_[i].end);
+						append_<uint64_t>(buffer,
+						                  sections_[i].offset);
+						append_<uint64_t>(buffer,
+						                  sections_[i].size);
+					}
+					continue;
+				}
+
+				// The children of consecutive nodes are consecutive, so the
+				// offset of a child follows from the sizes of the ones before.
+				uint64_t childOffset = levelOffsets[l - 1];
+
+				for (auto i = 0ul; i < n.firstChild; i++)
+				{
+					childOffset += 4 + levels[l - 1][i].childrenCount * (l == 1 ? 32 : 24);
+				}
+				for (auto i = n.firstChild; i < n.firstChild + n.childrenCount; i++)
+				{
+					const auto& child = levels[l - 1][i];
+
+					append_<uint32_t>(buffer,
+					                  child.startChromId);
+					append_<uint32_t>(buffer,
+					                  child.start);
+					append_<uint32_t>(buffer,
+					                  child.endChromId);
+					append_<uint32_t>(buffer,
+					                  child.end);
+					append_<uint64_t>(buffer,
+					                  childOffset);
+					childOffset += 4 + child.childrenCount * (l == 1 ? 32 : 24);
+				}
+			}
+		}
+	}
+};
+
+} // sctools
+
+#endif // SCTOOLS_INCLUDE_SCTOOLS_BIGWIG_WRITER_H
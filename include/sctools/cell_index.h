@@ -0,0 +1,674 @@
+/**
+ * \file   include/sctools/cell_index.h
+ * \author Elena Grassi
+ * \author Marilisa Montemurro
+ * \author Emanuele Parisi
+ * \date   February, 2019
+ *
+ * File containing the index mapping every barcode of a BAM file to the BGZF
+ * blocks storing its records.
+ */
+
+#ifndef SCTOOLS_INCLUDE_SCTOOLS_CELL_INDEX_H
+#define SCTOOLS_INCLUDE_SCTOOLS_CELL_INDEX_H
+
+#include <algorithm>
+#include <cstdint>
+#include <experimental/filesystem>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "bam_record_view.h"
+#include "bam_scanner.h"
+#include "bgzf.h"
+#include "compression_backend.h"
+
+namespace fs = std::experimental::filesystem;
+
+namespace sctools
+{
+
+/**
+ * \brief Class mapping every barcode of a BAM file to the BGZF blocks its
+ * records start in.
+ *
+ * The index lists the blocks at least one record starts in, along with the
+ * position of the first such record, and stores the blocks of every barcode
+ * as runs of consecutive entries of that list, delta and varint encoded. The
+ * runs of a set of barcodes give the virtual offset ranges holding all their
+ * records, so that they are extracted by decompressing only those blocks.
+ * The index is stored in a sidecar file next to the BAM file, and bound to
+ * its size and modification time.
+ */
+class CellIndex
+{
+
+public:
+
+	/**
+	 * Class constructor.
+	 */
+	CellIndex () = default;
+
+	/**
+	 * \brief Class copy constructor.
+	 *
+	 * \param other is the object the current instance is initialized from.
+	 */
+	CellIndex (const CellIndex& other) = delete;
+
+	/**
+	 * \brief Class copy assignment operator.
+	 *
+	 * \param other is the object the current instance is initialized from.
+	 * \return a reference to the assigned object.
+	 */
+	CellIndex&
+	operator= (const CellIndex& other) = delete;
+
+	/**
+	 * \brief Compute the path of the sidecar file of a BAM file.
+	 *
+	 * \param alignmentsPath is the path to the BAM file.
+	 * \return the path to its index.
+	 */
+	static inline fs::path
+	getSidecarPath (const fs::path& alignmentsPath)
+	{
+		auto indexPath = alignmentsPath;
+
+		indexPath += ".sci";
+
+		return indexPath;
+	}
+
+	/**
+	 * \brief Empty the index.
+	 */
+	inline void
+	reset () noexcept
+	{
+		sourceSize_ = 0;
+		sourceTime_ = 0;
+		blockOffsets_.clear();
+		firstRecords_.clear();
+		runs_.clear();
+	}
+
+	/**
+	 * \brief Build the index of a BAM file, scanning its records in
+	 * parallel.
+	 *
+	 * \param alignmentsPath is the path to the BAM file.
+	 * \param backendType is the deflate implementation used for
+	 * decompressing.
+	 * \param extractBarcode is called as extractBarcode(record, barcode) for
+	 * every record, and sets the barcode to the empty string if the record
+	 * has none. Records without barcode are not indexed.
+	 */
+	template <typename TExtractor>
+	inline void
+	build (const fs::path& alignmentsPath,
+	       CompressionBackendType backendType,
+	       TExtractor&& extractBarcode)
+	{
+		BamScanner                  scanner;
+		std::vector<ThreadIndex_>   threads(BamScanner::getThreadsCount());
+		std::vector<uint64_t>       blocks;
+		std::vector<uint64_t>       indices;
+		std::vector<BlockStart_>    starts;
+
+		reset();
+		scanner.configure(backendType);
+		scanner.scanWithOffsets(alignmentsPath,
+		                        [&threads, &extractBarcode] (const BamRecordView& record,
+		                                                     uint64_t virtualOffset,
+		                                                     uint64_t threadIndex)
+		                        {
+			                        auto& thread = threads[threadIndex];
+			                        auto  block  = virtualOffset >> 16;
+
+			                        // Every thread visits its records in file
+			                        // order, so blocks only grow.
+			                        if (thread.starts.empty() || thread.starts.back().offset != block)
+			                        {
+				                        thread.starts.push_back({block,
+				                                                 virtualOffset & 0xffff});
+			                        }
+			                        extractBarcode(record,
+			                                       thread.barcode);
+			                        if (thread.barcode.empty())
+			                        {
+				                        return;
+			                        }
+
+			                        auto& posting = thread.postings[thread.barcode];
+
+			                        if (posting.encoded.empty() || posting.lastBlock != block)
+			                        {
+				                        putVarint_(posting.encoded,
+				                                   block - posting.lastBlock);
+				                        posting.lastBlock = block;
+			                        }
+		                        });
+		bindSource_(alignmentsPath);
+
+		// List the blocks records start in, with the first record starting
+		// in every block.
+		for (auto& t : threads)
+		{
+			starts.insert(starts.end(),
+			              t.starts.begin(),
+			              t.starts.end());
+			t.starts.clear();
+		}
+		std::sort(starts.begin(),
+		          starts.end(),
+		          [] (const BlockStart_& lhs,
+		              const BlockStart_& rhs)
+		          {
+			          return lhs.offset < rhs.offset || (lhs.offset == rhs.offset && lhs.record < rhs.record);
+		          });
+		for (const auto& s : starts)
+		{
+			if (blockOffsets_.empty() || blockOffsets_.back() != s.offset)
+			{
+				blockOffsets_.emplace_back(s.offset);
+				firstRecords_.emplace_back(s.record);
+			}
+		}
+
+		// Merge the blocks every thread has seen for a barcode, and encode
+		// them as runs of consecutive entries of the blocks list.
+		for (auto& t : threads)
+		{
+			for (auto& p : t.postings)
+			{
+				if (runs_.count(p.first) > 0)
+				{
+					continue;
+				}
+				blocks.clear();
+				for (auto& o : threads)
+				{
+					auto postingIt = o.postings.find(p.first);
+
+					if (postingIt != o.postings.end())
+					{
+						decodeDeltas_(postingIt->second.encoded,
+						              blocks);
+					}
+				}
+				std::sort(blocks.begin(),
+				          blocks.end());
+				blocks.erase(std::unique(blocks.begin(),
+				                         blocks.end()),
+				             blocks.end());
+				indices.clear();
+				for (auto b : blocks)
+				{
+					indices.emplace_back(std::lower_bound(blockOffsets_.begin(),
+					                                      blockOffsets_.end(),
+					                                      b) - blockOffsets_.begin());
+				}
+				encodeRuns_(indices,
+				            runs_[p.first]);
+			}
+		}
+	}
+
+	/**
+	 * \brief Write the index to a file.
+	 *
+	 * \param indexPath is the path to the index file.
+	 */
+	inline void
+	save (const fs::path& indexPath) const
+	{
+		std::string   content(magic_());
+		std::ofstream indexWriter(indexPath,
+		                          std::ios::binary);
+		uint64_t      previous = 0;
+
+		putVarint_(content,
+		           sourceSize_);
+		putVarint_(content,
+		           sourceTime_);
+		putVarint_(content,
+		           blockOffsets_.size());
+		for (auto i = 0ul; i < blockOffsets_.size(); i++)
+		{
+			putVarint_(content,
+			           blockOffsets_[i] - previous);
+			putVarint_(content,
+			           firstRecords_[i]);
+			previous = blockOffsets_[i];
+		}
+		putVarint_(content,
+		           runs_.size());
+		for (const auto& r : runs_)
+		{
+			putVarint_(content,
+			           r.first.size());
+			content += r.first;
+			putVarint_(content,
+			           r.second.size());
+			content += r.second;
+		}
+		indexWriter.write(content.data(),
+		                  content.size());
+		if (!indexWriter)
+		{
+			throw std::runtime_error("cannot write the cell index '" +
+			                         indexPath.string() +
+			                         "'");
+		}
+	}
+
+	/**
+	 * \brief Read the index of a BAM file.
+	 *
+	 * \param indexPath is the path to the index file.
+	 * \param alignmentsPath is the path to the BAM file, which must not have
+	 * changed since the index was built.
+	 */
+	inline void
+	load (const fs::path& indexPath,
+	      const fs::path& alignmentsPath)
+	{
+		std::ifstream indexReader(indexPath,
+		                          std::ios::binary);
+		std::string   content;
+		uint64_t      cursor = magic_().size();
+		uint64_t      count  = 0;
+		uint64_t      size   = 0;
+		uint64_t      offset = 0;
+
+		reset();
+		if (!indexReader)
+		{
+			throw std::runtime_error("cannot open the cell index '" +
+			                         indexPath.string() +
+			                         "'; build it with --build-index");
+		}
+		content.assign(std::istreambuf_iterator<char>(indexReader),
+		               std::istreambuf_iterator<char>());
+		if (content.compare(0,
+		                    magic_().size(),
+		                    magic_()) != 0)
+		{
+			throw std::runtime_error("'" +
+			                         indexPath.string() +
+			                         "' is not a cell index");
+		}
+		bindSource_(alignmentsPath);
+		if (getVarint_(content,
+		               cursor) != sourceSize_ || getVarint_(content,
+		                                                    cursor) != sourceTime_)
+		{
+			throw std::runtime_error("the cell index '" +
+			                         indexPath.string() +
+			                         "' is older than '" +
+			                         alignmentsPath.string() +
+			                         "'; build it again with --build-index");
+		}
+		count = getVarint_(content,
+		                   cursor);
+		for (auto i = 0ul; i < count; i++)
+		{
+			offset += getVarint_(content,
+			                     cursor);
+			blockOffsets_.emplace_back(offset);
+			firstRecords_.emplace_back(getVarint_(content,
+			                                      cursor));
+		}
+		count = getVarint_(content,
+		                   cursor);
+		for (auto i = 0ul; i < count; i++)
+		{
+			std::string barcode;
+
+			size    = getVarint_(content,
+			                     cursor);
+			barcode = getBytes_(content,
+			                    cursor,
+			                    size);
+			size    = getVarint_(content,
+			                     cursor);
+			runs_.emplace(std::move(barcode),
+			              getBytes_(content,
+			                        cursor,
+			                        size));
+		}
+	}
+
+	/**
+	 * \brief Access the number of blocks records start in.
+	 *
+	 * \return the number of indexed blocks.
+	 */
+	inline uint64_t
+	getBlocksCount () const noexcept
+	{
+		return blockOffsets_.size();
+	}
+
+	/**
+	 * \brief Access the number of indexed barcodes.
+	 *
+	 * \return the number of barcodes.
+	 */
+	inline uint64_t
+	getBarcodesCount () const noexcept
+	{
+		return runs_.size();
+	}
+
+	/**
+	 * \brief Compute the ranges holding every record of a set of barcodes.
+	 *
+	 * Ranges also hold the records of other barcodes sharing their blocks.
+	 *
+	 * \param barcodes are the barcodes. Barcodes missing from the index have
+	 * no record, and are ignored.
+	 * \return the ranges, sorted and disjoint.
+	 */
+	inline std::vector<BgzfRange>
+	getRanges (const std::vector<std::string>& barcodes) const
+	{
+		std::vector<std::pair<uint64_t, uint64_t>> runs;
+		std::vector<BgzfRange>                     ranges;
+
+		for (const auto& b : barcodes)
+		{
+			auto runsIt = runs_.find(b);
+
+			if (runsIt != runs_.end())
+			{
+				decodeRuns_(runsIt->second,
+				            runs);
+			}
+		}
+		std::sort(runs.begin(),
+		          runs.end());
+
+		// Runs of entries which are adjacent in the blocks list are read in a
+		// single pass, since no record starts in between.
+		for (auto i = 0ul; i < runs.size();)
+		{
+			auto first = runs[i].first;
+			auto last  = runs[i].second;
+
+			for (i++; i < runs.size() && runs[i].first <= last; i++)
+			{
+				last = std::max(last,
+				                runs[i].second);
+			}
+			ranges.push_back({(blockOffsets_[first] << 16) | firstRecords_[first],
+			                  (blockOffsets_[last - 1] + 1) << 16});
+		}
+
+		return ranges;
+	}
+
+private:
+	/**
+	 * \brief Struct storing the first record starting in a block.
+	 */
+	struct BlockStart_
+	{
+		/**
+		 * Offset of the block in the compressed file.
+		 */
+		uint64_t offset;
+		/**
+		 * Offset of the record in the decompressed block.
+		 */
+		uint64_t record;
+	};
+
+	/**
+	 * \brief Struct storing the blocks a barcode has been seen in by a
+	 * thread.
+	 */
+	struct Posting_
+	{
+		/**
+		 * Offset of the last block.
+		 */
+		uint64_t    lastBlock = 0;
+		/**
+		 * Differences between the offsets of consecutive blocks, varint
+		 * encoded.
+		 */
+		std::string encoded;
+	};
+
+	/**
+	 * \brief Struct storing what a thread has seen while building the index.
+	 */
+	struct ThreadIndex_
+	{
+		/**
+		 * Blocks the records of the thread start in.
+		 */
+		std::vector<BlockStart_>                  starts;
+		/**
+		 * Blocks of every barcode.
+		 */
+		std::unordered_map<std::string, Posting_> postings;
+		/**
+		 * Barcode of the current record.
+		 */
+		std::string                               barcode;
+	};
+
+	/**
+	 * Size of the indexed file.
+	 */
+	uint64_t                                     sourceSize_ = 0;
+	/**
+	 * Modification time of the indexed file.
+	 */
+	uint64_t                                     sourceTime_ = 0;
+	/**
+	 * Offsets of the blocks records start in, in the compressed file.
+	 */
+	std::vector<uint64_t>                        blockOffsets_;
+	/**
+	 * Offset of the first record starting in every block, in the
+	 * decompressed block.
+	 */
+	std::vector<uint64_t>                        firstRecords_;
+	/**
+	 * Runs of blocks of every barcode, as varint encoded pairs made of the
+	 * distance from the end of the previous run and the length of the run.
+	 */
+	std::unordered_map<std::string, std::string> runs_;
+
+	/**
+	 * \brief Access the leading bytes of every index file.
+	 *
+	 * \return the bytes identifying index files.
+	 */
+	static inline const std::string&
+	magic_ () noexcept
+	{
+		static const std::string magic("SCTCIDX\1",
+		                               8);
+
+		return magic;
+	}
+
+	/**
+	 * \brief Record the size and the modification time of the indexed file.
+	 *
+	 * \param alignmentsPath is the path to the indexed file.
+	 */
+	inline void
+	bindSource_ (const fs::path& alignmentsPath)
+	{
+		sourceSize_ = fs::file_size(alignmentsPath);
+		sourceTime_ = fs::last_write_time(alignmentsPath).time_since_epoch().count();
+	}
+
+	/**
+	 * \brief Append an unsigned integer, 7 bits per byte.
+	 *
+	 * \param sink is the string the integer is appended to.
+	 * \param value is the integer.
+	 */
+	static inline void
+	putVarint_ (std::string& sink,
+	            uint64_t value)
+	{
+		while (value >= 0x80)
+		{
+			sink.push_back(static_cast<char>(value | 0x80));
+			value >>= 7;
+		}
+		sink.push_back(static_cast<char>(value));
+	}
+
+	/**
+	 * \brief Read an unsigned integer, 7 bits per byte.
+	 *
+	 * \param source is the string the integer is read from.
+	 * \param cursor is the position of the integer, moved past it.
+	 * \return the integer.
+	 */
+	static inline uint64_t
+	getVarint_ (const std::string& source,
+	            uint64_t& cursor)
+	{
+		uint64_t value = 0;
+
+		for (auto shift = 0u; shift < 64; shift += 7)
+		{
+			if (cursor >= source.size())
+			{
+				throw std::runtime_error("truncated cell index");
+			}
+
+			auto byte = static_cast<uint8_t>(source[cursor++]);
+
+			value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+			if (byte < 0x80)
+			{
+				return value;
+			}
+		}
+		throw std::runtime_error("malformed cell index");
+	}
+
+	/**
+	 * \brief Read a sequence of bytes.
+	 *
+	 * \param source is the string the bytes are read from.
+	 * \param cursor is the position of the bytes, moved past them.
+	 * \param size is the number of bytes.
+	 * \return the bytes.
+	 */
+	static inline std::string
+	getBytes_ (const std::string& source,
+	           uint64_t& cursor,
+	           uint64_t size)
+	{
+		if (size > source.size() - cursor)
+		{
+			throw std::runtime_error("truncated cell index");
+		}
+		cursor += size;
+
+		return source.substr(cursor - size,
+		                     size);
+	}
+
+	/**
+	 * \brief Decode the block offsets seen by a thread for a barcode.
+	 *
+	 * \param encoded are the varint encoded differences between offsets.
+	 * \param blocks are appended the block offsets.
+	 */
+	static inline void
+	decodeDeltas_ (const std::string& encoded,
+	               std::vector<uint64_t>& blocks)
+	{
+		uint64_t cursor = 0;
+		uint64_t block  = 0;
+
+		while (cursor < encoded.size())
+		{
+			block += getVarint_(encoded,
+			                    cursor);
+			blocks.emplace_back(block);
+		}
+	}
+
+	/**
+	 * \brief Encode sorted entries of the blocks list as runs.
+	 *
+	 * \param indices are the entries, sorted and distinct.
+	 * \param encoded is set to the varint encoded runs.
+	 */
+	static inline void
+	encodeRuns_ (const std::vector<uint64_t>& indices,
+	             std::string& encoded)
+	{
+		uint64_t previousEnd = 0;
+
+		encoded.clear();
+		for (auto i = 0ul; i < indices.size();)
+		{
+			auto first = indices[i];
+
+			for (i++; i < indices.size() && indices[i] == indices[i - 1] + 1; i++)
+			{
+			}
+			putVarint_(encoded,
+			           first - previousEnd);
+			putVarint_(encoded,
+			           indices[i - 1] + 1 - first);
+			previousEnd = indices[i - 1] + 1;
+		}
+	}
+
+	/**
+	 * \brief Decode the runs of a barcode.
+	 *
+	 * \param encoded are the varint encoded runs.
+	 * \param runs are appended the runs, as the entry of their first block
+	 * and the entry past their last block.
+	 */
+	inline void
+	decodeRuns_ (const std::string& encoded,
+	             std::vector<std::pair<uint64_t, uint64_t>>& runs) const
+	{
+		uint64_t cursor = 0;
+		uint64_t end    = 0;
+
+		while (cursor < encoded.size())
+		{
+			auto first = end + getVarint_(encoded,
+			                              cursor);
+
+			end = first + getVarint_(encoded,
+			                         cursor);
+			if (first >= end || end > blockOffsets_.size())
+			{
+				throw std::runtime_error("malformed cell index");
+			}
+			runs.emplace_back(first,
+			                  end);
+		}
+	}
+};
+
+} // sctools
+
+#endif // SCTOOLS_INCLUDE_SCTOOLS_CELL_INDEX_H
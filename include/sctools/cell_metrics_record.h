@@ -13,11 +13,12 @@
 #define SCTOOLS_INCLUDE_SCTOOLS_CELL_METRICS_RECORD_H
 
 #include <experimental/filesystem>
-#include <fstream>
 #include <string>
 #include <tuple>
 #include <vector>
 
+#include "delimited_reader.h"
+
 namespace fs = std::experimental::filesystem;
 
 namespace sctools
@@ -28,6 +29,50 @@ namespace sctools
  */
 class CellMetricsRecord
 {
+	/**
+	 * Type of the fields of a per-cell metrics record.
+	 */
+	using TRecordCore = std::tuple<std::string,
+	                               uint64_t,
+	                               uint64_t,
+	                               uint64_t,
+	                               uint64_t,
+	                               uint64_t,
+	                               uint64_t,
+	                               double,
+	                               double,
+	                               uint64_t,
+	                               double,
+	                               double,
+	                               double,
+	                               double,
+	                               double,
+	                               int64_t,
+	                               bool,
+	                               bool>;
+
+	/**
+	 * Type of the reader of per-cell metrics files.
+	 */
+	using TReader = DelimitedReader<std::string,
+	                                uint64_t,
+	                                uint64_t,
+	                                uint64_t,
+	                                uint64_t,
+	                                uint64_t,
+	                                uint64_t,
+	                                double,
+	                                double,
+	                                uint64_t,
+	                                double,
+	                                double,
+	                                double,
+	                                double,
+	                                double,
+	                                int64_t,
+	                                bool,
+	                                bool>;
+
 public:
 
 	static constexpr std::size_t BARCODE                     = 0;
@@ -53,31 +98,44 @@ public:
 	 * \brief Static method for reading all the records stored in a 10X per-cell summary
 	 * metrics file at once.
 	 *
+	 * Columns are matched by name with the header of the file, so that their
+	 * order does not matter and only the barcode column is required. Files
+	 * with no header, such as plain or gzip-compressed barcodes.tsv
+	 * whitelists, are read by position.
+	 *
 	 * \param inputFilePath is the path to the file to be parsed.
 	 * \return the sequence of records read from the file.
 	 */
 	static inline std::vector<CellMetricsRecord>
-	readRecords (const fs::path& inputFilePath) noexcept
+	readRecords (const fs::path& inputFilePath)
 	{
-		std::ifstream                         inputFile;
-		std::string                           line;
+		TReader                        reader;
+		TRecordCore                    fields;
 		std::vector<CellMetricsRecord> records;
 
-		// Open input file stream and read the CSV file header.
-		inputFile.open(inputFilePath);
-		std::getline(inputFile,
-		             line);
-
-		// Read all the records one at a time.
-		while (!inputFile.eof())
+		reader.open(inputFilePath,
+		            {{{"barcode", true},
+		              {"cell_id", false},
+		              {"total_num_reads", false},
+		              {"num_unmapped_reads", false},
+		              {"num_lowmapq_reads", false},
+		              {"num_duplicate_reads", false},
+		              {"num_mapped_dedup_reads", false},
+		              {"frac_mapped_duplicates", false},
+		              {"effective_depth_of_coverage", false},
+		              {"effective_reads_per_1Mbp", false},
+		              {"raw_mapd", false},
+		              {"normalized_mapd", false},
+		              {"raw_dimapd", false},
+		              {"normalized_dimapd", false},
+		              {"mean_ploidy", false},
+		              {"ploidy_confidence", false},
+		              {"is_high_dimapd", false},
+		              {"is_noisy", false}}});
+		while (reader.read(fields))
 		{
-			std::getline(inputFile,
-			             line);
-			if (!line.empty()) {
-				records.emplace_back(line);
-			}
+			records.emplace_back(fields);
 		}
-		inputFile.close();
 
 		return records;
 	}
@@ -85,147 +143,11 @@ public:
 	/**
 	 * \brief Class constructor.
 	 *
-	 * Given the string representation of a per-cell metrics file record, parse it and
-	 * store each field in a class attribute.
-	 *
-	 * \param stringRecord is the line of the source file containing the information to
-	 * be parsed.
+	 * \param fields are the values of the fields of the record.
 	 */
-	explicit CellMetricsRecord (const std::string& stringRecord) noexcept
+	explicit CellMetricsRecord (const TRecordCore& fields) :
+		fields_(fields)
 	{
-		std::istringstream stringStream(stringRecord);
-		std::string        token;
-
-		// Parse field 0 : BARCODE
-		std::getline(stringStream,
-		             token,
-		             ',');
-		std::get<0>(fields_) = token;
-
-		// Parse field 1 : CELL_ID
-		std::getline(stringStream,
-		             token,
-		             ',');
-		std::get<1>(fields_) = std::strtoull(token.data(),
-		                                     nullptr,
-		                                     10);
-
-		// Parse field 2 : TOTAL_NUM_READ
-		std::getline(stringStream,
-		             token,
-		             ',');
-		std::get<2>(fields_) = std::strtoull(token.data(),
-		                                     nullptr,
-		                                     10);
-
-		// Parse field 3 : NUM_UNMAPPED_READS
-		std::getline(stringStream,
-		             token,
-		             ',');
-		std::get<3>(fields_) = std::strtoull(token.data(),
-		                                     nullptr,
-		                                     10);
-
-		// Parse field 4 : NUM_LOWMAPQ_READS
-		std::getline(stringStream,
-		             token,
-		             ',');
-		std::get<4>(fields_) = std::strtoull(token.data(),
-		                                     nullptr,
-		                                     10);
-
-		// Parse field 5 : NUM_DUPLICATE_READS
-		std::getline(stringStream,
-		             token,
-		             ',');
-		std::get<5>(fields_) = std::strtoull(token.data(),
-		                                     nullptr,
-		                                     10);
-
-		// Parse field 6 : NUM_MAPPED_DEDUP_READS
-		std::getline(stringStream,
-		             token,
-		             ',');
-		std::get<6>(fields_) = std::strtoull(token.data(),
-		                                     nullptr,
-		                                     10);
-
-		// Parse field 7 : FRAC_MAPPED_DUPLICATES
-		std::getline(stringStream,
-		             token,
-		             ',');
-		std::get<7>(fields_) = std::strtod(token.data(),
-		                                   nullptr);
-
-		// Parse field 8 : EFFECTIVE_DEPTH_OF_COVERAGE
-		std::getline(stringStream,
-		             token,
-		             ',');
-		std::get<8>(fields_) = std::strtod(token.data(),
-		                                   nullptr);
-
-		// Parse field 9 : EFFECTIVE_READS_PER_MBP
-		std::getline(stringStream,
-		             token,
-		             ',');
-		std::get<9>(fields_) = std::strtoull(token.data(),
-		                                     nullptr,
-		                                     10);
-
-		// Parse field 10 : RAW_MAPD
-		std::getline(stringStream,
-		             token,
-		             ',');
-		std::get<10>(fields_) = std::strtod(token.data(),
-		                                    nullptr);
-
-		// Parse field 11 : NORMALIZED_MAPD
-		std::getline(stringStream,
-		             token,
-		             ',');
-		std::get<11>(fields_) = std::strtod(token.data(),
-		                                    nullptr);
-
-		// Parse field 12 : RAW_DIMAPD
-		std::getline(stringStream,
-		             token,
-		             ',');
-		std::get<12>(fields_) = std::strtod(token.data(),
-		                                    nullptr);
-
-		// Parse field 13 : NORMALIZED_DIMAPD
-		std::getline(stringStream,
-		             token,
-		             ',');
-		std::get<13>(fields_) = std::strtod(token.data(),
-		                                    nullptr);
-
-		// Parse field 14 : MEAN_PLOIDY
-		std::getline(stringStream,
-		             token,
-		             ',');
-		std::get<14>(fields_) = std::strtod(token.data(),
-		                                   nullptr);
-
-		// Parse field 15 : PLOIDY_CONFIDENCE
-		std::getline(stringStream,
-		             token,
-		             ',');
-		std::get<15>(fields_) = std::strtoull(token.data(),
-		                                     nullptr,
-		                                     10);
-
-		// Parse field 16 : IS_HIGH_DIMAPD
-		std::getline(stringStream,
-		             token,
-		             ',');
-		std::get<16>(fields_) = (token != "0");
-
-		// Parse field 17 : IS_NOISY
-		std::getline(stringStream,
-		             token,
-		             ',');
-		std::get<17>(fields_) = (token != "0");
 	}
 
 	/**
@@ -242,25 +164,6 @@ public:
 
 private:
 
-	using TRecordCore = std::tuple<std::string,
-	                               uint64_t,
-	                               uint64_t,
-	                               uint64_t,
-	                               uint64_t,
-	                               uint64_t,
-	                               uint64_t,
-	                               double,
-	                               double,
-	                               uint64_t,
-	                               double,
-	                               double,
-	                               double,
-	                               double,
-	                               double,
-	                               uint64_t,
-	                               bool,
-	                               bool>;
-
 	/**
 	 * Tuple of types composing a per-cell metrics record.
 	 */
@@ -0,0 +1,379 @@
+/**
+ * \file   include/sctools/compression_backend.h
+ * \author Elena Grassi
+ * \author Marilisa Montemurro
+ * \author Emanuele Parisi
+ * \date   February, 2019
+ *
+ * File containing the deflate codecs used for compressing and decompressing
+ * BGZF blocks.
+ */
+
+#ifndef SCTOOLS_INCLUDE_SCTOOLS_COMPRESSION_BACKEND_H
+#define SCTOOLS_INCLUDE_SCTOOLS_COMPRESSION_BACKEND_H
+
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+#include <zlib.h>
+
+#ifdef SCTOOLS_WITH_LIBDEFLATE
+#include <libdeflate.h>
+#endif
+
+namespace sctools
+{
+
+/**
+ * \brief Enumeration of the available deflate implementations.
+ */
+enum class CompressionBackendType
+{
+	ZLIB,
+	LIBDEFLATE
+};
+
+/**
+ * \brief Interface of a raw deflate codec.
+ *
+ * A backend instance keeps its own codec state, so it must not be shared
+ * among threads running concurrently.
+ */
+class CompressionBackend
+{
+
+public:
+
+	/**
+	 * \brief Create a backend of the requested type.
+	 *
+	 * \param type is the deflate implementation to be used.
+	 * \param level is the compression level, from 0 (no compression) to 9
+	 * (best compression).
+	 * \return the newly created backend.
+	 */
+	static inline std::unique_ptr<CompressionBackend>
+	create (CompressionBackendType type,
+	        int level);
+
+	/**
+	 * \brief Convert the name of a backend to its type.
+	 *
+	 * \param name is either "zlib" or "libdeflate".
+	 * \return the backend type corresponding to the name.
+	 */
+	static inline CompressionBackendType
+	parseType (const std::string& name)
+	{
+		if (name == "zlib")
+		{
+			return CompressionBackendType::ZLIB;
+		}
+		else if (name == "libdeflate")
+		{
+			return CompressionBackendType::LIBDEFLATE;
+		}
+		throw std::invalid_argument("unknown compression backend '" +
+		                            name +
+		                            "'");
+	}
+
+	/**
+	 * \brief Class destructor.
+	 */
+	virtual
+	~CompressionBackend () = default;
+
+	/**
+	 * \brief Compress a buffer as a raw deflate stream.
+	 *
+	 * \param source is the buffer to be compressed.
+	 * \param sourceSize is the size of the buffer to be compressed.
+	 * \param sink is the buffer the compressed stream is written to.
+	 * \param sinkCapacity is the size of the sink buffer.
+	 * \return the size of the compressed stream, or 0 if it does not fit the
+	 * sink buffer.
+	 */
+	virtual uint64_t
+	compress (const char* source,
+	          uint64_t sourceSize,
+	          char* sink,
+	          uint64_t sinkCapacity) noexcept = 0;
+
+	/**
+	 * \brief Decompress a raw deflate stream.
+	 *
+	 * \param source is the compressed stream.
+	 * \param sourceSize is the size of the compressed stream.
+	 * \param sink is the buffer the decompressed data are written to.
+	 * \param sinkSize is the exact size of the decompressed data.
+	 * \return true if the stream is decompressed successfully.
+	 */
+	virtual bool
+	decompress (const char* source,
+	            uint64_t sourceSize,
+	            char* sink,
+	            uint64_t sinkSize) noexcept = 0;
+
+	/**
+	 * \brief Update a CRC32 checksum.
+	 *
+	 * \param crc is the checksum computed so far.
+	 * \param data is the buffer to be checksummed.
+	 * \param size is the size of the buffer to be checksummed.
+	 * \return the updated checksum.
+	 */
+	virtual uint32_t
+	crc32 (uint32_t crc,
+	       const char* data,
+	       uint64_t size) noexcept = 0;
+};
+
+/**
+ * \brief Deflate codec based on zlib.
+ */
+class ZlibBackend : public CompressionBackend
+{
+
+public:
+
+	/**
+	 * \brief Class constructor.
+	 *
+	 * \param level is the compression level, from 0 to 9.
+	 */
+	explicit ZlibBackend (int level)
+	{
+		deflateStream_ = z_stream();
+		inflateStream_ = z_stream();
+		if (deflateInit2(&deflateStream_,
+		                 level,
+		                 Z_DEFLATED,
+		                 -15,
+		                 8,
+		                 Z_DEFAULT_STRATEGY) != Z_OK)
+		{
+			throw std::runtime_error("cannot initialize zlib deflate stream");
+		}
+		if (inflateInit2(&inflateStream_,
+		                 -15) != Z_OK)
+		{
+			deflateEnd(&deflateStream_);
+			throw std::runtime_error("cannot initialize zlib inflate stream");
+		}
+	}
+
+	/**
+	 * \brief Class copy constructor.
+	 *
+	 * \param other is the object the current instance is initialized from.
+	 */
+	ZlibBackend (const ZlibBackend& other) = delete;
+
+	/**
+	 * \brief Class copy assignment operator.
+	 *
+	 * \param other is the object the current instance is initialized from.
+	 * \return a reference to the assigned object.
+	 */
+	ZlibBackend&
+	operator= (const ZlibBackend& other) = delete;
+
+	/**
+	 * \brief Class destructor.
+	 */
+	~ZlibBackend () override
+	{
+		deflateEnd(&deflateStream_);
+		inflateEnd(&inflateStream_);
+	}
+
+	uint64_t
+	compress (const char* source,
+	          uint64_t sourceSize,
+	          char* sink,
+	          uint64_t sinkCapacity) noexcept override
+	{
+		deflateReset(&deflateStream_);
+		deflateStream_.next_in   = reinterpret_cast<Bytef*>(const_cast<char*>(source));
+		deflateStream_.avail_in  = static_cast<uInt>(sourceSize);
+		deflateStream_.next_out  = reinterpret_cast<Bytef*>(sink);
+		deflateStream_.avail_out = static_cast<uInt>(sinkCapacity);
+		if (deflate(&deflateStream_,
+		            Z_FINISH) != Z_STREAM_END)
+		{
+			return 0;
+		}
+
+		return deflateStream_.total_out;
+	}
+
+	bool
+	decompress (const char* source,
+	            uint64_t sourceSize,
+	            char* sink,
+	            uint64_t sinkSize) noexcept override
+	{
+		inflateReset(&inflateStream_);
+		inflateStream_.next_in   = reinterpret_cast<Bytef*>(const_cast<char*>(source));
+		inflateStream_.avail_in  = static_cast<uInt>(sourceSize);
+		inflateStream_.next_out  = reinterpret_cast<Bytef*>(sink);
+		inflateStream_.avail_out = static_cast<uInt>(sinkSize);
+
+		return inflate(&inflateStream_,
+		               Z_FINISH) == Z_STREAM_END &&
+		       inflateStream_.total_out == sinkSize;
+	}
+
+	uint32_t
+	crc32 (uint32_t crc,
+	       const char* data,
+	       uint64_t size) noexcept override
+	{
+		return ::crc32(crc,
+		               reinterpret_cast<const Bytef*>(data),
+		               static_cast<uInt>(size));
+	}
+
+private:
+	/**
+	 * Stream state used for compressing.
+	 */
+	z_stream deflateStream_;
+	/**
+	 * Stream state used for decompressing.
+	 */
+	z_stream inflateStream_;
+};
+
+#ifdef SCTOOLS_WITH_LIBDEFLATE
+
+/**
+ * \brief Deflate codec based on libdeflate.
+ */
+class LibdeflateBackend : public CompressionBackend
+{
+
+public:
+
+	/**
+	 * \brief Class constructor.
+	 *
+	 * \param level is the compression level, from 0 to 9.
+	 */
+	explicit LibdeflateBackend (int level)
+	{
+		compressor_   = libdeflate_alloc_compressor(level);
+		decompressor_ = libdeflate_alloc_decompressor();
+		if (compressor_ == nullptr || decompressor_ == nullptr)
+		{
+			libdeflate_free_compressor(compressor_);
+			libdeflate_free_decompressor(decompressor_);
+			throw std::runtime_error("cannot initialize libdeflate codecs");
+		}
+	}
+
+	/**
+	 * \brief Class copy constructor.
+	 *
+	 * \param other is the object the current instance is initialized from.
+	 */
+	LibdeflateBackend (const LibdeflateBackend& other) = delete;
+
+	/**
+	 * \brief Class copy assignment operator.
+	 *
+	 * \param other is the object the current instance is initialized from.
+	 * \return a reference to the assigned object.
+	 */
+	LibdeflateBackend&
+	operator= (const LibdeflateBackend& other) = delete;
+
+	/**
+	 * \brief Class destructor.
+	 */
+	~LibdeflateBackend () override
+	{
+		libdeflate_free_compressor(compressor_);
+		libdeflate_free_decompressor(decompressor_);
+	}
+
+	uint64_t
+	compress (const char* source,
+	          uint64_t sourceSize,
+	          char* sink,
+	          uint64_t sinkCapacity) noexcept override
+	{
+		return libdeflate_deflate_compress(compressor_,
+		                                   source,
+		                                   sourceSize,
+		                                   sink,
+		                                   sinkCapacity);
+	}
+
+	bool
+	decompress (const char* source,
+	            uint64_t sourceSize,
+	            char* sink,
+	            uint64_t sinkSize) noexcept override
+	{
+		return libdeflate_deflate_decompress(decompressor_,
+		                                     source,
+		                                     sourceSize,
+		                                     sink,
+		                                     sinkSize,
+		                                     nullptr) == LIBDEFLATE_SUCCESS;
+	}
+
+	uint32_t
+	crc32 (uint32_t crc,
+	       const char* data,
+	       uint64_t size) noexcept override
+	{
+		return libdeflate_crc32(crc,
+		                        data,
+		                        size);
+	}
+
+private:
+	/**
+	 * Codec state used for compressing.
+	 */
+	libdeflate_compressor*   compressor_;
+	/**
+	 * Codec state used for decompressing.
+	 */
+	libdeflate_decompressor* decompressor_;
+};
+
+#endif // SCTOOLS_WITH_LIBDEFLATE
+
+inline std::unique_ptr<CompressionBackend>
+CompressionBackend::create (CompressionBackendType type,
+                            int level)
+{
+	if (level < 0 || level > 9)
+	{
+		throw std::invalid_argument("compression level must be between 0 and 9");
+	}
+
+	switch (type)
+	{
+	case CompressionBackendType::ZLIB:
+		return std::unique_ptr<CompressionBackend>(new ZlibBackend(level));
+	case CompressionBackendType::LIBDEFLATE:
+#ifdef SCTOOLS_WITH_LIBDEFLATE
+		return std::unique_ptr<CompressionBackend>(new LibdeflateBackend(level));
+#else
+		throw std::invalid_argument("SCTools was built without libdeflate support");
+#endif
+	}
+
+	throw std::invalid_argument("unknown compression backend");
+}
+
+} // sctools
+
+#endif // SCTOOLS_INCLUDE_SCTOOLS_COMPRESSION_BACKEND_H
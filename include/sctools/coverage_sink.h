@@ -0,0 +1,665 @@
+/**
+ * \file   include/sctools/coverage_sink.h
+ * \author Elena Grassi
+ * \author Marilisa Montemurro
+ * \author Emanuele Parisi
+ * \date   February, 2019
+ *
+ * File containing the sink computing the coverage tracks of the
+ * de-multiplexed alignment records.
+ */
+
+#ifndef SCTOOLS_INCLUDE_SCTOOLS_COVERAGE_SINK_H
+#define SCTOOLS_INCLUDE_SCTOOLS_COVERAGE_SINK_H
+
+#include <algorithm>
+#include <experimental/filesystem>
+#include <fstream>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <queue>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <seqan/bam_io.h>
+
+#include "aligned_blocks.h"
+#include "alignments_reader.h"
+#include "bigwig_writer.h"
+#include "record_sink.h"
+
+namespace fs = std::experimental::filesystem;
+
+namespace sctools
+{
+
+/**
+ * \brief Enumeration of the formats of coverage tracks.
+ */
+enum class CoverageFormat
+{
+	BEDGRAPH,
+	BIGWIG
+};
+
+/**
+ * \brief Struct storing the configuration of a coverage sink.
+ */
+struct CoverageSinkConfig
+{
+	/**
+	 * Path to the directory where the coverage tracks are stored.
+	 */
+	fs::path                                     outputDirPath = ".";
+	/**
+	 * Format of the coverage tracks.
+	 */
+	CoverageFormat                               format        = CoverageFormat::BEDGRAPH;
+	/**
+	 * Map associating barcodes with the name of the group they are pooled
+	 * in. Barcodes without a group get a track of their own.
+	 */
+	std::unordered_map<std::string, std::string> groups;
+	/**
+	 * Number of bytes of every track buffered before they are appended to
+	 * its file.
+	 */
+	uint64_t                                     bufferedBytes = 64ull * 1024ull;
+
+	/**
+	 * \brief Parse the name of a coverage format.
+	 *
+	 * \param name is the name of the format, either "bedgraph" or "bigwig".
+	 * \return the corresponding format.
+	 */
+	static inline CoverageFormat
+	parseFormat (const std::string& name)
+	{
+		if (name == "bedgraph")
+		{
+			return CoverageFormat::BEDGRAPH;
+		}
+		if (name == "bigwig")
+		{
+			return CoverageFormat::BIGWIG;
+		}
+		throw std::invalid_argument("unknown coverage format '" + name + "'");
+	}
+};
+
+/**
+ * \brief Sink computing the read depth of every target barcode, or group,
+ * and forwarding the records to another sink.
+ *
+ * Records must be delivered in coordinate order. Every track is a sweep line
+ * over the aligned blocks of its records, skipping introns: the depth of the
+ * positions no further record can start before is final, and it is emitted
+ * as runs of equal depth. Only the blocks overlapping the current position
+ * are held, so that memory grows with the number of tracks and the depth, not
+ * with the length of the contigs. Positions with no coverage are omitted.
+ * Tracks are written as bedGraph or bigWig files, named after the barcode or
+ * the group, in the output directory.
+ */
+class CoverageSink : public RecordSink
+{
+
+public:
+
+	/**
+	 * Class constructor.
+	 */
+	CoverageSink () = default;
+
+	/**
+	 * \brief Class copy constructor.
+	 *
+	 * \param other is the object the current instance is initialized from.
+	 */
+	CoverageSink (const CoverageSink& other) = delete;
+
+	/**
+	 * \brief Class copy assignment operator.
+	 *
+	 * \param other is the object the current instance is initialized from.
+	 * \return a reference to the assigned object.
+	 */
+	CoverageSink&
+	operator= (const CoverageSink& other) = delete;
+
+	/**
+	 * \brief Initialize the sink.
+	 *
+	 * \param config is the configuration of the sink.
+	 * \param next is the sink records are forwarded to once they have been
+	 * accounted for, or nullptr for dropping them.
+	 */
+	inline void
+	configure (const CoverageSinkConfig& config,
+	           RecordSink* next = nullptr)
+	{
+		if (!fs::is_directory(config.outputDirPath))
+		{
+			throw std::invalid_argument("output directory '" +
+			                            config.outputDirPath.string() +
+			                            "' does not exist");
+		}
+		config_ = config;
+		next_   = next;
+	}
+
+	void
+	begin (const AlignmentsReader& reference,
+	       const std::vector<std::string>& barcodes) override
+	{
+		auto                                      context = reference.getContext();
+		const auto&                               names   = seqan::contigNames(context);
+		const auto&                               lengths = seqan::contigLengths(context);
+		std::unordered_map<std::string, uint64_t> groupIds;
+		std::vector<uint32_t>                     contigLengths;
+
+		contigNames_.clear();
+		for (auto i = 0ul; i < seqan::length(names); i++)
+		{
+			contigNames_.emplace_back(seqan::begin(names[i],
+			                                       seqan::Standard()),
+			                          seqan::end(names[i],
+			                                     seqan::Standard()));
+			contigLengths.emplace_back(lengths[i]);
+		}
+		if (config_.format == CoverageFormat::BIGWIG)
+		{
+			chromTree_ = BigWigWriter::encodeChromTree(contigNames_,
+			                                           contigLengths);
+		}
+
+		// Assign a track to every barcode, shared by the barcodes of the same
+		// group.
+		tracks_.clear();
+		trackIds_.clear();
+		for (const auto& b : barcodes)
+		{
+			auto groupIt = config_.groups.find(b);
+
+			if (groupIt != config_.groups.end())
+			{
+				auto groupId = groupIds.emplace(groupIt->second,
+				                                tracks_.size());
+
+				trackIds_.emplace_back(groupId.first->second);
+				if (!groupId.second)
+				{
+					continue;
+				}
+			}
+			else
+			{
+				trackIds_.emplace_back(tracks_.size());
+			}
+			tracks_.emplace_back(new Track_());
+			configureTrack_(*tracks_.back(),
+			                groupIt != config_.groups.end() ? groupIt->second : b);
+		}
+		touchedTracks_.clear();
+
+		if (next_ != nullptr)
+		{
+			next_->begin(reference,
+			             barcodes);
+		}
+	}
+
+	void
+	write (uint64_t cellId,
+	       const std::string& barcode,
+	       std::vector<seqan::BamAlignmentRecord>& records) override
+	{
+		auto& track = *tracks_[trackIds_[cellId]];
+
+		if (track.pending.empty())
+		{
+			touchedTracks_.emplace_back(trackIds_[cellId]);
+		}
+		for (const auto& r : records)
+		{
+			if (!seqan::hasFlagUnmapped(r))
+			{
+				forEachAlignedBlock(r,
+				                    [&track, &r] (int32_t start,
+				                                  int32_t end)
+				                    {
+					                    track.pending.push_back({r.rID,
+					                                             r.beginPos,
+					                                             start,
+					                                             end});
+				                    });
+			}
+		}
+		if (next_ != nullptr)
+		{
+			next_->write(cellId,
+			             barcode,
+			             records);
+		}
+	}
+
+	void
+	writeNoise (std::vector<seqan::BamAlignmentRecord>& records) override
+	{
+		if (next_ != nullptr)
+		{
+			next_->writeNoise(records);
+		}
+	}
+
+	void
+	endBatch () override
+	{
+		// The blocks of a group come from several cells, each one sorted on
+		// its own, so they are sorted together before sweeping over them.
+		for (auto t : touchedTracks_)
+		{
+			auto& track = *tracks_[t];
+
+			if (!std::is_sorted(track.pending.begin(),
+			                    track.pending.end()))
+			{
+				std::stable_sort(track.pending.begin(),
+				                 track.pending.end());
+			}
+			for (const auto& b : track.pending)
+			{
+				addBlock_(track,
+				          b);
+			}
+			track.pending.clear();
+		}
+		touchedTracks_.clear();
+		if (next_ != nullptr)
+		{
+			next_->endBatch();
+		}
+	}
+
+	void
+	finish (const DemultiplexerStatistics& statistics) override
+	{
+		endBatch();
+		for (auto& t : tracks_)
+		{
+			finishContig_(*t);
+			if (config_.format == CoverageFormat::BIGWIG)
+			{
+				t->bigWig.finish();
+			}
+			else
+			{
+				flushText_(*t);
+			}
+		}
+		if (next_ != nullptr)
+		{
+			next_->finish(statistics);
+		}
+	}
+
+	/**
+	 * \brief Access the number of tracks.
+	 *
+	 * \return the number of barcodes without group, plus the number of
+	 * groups.
+	 */
+	inline uint64_t
+	getTracksCount () const noexcept
+	{
+		return tracks_.size();
+	}
+
+	/**
+	 * \brief Access the path of a track.
+	 *
+	 * \param trackId is the index of the track.
+	 * \return the path of the file the track is written to.
+	 */
+	inline const fs::path&
+	getTrackPath (uint64_t trackId) const noexcept
+	{
+		return tracks_[trackId]->path;
+	}
+
+private:
+	/**
+	 * \brief Struct storing an aligned block of a record.
+	 */
+	struct Block_
+	{
+		/**
+		 * Reference sequence of the record.
+		 */
+		int32_t rID;
+		/**
+		 * Leftmost aligned position of the record, which gives the order of
+		 * the blocks.
+		 */
+		int32_t readStart;
+		/**
+		 * First position of the block.
+		 */
+		int32_t start;
+		/**
+		 * Position following the last one of the block.
+		 */
+		int32_t end;
+
+		/**
+		 * \brief Compare two blocks by record position.
+		 *
+		 * \param other is the block compared with the current one.
+		 * \return true if the record of the current block precedes the one
+		 * of the other block.
+		 */
+		inline bool
+		operator< (const Block_& other) const noexcept
+		{
+			return rID < other.rID || (rID == other.rID && readStart < other.readStart);
+		}
+	};
+
+	/**
+	 * \brief Struct storing the state of a track.
+	 */
+	struct Track_
+	{
+		/**
+		 * Path to the file of the track.
+		 */
+		fs::path                          path;
+		/**
+		 * Name of the track.
+		 */
+		std::string                       name;
+		/**
+		 * Blocks delivered during the current batch.
+		 */
+		std::vector<Block_>               pending;
+		/**
+		 * Reference sequence being swept, or -1 before the first block.
+		 */
+		int32_t                           rID       = -1;
+		/**
+		 * Leftmost aligned position of the last record swept.
+		 */
+		int32_t                           readStart = 0;
+		/**
+		 * Position up to which the depth has been emitted.
+		 */
+		int32_t                           position  = 0;
+		/**
+		 * Depth at the current position.
+		 */
+		int32_t                           depth     = 0;
+		/**
+		 * Depth changes beyond the current position, by increasing position.
+		 */
+		std::priority_queue<std::pair<int32_t, int32_t>,
+		                    std::vector<std::pair<int32_t, int32_t>>,
+		                    std::greater<std::pair<int32_t, int32_t>>> events;
+		/**
+		 * First position of the run being extended.
+		 */
+		int32_t                           runStart  = 0;
+		/**
+		 * Position following the last one of the run being extended.
+		 */
+		int32_t                           runEnd    = 0;
+		/**
+		 * Depth of the run being extended, or 0 if there is none.
+		 */
+		int32_t                           runDepth  = 0;
+		/**
+		 * Flag which is true once the file of the track has been created.
+		 */
+		bool                              isCreated = false;
+		/**
+		 * Text of the bedGraph runs waiting to be written.
+		 */
+		std::string                       text;
+		/**
+		 * Writer of the bigWig file.
+		 */
+		BigWigWriter                      bigWig;
+	};
+
+	/**
+	 * Configuration of the sink.
+	 */
+	CoverageSinkConfig                   config_;
+	/**
+	 * Sink records are forwarded to.
+	 */
+	RecordSink*                          next_ = nullptr;
+	/**
+	 * Names of the reference sequences.
+	 */
+	std::vector<std::string>             contigNames_;
+	/**
+	 * Chromosome tree shared by the bigWig files.
+	 */
+	std::string                          chromTree_;
+	/**
+	 * State of every track.
+	 */
+	std::vector<std::unique_ptr<Track_>> tracks_;
+	/**
+	 * Track of every target barcode.
+	 */
+	std::vector<uint64_t>                trackIds_;
+	/**
+	 * Tracks with blocks delivered during the current batch.
+	 */
+	std::vector<uint64_t>                touchedTracks_;
+
+	/**
+	 * \brief Initialize a track.
+	 *
+	 * \param track is the track.
+	 * \param name is the barcode or the group of the track.
+	 */
+	inline void
+	configureTrack_ (Track_& track,
+	                 const std::string& name)
+	{
+		track.name = name;
+		if (config_.format == CoverageFormat::BIGWIG)
+		{
+			track.path = config_.outputDirPath / (name + ".bw");
+			track.bigWig.configure(track.path,
+			                       &chromTree_,
+			                       config_.bufferedBytes);
+		}
+		else
+		{
+			track.path = config_.outputDirPath / (name + ".bedGraph");
+		}
+	}
+
+	/**
+	 * \brief Sweep a track up to the record of a block, and account for the
+	 * block.
+	 *
+	 * \param track is the track.
+	 * \param block is the block.
+	 */
+	inline void
+	addBlock_ (Track_& track,
+	           const Block_& block)
+	{
+		if (block.rID != track.rID)
+		{
+			if (block.rID < track.rID)
+			{
+				throw std::runtime_error("coverage tracks require coordinate-sorted input files");
+			}
+			finishContig_(track);
+			track.rID       = block.rID;
+			track.readStart = 0;
+			track.position  = 0;
+		}
+		if (block.readStart < track.readStart)
+		{
+			throw std::runtime_error("coverage tracks require coordinate-sorted input files");
+		}
+		track.readStart = block.readStart;
+		advance_(track,
+		         block.readStart);
+		track.events.emplace(block.start,
+		                     1);
+		track.events.emplace(block.end,
+		                     -1);
+	}
+
+	/**
+	 * \brief Emit the depth of a track up to a position, which no further
+	 * block can start before.
+	 *
+	 * \param track is the track.
+	 * \param position is the position.
+	 */
+	inline void
+	advance_ (Track_& track,
+	          int32_t position)
+	{
+		while (!track.events.empty() && track.events.top().first <= position)
+		{
+			auto event = track.events.top();
+
+			if (event.first > track.position)
+			{
+				emitRun_(track,
+				         track.position,
+				         event.first);
+				track.position = event.first;
+			}
+			track.depth += event.second;
+			track.events.pop();
+		}
+	}
+
+	/**
+	 * \brief Emit the depth of a track over a range, extending the current
+	 * run if it has the same depth and they are adjacent.
+	 *
+	 * \param track is the track.
+	 * \param start is the first position of the range.
+	 * \param end is the position following the last one of the range.
+	 */
+	inline void
+	emitRun_ (Track_& track,
+	          int32_t start,
+	          int32_t end)
+	{
+		if (track.depth == track.runDepth && start == track.runEnd)
+		{
+			track.runEnd = end;
+			return;
+		}
+		flushRun_(track);
+		track.runStart = start;
+		track.runEnd   = end;
+		track.runDepth = track.depth;
+	}
+
+	/**
+	 * \brief Write the current run of a track, unless its depth is 0.
+	 *
+	 * \param track is the track.
+	 */
+	inline void
+	flushRun_ (Track_& track)
+	{
+		if (track.runDepth == 0)
+		{
+			return;
+		}
+		if (config_.format == CoverageFormat::BIGWIG)
+		{
+			track.bigWig.add(track.rID,
+			                 track.runStart,
+			                 track.runEnd,
+			                 track.runDepth);
+		}
+		else
+		{
+			track.text.append(contigNames_[track.rID]);
+			track.text.push_back('\t');
+			track.text.append(std::to_string(track.runStart));
+			track.text.push_back('\t');
+			track.text.append(std::to_string(track.runEnd));
+			track.text.push_back('\t');
+			track.text.append(std::to_string(track.runDepth));
+			track.text.push_back('\n');
+			if (track.text.size() >= config_.bufferedBytes)
+			{
+				flushText_(track);
+			}
+		}
+		track.runDepth = 0;
+	}
+
+	/**
+	 * \brief Emit the remaining depth of the contig being swept by a track.
+	 *
+	 * \param track is the track.
+	 */
+	inline void
+	finishContig_ (Track_& track)
+	{
+		if (track.rID < 0)
+		{
+			return;
+		}
+		advance_(track,
+		         std::numeric_limits<int32_t>::max());
+		flushRun_(track);
+		track.runEnd = 0;
+		track.depth  = 0;
+	}
+
+	/**
+	 * \brief Append the buffered bedGraph runs of a track to its file,
+	 * creating it with a track line first if needed.
+	 *
+	 * \param track is the track.
+	 */
+	inline void
+	flushText_ (Track_& track)
+	{
+		std::ofstream fileStream;
+
+		if (!track.isCreated)
+		{
+			fileStream.open(track.path,
+			                std::ios::trunc);
+			fileStream << "track type=bedGraph name=\"" << track.name << "\"\n";
+			track.isCreated = true;
+		}
+		else
+		{
+			fileStream.open(track.path,
+			                std::ios::app);
+		}
+		fileStream << track.text;
+		if (!fileStream)
+		{
+			throw std::runtime_error("cannot write coverage track " + track.path.string());
+		}
+		track.text.clear();
+	}
+};
+
+} // sctools
+
+#endif // SCTOOLS_INCLUDE_SCTOOLS_COVERAGE_SINK_H
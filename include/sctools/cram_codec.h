@@ -0,0 +1,415 @@
+/**
+ * \file   include/sctools/cram_codec.h
+ * \author Elena Grassi
+ * \author Marilisa Montemurro
+ * \author Emanuele Parisi
+ * \date   February, 2019
+ *
+ * File containing facilities for reading and writing CRAM files through
+ * htslib, when SCTools is built with it.
+ */
+
+#ifndef SCTOOLS_INCLUDE_SCTOOLS_CRAM_CODEC_H
+#define SCTOOLS_INCLUDE_SCTOOLS_CRAM_CODEC_H
+
+#include <cstdint>
+#include <cstring>
+#include <experimental/filesystem>
+#include <stdexcept>
+#include <string>
+
+#include <seqan/basic.h>
+
+#ifdef SCTOOLS_WITH_HTSLIB
+#include <htslib/hts.h>
+#include <htslib/sam.h>
+#endif
+
+namespace fs = std::experimental::filesystem;
+
+namespace sctools
+{
+
+/**
+ * \brief Class providing facilities shared by CRAM readers and writers.
+ */
+class Cram
+{
+
+public:
+
+	/**
+	 * \brief Check if SCTools has been built with CRAM support.
+	 *
+	 * \return true if CRAM files can be read and written.
+	 */
+	static constexpr bool
+	isAvailable () noexcept
+	{
+#ifdef SCTOOLS_WITH_HTSLIB
+		return true;
+#else
+		return false;
+#endif
+	}
+
+	/**
+	 * \brief Check if a path names a CRAM file.
+	 *
+	 * \param path is the path to the file.
+	 * \return true if the file has the CRAM extension.
+	 */
+	static inline bool
+	isCramPath (const fs::path& path)
+	{
+		return path.extension() == ".cram";
+	}
+
+	/**
+	 * \brief Fail if SCTools has been built without CRAM support.
+	 *
+	 * \param path is the CRAM file which was to be read or written.
+	 */
+	static inline void
+	requireAvailable (const fs::path& path)
+	{
+		if (!isAvailable())
+		{
+			throw std::invalid_argument("cannot handle '" +
+			                            path.string() +
+			                            "': SCTools was built without CRAM "
+			                            "support");
+		}
+	}
+
+#ifdef SCTOOLS_WITH_HTSLIB
+	/**
+	 * \brief Re-encode a BAM file as a CRAM file.
+	 *
+	 * \param bamPath is the path to the BAM file.
+	 * \param cramPath is the path to the CRAM file to be written.
+	 * \param referencePath is the FASTA file of the reference sequences,
+	 * which must be indexed, or an empty path for resolving them from the
+	 * header and the REF_PATH environment variable.
+	 */
+	static inline void
+	encodeBam (const fs::path& bamPath,
+	           const fs::path& cramPath,
+	           const fs::path& referencePath)
+	{
+		samFile*   source = sam_open(bamPath.c_str(),
+		                             "r");
+		samFile*   sink   = nullptr;
+		sam_hdr_t* header = nullptr;
+		bam1_t*    record = bam_init1();
+		int        result = 0;
+		bool       failed = source == nullptr || record == nullptr;
+
+		if (!failed)
+		{
+			header = sam_hdr_read(source);
+			sink   = sam_open(cramPath.c_str(),
+			                  "wc");
+			failed = header == nullptr || sink == nullptr;
+		}
+		if (!failed && !referencePath.empty())
+		{
+			failed = hts_set_fai_filename(sink,
+			                              referencePath.c_str()) != 0;
+		}
+		if (!failed)
+		{
+			failed = sam_hdr_write(sink,
+			                       header) != 0;
+		}
+		while (!failed && (result = sam_read1(source,
+		                                      header,
+		                                      record)) >= 0)
+		{
+			failed = sam_write1(sink,
+			                    header,
+			                    record) < 0;
+		}
+		failed = failed || result < -1;
+
+		// Closing the CRAM file writes its last container, so it can fail
+		// as well.
+		if (sink != nullptr && sam_close(sink) < 0)
+		{
+			failed = true;
+		}
+		if (source != nullptr)
+		{
+			sam_close(source);
+		}
+		if (header != nullptr)
+		{
+			sam_hdr_destroy(header);
+		}
+		if (record != nullptr)
+		{
+			bam_destroy1(record);
+		}
+		if (failed)
+		{
+			throw std::runtime_error("cannot encode '" +
+			                         bamPath.string() +
+			                         "' as CRAM file '" +
+			                         cramPath.string() +
+			                         "'");
+		}
+	}
+#endif // SCTOOLS_WITH_HTSLIB
+};
+
+#ifdef SCTOOLS_WITH_HTSLIB
+
+/**
+ * \brief Class decoding the records of a CRAM file into their BAM binary
+ * representation.
+ *
+ * Containers are decoded by the thread pool of htslib, so slices are
+ * decompressed in parallel while records are consumed. Sequences are
+ * rebuilt against the reference FASTA file given at configuration time.
+ */
+class CramReader
+{
+
+public:
+
+	/**
+	 * \brief Class constructor.
+	 */
+	CramReader () = default;
+
+	/**
+	 * \brief Class copy constructor.
+	 *
+	 * \param other is the object the current instance is initialized from.
+	 */
+	CramReader (const CramReader& other) = delete;
+
+	/**
+	 * \brief Class copy assignment operator.
+	 *
+	 * \param other is the object the current instance is initialized from.
+	 * \return a reference to the assigned object.
+	 */
+	CramReader&
+	operator= (const CramReader& other) = delete;
+
+	/**
+	 * \brief Class destructor.
+	 */
+	~CramReader ()
+	{
+		reset();
+	}
+
+	/**
+	 * \brief Close the CRAM file.
+	 */
+	inline void
+	reset () noexcept
+	{
+		if (source_ != nullptr)
+		{
+			sam_close(source_);
+		}
+		if (header_ != nullptr)
+		{
+			sam_hdr_destroy(header_);
+		}
+		if (next_ != nullptr)
+		{
+			bam_destroy1(next_);
+		}
+		source_  = nullptr;
+		header_  = nullptr;
+		next_    = nullptr;
+		hasNext_ = false;
+	}
+
+	/**
+	 * \brief Open a CRAM file and read its header.
+	 *
+	 * \param sourcePath is the path to the CRAM file.
+	 * \param referencePath is the FASTA file of the reference sequences,
+	 * which must be indexed, or an empty path for resolving them from the
+	 * header and the REF_PATH environment variable.
+	 * \param threadsCount is the number of threads decoding containers.
+	 */
+	inline void
+	configure (const fs::path& sourcePath,
+	           const fs::path& referencePath,
+	           uint64_t threadsCount)
+	{
+		reset();
+		sourcePath_ = sourcePath;
+		source_     = sam_open(sourcePath.c_str(),
+		                       "r");
+		if (source_ == nullptr)
+		{
+			throw std::runtime_error("cannot open '" +
+			                         sourcePath.string() +
+			                         "'");
+		}
+		if (!referencePath.empty() && hts_set_fai_filename(source_,
+		                                                   referencePath.c_str()) != 0)
+		{
+			throw std::runtime_error("cannot load reference '" +
+			                         referencePath.string() +
+			                         "'");
+		}
+		if (threadsCount > 1)
+		{
+			hts_set_threads(source_,
+			                static_cast<int>(threadsCount));
+		}
+		header_ = sam_hdr_read(source_);
+		next_   = bam_init1();
+		if (header_ == nullptr || next_ == nullptr)
+		{
+			throw std::runtime_error("cannot read the header of '" +
+			                         sourcePath.string() +
+			                         "'");
+		}
+		advance_();
+	}
+
+	/**
+	 * \brief Access the header of the CRAM file.
+	 *
+	 * \return the header, as SAM text.
+	 */
+	inline seqan::CharString
+	getHeaderText () const
+	{
+		return seqan::CharString(sam_hdr_str(header_));
+	}
+
+	/**
+	 * \brief Check if every record of the CRAM file has been read.
+	 *
+	 * \return true if no record is left.
+	 */
+	inline bool
+	atEnd () const noexcept
+	{
+		return !hasNext_;
+	}
+
+	/**
+	 * \brief Read the next record, in its BAM binary representation.
+	 *
+	 * \param rawRecord is filled with the record, size included.
+	 */
+	inline void
+	read (seqan::CharString& rawRecord)
+	{
+		const auto& core      = next_->core;
+		uint32_t    nameSize  = core.l_qname - core.l_extranul;
+		uint32_t    blockSize = 32 + next_->l_data - core.l_extranul;
+
+		if (core.n_cigar > UINT16_MAX)
+		{
+			throw std::runtime_error("record of '" +
+			                         sourcePath_.string() +
+			                         "' has too many CIGAR operations");
+		}
+
+		// Fixed fields are laid out as in BAM files; the variable ones follow
+		// the read name, whose alignment padding is dropped.
+		seqan::resize(rawRecord,
+		              4 + blockSize);
+
+		auto* cursor = seqan::begin(rawRecord,
+		                            seqan::Standard());
+
+		cursor = put_<uint32_t>(cursor, blockSize);
+		cursor = put_<int32_t>(cursor, core.tid);
+		cursor = put_<int32_t>(cursor, static_cast<int32_t>(core.pos));
+		cursor = put_<uint8_t>(cursor, static_cast<uint8_t>(nameSize));
+		cursor = put_<uint8_t>(cursor, core.qual);
+		cursor = put_<uint16_t>(cursor, core.bin);
+		cursor = put_<uint16_t>(cursor, static_cast<uint16_t>(core.n_cigar));
+		cursor = put_<uint16_t>(cursor, core.flag);
+		cursor = put_<int32_t>(cursor, core.l_qseq);
+		cursor = put_<int32_t>(cursor, core.mtid);
+		cursor = put_<int32_t>(cursor, static_cast<int32_t>(core.mpos));
+		cursor = put_<int32_t>(cursor, static_cast<int32_t>(core.isize));
+		std::memcpy(cursor,
+		            next_->data,
+		            nameSize);
+		std::memcpy(cursor + nameSize,
+		            next_->data + core.l_qname,
+		            next_->l_data - core.l_qname);
+		advance_();
+	}
+
+private:
+	/**
+	 * Path to the CRAM file.
+	 */
+	fs::path   sourcePath_;
+	/**
+	 * Handle of the CRAM file.
+	 */
+	samFile*   source_  = nullptr;
+	/**
+	 * Header of the CRAM file.
+	 */
+	sam_hdr_t* header_  = nullptr;
+	/**
+	 * Next record to be read.
+	 */
+	bam1_t*    next_    = nullptr;
+	/**
+	 * Flag stating if the next record is available.
+	 */
+	bool       hasNext_ = false;
+
+	/**
+	 * \brief Decode the next record of the CRAM file.
+	 */
+	inline void
+	advance_ ()
+	{
+		auto result = sam_read1(source_,
+		                        header_,
+		                        next_);
+
+		if (result < -1)
+		{
+			throw std::runtime_error("cannot decode '" +
+			                         sourcePath_.string() +
+			                         "'");
+		}
+		hasNext_ = result >= 0;
+	}
+
+	/**
+	 * \brief Store a little-endian integer.
+	 *
+	 * \param cursor is the address the integer is stored at.
+	 * \param value is the integer.
+	 * \return the address past the integer.
+	 */
+	template <typename TValue>
+	static inline char*
+	put_ (char* cursor,
+	      TValue value) noexcept
+	{
+		std::memcpy(cursor,
+		            &value,
+		            sizeof(value));
+
+		return cursor + sizeof(value);
+	}
+};
+
+#endif // SCTOOLS_WITH_HTSLIB
+
+} // sctools
+
+#endif // SCTOOLS_INCLUDE_SCTOOLS_CRAM_CODEC_H
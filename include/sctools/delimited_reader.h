@@ -0,0 +1,649 @@
+/**
+ * \file   include/sctools/delimited_reader.h
+ * \author Elena Grassi
+ * \author Marilisa Montemurro
+ * \author Emanuele Parisi
+ * \date   February, 2019
+ *
+ * File containing the reader of CSV and TSV files, plain or gzip-compressed,
+ * into records whose columns are known at compile time.
+ */
+
+#ifndef SCTOOLS_INCLUDE_SCTOOLS_DELIMITED_READER_H
+#define SCTOOLS_INCLUDE_SCTOOLS_DELIMITED_READER_H
+
+#include <array>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <experimental/filesystem>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <zlib.h>
+
+namespace fs = std::experimental::filesystem;
+
+namespace sctools
+{
+
+/**
+ * \brief Struct describing a column of a delimited file.
+ */
+struct DelimitedColumn
+{
+	/**
+	 * Name of the column in the header of the file.
+	 */
+	const char* name;
+	/**
+	 * Flag which is true if every record must have a value for the column.
+	 */
+	bool        isRequired;
+};
+
+/**
+ * \brief Class reading the records of a comma- or tab-separated file, whose
+ * columns have the types given as template arguments.
+ *
+ * Columns are matched by name with the header of the file, when its first
+ * line names any of them, and by position otherwise, so that header-less
+ * files such as barcodes.tsv whitelists are read as well. The separator is a
+ * tab if the first line holds one, and a comma otherwise. Compressed files
+ * are inflated on the fly. Empty lines and lines starting with '#' are
+ * skipped.
+ *
+ * Values are parsed in place, with the parser of the type of their column
+ * chosen at compile time, and buffers are reused across records, so that
+ * reading a record allocates no memory beyond its string fields.
+ *
+ * \tparam TFields are the types of the columns, among std::string, integers,
+ * floating point numbers and bool.
+ */
+template <typename... TFields>
+class DelimitedReader
+{
+
+public:
+
+	/**
+	 * Number of columns of the records.
+	 */
+	static constexpr std::size_t COLUMNS_COUNT = sizeof...(TFields);
+
+	/**
+	 * Type of the records.
+	 */
+	using TRecord = std::tuple<TFields...>;
+
+	/**
+	 * Type of the description of the columns of the records.
+	 */
+	using TColumns = std::array<DelimitedColumn, sizeof...(TFields)>;
+
+	/**
+	 * \brief Class constructor.
+	 */
+	DelimitedReader () = default;
+
+	/**
+	 * \brief Class copy constructor.
+	 *
+	 * \param other is the object the current instance is initialized from.
+	 */
+	DelimitedReader (const DelimitedReader& other) = delete;
+
+	/**
+	 * \brief Class copy assignment operator.
+	 *
+	 * \param other is the object the current instance is initialized from.
+	 * \return a reference to the assigned object.
+	 */
+	DelimitedReader&
+	operator= (const DelimitedReader& other) = delete;
+
+	/**
+	 * \brief Class destructor.
+	 */
+	~DelimitedReader ()
+	{
+		close();
+	}
+
+	/**
+	 * \brief Open a file and match its columns.
+	 *
+	 * \param inputFilePath is the path to the file, plain or gzip-compressed.
+	 * \param columns is the description of the columns of the records.
+	 */
+	inline void
+	open (const fs::path& inputFilePath,
+	      const TColumns& columns)
+	{
+		close();
+		file_ = gzopen(inputFilePath.c_str(),
+		               "rb");
+		if (file_ == nullptr)
+		{
+			throw std::runtime_error("cannot open file '" +
+			                         inputFilePath.string() +
+			                         "'");
+		}
+		gzbuffer(file_,
+		         BUFFER_SIZE);
+		inputFilePath_ = inputFilePath;
+		columns_       = columns;
+		buffer_.resize(BUFFER_SIZE);
+		bufferPosition_ = 0;
+		bufferSize_     = 0;
+		lineNumber_     = 0;
+		hasPendingLine_ = false;
+		fieldIds_.fill(-1);
+
+		if (!readDataLine_())
+		{
+			return;
+		}
+		delimiter_ = line_.find('\t') != std::string::npos ? '\t' : ',';
+		splitLine_();
+
+		// The first line is a header if it names any column, and the first
+		// record otherwise.
+		for (auto i = 0ul; i < fields_.size(); i++)
+		{
+			for (const auto& c : columns_)
+			{
+				if (fieldEquals_(i,
+				                 c.name))
+				{
+					matchHeader_();
+					return;
+				}
+			}
+		}
+		for (auto i = 0ul; i < COLUMNS_COUNT; i++)
+		{
+			fieldIds_[i] = i;
+		}
+		hasPendingLine_ = true;
+	}
+
+	/**
+	 * \brief Close the file, if any.
+	 */
+	inline void
+	close () noexcept
+	{
+		if (file_ != nullptr)
+		{
+			gzclose(file_);
+			file_ = nullptr;
+		}
+	}
+
+	/**
+	 * \brief Read the next record.
+	 *
+	 * \param record is the record the values of the columns are stored in.
+	 * Columns with no value are value-initialized.
+	 * \return false if the end of the file has been reached.
+	 */
+	inline bool
+	read (TRecord& record)
+	{
+		if (hasPendingLine_)
+		{
+			hasPendingLine_ = false;
+		}
+		else
+		{
+			if (file_ == nullptr || !readDataLine_())
+			{
+				return false;
+			}
+			splitLine_();
+		}
+		parseColumns_(record,
+		              std::index_sequence_for<TFields...>());
+
+		return true;
+	}
+
+	/**
+	 * \brief Check if a column is in the file.
+	 *
+	 * \param columnId is the index of the column.
+	 * \return true if the header of the file names the column, or if the
+	 * file has no header.
+	 */
+	inline bool
+	hasColumn (std::size_t columnId) const noexcept
+	{
+		return fieldIds_[columnId] >= 0;
+	}
+
+	/**
+	 * \brief Access the number of the line read last.
+	 *
+	 * \return the 1-based number of the line of the last record.
+	 */
+	inline uint64_t
+	getLineNumber () const noexcept
+	{
+		return lineNumber_;
+	}
+
+private:
+	/**
+	 * Number of bytes read from the file at once.
+	 */
+	static constexpr uint64_t BUFFER_SIZE = 64ull * 1024ull;
+
+	/**
+	 * Handle of the file, inflating it if compressed.
+	 */
+	gzFile                                     file_           = nullptr;
+	/**
+	 * Path to the file.
+	 */
+	fs::path                                   inputFilePath_;
+	/**
+	 * Description of the columns of the records.
+	 */
+	TColumns                                   columns_;
+	/**
+	 * Field of every column, or -1 if the file does not have the column.
+	 */
+	std::array<int64_t, sizeof...(TFields)>    fieldIds_;
+	/**
+	 * Bytes read from the file.
+	 */
+	std::vector<char>                          buffer_;
+	/**
+	 * Position of the first byte of the buffer not consumed yet.
+	 */
+	uint64_t                                   bufferPosition_ = 0;
+	/**
+	 * Number of bytes in the buffer.
+	 */
+	uint64_t                                   bufferSize_     = 0;
+	/**
+	 * Line being parsed, whose separators are replaced by null characters.
+	 */
+	std::string                                line_;
+	/**
+	 * Offsets of the first and past-the-last characters of every field of
+	 * the line.
+	 */
+	std::vector<std::pair<uint64_t, uint64_t>> fields_;
+	/**
+	 * Character separating the fields.
+	 */
+	char                                       delimiter_      = ',';
+	/**
+	 * Number of the current line.
+	 */
+	uint64_t                                   lineNumber_     = 0;
+	/**
+	 * Flag which is true if the current line holds a record not read yet.
+	 */
+	bool                                       hasPendingLine_ = false;
+
+	/**
+	 * \brief Read the next line, without its line terminator.
+	 *
+	 * \return false if the end of the file has been reached.
+	 */
+	inline bool
+	readLine_ ()
+	{
+		line_.clear();
+		while (true)
+		{
+			if (bufferPosition_ == bufferSize_)
+			{
+				auto readBytes = gzread(file_,
+				                        buffer_.data(),
+				                        buffer_.size());
+
+				if (readBytes < 0)
+				{
+					throw std::runtime_error("cannot read file '" +
+					                         inputFilePath_.string() +
+					                         "'");
+				}
+				if (readBytes == 0)
+				{
+					if (line_.empty())
+					{
+						return false;
+					}
+					break;
+				}
+				bufferPosition_ = 0;
+				bufferSize_     = readBytes;
+			}
+
+			auto* begin   = buffer_.data() + bufferPosition_;
+			auto* newLine = static_cast<char*>(std::memchr(begin,
+			                                               '\n',
+			                                               bufferSize_ - bufferPosition_));
+
+			if (newLine != nullptr)
+			{
+				line_.append(begin,
+				             newLine);
+				bufferPosition_ = newLine - buffer_.data() + 1;
+				break;
+			}
+			line_.append(begin,
+			             bufferSize_ - bufferPosition_);
+			bufferPosition_ = bufferSize_;
+		}
+		if (!line_.empty() && line_.back() == '\r')
+		{
+			line_.pop_back();
+		}
+		lineNumber_ += 1;
+
+		return true;
+	}
+
+	/**
+	 * \brief Read the next line which is neither empty nor a comment.
+	 *
+	 * \return false if the end of the file has been reached.
+	 */
+	inline bool
+	readDataLine_ ()
+	{
+		while (readLine_())
+		{
+			if (!line_.empty() && line_.front() != '#')
+			{
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	/**
+	 * \brief Split the current line into its fields, removing the quotes
+	 * around them.
+	 */
+	inline void
+	splitLine_ ()
+	{
+		uint64_t start = 0;
+
+		fields_.clear();
+		while (true)
+		{
+			auto end = line_.find(delimiter_,
+			                      start);
+
+			if (end == std::string::npos)
+			{
+				end = line_.size();
+			}
+			else
+			{
+				line_[end] = '\0';
+			}
+			if (end - start >= 2 && line_[start] == '"' && line_[end - 1] == '"')
+			{
+				fields_.emplace_back(start + 1,
+				                     end - 1);
+			}
+			else
+			{
+				fields_.emplace_back(start,
+				                     end);
+			}
+			if (end == line_.size())
+			{
+				break;
+			}
+			start = end + 1;
+		}
+	}
+
+	/**
+	 * \brief Check if a field of the current line has a given value.
+	 *
+	 * \param fieldId is the index of the field.
+	 * \param value is the value.
+	 * \return true if the field holds the value.
+	 */
+	inline bool
+	fieldEquals_ (uint64_t fieldId,
+	              const char* value) const noexcept
+	{
+		auto length = fields_[fieldId].second - fields_[fieldId].first;
+
+		return std::strlen(value) == length && line_.compare(fields_[fieldId].first,
+		                                                     length,
+		                                                     value) == 0;
+	}
+
+	/**
+	 * \brief Match the columns with the fields of the header on the current
+	 * line.
+	 */
+	inline void
+	matchHeader_ ()
+	{
+		for (auto i = 0ul; i < COLUMNS_COUNT; i++)
+		{
+			for (auto j = 0ul; j < fields_.size(); j++)
+			{
+				if (fieldEquals_(j,
+				                 columns_[i].name))
+				{
+					fieldIds_[i] = j;
+					break;
+				}
+			}
+			if (fieldIds_[i] < 0 && columns_[i].isRequired)
+			{
+				throw std::invalid_argument("column '" +
+				                            std::string(columns_[i].name) +
+				                            "' is missing from the header of file '" +
+				                            inputFilePath_.string() +
+				                            "'");
+			}
+		}
+	}
+
+	/**
+	 * \brief Parse the fields of the current line into a record.
+	 *
+	 * \param record is the record.
+	 */
+	template <std::size_t... COLUMN_IDS>
+	inline void
+	parseColumns_ (TRecord& record,
+	               std::index_sequence<COLUMN_IDS...>)
+	{
+		using TExpander = int[];
+
+		(void) TExpander{0,
+		                 (parseColumn_<COLUMN_IDS>(std::get<COLUMN_IDS>(record)), 0)...};
+	}
+
+	/**
+	 * \brief Parse the field of a column of the current line.
+	 *
+	 * \tparam COLUMN_ID is the index of the column.
+	 * \param value is the value the field is parsed into.
+	 */
+	template <std::size_t COLUMN_ID,
+	          typename TValue>
+	inline void
+	parseColumn_ (TValue& value)
+	{
+		auto fieldId = fieldIds_[COLUMN_ID];
+
+		if (fieldId < 0 || static_cast<uint64_t>(fieldId) >= fields_.size())
+		{
+			if (fieldId >= 0 && columns_[COLUMN_ID].isRequired)
+			{
+				throw std::invalid_argument("line " +
+				                            std::to_string(lineNumber_) +
+				                            " of file '" +
+				                            inputFilePath_.string() +
+				                            "' has no '" +
+				                            columns_[COLUMN_ID].name +
+				                            "' field");
+			}
+			value = TValue();
+			return;
+		}
+
+		const char* begin = line_.data() + fields_[fieldId].first;
+		const char* end   = line_.data() + fields_[fieldId].second;
+
+		if (!parseValue_(begin,
+		                 end,
+		                 value))
+		{
+			throw std::invalid_argument("malformed '" +
+			                            std::string(columns_[COLUMN_ID].name) +
+			                            "' field at line " +
+			                            std::to_string(lineNumber_) +
+			                            " of file '" +
+			                            inputFilePath_.string() +
+			                            "'");
+		}
+	}
+
+	/**
+	 * \brief Parse a string field.
+	 *
+	 * \param begin is the first character of the field.
+	 * \param end is the character following the last one of the field.
+	 * \param value is the parsed value.
+	 * \return true.
+	 */
+	static inline bool
+	parseValue_ (const char* begin,
+	             const char* end,
+	             std::string& value)
+	{
+		value.assign(begin,
+		             end);
+
+		return true;
+	}
+
+	/**
+	 * \brief Parse a boolean field, which is false if empty, "0" or "false".
+	 *
+	 * \param begin is the first character of the field.
+	 * \param end is the character following the last one of the field.
+	 * \param value is the parsed value.
+	 * \return true.
+	 */
+	static inline bool
+	parseValue_ (const char* begin,
+	             const char* end,
+	             bool& value) noexcept
+	{
+		static const char* falseValues[] = {"0",
+		                                    "false",
+		                                    "False",
+		                                    "FALSE"};
+		auto               length        = static_cast<std::size_t>(end - begin);
+
+		value = length > 0;
+		for (auto f : falseValues)
+		{
+			if (std::strlen(f) == length && std::strncmp(begin,
+			                                              f,
+			                                              length) == 0)
+			{
+				value = false;
+			}
+		}
+
+		return true;
+	}
+
+	/**
+	 * \brief Parse an integer field, which is 0 if empty.
+	 *
+	 * \param begin is the first character of the field.
+	 * \param end is the character following the last one of the field.
+	 * \param value is the parsed value.
+	 * \return false if the field is not an integer.
+	 */
+	template <typename TValue>
+	static inline typename std::enable_if<std::is_integral<TValue>::value, bool>::type
+	parseValue_ (const char* begin,
+	             const char* end,
+	             TValue& value) noexcept
+	{
+		bool isNegative = std::is_signed<TValue>::value && begin != end && *begin == '-';
+
+		value = 0;
+		if (isNegative)
+		{
+			begin += 1;
+			if (begin == end)
+			{
+				return false;
+			}
+		}
+		for (; begin != end; begin++)
+		{
+			if (*begin < '0' || *begin > '9')
+			{
+				return false;
+			}
+			value = value * 10 + (*begin - '0');
+		}
+		if (isNegative)
+		{
+			value = -value;
+		}
+
+		return true;
+	}
+
+	/**
+	 * \brief Parse a floating point field, which is 0 if empty.
+	 *
+	 * \param begin is the first character of the field, which is followed by
+	 * a null character.
+	 * \param end is the character following the last one of the field.
+	 * \param value is the parsed value.
+	 * \return false if the field is not a number.
+	 */
+	template <typename TValue>
+	static inline typename std::enable_if<std::is_floating_point<TValue>::value, bool>::type
+	parseValue_ (const char* begin,
+	             const char* end,
+	             TValue& value) noexcept
+	{
+		char* parsedEnd = nullptr;
+
+		if (begin == end)
+		{
+			value = 0;
+			return true;
+		}
+		value = std::strtod(begin,
+		                    &parsedEnd);
+
+		return parsedEnd == end;
+	}
+};
+
+} // sctools
+
+#endif // SCTOOLS_INCLUDE_SCTOOLS_DELIMITED_READER_H
@@ -0,0 +1,1495 @@
+/**
+ * \file   include/sctools/demultiplexer.h
+ * \author Elena Grassi
+ * \author Marilisa Montemurro
+ * \author Emanuele Parisi
+ * \date   February, 2019
+ *
+ * File containing the barcode-based alignment records de-multiplexer.
+ */
+
+#ifndef SCTOOLS_INCLUDE_SCTOOLS_DEMULTIPLEXER_H
+#define SCTOOLS_INCLUDE_SCTOOLS_DEMULTIPLEXER_H
+
+#include <algorithm>
+#include <experimental/filesystem>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <seqan/bam_io.h>
+
+#include "alignments_merger.h"
+#include "alignments_reader.h"
+#include "barcode_lookup.h"
+#include "bam_record_view.h"
+#include "bam_scanner.h"
+#include "barcode_sketch.h"
+#include "cell_index.h"
+#include "cell_metrics_record.h"
+#include "compression_backend.h"
+#include "memory_tracker.h"
+#include "read_sampler.h"
+#include "record_filter.h"
+#include "record_sink.h"
+#include "sam_scanner.h"
+#include "umi_deduplicator.h"
+
+namespace fs = std::experimental::filesystem;
+
+namespace sctools
+{
+
+/**
+ * \brief Struct storing the configuration of a de-multiplexer.
+ */
+struct DemultiplexerConfig
+{
+	/**
+	 * Paths to the SAM, BAM or CRAM files containing the alignment records to
+	 * be de-multiplexed. All of them must share the same reference sequences.
+	 */
+	std::vector<fs::path>    alignmentsFilePaths;
+	/**
+	 * Flag which merges the records of multiple input files preserving their
+	 * coordinate order.
+	 */
+	bool                     coordinateMerge     = false;
+	/**
+	 * Barcodes to be de-multiplexed, without the "-1" suffix.
+	 */
+	std::vector<std::string> barcodes;
+	/**
+	 * Total number of reads of every barcode, used for downsampling. It is
+	 * either empty or as long as the barcodes list.
+	 */
+	std::vector<uint64_t>    expectedReads;
+	/**
+	 * Maximum number of alignment records loaded in main memory at once.
+	 */
+	uint64_t                 batchSize           = 1024ull * 1024ull;
+	/**
+	 * Expression alignment records must satisfy for being de-multiplexed.
+	 */
+	std::string              filterExpression;
+	/**
+	 * Minimum mapping quality of the records to be de-multiplexed.
+	 */
+	uint64_t                 minMappingQuality   = 0;
+	/**
+	 * Tags excluding the records they are present in.
+	 */
+	std::vector<std::string> forbiddenTags;
+	/**
+	 * Number of reads every cell is downsampled to, or 0 for keeping every
+	 * read. Downsampling requires the expected reads of every barcode.
+	 */
+	uint64_t                 targetReadsPerCell  = 0;
+	/**
+	 * Seed of the hash deciding which reads are kept when downsampling.
+	 */
+	uint64_t                 downsamplingSeed    = 0;
+	/**
+	 * Deflate implementation used for reading BAM files.
+	 */
+	CompressionBackendType   compressionBackend  = CompressionBackendType::ZLIB;
+	/**
+	 * Path to the FASTA file CRAM files are decoded against, or an empty path
+	 * for resolving it from their header.
+	 */
+	fs::path                 referenceFilePath;
+	/**
+	 * Number of noise barcodes tracked for finding the most frequent ones, or
+	 * 0 for not tracking them.
+	 */
+	uint64_t                 noiseSketchCapacity = BarcodeSketch::DEFAULT_CAPACITY;
+	/**
+	 * Flag which corrects raw barcodes differing by a single base from a
+	 * target barcode.
+	 */
+	bool                     correctBarcodes     = false;
+	/**
+	 * Lookup structures already built from the barcodes, or null for building
+	 * them when the de-multiplexer is configured. It must have been built for
+	 * correcting raw barcodes, if they are corrected.
+	 */
+	std::shared_ptr<const BarcodeLookup> barcodeLookup;
+	/**
+	 * Flag which keeps a single read for every molecule of every cell,
+	 * identified by its UMI, strand and unclipped 5' end. It requires
+	 * coordinate-sorted input files.
+	 */
+	bool                     deduplicateUmis     = false;
+	/**
+	 * Flag which merges the UMIs differing by a single base, when reads are
+	 * deduplicated.
+	 */
+	bool                     mergeUmiNeighbours  = false;
+	/**
+	 * Flag which samples the resident memory after every batch of records.
+	 */
+	bool                     sampleMemory        = false;
+	/**
+	 * Flag which reads only the blocks of the input BAM files holding records
+	 * of the target barcodes, as listed by the cell index next to every
+	 * file.
+	 */
+	bool                     useCellIndex        = false;
+
+	/**
+	 * \brief Load the target barcodes and their total number of reads from a
+	 * per-cell summary metrics CSV file.
+	 *
+	 * Files with no total number of reads, such as whitelists, leave the
+	 * expected reads empty.
+	 *
+	 * \param barcodeCSVPath is the CSV file containing the barcodes to be
+	 * de-multiplexed as first column, ended by the "-1" string.
+	 */
+	inline void
+	loadBarcodes (const fs::path& barcodeCSVPath)
+	{
+		MemoryScope scope(MemorySubsystem::METRICS);
+		auto        records = CellMetricsRecord::readRecords(barcodeCSVPath);
+
+		barcodes.clear();
+		expectedReads.clear();
+		for (auto&& r : records)
+		{
+			std::string rawBarcode = r.get<CellMetricsRecord::BARCODE>();
+
+			barcodes.emplace_back(rawBarcode.substr(0,
+			                                        rawBarcode.find_first_of('-')));
+			expectedReads.emplace_back(r.get<CellMetricsRecord::TOTAL_NUM_READS>());
+		}
+		if (std::all_of(expectedReads.begin(),
+		                expectedReads.end(),
+		                [] (uint64_t reads)
+		                {
+			                return reads == 0;
+		                }))
+		{
+			expectedReads.clear();
+		}
+	}
+};
+
+/**
+ * \brief Struct storing the outcome of a count-only run.
+ */
+struct CountStatistics
+{
+	/**
+	 * Number of records read from the input files.
+	 */
+	uint64_t                                          recordsCount        = 0;
+	/**
+	 * Number of records rejected by the filter.
+	 */
+	uint64_t                                          filteredCount       = 0;
+	/**
+	 * Number of records rejected by every predicate of the filter, sorted by
+	 * decreasing count.
+	 */
+	std::vector<std::pair<std::string, uint64_t>>     filterReasons;
+	/**
+	 * Number of records each target barcode would be de-multiplexed, indexed
+	 * as the barcodes list of the configuration.
+	 */
+	std::vector<uint64_t>                             cellCounts;
+	/**
+	 * Number of records whose barcode is not among the target ones.
+	 */
+	uint64_t                                          noiseCount          = 0;
+	/**
+	 * Number of records with neither the 'CB' nor the 'CR' tag.
+	 */
+	uint64_t                                          missingBarcodeCount = 0;
+	/**
+	 * Number of records of target barcodes dropped by downsampling.
+	 */
+	uint64_t                                          sampledOut          = 0;
+	/**
+	 * Number of records whose raw barcode has been corrected to a target one.
+	 */
+	uint64_t                                          correctedCount      = 0;
+	/**
+	 * Number of records whose raw barcode is equally close to several target
+	 * ones.
+	 */
+	uint64_t                                          ambiguousCount      = 0;
+	/**
+	 * Number of records whose raw barcode is not close to any target one.
+	 */
+	uint64_t                                          uncorrectableCount  = 0;
+	/**
+	 * Number of records accepted by the filter for every barcode, target or
+	 * not.
+	 */
+	std::unordered_map<std::string, uint64_t>         barcodeCounts;
+};
+
+/**
+ * \brief Class splitting the alignment records of one or more files by their
+ * barcode, and delivering them to a record sink.
+ *
+ * Errors are reported by throwing std::invalid_argument, for inconsistent
+ * configurations, and std::runtime_error, for failures while reading or
+ * writing records.
+ */
+class Demultiplexer
+{
+
+public:
+
+	/**
+	 * Class constructor.
+	 */
+	Demultiplexer () = default;
+
+	/**
+	 * \brief Class copy constructor.
+	 *
+	 * \param other is the object the current instance is initialized from.
+	 */
+	Demultiplexer (const Demultiplexer& other) = delete;
+
+	/**
+	 * \brief Class copy assignment operator.
+	 *
+	 * \param other is the object the current instance is initialized from.
+	 * \return a reference to the assigned object.
+	 */
+	Demultiplexer&
+	operator= (const Demultiplexer& other) = delete;
+
+	/**
+	 * \brief Initialize the de-multiplexer, opening the input files and
+	 * compiling the filter.
+	 *
+	 * \param config is the configuration of the de-multiplexer.
+	 */
+	inline void
+	configure (const DemultiplexerConfig& config)
+	{
+		if (config.alignmentsFilePaths.empty())
+		{
+			throw std::invalid_argument("no alignment file to be de-multiplexed");
+		}
+		if (config.batchSize == 0)
+		{
+			throw std::invalid_argument("the batch size must be positive");
+		}
+		if (!config.expectedReads.empty() && config.expectedReads.size() != config.barcodes.size())
+		{
+			throw std::invalid_argument("expected reads must be given for every barcode");
+		}
+		if (config.targetReadsPerCell > 0 && config.expectedReads.size() != config.barcodes.size())
+		{
+			throw std::invalid_argument("downsampling requires the total number of reads of every barcode");
+		}
+		if (config.deduplicateUmis && config.alignmentsFilePaths.size() > 1 && !config.coordinateMerge)
+		{
+			throw std::invalid_argument("UMI deduplication of multiple input files requires "
+			                            "merging them by coordinate");
+		}
+		if (config.useCellIndex && config.correctBarcodes)
+		{
+			throw std::invalid_argument("raw barcodes cannot be corrected when reading "
+			                            "through the cell index");
+		}
+		if (config.barcodeLookup &&
+		    (config.barcodeLookup->barcodesCount != config.barcodes.size() ||
+		     (config.correctBarcodes && !config.barcodes.empty() && !config.barcodeLookup->corrector.isEnabled())))
+		{
+			throw std::invalid_argument("the barcode lookup does not match the barcodes "
+			                            "to be de-multiplexed");
+		}
+		config_ = config;
+
+		// Open the input files, sizing the look-ahead buffer of every input
+		// so that all of them together hold about one batch of records.
+		MemoryScope readerScope(MemorySubsystem::READER);
+
+		reader_.configure(config_.alignmentsFilePaths,
+		                  config_.coordinateMerge,
+		                  std::max<uint64_t>(config_.batchSize / config_.alignmentsFilePaths.size(),
+		                                     1),
+		                  config_.compressionBackend,
+		                  config_.referenceFilePath);
+
+		// Read only the blocks holding records of the target barcodes, if
+		// the input files are indexed.
+		if (config_.useCellIndex)
+		{
+			for (auto i = 0ul; i < config_.alignmentsFilePaths.size(); i++)
+			{
+				const auto& p = config_.alignmentsFilePaths[i];
+				CellIndex   index;
+
+				index.load(CellIndex::getSidecarPath(p),
+				           p);
+				reader_.setRanges(i,
+				                  index.getRanges(config_.barcodes));
+			}
+		}
+
+		// Compile the filter expression, now that the reference sequences are
+		// known, and let the readers drop the records it rejects.
+		filter_.configure(buildFilterExpression_(),
+		                  extractContigNames_(reader_.getReference()));
+		reader_.setFilter(&filter_);
+
+		// Assign an identifier and a sampling threshold to every target
+		// barcode, indexing the neighbours of the target barcodes if raw
+		// barcodes are corrected. Lookup structures built already are shared.
+		MemoryScope barcodeMapScope(MemorySubsystem::BARCODE_MAP);
+
+		sampler_.configure(config_.targetReadsPerCell,
+		                   config_.downsamplingSeed);
+		lookup_ = config_.barcodeLookup ?
+		          config_.barcodeLookup :
+		          BarcodeLookup::build(config_.barcodes,
+		                               config_.correctBarcodes);
+		thresholds_.clear();
+		for (auto i = 0ul; i < config_.barcodes.size(); i++)
+		{
+			thresholds_.emplace_back(config_.expectedReads.empty() ?
+			                         ReadSampler::KEEP_ALL :
+			                         sampler_.threshold(config_.expectedReads[i]));
+		}
+		statistics_ = DemultiplexerStatistics();
+		statistics_.cellCounts.assign(config_.barcodes.size(),
+		                              0);
+		noiseSketch_.configure(config_.noiseSketchCapacity);
+
+		if (config_.deduplicateUmis)
+		{
+			deduplicator_.configure(config_.mergeUmiNeighbours);
+		}
+		else
+		{
+			deduplicator_.reset();
+		}
+	}
+
+	/**
+	 * \brief Access the reader of the first input file, which provides the
+	 * header and the context of the records.
+	 *
+	 * \return a reference to the reader.
+	 */
+	inline const AlignmentsReader&
+	getReference () const noexcept
+	{
+		return reader_.getReference();
+	}
+
+	/**
+	 * \brief Access the number of compressed bytes read from the input BAM
+	 * files.
+	 *
+	 * \return the size of the BGZF blocks read so far.
+	 */
+	inline uint64_t
+	getCompressedBytesRead () const noexcept
+	{
+		return reader_.getCompressedBytesRead();
+	}
+
+	/**
+	 * \brief Access the target barcodes.
+	 *
+	 * \return the target barcodes, indexed by cell identifier.
+	 */
+	inline const std::vector<std::string>&
+	getBarcodes () const noexcept
+	{
+		return config_.barcodes;
+	}
+
+	/**
+	 * \brief Access the outcome of the last run.
+	 *
+	 * \return the statistics of the last run.
+	 */
+	inline const DemultiplexerStatistics&
+	getStatistics () const noexcept
+	{
+		return statistics_;
+	}
+
+	/**
+	 * \brief Access the summary of the barcodes of noise records, filled by
+	 * both run() and count().
+	 *
+	 * Records with no barcode are not accounted for.
+	 *
+	 * \return a reference to the noise barcodes sketch.
+	 */
+	inline const BarcodeSketch&
+	getNoiseSketch () const noexcept
+	{
+		return noiseSketch_;
+	}
+
+	/**
+	 * \brief Read every record of the input files, and deliver it to the sink
+	 * according to its barcode.
+	 *
+	 * The input files are consumed, so the de-multiplexer must be configured
+	 * again before running it another time. SAM lines are forwarded to sinks
+	 * accepting them verbatim, unless reads are deduplicated or several input
+	 * files are merged by coordinate.
+	 *
+	 * \param sink is the destination of the de-multiplexed records.
+	 * \return the statistics of the run.
+	 */
+	inline const DemultiplexerStatistics&
+	run (RecordSink& sink)
+	{
+		if (canForwardText_(sink))
+		{
+			return runText_(sink);
+		}
+
+		MemoryScope                                         scope(MemorySubsystem::BATCH_BUFFER);
+		std::vector<seqan::BamAlignmentRecord>              buffer(config_.batchSize);
+		std::vector<std::vector<seqan::BamAlignmentRecord>> cellBuffers(config_.barcodes.size());
+		std::vector<seqan::BamAlignmentRecord>              noiseBuffer;
+		std::vector<uint64_t>                               touchedCells;
+		uint64_t                                            loadedRecords = 0;
+		uint64_t                                            batchesCount  = 0;
+		std::string                                         umi;
+
+		// Records emitted by the deduplicator are taken away into the buffers
+		// of their cells.
+		auto emit = [this, &cellBuffers, &touchedCells] (uint64_t cellId,
+		                                                 seqan::BamAlignmentRecord& record)
+		{
+			if (cellBuffers[cellId].empty())
+			{
+				touchedCells.emplace_back(cellId);
+			}
+			cellBuffers[cellId].emplace_back(std::move(record));
+			statistics_.cellCounts[cellId] += 1;
+		};
+
+		{
+			MemoryScope writersScope(MemorySubsystem::WRITERS);
+
+			sink.begin(reader_.getReference(),
+			           config_.barcodes);
+		}
+		do
+		{
+			// Load a batch of alignment records and group them by barcode.
+			// The fields of the buffered records grow while they are read, so
+			// their storage is attributed to the reader.
+			{
+				MemoryScope readerScope(MemorySubsystem::READER);
+
+				loadedRecords = reader_.read(buffer.begin(),
+				                             buffer.end());
+			}
+			statistics_.recordsCount += loadedRecords;
+
+			// The copies of the records grouped by barcode are attributed to
+			// the barcode map.
+			MemoryScope barcodeMapScope(MemorySubsystem::BARCODE_MAP);
+
+			for (auto i = 0ull; i < loadedRecords; i++)
+			{
+				auto barcode = extractBarcode(buffer[i],
+				                              deduplicator_.isEnabled() ? &umi : nullptr);
+				auto cellId  = 0ul;
+
+				if (!lookup_->cellIds.find(barcode,
+				                           cellId) &&
+				    !correctRawBarcode_(buffer[i],
+				                        barcode,
+				                        cellId,
+				                        statistics_.correctedCount,
+				                        statistics_.ambiguousCount,
+				                        statistics_.uncorrectableCount))
+				{
+					if (!barcode.empty())
+					{
+						noiseSketch_.add(barcode);
+					}
+					noiseBuffer.emplace_back(buffer[i]);
+					continue;
+				}
+
+				// Drop the reads exceeding the target depth of the cell.
+				if (!sampler_.keep(seqan::begin(buffer[i].qName,
+				                                seqan::Standard()),
+				                   seqan::length(buffer[i].qName),
+				                   thresholds_[cellId]))
+				{
+					statistics_.sampledOut += 1;
+					continue;
+				}
+
+				// Collapse the reads of the same molecule, which are delivered
+				// once no further read can join it.
+				if (deduplicator_.isEnabled())
+				{
+					deduplicator_.add(cellId,
+					                  buffer[i],
+					                  umi,
+					                  emit);
+					continue;
+				}
+				if (cellBuffers[cellId].empty())
+				{
+					touchedCells.emplace_back(cellId);
+				}
+				cellBuffers[cellId].emplace_back(buffer[i]);
+				statistics_.cellCounts[cellId] += 1;
+			}
+			if (loadedRecords == 0)
+			{
+				deduplicator_.flush(emit);
+			}
+
+			// Deliver the batch to the sink.
+			MemoryScope writersScope(MemorySubsystem::WRITERS);
+
+			for (auto cellId : touchedCells)
+			{
+				sink.write(cellId,
+				           config_.barcodes[cellId],
+				           cellBuffers[cellId]);
+				cellBuffers[cellId].clear();
+			}
+			statistics_.noiseCount += noiseBuffer.size();
+			sink.writeNoise(noiseBuffer);
+			sink.endBatch();
+			touchedCells.clear();
+			noiseBuffer.clear();
+			if (config_.sampleMemory && loadedRecords > 0)
+			{
+				batchesCount += 1;
+				MemoryTracker::sample("batch " + std::to_string(batchesCount));
+			}
+		}
+		while (loadedRecords > 0);
+
+		statistics_.duplicatesCount = deduplicator_.getDuplicatesCount();
+		statistics_.missingUmiCount = deduplicator_.getMissingUmiCount();
+
+		MemoryScope writersScope(MemorySubsystem::WRITERS);
+
+		sink.finish(statistics_);
+		if (config_.sampleMemory)
+		{
+			MemoryTracker::sample("finish");
+		}
+
+		return statistics_;
+	}
+
+	/**
+	 * \brief Count how many records every barcode would get, without writing
+	 * any of them.
+	 *
+	 * BAM files are scanned on their binary representation: only the fixed
+	 * fields and the optional fields of every record are accessed, and both
+	 * decompression and counting run in parallel over chunks of BGZF blocks.
+	 * SAM files are mapped in memory and their lines counted in parallel,
+	 * while CRAM files are read sequentially. Like run(), it consumes the
+	 * input files.
+	 *
+	 * \return the statistics of the count.
+	 */
+	inline const CountStatistics&
+	count ()
+	{
+		MemoryScope                 scope(MemorySubsystem::BARCODE_MAP);
+		BamScanner                  scanner;
+		SamScanner                  samScanner;
+		std::vector<CountCounters_> counters(BamScanner::getThreadsCount());
+
+		for (auto& c : counters)
+		{
+			c.filtered.assign(filter_.getProgramSize(),
+			                  0);
+			c.cells.assign(config_.barcodes.size(),
+			               0);
+			c.noiseSketch.configure(config_.noiseSketchCapacity);
+		}
+		{
+			MemoryScope readerScope(MemorySubsystem::READER);
+
+			scanner.configure(config_.compressionBackend);
+			samScanner.configure(extractContigNames_(reader_.getReference()));
+		}
+		for (const auto& p : config_.alignmentsFilePaths)
+		{
+			// Decompression buffers are attributed to the reader, and the
+			// barcode counts of the worker threads to the barcode map.
+			MemoryScope readerScope(MemorySubsystem::READER);
+
+			if (p.extension() == ".bam")
+			{
+				scanner.scan(p,
+				             [this, &counters] (const BamRecordView& record,
+				                                uint64_t threadIndex)
+				             {
+					             MemoryScope recordScope(MemorySubsystem::BARCODE_MAP);
+
+					             countRecord_(record,
+					                          counters[threadIndex]);
+				             });
+			}
+			else if (p.extension() == ".sam")
+			{
+				samScanner.scan(p,
+				                [this, &counters] (const BamRecordView& record,
+				                                   uint64_t threadIndex)
+				                {
+					                MemoryScope recordScope(MemorySubsystem::BARCODE_MAP);
+
+					                countRecord_(record,
+					                             counters[threadIndex]);
+				                });
+			}
+			else
+			{
+				countSequentially_(p,
+				                   counters.front());
+			}
+			if (config_.sampleMemory)
+			{
+				MemoryTracker::sample(p.filename().string());
+			}
+		}
+		mergeCounters_(counters);
+
+		return countStatistics_;
+	}
+
+	/**
+	 * \brief Access the outcome of the last count.
+	 *
+	 * \return the statistics of the last count.
+	 */
+	inline const CountStatistics&
+	getCountStatistics () const noexcept
+	{
+		return countStatistics_;
+	}
+
+	/**
+	 * \brief Extract the barcode from a binary alignment record.
+	 *
+	 * The same rules of the decoded records overload apply.
+	 *
+	 * \param record is the view over the alignment record.
+	 * \param barcode is the extracted barcode, or the empty string if the
+	 * record has no barcode.
+	 */
+	static inline void
+	extractBarcode (const BamRecordView& record,
+	                std::string& barcode)
+	{
+		const char* type   = record.findTag("CB");
+		const char* value  = nullptr;
+		uint64_t    length = 0;
+
+		if (type != nullptr && BamRecordView::tagString(type,
+		                                                value,
+		                                                length))
+		{
+			const void* dash = std::memchr(value,
+			                               '-',
+			                               length);
+
+			barcode.assign(value,
+			               dash == nullptr ? length : static_cast<const char*>(dash) - value);
+			return;
+		}
+		type = record.findTag("CR");
+		if (type != nullptr && BamRecordView::tagString(type,
+		                                                value,
+		                                                length))
+		{
+			barcode.assign(value,
+			               length);
+			return;
+		}
+		barcode.clear();
+	}
+
+	/**
+	 * \brief Extract the barcode, and optionally the UMI, from an alignment
+	 * record.
+	 *
+	 * The barcode of an alignment record is assumed to be the value of the
+	 * 'CB' tag, without its "-1" suffix. If the 'CB' tag is not present, the
+	 * 'CR' tag is looked for. If neither is present, the barcode is empty.
+	 * Likewise, the UMI is the value of the 'UB' tag, or of the 'UR' tag if
+	 * the former is not present. Both are looked up in the same scan of the
+	 * tags.
+	 *
+	 * \param bamRecord is the alignment record the barcode is extracted from.
+	 * \param umi is set to the UMI of the record, or to the empty string if
+	 * the record has no UMI, unless it is nullptr.
+	 * \return a string representing the extracted barcode.
+	 */
+	static inline std::string
+	extractBarcode (const seqan::BamAlignmentRecord& bamRecord,
+	                std::string* umi = nullptr)
+	{
+		uint64_t            tagIdx = 0;
+		std::string         barcode;
+		seqan::String<char> seqanBarcode;
+		seqan::BamTagsDict  tagsDict(bamRecord.tags);
+
+		if (seqan::findTagKey(tagIdx,
+		                      tagsDict,
+		                      "CB"))
+		{
+			seqan::extractTagValue(seqanBarcode,
+			                       tagsDict,
+			                       tagIdx);
+			barcode = seqan::toCString(seqanBarcode);
+			barcode = barcode.substr(0,
+			                         barcode.find_first_of('-'));
+		}
+		else if (seqan::findTagKey(tagIdx,
+		                           tagsDict,
+		                           "CR"))
+		{
+			seqan::extractTagValue(seqanBarcode,
+			                       tagsDict,
+			                       tagIdx);
+			barcode = seqan::toCString(seqanBarcode);
+		}
+		if (umi != nullptr)
+		{
+			umi->clear();
+			if (seqan::findTagKey(tagIdx,
+			                      tagsDict,
+			                      "UB") || seqan::findTagKey(tagIdx,
+			                                                 tagsDict,
+			                                                 "UR"))
+			{
+				seqan::extractTagValue(seqanBarcode,
+				                       tagsDict,
+				                       tagIdx);
+				*umi = seqan::toCString(seqanBarcode);
+			}
+		}
+
+		return barcode;
+	}
+
+private:
+	/**
+	 * Configuration of the de-multiplexer.
+	 */
+	DemultiplexerConfig                       config_;
+	/**
+	 * Reader merging the records of all the input files.
+	 */
+	AlignmentsMerger                          reader_;
+	/**
+	 * Filter records are tested with before being decoded.
+	 */
+	RecordFilter                              filter_;
+	/**
+	 * Sampler deciding which reads are kept when downsampling.
+	 */
+	ReadSampler                               sampler_;
+	/**
+	 * Structures target barcodes are looked up with, possibly shared with
+	 * other de-multiplexers.
+	 */
+	std::shared_ptr<const BarcodeLookup>      lookup_;
+	/**
+	 * Sampling threshold of every cell.
+	 */
+	std::vector<uint64_t>                     thresholds_;
+	/**
+	 * Outcome of the current run.
+	 */
+	DemultiplexerStatistics                   statistics_;
+	/**
+	 * Outcome of the current count.
+	 */
+	CountStatistics                           countStatistics_;
+	/**
+	 * Summary of the barcodes of noise records.
+	 */
+	BarcodeSketch                             noiseSketch_;
+	/**
+	 * Deduplicator collapsing the reads of the same molecule.
+	 */
+	UmiDeduplicator                           deduplicator_;
+
+	/**
+	 * \brief Struct storing the partial counts of a thread.
+	 */
+	struct CountCounters_
+	{
+		/**
+		 * Number of records read.
+		 */
+		uint64_t                                  records        = 0;
+		/**
+		 * Number of records rejected by every test of the filter.
+		 */
+		std::vector<uint64_t>                     filtered;
+		/**
+		 * Number of records of every target barcode.
+		 */
+		std::vector<uint64_t>                     cells;
+		/**
+		 * Number of noise records.
+		 */
+		uint64_t                                  noise          = 0;
+		/**
+		 * Number of records without barcode.
+		 */
+		uint64_t                                  missingBarcode = 0;
+		/**
+		 * Number of records dropped by downsampling.
+		 */
+		uint64_t                                  sampledOut     = 0;
+		/**
+		 * Number of records whose raw barcode has been corrected.
+		 */
+		uint64_t                                  corrected      = 0;
+		/**
+		 * Number of records whose raw barcode is ambiguous.
+		 */
+		uint64_t                                  ambiguous      = 0;
+		/**
+		 * Number of records whose raw barcode cannot be corrected.
+		 */
+		uint64_t                                  uncorrectable  = 0;
+		/**
+		 * Number of accepted records of every barcode.
+		 */
+		std::unordered_map<std::string, uint64_t> barcodes;
+		/**
+		 * Summary of the barcodes of noise records.
+		 */
+		BarcodeSketch                             noiseSketch;
+		/**
+		 * Buffer the barcode of the current record is extracted to.
+		 */
+		std::string                               barcode;
+	};
+
+	/**
+	 * Route of the records delivered as noise.
+	 */
+	static constexpr int64_t NOISE_ROUTE_   = -1;
+	/**
+	 * Route of the records which are not delivered.
+	 */
+	static constexpr int64_t DROPPED_ROUTE_ = -2;
+
+	/**
+	 * \brief Struct storing where a SAM line is delivered.
+	 */
+	struct LineRoute_
+	{
+		/**
+		 * First byte of the line.
+		 */
+		const char* line;
+		/**
+		 * Number of bytes of the line, newline excluded.
+		 */
+		uint64_t    length;
+		/**
+		 * Cell identifier the line is delivered to, or NOISE_ROUTE_.
+		 */
+		int64_t     cellId;
+	};
+
+	/**
+	 * \brief Check if the lines of the input files can be forwarded verbatim
+	 * to a sink.
+	 *
+	 * \param sink is the destination of the de-multiplexed records.
+	 * \return true if every input file is a SAM file read in file order, no
+	 * record is held back for deduplication, and the sink accepts lines.
+	 */
+	inline bool
+	canForwardText_ (const RecordSink& sink) const
+	{
+		if (deduplicator_.isEnabled() ||
+		    (config_.coordinateMerge && config_.alignmentsFilePaths.size() > 1) ||
+		    !sink.acceptsText())
+		{
+			return false;
+		}
+
+		return std::all_of(config_.alignmentsFilePaths.begin(),
+		                   config_.alignmentsFilePaths.end(),
+		                   [] (const fs::path& p)
+		                   {
+			                   return p.extension() == ".sam";
+		                   });
+	}
+
+	/**
+	 * \brief Deliver the lines of SAM input files to a sink, without decoding
+	 * them.
+	 *
+	 * Every round of chunks of a file is a batch: lines are routed
+	 * concurrently on their binary representation, then gathered per cell in
+	 * file order and delivered.
+	 *
+	 * \param sink is the destination of the de-multiplexed lines.
+	 * \return the statistics of the run.
+	 */
+	inline const DemultiplexerStatistics&
+	runText_ (RecordSink& sink)
+	{
+		MemoryScope                          scope(MemorySubsystem::BATCH_BUFFER);
+		SamScanner                           scanner;
+		std::vector<std::vector<LineRoute_>> routes(SamScanner::getThreadsCount());
+		std::vector<CountCounters_>          counters(SamScanner::getThreadsCount());
+		std::vector<std::string>             cellTexts(config_.barcodes.size());
+		std::string                          noiseText;
+		std::vector<uint64_t>                touchedCells;
+		uint64_t                             batchesCount = 0;
+
+		for (auto& c : counters)
+		{
+			c.noiseSketch.configure(config_.noiseSketchCapacity);
+		}
+		{
+			MemoryScope readerScope(MemorySubsystem::READER);
+
+			scanner.configure(extractContigNames_(reader_.getReference()));
+		}
+		{
+			MemoryScope writersScope(MemorySubsystem::WRITERS);
+
+			sink.begin(reader_.getReference(),
+			           config_.barcodes);
+		}
+
+		// Lines are routed by the thread parsing their chunk, and the routes
+		// of every chunk are kept apart so that file order is preserved.
+		auto visitor = [this, &routes, &counters] (const BamRecordView& record,
+		                                           const char* line,
+		                                           uint64_t length,
+		                                           uint64_t chunkIndex,
+		                                           uint64_t threadIndex)
+		{
+			MemoryScope recordScope(MemorySubsystem::BARCODE_MAP);
+
+			auto cellId = routeRecord_(record,
+			                           counters[threadIndex]);
+
+			if (cellId != DROPPED_ROUTE_)
+			{
+				routes[chunkIndex].push_back({line,
+				                              length,
+				                              cellId});
+			}
+		};
+		auto roundEnd = [&] (uint64_t chunksCount)
+		{
+			MemoryScope barcodeMapScope(MemorySubsystem::BARCODE_MAP);
+
+			for (auto i = 0ul; i < chunksCount; i++)
+			{
+				for (const auto& r : routes[i])
+				{
+					auto& text = r.cellId == NOISE_ROUTE_ ? noiseText : cellTexts[r.cellId];
+
+					if (r.cellId == NOISE_ROUTE_)
+					{
+						statistics_.noiseCount += 1;
+					}
+					else
+					{
+						if (text.empty())
+						{
+							touchedCells.emplace_back(r.cellId);
+						}
+						statistics_.cellCounts[r.cellId] += 1;
+					}
+					text.append(r.line,
+					            r.length);
+					text.push_back('\n');
+				}
+				routes[i].clear();
+			}
+
+			// Deliver the batch to the sink.
+			MemoryScope writersScope(MemorySubsystem::WRITERS);
+
+			for (auto cellId : touchedCells)
+			{
+				sink.writeText(cellId,
+				               config_.barcodes[cellId],
+				               cellTexts[cellId]);
+				cellTexts[cellId].clear();
+			}
+			sink.writeNoiseText(noiseText);
+			sink.endBatch();
+			touchedCells.clear();
+			noiseText.clear();
+			if (config_.sampleMemory)
+			{
+				batchesCount += 1;
+				MemoryTracker::sample("batch " + std::to_string(batchesCount));
+			}
+		};
+
+		for (const auto& p : config_.alignmentsFilePaths)
+		{
+			MemoryScope readerScope(MemorySubsystem::READER);
+
+			scanner.scanLines(p,
+			                  visitor,
+			                  roundEnd);
+		}
+		for (auto& c : counters)
+		{
+			statistics_.recordsCount       += c.records;
+			statistics_.sampledOut         += c.sampledOut;
+			statistics_.correctedCount     += c.corrected;
+			statistics_.ambiguousCount     += c.ambiguous;
+			statistics_.uncorrectableCount += c.uncorrectable;
+			noiseSketch_.merge(c.noiseSketch);
+		}
+
+		MemoryScope writersScope(MemorySubsystem::WRITERS);
+
+		sink.finish(statistics_);
+		if (config_.sampleMemory)
+		{
+			MemoryTracker::sample("finish");
+		}
+
+		return statistics_;
+	}
+
+	/**
+	 * \brief Route a binary record the way run() does.
+	 *
+	 * \param record is the view over the record.
+	 * \param counters are the partial counts of the calling thread.
+	 * \return the cell identifier the record is delivered to, NOISE_ROUTE_ or
+	 * DROPPED_ROUTE_ if it is rejected by the filter or by downsampling.
+	 */
+	inline int64_t
+	routeRecord_ (const BamRecordView& record,
+	              CountCounters_& counters) const
+	{
+		auto cellId = 0ul;
+
+		if (filter_.rejectingTest(record) >= 0)
+		{
+			return DROPPED_ROUTE_;
+		}
+		counters.records += 1;
+		extractBarcode(record,
+		               counters.barcode);
+		if (!lookup_->cellIds.find(counters.barcode,
+		                           cellId) &&
+		    !correctRawBarcode_(record,
+		                        counters.barcode,
+		                        cellId,
+		                        counters.corrected,
+		                        counters.ambiguous,
+		                        counters.uncorrectable))
+		{
+			if (!counters.barcode.empty())
+			{
+				counters.noiseSketch.add(counters.barcode);
+			}
+			return NOISE_ROUTE_;
+		}
+		if (!sampler_.keep(record.readName(),
+		                   record.readNameLength(),
+		                   thresholds_[cellId]))
+		{
+			counters.sampledOut += 1;
+			return DROPPED_ROUTE_;
+		}
+
+		return static_cast<int64_t>(cellId);
+	}
+
+	/**
+	 * \brief Count a binary record.
+	 *
+	 * \param record is the view over the record.
+	 * \param counters are the partial counts of the calling thread.
+	 */
+	inline void
+	countRecord_ (const BamRecordView& record,
+	              CountCounters_& counters) const
+	{
+		int32_t rejectingTest = filter_.rejectingTest(record);
+
+		counters.records += 1;
+		if (rejectingTest >= 0)
+		{
+			counters.filtered[rejectingTest] += 1;
+			return;
+		}
+
+		extractBarcode(record,
+		               counters.barcode);
+		if (counters.barcode.empty())
+		{
+			counters.missingBarcode += 1;
+			counters.noise          += 1;
+			return;
+		}
+
+		auto barcodeIt = counters.barcodes.find(counters.barcode);
+
+		if (barcodeIt == counters.barcodes.end())
+		{
+			counters.barcodes.emplace(counters.barcode,
+			                          1);
+		}
+		else
+		{
+			barcodeIt->second += 1;
+		}
+
+		auto cellId = 0ul;
+
+		if (!lookup_->cellIds.find(counters.barcode,
+		                           cellId) &&
+		    !correctRawBarcode_(record,
+		                        counters.barcode,
+		                        cellId,
+		                        counters.corrected,
+		                        counters.ambiguous,
+		                        counters.uncorrectable))
+		{
+			counters.noise += 1;
+			counters.noiseSketch.add(counters.barcode);
+			return;
+		}
+
+		if (!sampler_.keep(record.readName(),
+		                   record.readNameLength(),
+		                   thresholds_[cellId]))
+		{
+			counters.sampledOut += 1;
+		}
+		else
+		{
+			counters.cells[cellId] += 1;
+		}
+	}
+
+	/**
+	 * \brief Correct the raw barcode of a record, which has no 'CB' tag.
+	 *
+	 * Barcodes read from the 'CB' tag have already been corrected upstream,
+	 * so they are never changed.
+	 *
+	 * \param record is the record, either decoded or binary.
+	 * \param barcode is the barcode of the record, missing from the target
+	 * barcodes.
+	 * \param cellId is set to the identifier of the target barcode the raw
+	 * barcode is corrected to.
+	 * \param corrected is increased if the barcode is corrected.
+	 * \param ambiguous is increased if the barcode is close to several target
+	 * barcodes.
+	 * \param uncorrectable is increased if the barcode is not close to any
+	 * target barcode.
+	 * \return true if the barcode has been corrected.
+	 */
+	template <typename TRecord>
+	inline bool
+	correctRawBarcode_ (const TRecord& record,
+	                    const std::string& barcode,
+	                    uint64_t& cellId,
+	                    uint64_t& corrected,
+	                    uint64_t& ambiguous,
+	                    uint64_t& uncorrectable) const
+	{
+		std::string qualities;
+
+		if (!config_.correctBarcodes || !lookup_->corrector.isEnabled() || barcode.empty() ||
+		    !extractRawBarcodeQualities_(record,
+		                                 qualities))
+		{
+			return false;
+		}
+
+		switch (lookup_->corrector.correct(barcode.data(),
+		                           barcode.size(),
+		                           qualities.size() == barcode.size() ? qualities.data() : nullptr,
+		                           cellId))
+		{
+		case BarcodeCorrector::Outcome::EXACT:
+		case BarcodeCorrector::Outcome::CORRECTED:
+			corrected += 1;
+			return true;
+		case BarcodeCorrector::Outcome::AMBIGUOUS:
+			ambiguous += 1;
+			return false;
+		case BarcodeCorrector::Outcome::UNCORRECTABLE:
+			uncorrectable += 1;
+			return false;
+		}
+
+		return false;
+	}
+
+	/**
+	 * \brief Extract the qualities of the raw barcode of a decoded record.
+	 *
+	 * \param record is the alignment record.
+	 * \param qualities is set to the value of the 'CY' tag, or to the empty
+	 * string if it is missing.
+	 * \return false if the record has a 'CB' tag, so its barcode is not raw.
+	 */
+	static inline bool
+	extractRawBarcodeQualities_ (const seqan::BamAlignmentRecord& record,
+	                             std::string& qualities)
+	{
+		unsigned            tagIdx = 0;
+		seqan::String<char> seqanQualities;
+		seqan::BamTagsDict  tagsDict(record.tags);
+
+		if (seqan::findTagKey(tagIdx,
+		                      tagsDict,
+		                      "CB"))
+		{
+			return false;
+		}
+		qualities.clear();
+		if (seqan::findTagKey(tagIdx,
+		                      tagsDict,
+		                      "CY"))
+		{
+			seqan::extractTagValue(seqanQualities,
+			                       tagsDict,
+			                       tagIdx);
+			qualities = seqan::toCString(seqanQualities);
+		}
+
+		return true;
+	}
+
+	/**
+	 * \brief Extract the qualities of the raw barcode of a binary record.
+	 *
+	 * \param record is the view over the alignment record.
+	 * \param qualities is set to the value of the 'CY' tag, or to the empty
+	 * string if it is missing.
+	 * \return false if the record has a 'CB' tag, so its barcode is not raw.
+	 */
+	static inline bool
+	extractRawBarcodeQualities_ (const BamRecordView& record,
+	                             std::string& qualities)
+	{
+		const char* type   = nullptr;
+		const char* value  = nullptr;
+		uint64_t    length = 0;
+
+		if (record.findTag("CB") != nullptr)
+		{
+			return false;
+		}
+		qualities.clear();
+		type = record.findTag("CY");
+		if (type != nullptr && BamRecordView::tagString(type,
+		                                                value,
+		                                                length))
+		{
+			qualities.assign(value,
+			                 length);
+		}
+
+		return true;
+	}
+
+	/**
+	 * \brief Count the records of a CRAM file, which neither scanner reads.
+	 *
+	 * Records are decoded into SeqAn records by the alignments reader on the
+	 * calling thread, and each of them is encoded back in its binary
+	 * representation.
+	 *
+	 * \param path is the path to the CRAM file.
+	 * \param counters are the partial counts the records are added to.
+	 */
+	inline void
+	countSequentially_ (const fs::path& path,
+	                    CountCounters_& counters)
+	{
+		AlignmentsReader                       reader;
+		std::vector<seqan::BamAlignmentRecord> buffer(4096);
+		seqan::CharString                      rawRecord;
+		uint64_t                               loaded = 0;
+
+		reader.configure(path,
+		                 config_.compressionBackend,
+		                 config_.referenceFilePath);
+
+		auto context = reader.getContext();
+
+		do
+		{
+			loaded = reader.read(buffer.begin(),
+			                     buffer.end());
+			for (auto i = 0ul; i < loaded; i++)
+			{
+				seqan::clear(rawRecord);
+				seqan::write(rawRecord,
+				             buffer[i],
+				             context,
+				             seqan::Bam());
+				countRecord_(BamRecordView::fromSized(seqan::begin(rawRecord,
+				                                                   seqan::Standard())),
+				             counters);
+			}
+		}
+		while (loaded > 0);
+	}
+
+	/**
+	 * \brief Merge the partial counts of every thread into the count
+	 * statistics.
+	 *
+	 * \param counters are the partial counts of every thread.
+	 */
+	inline void
+	mergeCounters_ (std::vector<CountCounters_>& counters)
+	{
+		std::map<std::string, uint64_t> reasons;
+
+		countStatistics_ = CountStatistics();
+		countStatistics_.cellCounts.assign(config_.barcodes.size(),
+		                                   0);
+		noiseSketch_.configure(config_.noiseSketchCapacity);
+		for (auto& c : counters)
+		{
+			countStatistics_.recordsCount        += c.records;
+			countStatistics_.noiseCount          += c.noise;
+			countStatistics_.missingBarcodeCount += c.missingBarcode;
+			countStatistics_.sampledOut          += c.sampledOut;
+			countStatistics_.correctedCount      += c.corrected;
+			countStatistics_.ambiguousCount      += c.ambiguous;
+			countStatistics_.uncorrectableCount  += c.uncorrectable;
+			noiseSketch_.merge(c.noiseSketch);
+			for (auto i = 0ul; i < c.filtered.size(); i++)
+			{
+				countStatistics_.filteredCount += c.filtered[i];
+				if (c.filtered[i] > 0)
+				{
+					reasons[filter_.describeTest(i)] += c.filtered[i];
+				}
+			}
+			for (auto i = 0ul; i < c.cells.size(); i++)
+			{
+				countStatistics_.cellCounts[i] += c.cells[i];
+			}
+			if (countStatistics_.barcodeCounts.empty())
+			{
+				countStatistics_.barcodeCounts.swap(c.barcodes);
+			}
+			else
+			{
+				for (const auto& b : c.barcodes)
+				{
+					countStatistics_.barcodeCounts[b.first] += b.second;
+				}
+			}
+		}
+		countStatistics_.filterReasons.assign(reasons.begin(),
+		                                      reasons.end());
+		std::stable_sort(countStatistics_.filterReasons.begin(),
+		                 countStatistics_.filterReasons.end(),
+		                 [] (const std::pair<std::string, uint64_t>& lhs,
+		                     const std::pair<std::string, uint64_t>& rhs)
+		                 {
+			                 return lhs.second > rhs.second;
+		                 });
+	}
+
+	/**
+	 * \brief Build the filter expression alignment records are tested with.
+	 *
+	 * The minimum mapping quality and the forbidden tags are translated into
+	 * predicates, and combined with the expression of the configuration.
+	 *
+	 * \return the filter expression.
+	 */
+	inline std::string
+	buildFilterExpression_ () const
+	{
+		std::vector<std::string> terms;
+		std::string              expression;
+
+		if (config_.minMappingQuality > 0)
+		{
+			terms.emplace_back("mapq >= " +
+			                   std::to_string(config_.minMappingQuality));
+		}
+		for (const auto& t : config_.forbiddenTags)
+		{
+			terms.emplace_back("!has(" +
+			                   t +
+			                   ")");
+		}
+		if (!config_.filterExpression.empty())
+		{
+			terms.emplace_back("(" +
+			                   config_.filterExpression +
+			                   ")");
+		}
+		for (const auto& t : terms)
+		{
+			expression += expression.empty() ? t : " && " + t;
+		}
+
+		return expression;
+	}
+
+	/**
+	 * \brief Retrieve the names of the reference sequences of an alignment
+	 * file.
+	 *
+	 * \param reader is the reader of the alignment file.
+	 * \return the names of the reference sequences, indexed by their
+	 * identifier.
+	 */
+	static inline std::vector<std::string>
+	extractContigNames_ (const AlignmentsReader& reader)
+	{
+		auto                     context = reader.getContext();
+		const auto&              names   = seqan::contigNames(context);
+		std::vector<std::string> contigNames;
+
+		for (auto i = 0ul; i < seqan::length(names); i++)
+		{
+			contigNames.emplace_back(seqan::begin(names[i],
+			                                      seqan::Standard()),
+			                         seqan::end(names[i],
+			                                    seqan::Standard()));
+		}
+
+		return contigNames;
+	}
+};
+
+} // sctools
+
+#endif // SCTOOLS_INCLUDE_SCTOOLS_DEMULTIPLEXER_H
@@ -0,0 +1,1127 @@
+/**
+ * \file   include/sctools/file_sink.h
+ * \author Elena Grassi
+ * \author Marilisa Montemurro
+ * \author Emanuele Parisi
+ * \date   February, 2019
+ *
+ * File containing the sink writing de-multiplexed alignment records to one
+ * file per barcode.
+ */
+
+#ifndef SCTOOLS_INCLUDE_SCTOOLS_FILE_SINK_H
+#define SCTOOLS_INCLUDE_SCTOOLS_FILE_SINK_H
+
+#include <algorithm>
+#include <cstdint>
+#include <exception>
+#include <experimental/filesystem>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "alignments_reader.h"
+#include "alignments_writer.h"
+#include "bgzf.h"
+#include "compression_backend.h"
+#include "cram_codec.h"
+#include "delimited_reader.h"
+#include "memory_tracker.h"
+#include "name_sorter.h"
+#include "output_scheduler.h"
+#include "record_sink.h"
+#include "write_pool.h"
+
+namespace fs = std::experimental::filesystem;
+
+namespace sctools
+{
+
+/**
+ * \brief Enumeration of the ways target barcodes with no de-multiplexed record
+ * are handled.
+ */
+enum class EmptyOutputPolicy
+{
+	EMPTY_FILE,
+	SKIP,
+	MANIFEST
+};
+
+/**
+ * \brief Enumeration of the orders records are written to the files of the
+ * target barcodes in.
+ */
+enum class SortOrder
+{
+	INPUT,
+	QUERYNAME
+};
+
+/**
+ * \brief Struct storing the configuration of a file sink.
+ */
+struct FileSinkConfig
+{
+	/**
+	 * Path to the directory where the de-multiplexed files are stored.
+	 */
+	fs::path                                     outputDirPath      = ".";
+	/**
+	 * Flag which mirrors every de-multiplexed record to a BED file.
+	 */
+	bool                                         writeBed           = false;
+	/**
+	 * Deflate implementation used for compressing BAM files.
+	 */
+	CompressionBackendType                       compressionBackend = CompressionBackendType::ZLIB;
+	/**
+	 * Compression level of BAM files, from 0 to 9.
+	 */
+	int                                          compressionLevel   = AlignmentsWriter::DEFAULT_COMPRESSION_LEVEL;
+	/**
+	 * Flag which re-encodes every BAM file as a CRAM file once the run is
+	 * complete. The intermediate BAM files are compressed at level 1.
+	 */
+	bool                                         writeCram          = false;
+	/**
+	 * Path to the FASTA file CRAM files are encoded against, or an empty path
+	 * for resolving it from the header.
+	 */
+	fs::path                                     referenceFilePath;
+	/**
+	 * Handling of the target barcodes no record is de-multiplexed to.
+	 */
+	EmptyOutputPolicy                            emptyOutputPolicy  = EmptyOutputPolicy::EMPTY_FILE;
+	/**
+	 * Order of the records in the files of the target barcodes. The noise
+	 * file keeps the input order.
+	 */
+	SortOrder                                    sortOrder          = SortOrder::INPUT;
+	/**
+	 * Maximum number of bytes of records buffered for sorting by name,
+	 * across all the files, before the largest buffers are spilled to disk.
+	 */
+	uint64_t                                     sortMemory         = 1ull << 30;
+	/**
+	 * Maximum number of output writes submitted in a single batch.
+	 */
+	uint64_t                                     outputQueueDepth   = 32;
+	/**
+	 * Maximum number of de-multiplexed files kept open at the same time.
+	 */
+	uint64_t                                     maxOpenFiles       = 512;
+	/**
+	 * Flag which submits output writes through io_uring, when available.
+	 */
+	bool                                         useIoUring         = true;
+	/**
+	 * Map associating target barcodes with the group whose file their
+	 * records are written to. Barcodes without a group get their own file.
+	 */
+	std::unordered_map<std::string, std::string> groups;
+
+	/**
+	 * \brief Load the groups of the target barcodes from a mapping file.
+	 *
+	 * \param groupsFilePath is the file storing a barcode and its group on
+	 * every line, separated by a tab or a comma, possibly gzip-compressed.
+	 * The "-1" suffix of barcodes is ignored, and empty lines or lines
+	 * starting with '#' are skipped.
+	 */
+	inline void
+	loadGroups (const fs::path& groupsFilePath)
+	{
+		DelimitedReader<std::string, std::string> groupsReader;
+		std::tuple<std::string, std::string>      mapping;
+
+		groupsReader.open(groupsFilePath,
+		                  {{{"barcode", true},
+		                    {"group", true}}});
+		groups.clear();
+		while (groupsReader.read(mapping))
+		{
+			const auto& barcode = std::get<0>(mapping);
+			const auto& group   = std::get<1>(mapping);
+
+			if (barcode.empty() || group.empty())
+			{
+				throw std::invalid_argument("malformed line " +
+				                            std::to_string(groupsReader.getLineNumber()) +
+				                            " of groups file '" +
+				                            groupsFilePath.string() +
+				                            "'");
+			}
+			if (group.find('/') != std::string::npos)
+			{
+				throw std::invalid_argument("group '" +
+				                            group +
+				                            "' is not a valid file name");
+			}
+			groups[barcode.substr(0,
+			                      barcode.find_first_of('-'))] = group;
+		}
+	}
+};
+
+/**
+ * \brief Sink writing the records of every target barcode to its own file,
+ * and the remaining ones to the noise file.
+ *
+ * Barcodes mapped to a group share the file of the group, so that a single
+ * writer receives the records of many barcodes. A file is created when its
+ * first records are delivered, by writing verbatim the header encoded once for
+ * all the files. Records are collected until the end of every batch, then the
+ * files are encoded and compressed concurrently by a write pool, each one by a
+ * single thread. Compressed blocks are staged per thread and handed to an
+ * output scheduler, which writes all the files at once. CRAM files are encoded
+ * from the complete BAM files at the end of the run, concurrently. Lines of
+ * SAM input files are taken verbatim, unless they are mirrored to BED files or
+ * barcodes are grouped, since group files interleave records by coordinate.
+ *
+ * When records are sorted by name, every batch encodes the records of each
+ * file into its name sorter rather than writing them, and the largest sorters
+ * are spilled to run files in the output directory whenever the memory budget
+ * is exceeded. Files are written at the end of the run, concurrently, by
+ * merging their runs.
+ */
+class FileSink : public RecordSink
+{
+
+public:
+
+	/**
+	 * Class constructor.
+	 */
+	FileSink () = default;
+
+	/**
+	 * \brief Class copy constructor.
+	 *
+	 * \param other is the object the current instance is initialized from.
+	 */
+	FileSink (const FileSink& other) = delete;
+
+	/**
+	 * \brief Class copy assignment operator.
+	 *
+	 * \param other is the object the current instance is initialized from.
+	 * \return a reference to the assigned object.
+	 */
+	FileSink&
+	operator= (const FileSink& other) = delete;
+
+	/**
+	 * \brief Initialize the sink.
+	 *
+	 * \param config is the configuration of the sink.
+	 */
+	inline void
+	configure (const FileSinkConfig& config)
+	{
+		if (!fs::is_directory(config.outputDirPath))
+		{
+			throw std::invalid_argument("output directory '" +
+			                            config.outputDirPath.string() +
+			                            "' does not exist");
+		}
+		if (config.sortMemory == 0)
+		{
+			throw std::invalid_argument("the sort memory must be positive");
+		}
+		if (config.writeCram && !Cram::isAvailable())
+		{
+			throw std::invalid_argument("CRAM files cannot be written: SCTools was "
+			                            "built without CRAM support");
+		}
+		config_ = config;
+		if (config_.writeCram)
+		{
+			config_.compressionLevel = 1;
+		}
+	}
+
+	void
+	begin (const AlignmentsReader& reference,
+	       const std::vector<std::string>& barcodes) override
+	{
+		fs::path                                  extension = reference.isBinary() ? ".bam" : ".sam";
+		std::unordered_map<std::string, uint64_t> groupIds;
+
+		if (config_.writeCram && !reference.isBinary())
+		{
+			throw std::invalid_argument("CRAM files can only be written from BAM or "
+			                            "CRAM input files");
+		}
+
+		// Assign an output file to every target barcode: barcodes of the same
+		// group share it, while the other ones get their own.
+		reference_ = &reference;
+		paths_.clear();
+		outputNames_.clear();
+		outputIds_.clear();
+		for (const auto& b : barcodes)
+		{
+			auto groupIt = config_.groups.find(b);
+
+			if (groupIt != config_.groups.end())
+			{
+				auto groupId = groupIds.emplace(groupIt->second,
+				                                outputNames_.size());
+
+				outputIds_.emplace_back(groupId.first->second);
+				if (!groupId.second)
+				{
+					continue;
+				}
+				outputNames_.emplace_back(groupIt->second);
+			}
+			else
+			{
+				outputIds_.emplace_back(outputNames_.size());
+				outputNames_.emplace_back(b);
+			}
+			paths_.emplace_back(config_.outputDirPath / outputNames_.back());
+			paths_.back() += extension;
+		}
+		checkOutputNames_();
+		isCreated_.assign(outputNames_.size(),
+		                  0);
+		outputBuffers_.assign(outputNames_.size(),
+		                      {});
+		outputTexts_.assign(outputNames_.size(),
+		                    {});
+		contributors_.assign(outputNames_.size(),
+		                     0);
+		touchedOutputs_.clear();
+		noiseBuffer_.clear();
+		noiseText_.clear();
+		noisePath_  = config_.outputDirPath / "noise";
+		noisePath_ += extension;
+
+		// Register every file with the scheduler up front, since the writers
+		// running concurrently cannot.
+		scheduler_.configure(config_.outputQueueDepth,
+		                     config_.maxOpenFiles,
+		                     config_.useIoUring);
+		fileIds_.clear();
+		for (const auto& p : paths_)
+		{
+			fileIds_.emplace_back(scheduler_.open(p,
+			                                      false));
+		}
+		noiseFileId_ = scheduler_.open(noisePath_,
+		                               false);
+
+		// Give every thread of the pool its own writer and staging area.
+		pool_.configure();
+		writers_.clear();
+		for (auto i = 0ul; i < pool_.getThreadsCount(); i++)
+		{
+			writers_.emplace_back(new AlignmentsWriter());
+		}
+		stagings_.assign(pool_.getThreadsCount(),
+		                 Staging_());
+		noiseBlocks_.clear();
+
+		// Give every output file its own name sorter, spilling to a hidden
+		// file next to it, and every thread its own encoding context.
+		sorters_.clear();
+		contexts_.clear();
+		if (config_.sortOrder == SortOrder::QUERYNAME)
+		{
+			for (const auto& n : outputNames_)
+			{
+				sorters_.emplace_back(new NameSorter());
+				sorters_.back()->configure(config_.outputDirPath / ("." + n + ".run"));
+			}
+			contexts_.assign(pool_.getThreadsCount(),
+			                 reference.getContext());
+		}
+
+		// Encode the header shared by all the output files only once, and
+		// create the noise file, whose records keep the input order.
+		headerBlob_      = AlignmentsWriter::encodeHeader(reference,
+		                                                  config_.compressionBackend,
+		                                                  config_.compressionLevel,
+		                                                  config_.sortOrder == SortOrder::QUERYNAME ?
+		                                                  "queryname" :
+		                                                  "");
+		noiseHeaderBlob_ = config_.sortOrder == SortOrder::QUERYNAME ?
+		                   AlignmentsWriter::encodeHeader(reference,
+		                                                  config_.compressionBackend,
+		                                                  config_.compressionLevel) :
+		                   headerBlob_;
+		noiseWriter_.configure(noisePath_,
+		                       reference,
+		                       false,
+		                       config_.writeBed,
+		                       config_.compressionBackend,
+		                       config_.compressionLevel,
+		                       [this] (const char* block,
+		                               uint64_t blockSize)
+		                       {
+			                       noiseBlocks_.append(block,
+			                                           blockSize);
+		                       });
+		noiseWriter_.writeHeaderBlob(noiseHeaderBlob_);
+	}
+
+	void
+	write (uint64_t cellId,
+	       const std::string& barcode,
+	       std::vector<seqan::BamAlignmentRecord>& records) override
+	{
+		(void) barcode;
+
+		// Collect the records of the output file until the end of the batch,
+		// those of all the barcodes of a group together.
+		auto outputId = outputIds_[cellId];
+
+		if (outputBuffers_[outputId].empty())
+		{
+			touchedOutputs_.emplace_back(outputId);
+		}
+		append_(outputBuffers_[outputId],
+		        records);
+		contributors_[outputId] += 1;
+	}
+
+	void
+	writeNoise (std::vector<seqan::BamAlignmentRecord>& records) override
+	{
+		append_(noiseBuffer_,
+		        records);
+	}
+
+	bool
+	acceptsText () const override
+	{
+		return !config_.writeBed &&
+		       config_.groups.empty() &&
+		       config_.sortOrder == SortOrder::INPUT;
+	}
+
+	void
+	writeText (uint64_t cellId,
+	           const std::string& barcode,
+	           std::string& lines) override
+	{
+		(void) barcode;
+
+		auto outputId = outputIds_[cellId];
+
+		if (outputBuffers_[outputId].empty() && outputTexts_[outputId].empty())
+		{
+			touchedOutputs_.emplace_back(outputId);
+		}
+		appendText_(outputTexts_[outputId],
+		            lines);
+		contributors_[outputId] += 1;
+	}
+
+	void
+	writeNoiseText (std::string& lines) override
+	{
+		appendText_(noiseText_,
+		            lines);
+	}
+
+	void
+	endBatch () override
+	{
+		std::vector<uint64_t> costs;
+
+		// The noise file takes part in the batch as one more output file.
+		auto noiseId = outputNames_.size();
+
+		if (!noiseBuffer_.empty() || !noiseText_.empty())
+		{
+			touchedOutputs_.emplace_back(noiseId);
+		}
+
+		// A run delivers either records or lines, so costs are counted in
+		// records or in bytes of lines.
+		for (auto outputId : touchedOutputs_)
+		{
+			costs.emplace_back(outputId == noiseId ?
+			                   noiseBuffer_.size() + noiseText_.size() :
+			                   outputBuffers_[outputId].size() + outputTexts_[outputId].size());
+		}
+		pool_.run(touchedOutputs_,
+		          costs,
+		          [this, noiseId] (uint64_t outputId,
+		                           uint64_t threadIndex)
+		          {
+			          MemoryScope scope(MemorySubsystem::WRITERS);
+
+			          if (outputId == noiseId)
+			          {
+				          noiseWriter_.write(noiseBuffer_.begin(),
+				                             noiseBuffer_.end());
+				          if (!noiseText_.empty())
+				          {
+					          noiseWriter_.writeText(noiseText_);
+				          }
+			          }
+			          else if (config_.sortOrder == SortOrder::QUERYNAME)
+			          {
+				          for (const auto& r : outputBuffers_[outputId])
+				          {
+					          sorters_[outputId]->add(r,
+					                                  contexts_[threadIndex]);
+				          }
+			          }
+			          else
+			          {
+				          writeOutput_(outputId,
+				                       threadIndex);
+			          }
+		          });
+		if (config_.sortOrder == SortOrder::QUERYNAME)
+		{
+			spillSorters_();
+		}
+
+		// Hand the blocks compressed during this batch to the scheduler, and
+		// write all the output files at once.
+		for (auto& s : stagings_)
+		{
+			uint64_t begin = 0;
+
+			for (auto i = 0ul; i < s.fileIds.size(); i++)
+			{
+				scheduler_.submit(s.fileIds[i],
+				                  s.blocks.data() + begin,
+				                  s.ends[i] - begin);
+				begin = s.ends[i];
+			}
+			s.blocks.clear();
+			s.fileIds.clear();
+			s.ends.clear();
+		}
+		submitNoise_();
+		scheduler_.flush();
+
+		for (auto outputId : touchedOutputs_)
+		{
+			if (outputId != noiseId)
+			{
+				outputBuffers_[outputId].clear();
+				outputTexts_[outputId].clear();
+				contributors_[outputId] = 0;
+			}
+		}
+		touchedOutputs_.clear();
+		noiseBuffer_.clear();
+		noiseText_.clear();
+	}
+
+	void
+	finish (const DemultiplexerStatistics& statistics) override
+	{
+		(void) statistics;
+
+		// Terminate the noise file and write its last blocks.
+		noiseWriter_.reset();
+		submitNoise_();
+		scheduler_.flush();
+		if (config_.sortOrder == SortOrder::QUERYNAME)
+		{
+			writeSortedOutputs_();
+		}
+		finishEmptyOutputs_();
+		if (config_.writeCram)
+		{
+			encodeCram_();
+		}
+	}
+
+	/**
+	 * \brief Access the path of the file of a target barcode.
+	 *
+	 * \param cellId is the index of the barcode in the barcodes list.
+	 * \return the path of the file, which is shared by all the barcodes of
+	 * the same group. It is the path of the CRAM file once the sink is
+	 * finished, if CRAM files are written.
+	 */
+	inline const fs::path&
+	getPath (uint64_t cellId) const noexcept
+	{
+		return paths_[outputIds_[cellId]];
+	}
+
+	/**
+	 * \brief Access the number of output files, besides the noise one.
+	 *
+	 * \return the number of groups plus the number of barcodes without a
+	 * group.
+	 */
+	inline uint64_t
+	getOutputsCount () const noexcept
+	{
+		return outputNames_.size();
+	}
+
+	/**
+	 * \brief Access the output file of a target barcode.
+	 *
+	 * \param cellId is the index of the barcode in the barcodes list.
+	 * \return the index of the output file.
+	 */
+	inline uint64_t
+	getOutputId (uint64_t cellId) const noexcept
+	{
+		return outputIds_[cellId];
+	}
+
+	/**
+	 * \brief Access the name of an output file, without extension.
+	 *
+	 * \param outputId is the index of the output file.
+	 * \return the group or the barcode the output file is named after.
+	 */
+	inline const std::string&
+	getOutputName (uint64_t outputId) const noexcept
+	{
+		return outputNames_[outputId];
+	}
+
+	/**
+	 * \brief Access the path of the noise file.
+	 *
+	 * \return the path of the noise file.
+	 */
+	inline const fs::path&
+	getNoisePath () const noexcept
+	{
+		return noisePath_;
+	}
+
+	/**
+	 * \brief Access the scheduler output writes are issued through.
+	 *
+	 * \return a reference to the output scheduler.
+	 */
+	inline const OutputScheduler&
+	getScheduler () const noexcept
+	{
+		return scheduler_;
+	}
+
+	/**
+	 * \brief Access the number of runs spilled to disk while sorting records
+	 * by name.
+	 *
+	 * \return the number of runs written by all the name sorters.
+	 */
+	inline uint64_t
+	getSpilledRunsCount () const noexcept
+	{
+		uint64_t spilledCount = 0;
+
+		for (const auto& s : sorters_)
+		{
+			spilledCount += s->getSpilledCount();
+		}
+
+		return spilledCount;
+	}
+
+	/**
+	 * \brief Access the pool output files are encoded and compressed by.
+	 *
+	 * \return a reference to the write pool.
+	 */
+	inline const WritePool&
+	getWritePool () const noexcept
+	{
+		return pool_;
+	}
+
+private:
+	/**
+	 * \brief Compressed blocks of the output files written by a thread in
+	 * the current batch, laid one file after the other.
+	 */
+	struct Staging_
+	{
+		std::string           blocks;
+		std::vector<uint64_t> fileIds;
+		std::vector<uint64_t> ends;
+	};
+
+	/**
+	 * Type of the context records are encoded with.
+	 */
+	using TContext_ = decltype(std::declval<const AlignmentsReader&>().getContext());
+
+	/**
+	 * Configuration of the sink.
+	 */
+	FileSinkConfig                                      config_;
+	/**
+	 * Reader providing the header and the context of the records.
+	 */
+	const AlignmentsReader*                             reference_ = nullptr;
+	/**
+	 * Name of every output file, without extension.
+	 */
+	std::vector<std::string>                            outputNames_;
+	/**
+	 * Path of every output file.
+	 */
+	std::vector<fs::path>                               paths_;
+	/**
+	 * Output file of every target barcode.
+	 */
+	std::vector<uint64_t>                               outputIds_;
+	/**
+	 * Identifier of every output file within the scheduler.
+	 */
+	std::vector<uint64_t>                               fileIds_;
+	/**
+	 * Flag stating if every output file has been created, stored as bytes so
+	 * that threads can set the flags of different files concurrently.
+	 */
+	std::vector<uint8_t>                                isCreated_;
+	/**
+	 * Records of every output file in the current batch.
+	 */
+	std::vector<std::vector<seqan::BamAlignmentRecord>> outputBuffers_;
+	/**
+	 * SAM lines of every output file in the current batch.
+	 */
+	std::vector<std::string>                            outputTexts_;
+	/**
+	 * Number of barcodes contributing to every output file in the current
+	 * batch.
+	 */
+	std::vector<uint64_t>                               contributors_;
+	/**
+	 * Output files with records in the current batch.
+	 */
+	std::vector<uint64_t>                               touchedOutputs_;
+	/**
+	 * Noise records of the current batch.
+	 */
+	std::vector<seqan::BamAlignmentRecord>              noiseBuffer_;
+	/**
+	 * Noise SAM lines of the current batch.
+	 */
+	std::string                                         noiseText_;
+	/**
+	 * Path of the noise file.
+	 */
+	fs::path                                            noisePath_;
+	/**
+	 * Header written at the beginning of every output file.
+	 */
+	std::string                                         headerBlob_;
+	/**
+	 * Header written at the beginning of the noise file.
+	 */
+	std::string                                         noiseHeaderBlob_;
+	/**
+	 * Name sorter of every output file, when records are sorted by name.
+	 */
+	std::vector<std::unique_ptr<NameSorter>>            sorters_;
+	/**
+	 * Context every thread of the pool encodes records to be sorted with.
+	 */
+	std::vector<TContext_>                              contexts_;
+	/**
+	 * Scheduler batching the writes of all the output files.
+	 */
+	OutputScheduler                                     scheduler_;
+	/**
+	 * Identifier of the noise file within the scheduler.
+	 */
+	uint64_t                                            noiseFileId_ = 0;
+	/**
+	 * Compressed blocks of the noise file not handed to the scheduler yet.
+	 */
+	std::string                                         noiseBlocks_;
+	/**
+	 * Writer of the noise file, kept open during the whole run. It is
+	 * declared after the blocks it stages, which it may flush when destroyed.
+	 */
+	AlignmentsWriter                                    noiseWriter_;
+	/**
+	 * Pool encoding and compressing the output files of every batch.
+	 */
+	WritePool                                           pool_;
+	/**
+	 * Staging area of every thread of the pool.
+	 */
+	std::vector<Staging_>                               stagings_;
+	/**
+	 * Writer of every thread of the pool.
+	 */
+	std::vector<std::unique_ptr<AlignmentsWriter>>      writers_;
+
+	/**
+	 * \brief Check that no two output files, including the noise one, share
+	 * the same name.
+	 */
+	inline void
+	checkOutputNames_ () const
+	{
+		std::vector<std::string> names(outputNames_);
+
+		names.emplace_back("noise");
+		std::sort(names.begin(),
+		          names.end());
+
+		auto duplicateIt = std::adjacent_find(names.begin(),
+		                                      names.end());
+
+		if (duplicateIt != names.end())
+		{
+			throw std::invalid_argument("output file name '" +
+			                            *duplicateIt +
+			                            "' is used by more than one group or "
+			                            "barcode");
+		}
+	}
+
+	/**
+	 * \brief Move a batch of records at the end of a buffer.
+	 *
+	 * \param buffer is the buffer the records are appended to.
+	 * \param records are the records to be appended.
+	 */
+	static inline void
+	append_ (std::vector<seqan::BamAlignmentRecord>& buffer,
+	         std::vector<seqan::BamAlignmentRecord>& records)
+	{
+		if (buffer.empty())
+		{
+			buffer.swap(records);
+		}
+		else
+		{
+			buffer.insert(buffer.end(),
+			              records.begin(),
+			              records.end());
+		}
+	}
+
+	/**
+	 * \brief Move a batch of SAM lines at the end of a buffer.
+	 *
+	 * \param buffer is the buffer the lines are appended to.
+	 * \param lines are the lines to be appended.
+	 */
+	static inline void
+	appendText_ (std::string& buffer,
+	             std::string& lines)
+	{
+		if (buffer.empty())
+		{
+			buffer.swap(lines);
+		}
+		else
+		{
+			buffer.append(lines);
+		}
+	}
+
+	/**
+	 * \brief Write the records of an output file in the current batch,
+	 * creating it if needed.
+	 *
+	 * BAM blocks are staged by the calling thread, and SAM records are
+	 * written to the file directly.
+	 *
+	 * \param outputId is the index of the output file.
+	 * \param threadIndex is the index of the calling thread within the pool.
+	 */
+	inline void
+	writeOutput_ (uint64_t outputId,
+	              uint64_t threadIndex)
+	{
+		auto& records = outputBuffers_[outputId];
+		auto& writer  = *writers_[threadIndex];
+		auto& staging = stagings_[threadIndex];
+
+		// Records of different barcodes of a group are interleaved back by
+		// coordinate, which keeps the group file sorted when the input is,
+		// and is harmless otherwise.
+		if (contributors_[outputId] > 1)
+		{
+			std::stable_sort(records.begin(),
+			                 records.end(),
+			                 [] (const seqan::BamAlignmentRecord& lhs,
+			                     const seqan::BamAlignmentRecord& rhs)
+			                 {
+				                 return std::make_pair(static_cast<uint32_t>(lhs.rID),
+				                                       static_cast<uint32_t>(lhs.beginPos)) <
+				                        std::make_pair(static_cast<uint32_t>(rhs.rID),
+				                                       static_cast<uint32_t>(rhs.beginPos));
+			                 });
+		}
+
+		writer.configure(paths_[outputId],
+		                 *reference_,
+		                 isCreated_[outputId] != 0,
+		                 config_.writeBed,
+		                 config_.compressionBackend,
+		                 config_.compressionLevel,
+		                 [&staging] (const char* block,
+		                             uint64_t blockSize)
+		                 {
+			                 staging.blocks.append(block,
+			                                       blockSize);
+		                 });
+		if (isCreated_[outputId] == 0)
+		{
+			writer.writeHeaderBlob(headerBlob_);
+			isCreated_[outputId] = 1;
+		}
+		writer.write(records.begin(),
+		             records.end());
+		if (!outputTexts_[outputId].empty())
+		{
+			writer.writeText(outputTexts_[outputId]);
+		}
+		writer.reset();
+		if (reference_->isBinary())
+		{
+			staging.fileIds.emplace_back(fileIds_[outputId]);
+			staging.ends.emplace_back(staging.blocks.size());
+		}
+	}
+
+	/**
+	 * \brief Spill the largest name sorters to disk, if the records they
+	 * buffer exceed the memory budget, until they fit in half of it.
+	 */
+	inline void
+	spillSorters_ ()
+	{
+		std::vector<uint64_t> outputIds;
+		std::vector<uint64_t> costs;
+		uint64_t              bufferedBytes = 0;
+
+		for (auto i = 0ul; i < sorters_.size(); i++)
+		{
+			bufferedBytes += sorters_[i]->getBufferedBytes();
+			outputIds.emplace_back(i);
+		}
+		if (bufferedBytes <= config_.sortMemory)
+		{
+			return;
+		}
+		std::sort(outputIds.begin(),
+		          outputIds.end(),
+		          [this] (uint64_t lhs,
+		                  uint64_t rhs)
+		          {
+			          return sorters_[lhs]->getBufferedBytes() >
+			                 sorters_[rhs]->getBufferedBytes();
+		          });
+
+		auto spilledEnd = outputIds.begin();
+
+		while (spilledEnd != outputIds.end() && bufferedBytes > config_.sortMemory / 2)
+		{
+			bufferedBytes -= sorters_[*spilledEnd]->getBufferedBytes();
+			costs.emplace_back(sorters_[*spilledEnd]->getBufferedBytes());
+			spilledEnd++;
+		}
+		outputIds.erase(spilledEnd,
+		                outputIds.end());
+		pool_.run(outputIds,
+		          costs,
+		          [this] (uint64_t outputId,
+		                  uint64_t)
+		          {
+			          MemoryScope scope(MemorySubsystem::WRITERS);
+
+			          sorters_[outputId]->spill();
+		          });
+	}
+
+	/**
+	 * \brief Write the files of the records sorted by name, merging the runs
+	 * of every file with the records left in memory.
+	 *
+	 * Files are written concurrently, each one by a single thread, directly
+	 * rather than through the scheduler.
+	 */
+	inline void
+	writeSortedOutputs_ ()
+	{
+		std::vector<uint64_t> outputIds;
+		std::vector<uint64_t> costs;
+
+		for (auto i = 0ul; i < sorters_.size(); i++)
+		{
+			if (sorters_[i]->getRecordsCount() > 0)
+			{
+				outputIds.emplace_back(i);
+				costs.emplace_back(sorters_[i]->getRecordsCount());
+			}
+		}
+		pool_.run(outputIds,
+		          costs,
+		          [this] (uint64_t outputId,
+		                  uint64_t threadIndex)
+		          {
+			          MemoryScope scope(MemorySubsystem::WRITERS);
+			          auto&       writer = *writers_[threadIndex];
+
+			          writer.configure(paths_[outputId],
+			                           *reference_,
+			                           false,
+			                           config_.writeBed,
+			                           config_.compressionBackend,
+			                           config_.compressionLevel,
+			                           BgzfWriter::TBlockSink());
+			          writer.writeHeaderBlob(headerBlob_);
+			          sorters_[outputId]->merge([&writer] (const char* rawRecord)
+			                                    {
+				                                    writer.writeRaw(rawRecord);
+			                                    });
+			          writer.reset();
+			          isCreated_[outputId] = 1;
+		          });
+	}
+
+	/**
+	 * \brief Hand the compressed blocks of the noise file to the scheduler.
+	 */
+	inline void
+	submitNoise_ ()
+	{
+		scheduler_.submit(noiseFileId_,
+		                  noiseBlocks_.data(),
+		                  noiseBlocks_.size());
+		noiseBlocks_.clear();
+	}
+
+	/**
+	 * \brief Re-encode every BAM file written as a CRAM file, and remove it.
+	 *
+	 * Files are encoded concurrently, each one by a single thread.
+	 */
+	inline void
+	encodeCram_ ()
+	{
+		std::vector<fs::path*>          bamPaths;
+		std::vector<std::exception_ptr> errors;
+
+		// Files skipped by the empty output policy do not exist.
+		for (auto& p : paths_)
+		{
+			if (fs::exists(p))
+			{
+				bamPaths.emplace_back(&p);
+			}
+		}
+		bamPaths.emplace_back(&noisePath_);
+		errors.assign(bamPaths.size(),
+		              nullptr);
+
+		#pragma omp parallel for schedule(dynamic, 1)
+		for (auto i = 0l; i < static_cast<int64_t>(bamPaths.size()); i++)
+		{
+			try
+			{
+#ifdef SCTOOLS_WITH_HTSLIB
+				auto cramPath = *bamPaths[i];
+
+				cramPath.replace_extension(".cram");
+				Cram::encodeBam(*bamPaths[i],
+				                cramPath,
+				                config_.referenceFilePath);
+				fs::remove(*bamPaths[i]);
+#endif
+			}
+			catch (...)
+			{
+				errors[i] = std::current_exception();
+			}
+		}
+		for (const auto& e : errors)
+		{
+			if (e != nullptr)
+			{
+				std::rethrow_exception(e);
+			}
+		}
+		for (auto& p : paths_)
+		{
+			p.replace_extension(".cram");
+		}
+		noisePath_.replace_extension(".cram");
+	}
+
+	/**
+	 * \brief Handle the output files which have never been created,
+	 * according to the empty output policy.
+	 */
+	inline void
+	finishEmptyOutputs_ ()
+	{
+		std::vector<uint64_t> emptyCells;
+
+		for (auto i = 0ul; i < isCreated_.size(); i++)
+		{
+			if (!isCreated_[i])
+			{
+				emptyCells.emplace_back(i);
+			}
+		}
+		std::sort(emptyCells.begin(),
+		          emptyCells.end(),
+		          [this] (uint64_t lhs,
+		                  uint64_t rhs)
+		          {
+			          return paths_[lhs] < paths_[rhs];
+		          });
+
+		switch (config_.emptyOutputPolicy)
+		{
+		case EmptyOutputPolicy::EMPTY_FILE:
+			// Write the bare header, so that every target barcode has a valid
+			// output file.
+			for (auto i : emptyCells)
+			{
+				std::ofstream emptyWriter(paths_[i],
+				                          std::ios::binary);
+
+				emptyWriter.write(headerBlob_.data(),
+				                  headerBlob_.size());
+				if (reference_->isBinary())
+				{
+					emptyWriter.write(Bgzf::eofBlock().data(),
+					                  Bgzf::eofBlock().size());
+				}
+			}
+			break;
+		case EmptyOutputPolicy::MANIFEST:
+		{
+			std::ofstream manifestWriter(config_.outputDirPath / "empty_barcodes.txt");
+
+			for (auto i : emptyCells)
+			{
+				manifestWriter << paths_[i].stem().string() << "\n";
+			}
+			break;
+		}
+		case EmptyOutputPolicy::SKIP:
+			break;
+		}
+	}
+};
+
+} // sctools
+
+#endif // SCTOOLS_INCLUDE_SCTOOLS_FILE_SINK_H
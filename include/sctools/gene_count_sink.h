@@ -0,0 +1,431 @@
+/**
+ * \file   include/sctools/gene_count_sink.h
+ * \author Elena Grassi
+ * \author Marilisa Montemurro
+ * \author Emanuele Parisi
+ * \date   February, 2019
+ *
+ * File containing the sink counting the de-multiplexed alignment records of
+ * every gene.
+ */
+
+#ifndef SCTOOLS_INCLUDE_SCTOOLS_GENE_COUNT_SINK_H
+#define SCTOOLS_INCLUDE_SCTOOLS_GENE_COUNT_SINK_H
+
+#include <algorithm>
+#include <experimental/filesystem>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+
+#include <seqan/bam_io.h>
+
+#include "aligned_blocks.h"
+#include "alignments_reader.h"
+#include "annotation_index.h"
+#include "bam_record_view.h"
+#include "record_sink.h"
+
+namespace fs = std::experimental::filesystem;
+
+namespace sctools
+{
+
+/**
+ * \brief Sink counting the records of every target barcode overlapping every
+ * gene of an annotation, and forwarding them to another sink.
+ *
+ * Every read, or pair of reads, is counted once: secondary and supplementary
+ * alignments are skipped, and so are the second reads of pairs, unless their
+ * first read is unmapped. A record is assigned to a gene when its aligned
+ * blocks overlap the intervals of that gene only, regardless of the strand.
+ * Records overlapping no gene, or several ones, are only reported. Counts are written in the Matrix Market
+ * format, with genes as rows and target barcodes as columns, to the
+ * matrix.mtx file of the gene_counts directory of the output directory, along
+ * with the features.tsv and barcodes.tsv files naming rows and columns.
+ */
+class GeneCountSink : public RecordSink
+{
+
+public:
+
+	/**
+	 * Class constructor.
+	 */
+	GeneCountSink () = default;
+
+	/**
+	 * \brief Class copy constructor.
+	 *
+	 * \param other is the object the current instance is initialized from.
+	 */
+	GeneCountSink (const GeneCountSink& other) = delete;
+
+	/**
+	 * \brief Class copy assignment operator.
+	 *
+	 * \param other is the object the current instance is initialized from.
+	 * \return a reference to the assigned object.
+	 */
+	GeneCountSink&
+	operator= (const GeneCountSink& other) = delete;
+
+	/**
+	 * \brief Initialize the sink.
+	 *
+	 * \param index is the annotation records are counted against, which
+	 * must outlive the sink.
+	 * \param outputDirPath is the path to the directory the count matrix is
+	 * written to.
+	 * \param next is the sink records are forwarded to once they have been
+	 * counted, or nullptr for dropping them.
+	 */
+	inline void
+	configure (const AnnotationIndex& index,
+	           const fs::path& outputDirPath,
+	           RecordSink* next = nullptr)
+	{
+		if (!fs::is_directory(outputDirPath))
+		{
+			throw std::invalid_argument("output directory '" +
+			                            outputDirPath.string() +
+			                            "' does not exist");
+		}
+		index_         = &index;
+		outputDirPath_ = outputDirPath;
+		next_          = next;
+	}
+
+	void
+	begin (const AlignmentsReader& reference,
+	       const std::vector<std::string>& barcodes) override
+	{
+		auto        context = reference.getContext();
+		const auto& names   = seqan::contigNames(context);
+
+		// Reference sequences are matched with the contigs of the annotation
+		// by name.
+		contigIds_.clear();
+		for (auto i = 0ul; i < seqan::length(names); i++)
+		{
+			contigIds_.emplace_back(index_->findContig(std::string(seqan::begin(names[i],
+			                                                                    seqan::Standard()),
+			                                                       seqan::end(names[i],
+			                                                                  seqan::Standard()))));
+		}
+		barcodes_       = barcodes;
+		assignedCount_  = 0;
+		noFeatureCount_ = 0;
+		ambiguousCount_ = 0;
+		skippedCount_   = 0;
+		counts_.clear();
+
+		if (next_ != nullptr)
+		{
+			next_->begin(reference,
+			             barcodes);
+		}
+	}
+
+	void
+	write (uint64_t cellId,
+	       const std::string& barcode,
+	       std::vector<seqan::BamAlignmentRecord>& records) override
+	{
+		// Records of a cell come in order, so the cursor only moves forward
+		// within a call.
+		AnnotationIndex::Cursor cursor;
+
+		for (const auto& r : records)
+		{
+			countRecord_(cellId,
+			             r,
+			             cursor);
+		}
+		if (next_ != nullptr)
+		{
+			next_->write(cellId,
+			             barcode,
+			             records);
+		}
+	}
+
+	void
+	writeNoise (std::vector<seqan::BamAlignmentRecord>& records) override
+	{
+		if (next_ != nullptr)
+		{
+			next_->writeNoise(records);
+		}
+	}
+
+	void
+	endBatch () override
+	{
+		if (next_ != nullptr)
+		{
+			next_->endBatch();
+		}
+	}
+
+	void
+	finish (const DemultiplexerStatistics& statistics) override
+	{
+		writeMatrix_();
+		if (next_ != nullptr)
+		{
+			next_->finish(statistics);
+		}
+	}
+
+	/**
+	 * \brief Access the number of records assigned to a gene.
+	 *
+	 * \return the number of records assigned to a gene.
+	 */
+	inline uint64_t
+	getAssignedCount () const noexcept
+	{
+		return assignedCount_;
+	}
+
+	/**
+	 * \brief Access the number of records overlapping no gene.
+	 *
+	 * \return the number of mapped records overlapping no gene.
+	 */
+	inline uint64_t
+	getNoFeatureCount () const noexcept
+	{
+		return noFeatureCount_;
+	}
+
+	/**
+	 * \brief Access the number of records overlapping several genes.
+	 *
+	 * \return the number of records overlapping several genes.
+	 */
+	inline uint64_t
+	getAmbiguousCount () const noexcept
+	{
+		return ambiguousCount_;
+	}
+
+	/**
+	 * \brief Access the number of mapped records which are not counted.
+	 *
+	 * \return the number of secondary and supplementary alignments, and of
+	 * second reads of pairs whose first read is mapped.
+	 */
+	inline uint64_t
+	getSkippedCount () const noexcept
+	{
+		return skippedCount_;
+	}
+
+	/**
+	 * \brief Access the number of non-zero entries of the count matrix.
+	 *
+	 * \return the number of pairs of target barcode and gene with at least
+	 * one record.
+	 */
+	inline uint64_t
+	getEntriesCount () const noexcept
+	{
+		return counts_.size();
+	}
+
+private:
+	/**
+	 * Annotation records are counted against.
+	 */
+	const AnnotationIndex*                 index_          = nullptr;
+	/**
+	 * Path to the directory the count matrix is written to.
+	 */
+	fs::path                               outputDirPath_;
+	/**
+	 * Sink records are forwarded to.
+	 */
+	RecordSink*                            next_           = nullptr;
+	/**
+	 * Contig of the annotation of every reference sequence, or -1 if it has
+	 * no gene.
+	 */
+	std::vector<int64_t>                   contigIds_;
+	/**
+	 * Target barcodes, naming the columns of the count matrix.
+	 */
+	std::vector<std::string>               barcodes_;
+	/**
+	 * Genes overlapped by the record being counted.
+	 */
+	std::vector<uint32_t>                  genes_;
+	/**
+	 * Count of every pair of target barcode and gene, keyed by the index of
+	 * the barcode in the upper half and the index of the gene in the lower
+	 * one.
+	 */
+	std::unordered_map<uint64_t, uint64_t> counts_;
+	/**
+	 * Number of records assigned to a gene.
+	 */
+	uint64_t                               assignedCount_  = 0;
+	/**
+	 * Number of mapped records overlapping no gene.
+	 */
+	uint64_t                               noFeatureCount_ = 0;
+	/**
+	 * Number of records overlapping several genes.
+	 */
+	uint64_t                               ambiguousCount_ = 0;
+	/**
+	 * Number of mapped records which are not counted.
+	 */
+	uint64_t                               skippedCount_   = 0;
+
+	/**
+	 * \brief Assign a record to the gene it overlaps, if it is unique.
+	 *
+	 * \param cellId is the index of the target barcode of the record.
+	 * \param record is the record.
+	 * \param cursor is the cursor of the previous record of the barcode.
+	 */
+	inline void
+	countRecord_ (uint64_t cellId,
+	              const seqan::BamAlignmentRecord& record,
+	              AnnotationIndex::Cursor& cursor)
+	{
+		if (seqan::hasFlagUnmapped(record))
+		{
+			return;
+		}
+
+		// Pairs are counted through their first read, or through the second
+		// one if the first is unmapped.
+		if ((record.flag & (BamRecordView::FLAG_SECONDARY | BamRecordView::FLAG_SUPPLEMENTARY)) != 0 ||
+		    ((record.flag & BamRecordView::FLAG_PAIRED) != 0 &&
+		     (record.flag & BamRecordView::FLAG_READ2) != 0 &&
+		     (record.flag & BamRecordView::FLAG_MATE_UNMAPPED) == 0))
+		{
+			skippedCount_ += 1;
+			return;
+		}
+		if (record.rID < 0 || static_cast<uint64_t>(record.rID) >= contigIds_.size())
+		{
+			noFeatureCount_ += 1;
+			return;
+		}
+
+		auto contigId = contigIds_[record.rID];
+
+		if (contigId < 0)
+		{
+			noFeatureCount_ += 1;
+			return;
+		}
+
+		// Every block starts at or after the record, so a single seek serves
+		// all of them.
+		genes_.clear();
+		index_->seek(cursor,
+		             contigId,
+		             record.beginPos);
+		forEachAlignedBlock(record,
+		                    [this, &cursor] (int32_t start,
+		                                     int32_t end)
+		                    {
+			                    index_->forEachOverlap(cursor,
+			                                           start,
+			                                           end,
+			                                           [this] (uint32_t geneId)
+			                                           {
+				                                           genes_.emplace_back(geneId);
+			                                           });
+		                    });
+		std::sort(genes_.begin(),
+		          genes_.end());
+		genes_.erase(std::unique(genes_.begin(),
+		                         genes_.end()),
+		             genes_.end());
+		if (genes_.empty())
+		{
+			noFeatureCount_ += 1;
+		}
+		else if (genes_.size() > 1)
+		{
+			ambiguousCount_ += 1;
+		}
+		else
+		{
+			counts_[(cellId << 32) | genes_.front()] += 1;
+			assignedCount_ += 1;
+		}
+	}
+
+	/**
+	 * \brief Write the count matrix, along with the names of its rows and
+	 * columns.
+	 */
+	inline void
+	writeMatrix_ () const
+	{
+		auto                                                  countsDirPath = outputDirPath_ / "gene_counts";
+		std::vector<std::tuple<uint64_t, uint64_t, uint64_t>> entries;
+		std::ofstream                                         matrixStream;
+		std::ofstream                                         featuresStream;
+		std::ofstream                                         barcodesStream;
+
+		fs::create_directories(countsDirPath);
+
+		// Entries are sorted by column, then by row.
+		entries.reserve(counts_.size());
+		for (const auto& c : counts_)
+		{
+			entries.emplace_back(c.first >> 32,
+			                     c.first & 0xffffffffull,
+			                     c.second);
+		}
+		std::sort(entries.begin(),
+		          entries.end());
+
+		matrixStream.open(countsDirPath / "matrix.mtx");
+		matrixStream << "%%MatrixMarket matrix coordinate integer general\n"
+		             << index_->getGenesCount() << " "
+		             << barcodes_.size() << " "
+		             << entries.size() << "\n";
+		for (const auto& e : entries)
+		{
+			matrixStream << std::get<1>(e) + 1 << " "
+			             << std::get<0>(e) + 1 << " "
+			             << std::get<2>(e) << "\n";
+		}
+
+		featuresStream.open(countsDirPath / "features.tsv");
+		for (auto i = 0ul; i < index_->getGenesCount(); i++)
+		{
+			featuresStream << index_->getGeneId(i) << "\t"
+			               << index_->getGeneName(i) << "\tGene Expression\n";
+		}
+
+		barcodesStream.open(countsDirPath / "barcodes.tsv");
+		for (const auto& b : barcodes_)
+		{
+			barcodesStream << b << "\n";
+		}
+
+		if (!matrixStream || !featuresStream || !barcodesStream)
+		{
+			throw std::runtime_error("cannot write the gene count matrix to '" +
+			                         countsDirPath.string() +
+			                         "'");
+		}
+	}
+};
+
+} // sctools
+
+#endif // SCTOOLS_INCLUDE_SCTOOLS_GENE_COUNT_SINK_H
@@ -0,0 +1,73 @@
+/**
+ * \file   include/sctools/hash.h
+ * \author Elena Grassi
+ * \author Marilisa Montemurro
+ * \author Emanuele Parisi
+ * \date   February, 2019
+ *
+ * File containing the hashing of byte strings shared by the sketches and the
+ * samplers of reads and barcodes.
+ */
+
+#ifndef SCTOOLS_INCLUDE_SCTOOLS_HASH_H
+#define SCTOOLS_INCLUDE_SCTOOLS_HASH_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+namespace sctools
+{
+
+/**
+ * \brief Scramble the bits of a 64 bits word, with the finalizer of
+ * splitmix64.
+ *
+ * \param x is the word to be scrambled.
+ * \return the scrambled word.
+ */
+inline uint64_t
+mixBits (uint64_t x) noexcept
+{
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ull;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebull;
+	x ^= x >> 31;
+
+	return x;
+}
+
+/**
+ * \brief Hash a byte string, 8 bytes at a time.
+ *
+ * \param data is the byte string.
+ * \param size is the length of the byte string.
+ * \param seed is the seed of the hash, so that different seeds yield
+ * independent hashes.
+ * \return the hash of the byte string.
+ */
+inline uint64_t
+hashBytes (const char* data,
+           uint64_t size,
+           uint64_t seed = 0) noexcept
+{
+	uint64_t h = mixBits(seed ^ (size * 0x9e3779b97f4a7c15ull));
+
+	for (auto i = 0ull; i < size; i += 8)
+	{
+		uint64_t word = 0;
+
+		std::memcpy(&word,
+		            data + i,
+		            std::min<uint64_t>(8,
+		                               size - i));
+		h = mixBits(h ^ word) + 0x9e3779b97f4a7c15ull;
+	}
+
+	return mixBits(h);
+}
+
+} // sctools
+
+#endif // SCTOOLS_INCLUDE_SCTOOLS_HASH_H
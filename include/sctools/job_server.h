@@ -0,0 +1,850 @@
+/**
+ * \file   include/sctools/job_server.h
+ * \author Elena Grassi
+ * \author Marilisa Montemurro
+ * \author Emanuele Parisi
+ * \date   February, 2019
+ *
+ * File containing facilities for running jobs submitted through a local
+ * socket.
+ */
+
+#ifndef SCTOOLS_INCLUDE_SCTOOLS_JOB_SERVER_H
+#define SCTOOLS_INCLUDE_SCTOOLS_JOB_SERVER_H
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <experimental/filesystem>
+#include <mutex>
+#include <ostream>
+#include <stdexcept>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace fs = std::experimental::filesystem;
+
+namespace sctools
+{
+
+/**
+ * \brief Class sharing a fixed number of threads among concurrent jobs.
+ *
+ * A job asks for the threads it would like to run on, and is granted as many
+ * as are left, waiting only while none is left.
+ */
+class ThreadBudget
+{
+
+public:
+
+	/**
+	 * Class constructor.
+	 */
+	ThreadBudget () = default;
+
+	/**
+	 * \brief Class copy constructor.
+	 *
+	 * \param other is the object the current instance is initialized from.
+	 */
+	ThreadBudget (const ThreadBudget& other) = delete;
+
+	/**
+	 * \brief Class copy assignment operator.
+	 *
+	 * \param other is the object the current instance is initialized from.
+	 * \return a reference to the assigned object.
+	 */
+	ThreadBudget&
+	operator= (const ThreadBudget& other) = delete;
+
+	/**
+	 * \brief Initialize the budget, with no thread granted.
+	 *
+	 * \param threadsCount is the number of threads shared among the jobs.
+	 */
+	inline void
+	configure (uint64_t threadsCount)
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+
+		if (threadsCount == 0)
+		{
+			throw std::invalid_argument("the thread budget must be positive");
+		}
+		threadsCount_   = threadsCount;
+		availableCount_ = threadsCount;
+	}
+
+	/**
+	 * \brief Access the number of threads shared among the jobs.
+	 *
+	 * \return the number of threads of the budget.
+	 */
+	inline uint64_t
+	getThreadsCount () const noexcept
+	{
+		return threadsCount_;
+	}
+
+	/**
+	 * \brief Take threads from the budget, waiting until at least one is
+	 * left.
+	 *
+	 * \param requestedCount is the number of threads the job would like to
+	 * run on.
+	 * \return the number of threads granted, between 1 and the requested
+	 * number, which must be given back through release().
+	 */
+	inline uint64_t
+	acquire (uint64_t requestedCount)
+	{
+		std::unique_lock<std::mutex> lock(mutex_);
+		uint64_t                     grantedCount;
+
+		released_.wait(lock,
+		               [this] ()
+		               {
+			               return availableCount_ > 0;
+		               });
+		grantedCount     = std::min(std::max<uint64_t>(requestedCount,
+		                                               1),
+		                            availableCount_);
+		availableCount_ -= grantedCount;
+
+		return grantedCount;
+	}
+
+	/**
+	 * \brief Give threads back to the budget.
+	 *
+	 * \param grantedCount is the number of threads returned by acquire().
+	 */
+	inline void
+	release (uint64_t grantedCount)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+
+			availableCount_ += grantedCount;
+		}
+		released_.notify_all();
+	}
+
+private:
+	/**
+	 * Mutex guarding the number of threads left.
+	 */
+	std::mutex              mutex_;
+	/**
+	 * Condition notified whenever threads are given back.
+	 */
+	std::condition_variable released_;
+	/**
+	 * Number of threads shared among the jobs.
+	 */
+	uint64_t                threadsCount_   = 0;
+	/**
+	 * Number of threads not granted to any job.
+	 */
+	uint64_t                availableCount_ = 0;
+};
+
+/**
+ * \brief Class running the jobs submitted through a Unix domain socket.
+ *
+ * A fixed set of worker threads, living as long as the server, runs the jobs,
+ * so that the state they keep from job to job stays warm. A request lists the
+ * working directory of the client followed by the job arguments, every field
+ * ended by a NUL byte and the request ended by an empty field. The server
+ * streams back the job output, then a NUL byte followed by the error message
+ * of the job, empty if the job succeeded, and closes the connection.
+ */
+class JobServer
+{
+
+public:
+
+	/**
+	 * Maximum number of bytes of a request.
+	 */
+	static constexpr uint64_t MAX_REQUEST_SIZE = 1ull << 20;
+
+	/**
+	 * \brief Struct storing a submitted job.
+	 */
+	struct Request
+	{
+		/**
+		 * Directory the client runs in, relative paths of the job arguments
+		 * refer to.
+		 */
+		std::string              workingDirPath;
+		/**
+		 * Arguments of the job, none of them empty.
+		 */
+		std::vector<std::string> arguments;
+	};
+
+	/**
+	 * Class constructor.
+	 */
+	JobServer () = default;
+
+	/**
+	 * \brief Class copy constructor.
+	 *
+	 * \param other is the object the current instance is initialized from.
+	 */
+	JobServer (const JobServer& other) = delete;
+
+	/**
+	 * \brief Class copy assignment operator.
+	 *
+	 * \param other is the object the current instance is initialized from.
+	 * \return a reference to the assigned object.
+	 */
+	JobServer&
+	operator= (const JobServer& other) = delete;
+
+	/**
+	 * \brief Class destructor, removing the socket.
+	 */
+	~JobServer ()
+	{
+		if (listenFd_ >= 0)
+		{
+			::close(listenFd_);
+			::unlink(socketPath_.c_str());
+		}
+	}
+
+	/**
+	 * \brief Create the socket jobs are submitted through.
+	 *
+	 * The socket is accessible by its owner only. A stale socket left by a
+	 * server which is not running anymore is replaced.
+	 *
+	 * \param socketPath is the path of the socket.
+	 * \param workersCount is the maximum number of jobs run concurrently.
+	 */
+	inline void
+	configure (const fs::path& socketPath,
+	           uint64_t workersCount)
+	{
+		sockaddr_un address = makeAddress_(socketPath);
+
+		if (listenFd_ >= 0)
+		{
+			throw std::logic_error("the job server is already configured");
+		}
+		if (workersCount == 0)
+		{
+			throw std::invalid_argument("the number of concurrent jobs must be positive");
+		}
+		if (fs::exists(fs::symlink_status(socketPath)))
+		{
+			int probeFd = connect_(socketPath);
+
+			if (probeFd >= 0)
+			{
+				::close(probeFd);
+				throw std::runtime_error("'" +
+				                         socketPath.string() +
+				                         "' is already served");
+			}
+			if (!fs::is_socket(fs::symlink_status(socketPath)))
+			{
+				throw std::runtime_error("'" +
+				                         socketPath.string() +
+				                         "' exists and is not a socket");
+			}
+			fs::remove(socketPath);
+		}
+
+		listenFd_ = ::socket(AF_UNIX,
+		                     SOCK_STREAM | SOCK_CLOEXEC,
+		                     0);
+		if (listenFd_ < 0)
+		{
+			throw std::runtime_error(std::string("cannot create the job socket: ") +
+			                         std::strerror(errno));
+		}
+		if (::bind(listenFd_,
+		           reinterpret_cast<const sockaddr*>(&address),
+		           sizeof(address)) < 0 ||
+		    ::chmod(socketPath.c_str(),
+		            S_IRUSR | S_IWUSR) < 0 ||
+		    ::listen(listenFd_,
+		             SOMAXCONN) < 0)
+		{
+			auto error = errno;
+
+			::close(listenFd_);
+			listenFd_ = -1;
+			::unlink(socketPath.c_str());
+			throw std::runtime_error("cannot listen on '" +
+			                         socketPath.string() +
+			                         "': " +
+			                         std::strerror(error));
+		}
+		socketPath_   = socketPath;
+		workersCount_ = workersCount;
+		stopping_     = false;
+	}
+
+	/**
+	 * \brief Run the submitted jobs until the server is stopped.
+	 *
+	 * Jobs accepted before the server is stopped are run to completion.
+	 *
+	 * \param handler is called as handler(request, output) for every job,
+	 * concurrently from the worker threads, where output is the stream sent
+	 * back to the client. The job fails if the handler throws an exception.
+	 */
+	template <typename THandler>
+	inline void
+	serve (THandler&& handler)
+	{
+		std::vector<std::thread> workers;
+		std::exception_ptr       error;
+
+		if (listenFd_ < 0)
+		{
+			throw std::logic_error("the job server is not configured");
+		}
+		for (auto i = 0ul; i < workersCount_; i++)
+		{
+			workers.emplace_back([this, &handler] ()
+			                     {
+				                     int clientFd;
+
+				                     while (popClient_(clientFd))
+				                     {
+					                     runJob_(clientFd,
+					                             handler);
+				                     }
+			                     });
+		}
+
+		// Queue the accepted connections for the workers, until the listening
+		// socket is shut down.
+		while (!stopping_)
+		{
+			int clientFd = ::accept4(listenFd_,
+			                         nullptr,
+			                         nullptr,
+			                         SOCK_CLOEXEC);
+
+			if (clientFd < 0)
+			{
+				if (stopping_ || errno == EINTR || errno == ECONNABORTED)
+				{
+					continue;
+				}
+				error = std::make_exception_ptr(std::runtime_error(std::string("cannot accept a job: ") +
+				                                                   std::strerror(errno)));
+				break;
+			}
+			{
+				std::lock_guard<std::mutex> lock(pendingMutex_);
+
+				pending_.emplace_back(clientFd);
+			}
+			pendingCondition_.notify_one();
+		}
+		{
+			std::lock_guard<std::mutex> lock(pendingMutex_);
+
+			stopping_ = true;
+		}
+		pendingCondition_.notify_all();
+		for (auto& w : workers)
+		{
+			w.join();
+		}
+		if (error)
+		{
+			std::rethrow_exception(error);
+		}
+	}
+
+	/**
+	 * \brief Stop accepting jobs, letting serve() return once the accepted
+	 * jobs are over.
+	 *
+	 * It is safe to call it from a signal handler.
+	 */
+	inline void
+	stop () noexcept
+	{
+		stopping_ = true;
+		if (listenFd_ >= 0)
+		{
+			::shutdown(listenFd_,
+			           SHUT_RDWR);
+		}
+	}
+
+	/**
+	 * \brief Submit a job to a server, and wait for its completion.
+	 *
+	 * \param socketPath is the path of the socket the server listens on.
+	 * \param request is the job to be run.
+	 * \param output receives the output of the job, as it is produced.
+	 */
+	static inline void
+	submit (const fs::path& socketPath,
+	        const Request& request,
+	        std::ostream& output)
+	{
+		std::string message;
+		std::string response(64 * 1024,
+		                     '\0');
+		bool        ended = false;
+		int         fd;
+
+		// Encode the request, then send it whole.
+		message = request.workingDirPath;
+		message.push_back('\0');
+		for (const auto& a : request.arguments)
+		{
+			if (a.empty())
+			{
+				throw std::invalid_argument("job arguments cannot be empty");
+			}
+			message += a;
+			message.push_back('\0');
+		}
+		message.push_back('\0');
+		if (request.workingDirPath.empty() || message.size() > MAX_REQUEST_SIZE)
+		{
+			throw std::invalid_argument("invalid job request");
+		}
+		fd = connect_(socketPath);
+		if (fd < 0)
+		{
+			throw std::runtime_error("cannot connect to '" +
+			                         socketPath.string() +
+			                         "': " +
+			                         std::strerror(errno));
+		}
+		if (!sendAll_(fd,
+		              message.data(),
+		              message.size()))
+		{
+			::close(fd);
+			throw std::runtime_error("cannot submit the job to '" +
+			                         socketPath.string() +
+			                         "'");
+		}
+
+		// Forward the output of the job, then collect its error message.
+		message.clear();
+		while (true)
+		{
+			auto received = ::recv(fd,
+			                       &response[0],
+			                       response.size(),
+			                       0);
+
+			if (received < 0 && errno == EINTR)
+			{
+				continue;
+			}
+			if (received <= 0)
+			{
+				break;
+			}
+			if (ended)
+			{
+				message.append(response.data(),
+				               received);
+				continue;
+			}
+
+			auto end = static_cast<const char*>(std::memchr(response.data(),
+			                                                '\0',
+			                                                received));
+
+			if (end == nullptr)
+			{
+				output.write(response.data(),
+				             received);
+				continue;
+			}
+			output.write(response.data(),
+			             end - response.data());
+			message.append(end + 1,
+			               response.data() + received);
+			ended = true;
+		}
+		::close(fd);
+		output.flush();
+		if (!ended)
+		{
+			throw std::runtime_error("the job server closed the connection");
+		}
+		if (!message.empty())
+		{
+			throw std::runtime_error(message);
+		}
+	}
+
+private:
+	/**
+	 * Number of seconds a client is given for sending its request.
+	 */
+	static constexpr long     REQUEST_TIMEOUT_ = 10;
+
+	/**
+	 * \brief Class buffering the output of a job, and sending it to the
+	 * client.
+	 *
+	 * Once the client is gone, the output is discarded, and the job goes on.
+	 */
+	class SocketBuffer_ : public std::streambuf
+	{
+
+	public:
+
+		/**
+		 * \brief Class constructor.
+		 *
+		 * \param fd is the socket connected to the client.
+		 */
+		explicit SocketBuffer_ (int fd)
+			: fd_(fd),
+			  buffer_(64 * 1024)
+		{
+			setp(buffer_.data(),
+			     buffer_.data() + buffer_.size());
+		}
+
+	protected:
+		/**
+		 * \brief Send the buffered output, then buffer a character.
+		 *
+		 * \param c is the character which did not fit the buffer.
+		 * \return the character, or EOF.
+		 */
+		inline int_type
+		overflow (int_type c) override
+		{
+			sync();
+			if (!traits_type::eq_int_type(c,
+			                              traits_type::eof()))
+			{
+				*pptr() = traits_type::to_char_type(c);
+				pbump(1);
+			}
+
+			return traits_type::not_eof(c);
+		}
+
+		/**
+		 * \brief Send the buffered output.
+		 *
+		 * \return always 0, as a client which is gone does not fail the job.
+		 */
+		inline int
+		sync () override
+		{
+			connected_ = connected_ && sendAll_(fd_,
+			                                    pbase(),
+			                                    pptr() - pbase());
+			setp(buffer_.data(),
+			     buffer_.data() + buffer_.size());
+
+			return 0;
+		}
+
+	private:
+		/**
+		 * Socket connected to the client.
+		 */
+		int               fd_;
+		/**
+		 * Output not sent yet.
+		 */
+		std::vector<char> buffer_;
+		/**
+		 * Flag which is false once the client is gone.
+		 */
+		bool              connected_ = true;
+	};
+
+	/**
+	 * Path of the socket.
+	 */
+	fs::path                socketPath_;
+	/**
+	 * Listening socket, or -1 if the server is not configured.
+	 */
+	int                     listenFd_     = -1;
+	/**
+	 * Number of worker threads.
+	 */
+	uint64_t                workersCount_ = 0;
+	/**
+	 * Flag which is set once the server stops accepting jobs.
+	 */
+	std::atomic<bool>       stopping_{false};
+	/**
+	 * Mutex guarding the accepted connections.
+	 */
+	std::mutex              pendingMutex_;
+	/**
+	 * Condition notified whenever a connection is accepted, or the server
+	 * stops.
+	 */
+	std::condition_variable pendingCondition_;
+	/**
+	 * Connections accepted and not yet taken by a worker.
+	 */
+	std::deque<int>         pending_;
+
+	/**
+	 * \brief Build the address of a socket.
+	 *
+	 * \param socketPath is the path of the socket.
+	 * \return the address.
+	 */
+	static inline sockaddr_un
+	makeAddress_ (const fs::path& socketPath)
+	{
+		sockaddr_un address;
+
+		std::memset(&address,
+		            0,
+		            sizeof(address));
+		address.sun_family = AF_UNIX;
+		if (socketPath.empty() || socketPath.native().size() >= sizeof(address.sun_path))
+		{
+			throw std::invalid_argument("invalid socket path '" +
+			                            socketPath.string() +
+			                            "'");
+		}
+		std::memcpy(address.sun_path,
+		            socketPath.c_str(),
+		            socketPath.native().size());
+
+		return address;
+	}
+
+	/**
+	 * \brief Connect to a socket.
+	 *
+	 * \param socketPath is the path of the socket.
+	 * \return the connected socket, or -1 with errno set.
+	 */
+	static inline int
+	connect_ (const fs::path& socketPath)
+	{
+		sockaddr_un address = makeAddress_(socketPath);
+		int         fd      = ::socket(AF_UNIX,
+		                               SOCK_STREAM | SOCK_CLOEXEC,
+		                               0);
+
+		if (fd >= 0 && ::connect(fd,
+		                         reinterpret_cast<const sockaddr*>(&address),
+		                         sizeof(address)) < 0)
+		{
+			auto error = errno;
+
+			::close(fd);
+			errno = error;
+			return -1;
+		}
+
+		return fd;
+	}
+
+	/**
+	 * \brief Send bytes through a socket, without raising SIGPIPE if the peer
+	 * is gone.
+	 *
+	 * \param fd is the socket.
+	 * \param data are the bytes to be sent.
+	 * \param size is the number of bytes to be sent.
+	 * \return true if every byte has been sent.
+	 */
+	static inline bool
+	sendAll_ (int fd,
+	          const char* data,
+	          uint64_t size)
+	{
+		while (size > 0)
+		{
+			auto sent = ::send(fd,
+			                   data,
+			                   size,
+			                   MSG_NOSIGNAL);
+
+			if (sent < 0 && errno == EINTR)
+			{
+				continue;
+			}
+			if (sent <= 0)
+			{
+				return false;
+			}
+			data += sent;
+			size -= sent;
+		}
+
+		return true;
+	}
+
+	/**
+	 * \brief Take the next accepted connection.
+	 *
+	 * \param clientFd is set to the connection.
+	 * \return false if the server stopped and no connection is left.
+	 */
+	inline bool
+	popClient_ (int& clientFd)
+	{
+		std::unique_lock<std::mutex> lock(pendingMutex_);
+
+		pendingCondition_.wait(lock,
+		                       [this] ()
+		                       {
+			                       return stopping_ || !pending_.empty();
+		                       });
+		if (pending_.empty())
+		{
+			return false;
+		}
+		clientFd = pending_.front();
+		pending_.pop_front();
+
+		return true;
+	}
+
+	/**
+	 * \brief Read and decode the request of a client.
+	 *
+	 * \param clientFd is the connection.
+	 * \param request is filled with the decoded request.
+	 */
+	static inline void
+	readRequest_ (int clientFd,
+	              Request& request)
+	{
+		std::string message;
+		std::string terminator(2,
+		                       '\0');
+		char        buffer[4096];
+		timeval     timeout   = {REQUEST_TIMEOUT_,
+		                         0};
+		uint64_t    begin     = 0;
+		uint64_t    end;
+
+		// Read until the empty field ending the request, without waiting
+		// forever for a client which does not send it.
+		::setsockopt(clientFd,
+		             SOL_SOCKET,
+		             SO_RCVTIMEO,
+		             &timeout,
+		             sizeof(timeout));
+		while (message.find(terminator) == std::string::npos)
+		{
+			auto received = ::recv(clientFd,
+			                       buffer,
+			                       sizeof(buffer),
+			                       0);
+
+			if (received < 0 && errno == EINTR)
+			{
+				continue;
+			}
+			if (received <= 0 || message.size() + received > MAX_REQUEST_SIZE)
+			{
+				throw std::runtime_error("invalid job request");
+			}
+			message.append(buffer,
+			               received);
+		}
+
+		// Split the fields, the first one being the working directory.
+		request.workingDirPath.clear();
+		request.arguments.clear();
+		while ((end = message.find('\0',
+		                           begin)) != begin)
+		{
+			if (begin == 0)
+			{
+				request.workingDirPath = message.substr(0,
+				                                        end);
+			}
+			else
+			{
+				request.arguments.emplace_back(message.substr(begin,
+				                                              end - begin));
+			}
+			begin = end + 1;
+		}
+		if (begin != message.size() - 1 || begin == 0)
+		{
+			throw std::runtime_error("invalid job request");
+		}
+	}
+
+	/**
+	 * \brief Run the job of a client, and close its connection.
+	 *
+	 * \param clientFd is the connection.
+	 * \param handler is the function running the job.
+	 */
+	template <typename THandler>
+	static inline void
+	runJob_ (int clientFd,
+	         THandler& handler)
+	{
+		SocketBuffer_ buffer(clientFd);
+		std::ostream  output(&buffer);
+		Request       request;
+		std::string   trailer(1,
+		                      '\0');
+
+		try
+		{
+			readRequest_(clientFd,
+			             request);
+			handler(request,
+			        output);
+		}
+		catch (std::exception& e)
+		{
+			trailer += *e.what() != '\0' ? e.what() : "the job failed";
+		}
+		catch (...)
+		{
+			trailer += "the job failed";
+		}
+		output.flush();
+		sendAll_(clientFd,
+		         trailer.data(),
+		         trailer.size());
+		::close(clientFd);
+	}
+};
+
+} // sctools
+
+#endif // SCTOOLS_INCLUDE_SCTOOLS_JOB_SERVER_H
@@ -0,0 +1,414 @@
+/**
+ * \file   include/sctools/memory_tracker.h
+ * \author Elena Grassi
+ * \author Marilisa Montemurro
+ * \author Emanuele Parisi
+ * \date   February, 2019
+ *
+ * File containing the attribution of heap allocations to the subsystems of
+ * the de-multiplexer, and the sampling of its resident memory.
+ */
+
+#ifndef SCTOOLS_INCLUDE_SCTOOLS_MEMORY_TRACKER_H
+#define SCTOOLS_INCLUDE_SCTOOLS_MEMORY_TRACKER_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <sys/resource.h>
+#include <unistd.h>
+
+namespace sctools
+{
+
+/**
+ * \brief Enumeration of the subsystems heap allocations are attributed to.
+ */
+enum class MemorySubsystem : uint32_t
+{
+	OTHER,
+	READER,
+	BATCH_BUFFER,
+	BARCODE_MAP,
+	WRITERS,
+	METRICS,
+	COUNT
+};
+
+/**
+ * \brief Class accounting for the heap allocations of every subsystem, and
+ * sampling the resident memory of the process.
+ *
+ * Allocations are only accounted for when the program is built with the
+ * SCTOOLS_TRACK_ALLOCATIONS macro defined, and the allocation_hooks.h file is
+ * included in exactly one of its translation units. Every allocation is
+ * attributed to the subsystem of the innermost MemoryScope of the allocating
+ * thread, and its release to the same subsystem. Resident memory samples are
+ * available in every build.
+ */
+class MemoryTracker
+{
+
+public:
+
+	/**
+	 * Flag which is true if allocations are accounted for.
+	 */
+#ifdef SCTOOLS_TRACK_ALLOCATIONS
+	static constexpr bool ENABLED = true;
+#else
+	static constexpr bool ENABLED = false;
+#endif
+
+	/**
+	 * \brief Struct storing the allocations of a subsystem.
+	 */
+	struct Usage
+	{
+		/**
+		 * Number of allocations.
+		 */
+		uint64_t allocations    = 0;
+		/**
+		 * Number of bytes allocated, released ones included.
+		 */
+		uint64_t allocatedBytes = 0;
+		/**
+		 * Number of bytes allocated and not released yet.
+		 */
+		uint64_t liveBytes      = 0;
+		/**
+		 * Highest number of bytes allocated and not released at once.
+		 */
+		uint64_t peakBytes      = 0;
+	};
+
+	/**
+	 * \brief Struct storing a sample of the resident memory.
+	 */
+	struct Sample
+	{
+		/**
+		 * Description of the point the sample has been taken at.
+		 */
+		std::string label;
+		/**
+		 * Resident set size, in KiB.
+		 */
+		uint64_t    rssKiB    = 0;
+		/**
+		 * Number of heap bytes allocated and not released, in every
+		 * subsystem, if allocations are accounted for.
+		 */
+		uint64_t    liveBytes = 0;
+	};
+
+	/**
+	 * \brief Access the name of a subsystem.
+	 *
+	 * \param subsystem is the subsystem.
+	 * \return the name of the subsystem.
+	 */
+	static inline const char*
+	getName (MemorySubsystem subsystem) noexcept
+	{
+		static const char* names[] = {"other",
+		                              "reader",
+		                              "batch buffer",
+		                              "barcode map",
+		                              "writers",
+		                              "metrics"};
+
+		return names[static_cast<uint32_t>(subsystem)];
+	}
+
+	/**
+	 * \brief Access the subsystem allocations of the calling thread are
+	 * attributed to.
+	 *
+	 * \return a reference to the subsystem of the calling thread.
+	 */
+	static inline MemorySubsystem&
+	currentSubsystem () noexcept
+	{
+		static thread_local MemorySubsystem subsystem = MemorySubsystem::OTHER;
+
+		return subsystem;
+	}
+
+	/**
+	 * \brief Account for an allocation.
+	 *
+	 * \param subsystem is the subsystem the allocation is attributed to.
+	 * \param size is the number of bytes allocated.
+	 */
+	static inline void
+	recordAllocation (MemorySubsystem subsystem,
+	                  uint64_t size) noexcept
+	{
+		auto& counters = counters_()[static_cast<uint32_t>(subsystem)];
+		auto  live     = counters.liveBytes.fetch_add(size,
+		                                              std::memory_order_relaxed) + size;
+		auto  peak     = counters.peakBytes.load(std::memory_order_relaxed);
+
+		counters.allocations.fetch_add(1,
+		                               std::memory_order_relaxed);
+		counters.allocatedBytes.fetch_add(size,
+		                                  std::memory_order_relaxed);
+		while (live > peak && !counters.peakBytes.compare_exchange_weak(peak,
+		                                                                live,
+		                                                                std::memory_order_relaxed))
+		{
+		}
+	}
+
+	/**
+	 * \brief Account for the release of an allocation.
+	 *
+	 * \param subsystem is the subsystem the allocation was attributed to.
+	 * \param size is the number of bytes released.
+	 */
+	static inline void
+	recordRelease (MemorySubsystem subsystem,
+	               uint64_t size) noexcept
+	{
+		counters_()[static_cast<uint32_t>(subsystem)].liveBytes.fetch_sub(size,
+		                                                                  std::memory_order_relaxed);
+	}
+
+	/**
+	 * \brief Access the allocations of a subsystem.
+	 *
+	 * \param subsystem is the subsystem.
+	 * \return the allocations attributed to the subsystem so far.
+	 */
+	static inline Usage
+	getUsage (MemorySubsystem subsystem) noexcept
+	{
+		const auto& counters = counters_()[static_cast<uint32_t>(subsystem)];
+		Usage       usage;
+
+		usage.allocations    = counters.allocations.load(std::memory_order_relaxed);
+		usage.allocatedBytes = counters.allocatedBytes.load(std::memory_order_relaxed);
+		usage.liveBytes      = counters.liveBytes.load(std::memory_order_relaxed);
+		usage.peakBytes      = counters.peakBytes.load(std::memory_order_relaxed);
+
+		return usage;
+	}
+
+	/**
+	 * \brief Read the current resident set size of the process.
+	 *
+	 * \return the resident set size in KiB, or 0 if it cannot be read.
+	 */
+	static inline uint64_t
+	readRss () noexcept
+	{
+		unsigned long long totalPages    = 0;
+		unsigned long long residentPages = 0;
+		std::FILE*         statm         = std::fopen("/proc/self/statm",
+		                                              "r");
+
+		if (statm == nullptr)
+		{
+			return 0;
+		}
+		if (std::fscanf(statm,
+		                "%llu %llu",
+		                &totalPages,
+		                &residentPages) != 2)
+		{
+			residentPages = 0;
+		}
+		std::fclose(statm);
+
+		return residentPages * (sysconf(_SC_PAGESIZE) / 1024);
+	}
+
+	/**
+	 * \brief Read the highest resident set size the process has reached.
+	 *
+	 * \return the peak resident set size, in KiB.
+	 */
+	static inline uint64_t
+	readPeakRss () noexcept
+	{
+		struct rusage usage;
+
+		if (getrusage(RUSAGE_SELF,
+		              &usage) != 0)
+		{
+			return 0;
+		}
+
+		return usage.ru_maxrss;
+	}
+
+	/**
+	 * \brief Record a sample of the resident memory.
+	 *
+	 * \param label is the description of the point the sample is taken at.
+	 */
+	static inline void
+	sample (const std::string& label)
+	{
+		Sample                      sample;
+		std::lock_guard<std::mutex> lock(samplesMutex_());
+
+		sample.label  = label;
+		sample.rssKiB = readRss();
+		for (auto i = 0u; i < static_cast<uint32_t>(MemorySubsystem::COUNT); i++)
+		{
+			sample.liveBytes += getUsage(static_cast<MemorySubsystem>(i)).liveBytes;
+		}
+		samples_().emplace_back(sample);
+	}
+
+	/**
+	 * \brief Access the resident memory samples recorded so far.
+	 *
+	 * \return the samples, in the order they have been recorded.
+	 */
+	static inline std::vector<Sample>
+	getSamples ()
+	{
+		std::lock_guard<std::mutex> lock(samplesMutex_());
+
+		return samples_();
+	}
+
+private:
+	/**
+	 * \brief Struct storing the counters of a subsystem, updated concurrently.
+	 */
+	struct Counters_
+	{
+		/**
+		 * Number of allocations.
+		 */
+		std::atomic<uint64_t> allocations;
+		/**
+		 * Number of bytes allocated.
+		 */
+		std::atomic<uint64_t> allocatedBytes;
+		/**
+		 * Number of bytes allocated and not released yet.
+		 */
+		std::atomic<uint64_t> liveBytes;
+		/**
+		 * Highest number of live bytes.
+		 */
+		std::atomic<uint64_t> peakBytes;
+	};
+
+	/**
+	 * \brief Access the counters of every subsystem.
+	 *
+	 * They are zero-initialized before any allocation happens, and never
+	 * destroyed, so that allocations made during the static initialization
+	 * and destruction of the program are accounted for too.
+	 *
+	 * \return the counters, indexed by subsystem.
+	 */
+	static inline Counters_*
+	counters_ () noexcept
+	{
+		static Counters_ counters[static_cast<uint32_t>(MemorySubsystem::COUNT)];
+
+		return counters;
+	}
+
+	/**
+	 * \brief Access the resident memory samples.
+	 *
+	 * \return a reference to the samples.
+	 */
+	static inline std::vector<Sample>&
+	samples_ ()
+	{
+		static std::vector<Sample> samples;
+
+		return samples;
+	}
+
+	/**
+	 * \brief Access the mutex guarding the resident memory samples.
+	 *
+	 * \return a reference to the mutex.
+	 */
+	static inline std::mutex&
+	samplesMutex_ ()
+	{
+		static std::mutex samplesMutex;
+
+		return samplesMutex;
+	}
+};
+
+/**
+ * \brief Class attributing the allocations of the calling thread to a
+ * subsystem, for its whole lifetime.
+ *
+ * Scopes nest: when a scope is destroyed, the subsystem of the enclosing one
+ * is restored. They cost nothing when allocations are not accounted for.
+ */
+class MemoryScope
+{
+
+public:
+
+	/**
+	 * \brief Class constructor.
+	 *
+	 * \param subsystem is the subsystem allocations are attributed to.
+	 */
+	explicit MemoryScope (MemorySubsystem subsystem) noexcept
+	{
+		if (MemoryTracker::ENABLED)
+		{
+			previous_                         = MemoryTracker::currentSubsystem();
+			MemoryTracker::currentSubsystem() = subsystem;
+		}
+	}
+
+	/**
+	 * \brief Class copy constructor.
+	 *
+	 * \param other is the object the current instance is initialized from.
+	 */
+	MemoryScope (const MemoryScope& other) = delete;
+
+	/**
+	 * \brief Class copy assignment operator.
+	 *
+	 * \param other is the object the current instance is initialized from.
+	 * \return a reference to the assigned object.
+	 */
+	MemoryScope&
+	operator= (const MemoryScope& other) = delete;
+
+	/**
+	 * Class destructor, restoring the subsystem of the enclosing scope.
+	 */
+	~MemoryScope ()
+	{
+		if (MemoryTracker::ENABLED)
+		{
+			MemoryTracker::currentSubsystem() = previous_;
+		}
+	}
+
+private:
+	/**
+	 * Subsystem of the enclosing scope.
+	 */
+	MemorySubsystem previous_ = MemorySubsystem::OTHER;
+};
+
+} // sctools
+
+#endif // SCTOOLS_INCLUDE_SCTOOLS_MEMORY_TRACKER_H
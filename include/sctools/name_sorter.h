@@ -0,0 +1,558 @@
+/**
+ * \file   include/sctools/name_sorter.h
+ * \author Elena Grassi
+ * \author Marilisa Montemurro
+ * \author Emanuele Parisi
+ * \date   February, 2019
+ *
+ * File containing facilities for sorting the records of an output file by
+ * read name.
+ */
+
+#ifndef SCTOOLS_INCLUDE_SCTOOLS_NAME_SORTER_H
+#define SCTOOLS_INCLUDE_SCTOOLS_NAME_SORTER_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <experimental/filesystem>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include <seqan/bam_io.h>
+
+namespace fs = std::experimental::filesystem;
+
+namespace sctools
+{
+
+/**
+ * \brief Class sorting the binary records of an output file by read name.
+ *
+ * Records are encoded into an arena as they are added. When the arena is
+ * spilled, its records are sorted by an MSD radix sort over the bytes of their
+ * names, and written to a run file. Sorted records are read back by merging
+ * the runs with the records left in the arena. Records with the same name
+ * keep the order they have been added in, so mates stay in input order.
+ */
+class NameSorter
+{
+
+public:
+
+	/**
+	 * Maximum number of runs kept on disk: when it is reached, the runs are
+	 * merged into a single one by the next spill.
+	 */
+	static constexpr uint64_t MAX_RUNS = 64;
+
+	/**
+	 * Class constructor.
+	 */
+	NameSorter () = default;
+
+	/**
+	 * \brief Class copy constructor.
+	 *
+	 * \param other is the object the current instance is initialized from.
+	 */
+	NameSorter (const NameSorter& other) = delete;
+
+	/**
+	 * \brief Class copy assignment operator.
+	 *
+	 * \param other is the object the current instance is initialized from.
+	 * \return a reference to the assigned object.
+	 */
+	NameSorter&
+	operator= (const NameSorter& other) = delete;
+
+	/**
+	 * \brief Class destructor.
+	 *
+	 * Run files left on disk are removed.
+	 */
+	~NameSorter ()
+	{
+		reset();
+	}
+
+	/**
+	 * \brief Drop every record, removing the run files.
+	 */
+	inline void
+	reset () noexcept
+	{
+		std::error_code error;
+
+		for (const auto& p : runPaths_)
+		{
+			fs::remove(p,
+			           error);
+		}
+		runPaths_.clear();
+		std::string().swap(arena_);
+		std::vector<uint64_t>().swap(offsets_);
+		recordsCount_ = 0;
+		spilledCount_ = 0;
+	}
+
+	/**
+	 * \brief Initialize the sorter.
+	 *
+	 * \param runPathPrefix is the path run files are named after, followed
+	 * by their number.
+	 */
+	inline void
+	configure (const fs::path& runPathPrefix)
+	{
+		reset();
+		runPathPrefix_ = runPathPrefix;
+	}
+
+	/**
+	 * \brief Add a record.
+	 *
+	 * \param record is the record.
+	 * \param context is the context the record is encoded with.
+	 */
+	template <typename TContext>
+	inline void
+	add (const seqan::BamAlignmentRecord& record,
+	     TContext& context)
+	{
+		seqan::clear(rawRecord_);
+		seqan::write(rawRecord_,
+		             record,
+		             context,
+		             seqan::Bam());
+		offsets_.emplace_back(arena_.size());
+		arena_.append(seqan::begin(rawRecord_,
+		                           seqan::Standard()),
+		              seqan::length(rawRecord_));
+		recordsCount_ += 1;
+	}
+
+	/**
+	 * \brief Access the number of bytes of the records held in memory.
+	 *
+	 * \return the size of the arena and of the offsets of its records.
+	 */
+	inline uint64_t
+	getBufferedBytes () const noexcept
+	{
+		return arena_.size() + offsets_.size() * sizeof(uint64_t);
+	}
+
+	/**
+	 * \brief Access the number of records added since configuration.
+	 *
+	 * \return the number of records, both in memory and spilled.
+	 */
+	inline uint64_t
+	getRecordsCount () const noexcept
+	{
+		return recordsCount_;
+	}
+
+	/**
+	 * \brief Access the number of times records have been spilled.
+	 *
+	 * \return the number of runs written since configuration.
+	 */
+	inline uint64_t
+	getSpilledCount () const noexcept
+	{
+		return spilledCount_;
+	}
+
+	/**
+	 * \brief Sort the records held in memory, write them to a run file and
+	 * release the memory.
+	 *
+	 * If MAX_RUNS runs are already on disk, they are merged along with the
+	 * records in memory into a single run.
+	 */
+	inline void
+	spill ()
+	{
+		if (offsets_.empty())
+		{
+			return;
+		}
+
+		auto          runPath = runPathPrefix_;
+		std::ofstream runWriter;
+
+		runPath += std::to_string(spilledCount_);
+		runWriter.open(runPath,
+		               std::ios::binary);
+		if (!runWriter)
+		{
+			throw std::runtime_error("cannot create run file '" +
+			                         runPath.string() +
+			                         "'");
+		}
+		if (runPaths_.size() >= MAX_RUNS)
+		{
+			merge([&runWriter] (const char* rawRecord)
+			      {
+				      runWriter.write(rawRecord,
+				                      4 + blockSize_(rawRecord));
+			      });
+		}
+		else
+		{
+			sortArena_();
+			for (auto offset : offsets_)
+			{
+				runWriter.write(arena_.data() + offset,
+				                4 + blockSize_(arena_.data() + offset));
+			}
+			std::string().swap(arena_);
+			std::vector<uint64_t>().swap(offsets_);
+		}
+		runWriter.close();
+		if (!runWriter)
+		{
+			throw std::runtime_error("cannot write run file '" +
+			                         runPath.string() +
+			                         "'");
+		}
+		runPaths_.emplace_back(runPath);
+		spilledCount_ += 1;
+	}
+
+	/**
+	 * \brief Emit every record in name order, and drop them.
+	 *
+	 * \param emit is called as emit(rawRecord) for every record, where
+	 * rawRecord points to its block size.
+	 */
+	template <typename TEmit>
+	inline void
+	merge (TEmit&& emit)
+	{
+		std::vector<std::unique_ptr<RunReader_>> readers;
+		std::vector<const char*>                 heads;
+		std::vector<uint64_t>                    heap;
+		uint64_t                                 arenaCursor = 0;
+
+		sortArena_();
+		for (const auto& p : runPaths_)
+		{
+			readers.emplace_back(new RunReader_(p));
+		}
+
+		// Sources are the runs, oldest first, followed by the arena, so that
+		// ties are broken by source in the order records have been added.
+		auto arenaSource = readers.size();
+		auto advance     = [&] (uint64_t source)
+		{
+			if (source < arenaSource)
+			{
+				return readers[source]->next() ? readers[source]->get() : nullptr;
+			}
+			if (arenaCursor < offsets_.size())
+			{
+				return static_cast<const char*>(arena_.data() + offsets_[arenaCursor++]);
+			}
+
+			return static_cast<const char*>(nullptr);
+		};
+		auto after       = [&heads] (uint64_t lhs,
+		                             uint64_t rhs)
+		{
+			int order = std::strcmp(name_(heads[lhs]),
+			                        name_(heads[rhs]));
+
+			return order > 0 || (order == 0 && lhs > rhs);
+		};
+
+		heads.resize(arenaSource + 1);
+		for (auto i = 0ul; i <= arenaSource; i++)
+		{
+			heads[i] = advance(i);
+			if (heads[i] != nullptr)
+			{
+				heap.emplace_back(i);
+			}
+		}
+		std::make_heap(heap.begin(),
+		               heap.end(),
+		               after);
+		while (!heap.empty())
+		{
+			std::pop_heap(heap.begin(),
+			              heap.end(),
+			              after);
+
+			auto source = heap.back();
+
+			emit(heads[source]);
+			heads[source] = advance(source);
+			if (heads[source] != nullptr)
+			{
+				std::push_heap(heap.begin(),
+				               heap.end(),
+				               after);
+			}
+			else
+			{
+				heap.pop_back();
+			}
+		}
+
+		// Drop the merged records, but keep counting them.
+		readers.clear();
+
+		auto recordsCount = recordsCount_;
+		auto spilledCount = spilledCount_;
+
+		reset();
+		recordsCount_ = recordsCount;
+		spilledCount_ = spilledCount;
+	}
+
+private:
+	/**
+	 * Size below which ranges of records are sorted by comparison.
+	 */
+	static constexpr uint64_t RADIX_THRESHOLD_ = 64;
+
+	/**
+	 * \brief Reader of the records of a run file.
+	 */
+	class RunReader_
+	{
+
+	public:
+
+		/**
+		 * \brief Open a run file.
+		 *
+		 * \param path is the path to the run file.
+		 */
+		explicit RunReader_ (const fs::path& path) :
+			path_(path),
+			buffer_(1ul << 20)
+		{
+			source_.rdbuf()->pubsetbuf(buffer_.data(),
+			                           buffer_.size());
+			source_.open(path,
+			             std::ios::binary);
+			if (!source_)
+			{
+				throw std::runtime_error("cannot open run file '" +
+				                         path.string() +
+				                         "'");
+			}
+		}
+
+		/**
+		 * \brief Read the next record.
+		 *
+		 * \return false if the run is over.
+		 */
+		inline bool
+		next ()
+		{
+			uint32_t blockSize = 0;
+
+			if (!source_.read(reinterpret_cast<char*>(&blockSize),
+			                  4))
+			{
+				return false;
+			}
+			record_.resize(4 + blockSize);
+			std::memcpy(&record_[0],
+			            &blockSize,
+			            4);
+			if (!source_.read(&record_[4],
+			                  blockSize))
+			{
+				throw std::runtime_error("truncated run file '" +
+				                         path_.string() +
+				                         "'");
+			}
+
+			return true;
+		}
+
+		/**
+		 * \brief Access the last record read.
+		 *
+		 * \return the pointer to the block size of the record.
+		 */
+		inline const char*
+		get () const noexcept
+		{
+			return record_.data();
+		}
+
+	private:
+		/**
+		 * Path to the run file.
+		 */
+		fs::path          path_;
+		/**
+		 * Buffer of the stream.
+		 */
+		std::vector<char> buffer_;
+		/**
+		 * Stream of the run file.
+		 */
+		std::ifstream     source_;
+		/**
+		 * Last record read, block size included.
+		 */
+		std::string       record_;
+	};
+
+	/**
+	 * Path run files are named after.
+	 */
+	fs::path              runPathPrefix_;
+	/**
+	 * Paths of the run files on disk, oldest first.
+	 */
+	std::vector<fs::path> runPaths_;
+	/**
+	 * Records held in memory, block sizes included.
+	 */
+	std::string           arena_;
+	/**
+	 * Offset of every record in the arena.
+	 */
+	std::vector<uint64_t> offsets_;
+	/**
+	 * Binary representation of the record being added.
+	 */
+	seqan::CharString     rawRecord_;
+	/**
+	 * Number of records added since configuration.
+	 */
+	uint64_t              recordsCount_ = 0;
+	/**
+	 * Number of runs written since configuration.
+	 */
+	uint64_t              spilledCount_ = 0;
+
+	/**
+	 * \brief Access the block size of a binary record.
+	 *
+	 * \param rawRecord is the pointer to the block size of the record.
+	 * \return the size of the record, block size excluded.
+	 */
+	static inline uint32_t
+	blockSize_ (const char* rawRecord) noexcept
+	{
+		uint32_t blockSize = 0;
+
+		std::memcpy(&blockSize,
+		            rawRecord,
+		            4);
+
+		return blockSize;
+	}
+
+	/**
+	 * \brief Access the read name of a binary record.
+	 *
+	 * \param rawRecord is the pointer to the block size of the record.
+	 * \return the null-terminated read name.
+	 */
+	static inline const char*
+	name_ (const char* rawRecord) noexcept
+	{
+		return rawRecord + 36;
+	}
+
+	/**
+	 * \brief Sort the offsets of the records held in memory by read name.
+	 */
+	inline void
+	sortArena_ ()
+	{
+		std::vector<uint64_t> scratch(offsets_.size());
+
+		radixSort_(arena_.data(),
+		           offsets_.data(),
+		           offsets_.data() + offsets_.size(),
+		           scratch.data(),
+		           0);
+	}
+
+	/**
+	 * \brief Sort a range of records by the bytes of their names following a
+	 * common prefix, keeping the order of records with the same name.
+	 *
+	 * Records are distributed by their byte at the given depth, and every
+	 * bucket is sorted by the next byte. Names ending at that depth are equal,
+	 * so their bucket is left as it is.
+	 *
+	 * \param arena is the arena the records are stored in.
+	 * \param begin is the offset of the first record of the range.
+	 * \param end is the offset past the last record of the range.
+	 * \param scratch is a buffer as large as the range.
+	 * \param depth is the length of the prefix shared by the names.
+	 */
+	static inline void
+	radixSort_ (const char* arena,
+	            uint64_t* begin,
+	            uint64_t* end,
+	            uint64_t* scratch,
+	            uint64_t depth)
+	{
+		uint64_t bounds[257] = {};
+		uint64_t cursors[256];
+
+		if (static_cast<uint64_t>(end - begin) < RADIX_THRESHOLD_)
+		{
+			std::stable_sort(begin,
+			                 end,
+			                 [arena, depth] (uint64_t lhs,
+			                                 uint64_t rhs)
+			                 {
+				                 return std::strcmp(name_(arena + lhs) + depth,
+				                                    name_(arena + rhs) + depth) < 0;
+			                 });
+			return;
+		}
+		for (auto it = begin; it < end; it++)
+		{
+			bounds[static_cast<uint8_t>(name_(arena + *it)[depth]) + 1] += 1;
+		}
+		for (auto i = 0; i < 256; i++)
+		{
+			bounds[i + 1] += bounds[i];
+			cursors[i]     = bounds[i];
+		}
+		for (auto it = begin; it < end; it++)
+		{
+			scratch[cursors[static_cast<uint8_t>(name_(arena + *it)[depth])]++] = *it;
+		}
+		std::copy(scratch,
+		          scratch + (end - begin),
+		          begin);
+		for (auto i = 1; i < 256; i++)
+		{
+			if (bounds[i + 1] - bounds[i] > 1)
+			{
+				radixSort_(arena,
+				           begin + bounds[i],
+				           begin + bounds[i + 1],
+				           scratch + bounds[i],
+				           depth + 1);
+			}
+		}
+	}
+};
+
+} // sctools
+
+#endif // SCTOOLS_INCLUDE_SCTOOLS_NAME_SORTER_H
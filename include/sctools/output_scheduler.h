@@ -0,0 +1,1104 @@
+/**
+ * \file   include/sctools/output_scheduler.h
+ * \author Elena Grassi
+ * \author Marilisa Montemurro
+ * \author Emanuele Parisi
+ * \date   February, 2019
+ *
+ * File containing facilities for batching the writes addressed to many output
+ * files, and submitting them asynchronously through io_uring on Linux.
+ */
+
+#ifndef SCTOOLS_INCLUDE_SCTOOLS_OUTPUT_SCHEDULER_H
+#define SCTOOLS_INCLUDE_SCTOOLS_OUTPUT_SCHEDULER_H
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <experimental/filesystem>
+#include <list>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define SCTOOLS_HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
+#endif
+
+namespace fs = std::experimental::filesystem;
+
+namespace sctools
+{
+
+/**
+ * \brief Counters describing the activity of an output scheduler.
+ */
+struct OutputStatistics
+{
+	/**
+	 * Number of system calls issued, file opening and closing included.
+	 */
+	uint64_t syscalls    = 0;
+	/**
+	 * Number of write requests completed.
+	 */
+	uint64_t writes      = 0;
+	/**
+	 * Number of bytes written.
+	 */
+	uint64_t bytes       = 0;
+	/**
+	 * Number of batches submitted.
+	 */
+	uint64_t batches     = 0;
+	/**
+	 * Maximum number of write requests in flight at the same time.
+	 */
+	uint64_t maxInFlight = 0;
+};
+
+#ifdef SCTOOLS_HAVE_IO_URING
+
+/**
+ * \brief Minimal io_uring submission and completion rings, driven through the
+ * raw system calls.
+ */
+class IoUring
+{
+
+public:
+
+	/**
+	 * \brief Class constructor.
+	 */
+	IoUring () = default;
+
+	/**
+	 * \brief Class copy constructor.
+	 *
+	 * \param other is the object the current instance is initialized from.
+	 */
+	IoUring (const IoUring& other) = delete;
+
+	/**
+	 * \brief Class copy assignment operator.
+	 *
+	 * \param other is the object the current instance is initialized from.
+	 * \return a reference to the assigned object.
+	 */
+	IoUring&
+	operator= (const IoUring& other) = delete;
+
+	/**
+	 * \brief Class destructor.
+	 */
+	~IoUring ()
+	{
+		reset();
+	}
+
+	/**
+	 * \brief Release the rings.
+	 */
+	inline void
+	reset () noexcept
+	{
+		if (sqes_ != nullptr)
+		{
+			munmap(sqes_,
+			       sqesSize_);
+		}
+		if (cqRing_ != nullptr && cqRing_ != sqRing_)
+		{
+			munmap(cqRing_,
+			       cqRingSize_);
+		}
+		if (sqRing_ != nullptr)
+		{
+			munmap(sqRing_,
+			       sqRingSize_);
+		}
+		if (ringFd_ >= 0)
+		{
+			::close(ringFd_);
+		}
+		sqes_   = nullptr;
+		sqRing_ = nullptr;
+		cqRing_ = nullptr;
+		ringFd_ = -1;
+	}
+
+	/**
+	 * \brief Create the rings.
+	 *
+	 * \param entries is the number of entries of the submission ring.
+	 * \return false if io_uring is not available on the running kernel.
+	 */
+	inline bool
+	configure (uint32_t entries) noexcept
+	{
+		io_uring_params params;
+
+		reset();
+		std::memset(&params,
+		            0,
+		            sizeof(params));
+		ringFd_ = static_cast<int>(syscall(__NR_io_uring_setup,
+		                                   entries,
+		                                   &params));
+		if (ringFd_ < 0)
+		{
+			return false;
+		}
+
+		sqRingSize_ = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+		cqRingSize_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+		if (params.features & IORING_FEAT_SINGLE_MMAP)
+		{
+			sqRingSize_ = std::max(sqRingSize_,
+			                       cqRingSize_);
+			cqRingSize_ = sqRingSize_;
+		}
+		sqRing_ = mmap(nullptr,
+		               sqRingSize_,
+		               PROT_READ | PROT_WRITE,
+		               MAP_SHARED | MAP_POPULATE,
+		               ringFd_,
+		               IORING_OFF_SQ_RING);
+		if (sqRing_ == MAP_FAILED)
+		{
+			sqRing_ = nullptr;
+			reset();
+			return false;
+		}
+		if (params.features & IORING_FEAT_SINGLE_MMAP)
+		{
+			cqRing_ = sqRing_;
+		}
+		else
+		{
+			cqRing_ = mmap(nullptr,
+			               cqRingSize_,
+			               PROT_READ | PROT_WRITE,
+			               MAP_SHARED | MAP_POPULATE,
+			               ringFd_,
+			               IORING_OFF_CQ_RING);
+			if (cqRing_ == MAP_FAILED)
+			{
+				cqRing_ = nullptr;
+				reset();
+				return false;
+			}
+		}
+		sqesSize_ = params.sq_entries * sizeof(io_uring_sqe);
+		sqes_     = static_cast<io_uring_sqe*>(mmap(nullptr,
+		                                            sqesSize_,
+		                                            PROT_READ | PROT_WRITE,
+		                                            MAP_SHARED | MAP_POPULATE,
+		                                            ringFd_,
+		                                            IORING_OFF_SQES));
+		if (sqes_ == MAP_FAILED)
+		{
+			sqes_ = nullptr;
+			reset();
+			return false;
+		}
+
+		sqHead_  = ringField_(sqRing_, params.sq_off.head);
+		sqTail_  = ringField_(sqRing_, params.sq_off.tail);
+		sqMask_  = ringField_(sqRing_, params.sq_off.ring_mask);
+		sqArray_ = ringField_(sqRing_, params.sq_off.array);
+		cqHead_  = ringField_(cqRing_, params.cq_off.head);
+		cqTail_  = ringField_(cqRing_, params.cq_off.tail);
+		cqMask_  = ringField_(cqRing_, params.cq_off.ring_mask);
+		cqes_    = reinterpret_cast<io_uring_cqe*>(static_cast<char*>(cqRing_) +
+		                                           params.cq_off.cqes);
+		entries_ = params.sq_entries;
+
+		return true;
+	}
+
+	/**
+	 * \brief Register the buffers write requests are served from.
+	 *
+	 * \param buffers is the list of buffers to be registered.
+	 * \return false if the kernel refuses the registration, for example
+	 * because of the locked memory limit.
+	 */
+	inline bool
+	registerBuffers (const std::vector<iovec>& buffers) noexcept
+	{
+		return syscall(__NR_io_uring_register,
+		               ringFd_,
+		               IORING_REGISTER_BUFFERS,
+		               buffers.data(),
+		               static_cast<unsigned>(buffers.size())) == 0;
+	}
+
+	/**
+	 * \brief Access the number of entries of the submission ring.
+	 *
+	 * \return the maximum number of requests submitted at once.
+	 */
+	inline uint32_t
+	getEntries () const noexcept
+	{
+		return entries_;
+	}
+
+	/**
+	 * \brief Queue a write request in the submission ring.
+	 *
+	 * \param fd is the descriptor of the file to be written.
+	 * \param data is the buffer to be written.
+	 * \param size is the number of bytes to be written.
+	 * \param offset is the file offset the buffer is written at.
+	 * \param bufferIndex is the index of the registered buffer holding data,
+	 * or -1 if buffers are not registered.
+	 * \param userData is the value reported back by the completion.
+	 */
+	inline void
+	prepareWrite (int fd,
+	              const char* data,
+	              uint32_t size,
+	              uint64_t offset,
+	              int bufferIndex,
+	              uint64_t userData) noexcept
+	{
+		uint32_t      tail  = *sqTail_;
+		uint32_t      index = tail & *sqMask_;
+		io_uring_sqe& sqe   = sqes_[index];
+
+		std::memset(&sqe,
+		            0,
+		            sizeof(sqe));
+		sqe.opcode    = bufferIndex >= 0 ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+		sqe.fd        = fd;
+		sqe.off       = offset;
+		sqe.addr      = reinterpret_cast<uint64_t>(data);
+		sqe.len       = size;
+		sqe.buf_index = static_cast<uint16_t>(std::max(bufferIndex,
+		                                               0));
+		sqe.user_data = userData;
+		sqArray_[index] = index;
+		__atomic_store_n(sqTail_,
+		                 tail + 1,
+		                 __ATOMIC_RELEASE);
+	}
+
+	/**
+	 * \brief Submit the queued requests and wait for their completion, with a
+	 * single system call.
+	 *
+	 * The kernel does not wait for any completion if it takes fewer requests
+	 * than queued.
+	 *
+	 * \param count is the number of queued requests.
+	 * \return the number of requests the kernel took, which are the first
+	 * ones queued, or -1 if the system call fails.
+	 */
+	inline long
+	submitAndWait (uint32_t count) noexcept
+	{
+		long result = 0;
+
+		do
+		{
+			result = syscall(__NR_io_uring_enter,
+			                 ringFd_,
+			                 count,
+			                 count,
+			                 IORING_ENTER_GETEVENTS,
+			                 nullptr,
+			                 0);
+		}
+		while (result < 0 && errno == EINTR);
+
+		return result;
+	}
+
+	/**
+	 * \brief Wait for the completion of submitted requests.
+	 *
+	 * \param count is the number of completions to wait for.
+	 * \return false if the system call fails.
+	 */
+	inline bool
+	wait (uint32_t count) noexcept
+	{
+		long result = 0;
+
+		do
+		{
+			result = syscall(__NR_io_uring_enter,
+			                 ringFd_,
+			                 0,
+			                 count,
+			                 IORING_ENTER_GETEVENTS,
+			                 nullptr,
+			                 0);
+		}
+		while (result < 0 && errno == EINTR);
+
+		return result >= 0;
+	}
+
+	/**
+	 * \brief Pop a completion from the completion ring.
+	 *
+	 * \param userData is the value given when the request was queued.
+	 * \param result is the outcome of the request.
+	 * \return false if the completion ring is empty.
+	 */
+	inline bool
+	popCompletion (uint64_t& userData,
+	               int32_t& result) noexcept
+	{
+		uint32_t head = *cqHead_;
+
+		if (head == __atomic_load_n(cqTail_,
+		                            __ATOMIC_ACQUIRE))
+		{
+			return false;
+		}
+		userData = cqes_[head & *cqMask_].user_data;
+		result   = cqes_[head & *cqMask_].res;
+		__atomic_store_n(cqHead_,
+		                 head + 1,
+		                 __ATOMIC_RELEASE);
+
+		return true;
+	}
+
+private:
+	/**
+	 * Descriptor of the io_uring instance.
+	 */
+	int           ringFd_     = -1;
+	/**
+	 * Mapping of the submission ring.
+	 */
+	void*         sqRing_     = nullptr;
+	/**
+	 * Mapping of the completion ring.
+	 */
+	void*         cqRing_     = nullptr;
+	/**
+	 * Mapping of the submission queue entries.
+	 */
+	io_uring_sqe* sqes_       = nullptr;
+	/**
+	 * Size of the submission ring mapping.
+	 */
+	uint64_t      sqRingSize_ = 0;
+	/**
+	 * Size of the completion ring mapping.
+	 */
+	uint64_t      cqRingSize_ = 0;
+	/**
+	 * Size of the submission queue entries mapping.
+	 */
+	uint64_t      sqesSize_   = 0;
+	/**
+	 * Number of entries of the submission ring.
+	 */
+	uint32_t      entries_    = 0;
+	/**
+	 * Pointers to the fields shared with the kernel.
+	 */
+	uint32_t*     sqHead_     = nullptr;
+	uint32_t*     sqTail_     = nullptr;
+	uint32_t*     sqMask_     = nullptr;
+	uint32_t*     sqArray_    = nullptr;
+	uint32_t*     cqHead_     = nullptr;
+	uint32_t*     cqTail_     = nullptr;
+	uint32_t*     cqMask_     = nullptr;
+	io_uring_cqe* cqes_       = nullptr;
+
+	/**
+	 * \brief Compute the address of a field of a ring mapping.
+	 *
+	 * \param ring is the ring mapping.
+	 * \param offset is the offset of the field reported by the kernel.
+	 * \return the address of the field.
+	 */
+	static inline uint32_t*
+	ringField_ (void* ring,
+	            uint32_t offset) noexcept
+	{
+		return reinterpret_cast<uint32_t*>(static_cast<char*>(ring) + offset);
+	}
+};
+
+#endif // SCTOOLS_HAVE_IO_URING
+
+/**
+ * \brief Class collecting the writes addressed to many output files and
+ * issuing them in batches.
+ *
+ * Bytes handed to the scheduler are copied into a pool of fixed-size slots,
+ * coalescing consecutive writes to the same file. When the pool is exhausted,
+ * or when a flush is requested, all the filled slots are written at once:
+ * with io_uring the whole batch costs a single system call, and slots are
+ * registered with the kernel when the locked memory limit allows it.
+ * Otherwise, every slot is written with pwrite. Writes to the same file are
+ * issued at explicit offsets, so their order is preserved.
+ */
+class OutputScheduler
+{
+
+public:
+
+	/**
+	 * Size of a slot of the pool, which holds several BGZF blocks.
+	 */
+	static constexpr uint64_t SLOT_SIZE = 256 * 1024;
+
+	/**
+	 * \brief Class constructor.
+	 */
+	OutputScheduler () = default;
+
+	/**
+	 * \brief Class copy constructor.
+	 *
+	 * \param other is the object the current instance is initialized from.
+	 */
+	OutputScheduler (const OutputScheduler& other) = delete;
+
+	/**
+	 * \brief Class copy assignment operator.
+	 *
+	 * \param other is the object the current instance is initialized from.
+	 * \return a reference to the assigned object.
+	 */
+	OutputScheduler&
+	operator= (const OutputScheduler& other) = delete;
+
+	/**
+	 * \brief Class destructor.
+	 *
+	 * Pending writes are flushed and every file is closed.
+	 */
+	~OutputScheduler ()
+	{
+		try
+		{
+			flush();
+		}
+		catch (...)
+		{
+		}
+		closeAll_();
+	}
+
+	/**
+	 * \brief Initialize the scheduler instance.
+	 *
+	 * \param queueDepth is the number of slots, that is the maximum number of
+	 * writes submitted in a single batch.
+	 * \param maxOpenFiles is the maximum number of files kept open at once.
+	 * Batches writing more files are submitted in several parts.
+	 * \param useIoUring is a flag which enables io_uring, if it is true and
+	 * the running kernel supports it.
+	 */
+	inline void
+	configure (uint64_t queueDepth,
+	           uint64_t maxOpenFiles,
+	           bool useIoUring)
+	{
+		flush();
+		closeAll_();
+		files_.clear();
+		fileIds_.clear();
+		queueDepth   = std::max<uint64_t>(queueDepth,
+		                                  1);
+		maxOpenFiles_ = std::max<uint64_t>(maxOpenFiles,
+		                                   1);
+		openFiles_    = 0;
+		part_         = 0;
+		statistics_   = OutputStatistics();
+		pool_.assign(queueDepth * SLOT_SIZE,
+		             0);
+		slots_.assign(queueDepth,
+		              Slot());
+		freeSlots_.clear();
+		for (auto i = queueDepth; i > 0; i--)
+		{
+			freeSlots_.emplace_back(i - 1);
+		}
+		filledSlots_.clear();
+		useIoUring_        = false;
+		registeredBuffers_ = false;
+#ifdef SCTOOLS_HAVE_IO_URING
+		if (useIoUring)
+		{
+			useIoUring_ = ring_.configure(static_cast<uint32_t>(queueDepth));
+			statistics_.syscalls += 1;
+			if (useIoUring_)
+			{
+				std::vector<iovec> buffers(queueDepth);
+
+				for (auto i = 0ul; i < queueDepth; i++)
+				{
+					buffers[i].iov_base = pool_.data() + i * SLOT_SIZE;
+					buffers[i].iov_len  = SLOT_SIZE;
+				}
+				registeredBuffers_ = ring_.registerBuffers(buffers);
+				statistics_.syscalls += 1;
+
+				// Plain writes are missing from the kernels older than 5.6,
+				// so the ring is only used with registered buffers.
+				if (!registeredBuffers_)
+				{
+					disableIoUring_();
+				}
+			}
+		}
+#else
+		(void) useIoUring;
+#endif
+	}
+
+	/**
+	 * \brief Check if writes are submitted through io_uring.
+	 *
+	 * \return true if io_uring is in use, false if pwrite is used instead.
+	 */
+	inline bool
+	usesIoUring () const noexcept
+	{
+		return useIoUring_;
+	}
+
+	/**
+	 * \brief Check if slots are registered with the kernel.
+	 *
+	 * \return true if writes are served from registered buffers.
+	 */
+	inline bool
+	usesRegisteredBuffers () const noexcept
+	{
+		return registeredBuffers_;
+	}
+
+	/**
+	 * \brief Access the activity counters of the scheduler.
+	 *
+	 * \return the activity counters.
+	 */
+	inline const OutputStatistics&
+	getStatistics () const noexcept
+	{
+		return statistics_;
+	}
+
+	/**
+	 * \brief Register an output file.
+	 *
+	 * The file is actually opened when its first write is issued. Registering
+	 * the same path again returns the same identifier, so that writes keep
+	 * being appended after the previous ones.
+	 *
+	 * \param path is the path to the output file.
+	 * \param append is a flag which appends writes to the current content of
+	 * the file, if it is true; otherwise, the file is truncated.
+	 * \return the identifier of the file.
+	 */
+	inline uint64_t
+	open (const fs::path& path,
+	      bool append)
+	{
+		auto it = fileIds_.find(path.string());
+
+		if (it != fileIds_.end())
+		{
+			return it->second;
+		}
+		files_.emplace_back();
+		files_.back().path     = path;
+		files_.back().truncate = !append;
+		fileIds_.emplace(path.string(),
+		                 files_.size() - 1);
+
+		return files_.size() - 1;
+	}
+
+	/**
+	 * \brief Queue bytes to be written at the end of a file.
+	 *
+	 * \param fileId is the identifier returned when the file was registered.
+	 * \param data is the buffer to be written.
+	 * \param size is the size of the buffer to be written.
+	 */
+	inline void
+	submit (uint64_t fileId,
+	        const char* data,
+	        uint64_t size)
+	{
+		while (size > 0)
+		{
+			File&    file  = files_[fileId];
+			uint64_t chunk = 0;
+
+			if (file.slot < 0 || slots_[file.slot].size == SLOT_SIZE)
+			{
+				if (file.slot >= 0)
+				{
+					filledSlots_.emplace_back(file.slot);
+					file.slot = -1;
+				}
+				if (freeSlots_.empty())
+				{
+					flush();
+				}
+				file.slot = static_cast<int64_t>(freeSlots_.back());
+				freeSlots_.pop_back();
+				slots_[file.slot].fileId = fileId;
+				slots_[file.slot].size   = 0;
+			}
+
+			Slot& slot = slots_[file.slot];
+
+			chunk = std::min(size,
+			                 SLOT_SIZE - slot.size);
+			std::memcpy(pool_.data() + file.slot * SLOT_SIZE + slot.size,
+			            data,
+			            chunk);
+			slot.size += chunk;
+			data      += chunk;
+			size      -= chunk;
+		}
+	}
+
+	/**
+	 * \brief Write every queued byte and wait for completion.
+	 */
+	inline void
+	flush ()
+	{
+		std::vector<uint64_t> batch;
+		std::vector<uint64_t> part;
+		uint64_t              partFiles = 0;
+
+		for (auto& f : files_)
+		{
+			if (f.slot >= 0)
+			{
+				filledSlots_.emplace_back(f.slot);
+				f.slot = -1;
+			}
+		}
+		if (filledSlots_.empty())
+		{
+			return;
+		}
+
+		// Files are opened, and their offsets reserved, in submission order:
+		// slots of the same file are thus written one after the other. Once
+		// a part of the batch writes as many files as can be kept open, it is
+		// submitted before the next file is opened.
+		batch.swap(filledSlots_);
+		part_ += 1;
+		for (auto s : batch)
+		{
+			bool isNewFile = files_[slots_[s].fileId].part != part_;
+
+			if (isNewFile && partFiles == maxOpenFiles_)
+			{
+				writeBatch_(part);
+				part.clear();
+				part_     += 1;
+				partFiles  = 0;
+			}
+			partFiles += isNewFile ? 1 : 0;
+
+			File& file = openFile_(slots_[s].fileId);
+
+			slots_[s].offset  = file.offset;
+			file.offset      += slots_[s].size;
+			part.emplace_back(s);
+		}
+		writeBatch_(part);
+	}
+
+private:
+	/**
+	 * \brief Status of an output file.
+	 */
+	struct File
+	{
+		fs::path                      path;
+		int                           fd       = -1;
+		uint64_t                      offset   = 0;
+		bool                          truncate = false;
+		int64_t                       slot     = -1;
+		uint64_t                      part     = 0;
+		std::list<uint64_t>::iterator recentIt;
+	};
+
+	/**
+	 * \brief Status of a slot of the pool.
+	 */
+	struct Slot
+	{
+		uint64_t fileId = 0;
+		uint64_t size   = 0;
+		uint64_t offset = 0;
+	};
+
+	/**
+	 * Registered output files.
+	 */
+	std::vector<File>                         files_;
+	/**
+	 * Map associating every registered path with its identifier.
+	 */
+	std::unordered_map<std::string, uint64_t> fileIds_;
+	/**
+	 * Memory backing every slot.
+	 */
+	std::vector<char>                         pool_;
+	/**
+	 * Status of every slot.
+	 */
+	std::vector<Slot>                         slots_;
+	/**
+	 * Slots available for new writes.
+	 */
+	std::vector<uint64_t>                     freeSlots_;
+	/**
+	 * Slots waiting to be written, in the order they were filled.
+	 */
+	std::vector<uint64_t>                     filledSlots_;
+	/**
+	 * Maximum number of files kept open at once.
+	 */
+	uint64_t                                  maxOpenFiles_      = 1;
+	/**
+	 * Number of files currently open.
+	 */
+	uint64_t                                  openFiles_         = 0;
+	/**
+	 * Identifiers of the open files, from the least to the most recently
+	 * written.
+	 */
+	std::list<uint64_t>                       recentFiles_;
+	/**
+	 * Number of the batch part being submitted; the files it writes cannot
+	 * be closed until it completes.
+	 */
+	uint64_t                                  part_              = 0;
+	/**
+	 * Flag stating if writes are submitted through io_uring.
+	 */
+	bool                                      useIoUring_        = false;
+	/**
+	 * Flag stating if slots are registered with the kernel.
+	 */
+	bool                                      registeredBuffers_ = false;
+	/**
+	 * Activity counters.
+	 */
+	OutputStatistics                          statistics_;
+#ifdef SCTOOLS_HAVE_IO_URING
+	/**
+	 * Rings used for submitting writes.
+	 */
+	IoUring                                   ring_;
+#endif
+
+	/**
+	 * \brief Make sure a file is open, closing the least recently written
+	 * one first if the open files limit is met.
+	 *
+	 * \param fileId is the identifier of the file.
+	 * \return the status of the file.
+	 */
+	inline File&
+	openFile_ (uint64_t fileId)
+	{
+		File& file = files_[fileId];
+
+		file.part = part_;
+		if (file.fd >= 0)
+		{
+			recentFiles_.splice(recentFiles_.end(),
+			                    recentFiles_,
+			                    file.recentIt);
+			return file;
+		}
+
+		while (openFiles_ >= maxOpenFiles_ && closeLeastRecent_())
+		{
+		}
+		file.fd = ::open(file.path.c_str(),
+		                 O_WRONLY | O_CREAT | (file.truncate ? O_TRUNC : 0),
+		                 0644);
+		statistics_.syscalls += 1;
+		if (file.fd < 0)
+		{
+			throw std::runtime_error("cannot open '" +
+			                         file.path.string() +
+			                         "': " +
+			                         std::strerror(errno));
+		}
+		if (!file.truncate && file.offset == 0)
+		{
+			struct stat fileStatus;
+
+			fstat(file.fd,
+			      &fileStatus);
+			statistics_.syscalls += 1;
+			file.offset = fileStatus.st_size;
+		}
+		file.truncate  = false;
+		file.recentIt  = recentFiles_.insert(recentFiles_.end(),
+		                                     fileId);
+		openFiles_    += 1;
+
+		return file;
+	}
+
+	/**
+	 * \brief Close the least recently written file, sparing the ones written
+	 * by the batch part being submitted.
+	 *
+	 * \return true if a file has been closed.
+	 */
+	inline bool
+	closeLeastRecent_ () noexcept
+	{
+		for (auto it = recentFiles_.begin(); it != recentFiles_.end(); it++)
+		{
+			File& file = files_[*it];
+
+			if (file.part != part_)
+			{
+				::close(file.fd);
+				statistics_.syscalls += 1;
+				file.fd               = -1;
+				openFiles_           -= 1;
+				recentFiles_.erase(it);
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	/**
+	 * \brief Write the slots of a batch part and wait for completion.
+	 *
+	 * \param part is the list of slots to be written.
+	 */
+	inline void
+	writeBatch_ (const std::vector<uint64_t>& part)
+	{
+		if (part.empty())
+		{
+			return;
+		}
+		statistics_.batches     += 1;
+		statistics_.maxInFlight  = std::max<uint64_t>(statistics_.maxInFlight,
+		                                              part.size());
+#ifdef SCTOOLS_HAVE_IO_URING
+		if (useIoUring_)
+		{
+			writeWithIoUring_(part);
+		}
+		else
+#endif
+		{
+			writeWithPwrite_(part);
+		}
+		for (auto s : part)
+		{
+			statistics_.writes += 1;
+			statistics_.bytes  += slots_[s].size;
+			freeSlots_.emplace_back(s);
+		}
+	}
+
+	/**
+	 * \brief Close every open file.
+	 */
+	inline void
+	closeAll_ () noexcept
+	{
+		for (auto& f : files_)
+		{
+			if (f.fd >= 0)
+			{
+				::close(f.fd);
+				statistics_.syscalls += 1;
+				f.fd = -1;
+			}
+		}
+		recentFiles_.clear();
+		openFiles_ = 0;
+	}
+
+	/**
+	 * \brief Write a range of a slot with pwrite, until it is complete.
+	 *
+	 * \param slotId is the slot to be written.
+	 * \param written is the number of bytes of the slot already written.
+	 */
+	inline void
+	pwriteSlot_ (uint64_t slotId,
+	             uint64_t written)
+	{
+		const Slot& slot = slots_[slotId];
+		const File& file = files_[slot.fileId];
+
+		while (written < slot.size)
+		{
+			auto result = ::pwrite(file.fd,
+			                       pool_.data() + slotId * SLOT_SIZE + written,
+			                       slot.size - written,
+			                       slot.offset + written);
+
+			statistics_.syscalls += 1;
+			if (result < 0 && errno != EINTR)
+			{
+				throw std::runtime_error("cannot write '" +
+				                         file.path.string() +
+				                         "': " +
+				                         std::strerror(errno));
+			}
+			written += std::max<ssize_t>(result,
+			                             0);
+		}
+	}
+
+	/**
+	 * \brief Write a batch of slots with pwrite.
+	 *
+	 * \param batch is the list of slots to be written.
+	 */
+	inline void
+	writeWithPwrite_ (const std::vector<uint64_t>& batch)
+	{
+		for (auto s : batch)
+		{
+			pwriteSlot_(s,
+			            0);
+		}
+	}
+
+#ifdef SCTOOLS_HAVE_IO_URING
+	/**
+	 * \brief Release the ring, writes being served by pwrite from now on.
+	 */
+	inline void
+	disableIoUring_ () noexcept
+	{
+		ring_.reset();
+		useIoUring_        = false;
+		registeredBuffers_ = false;
+	}
+
+	/**
+	 * \brief Write a batch of slots with io_uring.
+	 *
+	 * The batch is split in chunks as large as the submission ring; each
+	 * chunk is submitted and awaited with a single system call. Short writes
+	 * are completed with pwrite. If the kernel does not take every request
+	 * of a chunk, or rejects a write as unsupported, the ring is released
+	 * once the requests it took are complete, and the slots left are written
+	 * with pwrite.
+	 *
+	 * \param batch is the list of slots to be written.
+	 */
+	inline void
+	writeWithIoUring_ (const std::vector<uint64_t>& batch)
+	{
+		uint64_t first = 0;
+
+		while (first < batch.size() && useIoUring_)
+		{
+			auto     last        = std::min<uint64_t>(first + ring_.getEntries(),
+			                                          batch.size());
+			auto     count       = static_cast<uint32_t>(last - first);
+			uint64_t userData    = 0;
+			int32_t  result      = 0;
+			long     submitted   = 0;
+			bool     unsupported = false;
+
+			for (auto i = first; i < last; i++)
+			{
+				const Slot& slot = slots_[batch[i]];
+
+				ring_.prepareWrite(files_[slot.fileId].fd,
+				                   pool_.data() + batch[i] * SLOT_SIZE,
+				                   static_cast<uint32_t>(slot.size),
+				                   slot.offset,
+				                   static_cast<int>(batch[i]),
+				                   batch[i]);
+			}
+			statistics_.syscalls += 1;
+			submitted = ring_.submitAndWait(count);
+			if (submitted >= 0 && submitted < count)
+			{
+				// The slots the kernel took cannot be reused before their
+				// writes complete.
+				statistics_.syscalls += 1;
+				if (submitted > 0 && !ring_.wait(static_cast<uint32_t>(submitted)))
+				{
+					throw std::runtime_error(std::string("io_uring wait failed: ") +
+					                         std::strerror(errno));
+				}
+			}
+			while (ring_.popCompletion(userData,
+			                           result))
+			{
+				if (result == -EINVAL || result == -EOPNOTSUPP)
+				{
+					unsupported = true;
+					pwriteSlot_(userData,
+					            0);
+					continue;
+				}
+				if (result < 0)
+				{
+					throw std::runtime_error("cannot write '" +
+					                         files_[slots_[userData].fileId].path.string() +
+					                         "': " +
+					                         std::strerror(-result));
+				}
+				pwriteSlot_(userData,
+				            static_cast<uint64_t>(result));
+			}
+
+			// Requests left in the submission ring are dropped along with it.
+			first += std::max<long>(submitted,
+			                        0);
+			if (submitted < count || unsupported)
+			{
+				disableIoUring_();
+			}
+		}
+		for (auto i = first; i < batch.size(); i++)
+		{
+			pwriteSlot_(batch[i],
+			            0);
+		}
+	}
+#endif // SCTOOLS_HAVE_IO_URING
+};
+
+} // sctools
+
+#endif // SCTOOLS_INCLUDE_SCTOOLS_OUTPUT_SCHEDULER_H
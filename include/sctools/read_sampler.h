@@ -0,0 +1,156 @@
+/**
+ * \file   include/sctools/read_sampler.h
+ * \author Elena Grassi
+ * \author Marilisa Montemurro
+ * \author Emanuele Parisi
+ * \date   February, 2019
+ *
+ * File containing facilities for deterministically downsampling reads.
+ */
+
+#ifndef SCTOOLS_INCLUDE_SCTOOLS_READ_SAMPLER_H
+#define SCTOOLS_INCLUDE_SCTOOLS_READ_SAMPLER_H
+
+#include <cstdint>
+
+#include "hash.h"
+
+namespace sctools
+{
+
+/**
+ * \brief Class deciding which reads are kept when downsampling a cell to a
+ * target number of reads.
+ *
+ * Every read is kept with probability min(1, target / expected), where
+ * expected is the total number of reads of its cell. The decision depends only
+ * on the seed and on the read name, so that it is reproducible, and all the
+ * records of a read (mates, secondary and supplementary alignments) are either
+ * kept or dropped together.
+ */
+class ReadSampler
+{
+
+public:
+
+	/**
+	 * Threshold keeping every read.
+	 */
+	static constexpr uint64_t KEEP_ALL = 1ull << 53;
+
+	/**
+	 * Class constructor.
+	 */
+	ReadSampler () = default;
+
+	/**
+	 * \brief Class copy constructor.
+	 *
+	 * \param other is the object the current instance is initialized from.
+	 */
+	ReadSampler (const ReadSampler& other) = delete;
+
+	/**
+	 * \brief Class copy assignment operator.
+	 *
+	 * \param other is the object the current instance is initialized from.
+	 * \return a reference to the assigned object.
+	 */
+	ReadSampler&
+	operator= (const ReadSampler& other) = delete;
+
+	/**
+	 * \brief Reset the sampler, so that it keeps every read.
+	 */
+	inline void
+	reset () noexcept
+	{
+		targetReads_ = 0;
+		seed_        = 0;
+	}
+
+	/**
+	 * \brief Initialize the sampler.
+	 *
+	 * \param targetReads is the number of reads every cell is downsampled
+	 * to, or 0 for keeping every read.
+	 * \param seed is the seed of the read name hash.
+	 */
+	inline void
+	configure (uint64_t targetReads,
+	           uint64_t seed) noexcept
+	{
+		reset();
+		targetReads_ = targetReads;
+		seed_        = seed;
+	}
+
+	/**
+	 * \brief Check if the sampler drops any read.
+	 *
+	 * \return true if a target number of reads has been set.
+	 */
+	inline bool
+	isEnabled () const noexcept
+	{
+		return targetReads_ > 0;
+	}
+
+	/**
+	 * \brief Compute the threshold the reads of a cell are kept below.
+	 *
+	 * \param expectedReads is the total number of reads of the cell.
+	 * \return the threshold, to be passed to keep().
+	 */
+	inline uint64_t
+	threshold (uint64_t expectedReads) const noexcept
+	{
+		if (targetReads_ == 0 || expectedReads <= targetReads_)
+		{
+			return KEEP_ALL;
+		}
+
+		// Probabilities are represented with 53 bits, which is the precision
+		// of double.
+		return static_cast<uint64_t>(static_cast<double>(targetReads_) /
+		                             static_cast<double>(expectedReads) *
+		                             static_cast<double>(KEEP_ALL));
+	}
+
+	/**
+	 * \brief Decide if a read is kept.
+	 *
+	 * \param readName is the name of the read.
+	 * \param readNameLength is the length of the name of the read.
+	 * \param threshold is the threshold of the cell the read belongs to.
+	 * \return true if the read is kept.
+	 */
+	inline bool
+	keep (const char* readName,
+	      uint64_t readNameLength,
+	      uint64_t threshold) const noexcept
+	{
+		if (threshold >= KEEP_ALL)
+		{
+			return true;
+		}
+
+		return (hashBytes(readName,
+		                  readNameLength,
+		                  seed_) >> 11) < threshold;
+	}
+
+private:
+	/**
+	 * Number of reads every cell is downsampled to.
+	 */
+	uint64_t targetReads_ = 0;
+	/**
+	 * Seed of the read name hash.
+	 */
+	uint64_t seed_        = 0;
+};
+
+} // sctools
+
+#endif // SCTOOLS_INCLUDE_SCTOOLS_READ_SAMPLER_H
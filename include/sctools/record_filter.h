@@ -0,0 +1,1286 @@
+/**
+ * \file   include/sctools/record_filter.h
+ * \author Elena Grassi
+ * \author Marilisa Montemurro
+ * \author Emanuele Parisi
+ * \date   February, 2019
+ *
+ * File containing facilities for compiling alignment record filter
+ * expressions and evaluating them on binary BAM records.
+ */
+
+#ifndef SCTOOLS_INCLUDE_SCTOOLS_RECORD_FILTER_H
+#define SCTOOLS_INCLUDE_SCTOOLS_RECORD_FILTER_H
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "bam_record_view.h"
+
+namespace sctools
+{
+
+/**
+ * \brief Class compiling a filter expression into a flat predicate program,
+ * which is evaluated on binary BAM records without decoding them.
+ *
+ * An expression combines the following predicates with '&&', '||', '!' and
+ * parentheses:
+ *   - 'mapq OP N', comparing the mapping quality;
+ *   - 'flag & MASK', true if any bit of the mask is set in the record flag;
+ *   - 'paired', 'proper', 'unmapped', 'mate_unmapped', 'reverse',
+ *     'mate_reverse', 'read1', 'read2', 'secondary', 'qcfail', 'duplicate',
+ *     'supplementary', true if the corresponding flag bit is set;
+ *   - 'contig == NAME', 'contig != NAME' and 'contig in (NAME, ...)';
+ *   - 'region(CONTIG[:BEGIN[-END]], ...)', true if the alignment overlaps any
+ *     of the 1-based inclusive regions;
+ *   - 'has(TG)', true if the optional field TG is present;
+ *   - 'TG OP VALUE', comparing the optional field TG with a number, or with a
+ *     quoted string; it is false if the field is not present.
+ * OP is one of '==', '!=', '<', '<=', '>' and '>='.
+ *
+ * Every '&&' and '||' operand list is reordered so that cheap predicates,
+ * which read fixed-offset fields, are evaluated before the ones scanning the
+ * CIGAR string or the optional fields. The resulting tree is then laid out as
+ * an array of tests, each one holding the index of the test to be evaluated
+ * next when it succeeds and when it fails, so that evaluation short-circuits
+ * without recursion.
+ */
+class RecordFilter
+{
+
+public:
+
+	/**
+	 * Class constructor.
+	 */
+	RecordFilter () = default;
+
+	/**
+	 * \brief Class copy constructor.
+	 *
+	 * \param other is the object the current instance is initialized from.
+	 */
+	RecordFilter (const RecordFilter& other) = delete;
+
+	/**
+	 * \brief Class copy assignment operator.
+	 *
+	 * \param other is the object the current instance is initialized from.
+	 * \return a reference to the assigned object.
+	 */
+	RecordFilter&
+	operator= (const RecordFilter& other) = delete;
+
+	/**
+	 * \brief Reset the filter, so that it accepts every record.
+	 */
+	inline void
+	reset () noexcept
+	{
+		program_.clear();
+		entry_ = ACCEPT;
+	}
+
+	/**
+	 * \brief Compile a filter expression.
+	 *
+	 * \param expression is the filter expression. An empty expression accepts
+	 * every record.
+	 * \param contigNames are the names of the reference sequences, indexed by
+	 * their identifier in the alignment files.
+	 */
+	inline void
+	configure (const std::string& expression,
+	           const std::vector<std::string>& contigNames)
+	{
+		std::vector<Instruction> reversed;
+		std::unique_ptr<Node>    root;
+		int32_t                  entry = ACCEPT;
+
+		reset();
+		expression_  = expression;
+		contigNames_ = contigNames;
+		tokenize_();
+		if (tokens_.size() == 1)
+		{
+			return;
+		}
+		tokenIndex_ = 0;
+		root        = parseOr_();
+		if (tokens_[tokenIndex_].kind != TokenKind::END)
+		{
+			fail_("unexpected '" +
+			      tokens_[tokenIndex_].text +
+			      "'");
+		}
+		sortByCost_(*root);
+
+		// Tests are emitted from the last to be evaluated to the first, so
+		// that jump targets are known when a test is emitted. Reversing the
+		// array makes every jump go forward.
+		entry = emit_(*root,
+		              ACCEPT,
+		              REJECT,
+		              false,
+		              reversed);
+		program_.assign(reversed.rbegin(),
+		                reversed.rend());
+		for (auto& i : program_)
+		{
+			i.onTrue  = remap_(i.onTrue);
+			i.onFalse = remap_(i.onFalse);
+		}
+		entry_ = remap_(entry);
+	}
+
+	/**
+	 * \brief Check if the filter accepts every record.
+	 *
+	 * \return true if no expression has been compiled.
+	 */
+	inline bool
+	isEmpty () const noexcept
+	{
+		return program_.empty();
+	}
+
+	/**
+	 * \brief Access the number of tests the compiled program is made of.
+	 *
+	 * \return the size of the program.
+	 */
+	inline uint64_t
+	getProgramSize () const noexcept
+	{
+		return program_.size();
+	}
+
+	/**
+	 * \brief Evaluate the compiled program on a binary BAM record.
+	 *
+	 * \param record is the view over the record to be tested.
+	 * \return true if the record satisfies the filter expression.
+	 */
+	inline bool
+	accept (const BamRecordView& record) const noexcept
+	{
+		int32_t pc = entry_;
+
+		while (pc >= 0)
+		{
+			const Instruction& i = program_[pc];
+
+			pc = test_(i,
+			           record) ? i.onTrue : i.onFalse;
+		}
+
+		return pc == ACCEPT;
+	}
+
+	/**
+	 * \brief Evaluate the compiled program on a binary BAM record, and report
+	 * the test which caused the record to be rejected.
+	 *
+	 * \param record is the view over the record to be tested.
+	 * \return the index of the last test evaluated before rejecting the
+	 * record, or -1 if the record is accepted.
+	 */
+	inline int32_t
+	rejectingTest (const BamRecordView& record) const noexcept
+	{
+		int32_t pc   = entry_;
+		int32_t last = -1;
+
+		while (pc >= 0)
+		{
+			const Instruction& i = program_[pc];
+
+			last = pc;
+			pc   = test_(i,
+			             record) ? i.onTrue : i.onFalse;
+		}
+
+		return pc == ACCEPT ? -1 : last;
+	}
+
+	/**
+	 * \brief Describe a test of the compiled program.
+	 *
+	 * \param testIndex is the index of the test.
+	 * \return the predicate of the expression the test comes from, negated
+	 * if the test rejects records by succeeding.
+	 */
+	inline const std::string&
+	describeTest (uint64_t testIndex) const noexcept
+	{
+		return program_[testIndex].description;
+	}
+
+private:
+	/**
+	 * Jump target terminating the evaluation with a success.
+	 */
+	static constexpr int32_t ACCEPT = -1;
+	/**
+	 * Jump target terminating the evaluation with a failure.
+	 */
+	static constexpr int32_t REJECT = -2;
+
+	/**
+	 * \brief Enumeration of the tests a program is made of.
+	 */
+	enum class Opcode
+	{
+		MAPQ,
+		FLAG,
+		CONTIG,
+		REGION,
+		TAG_PRESENT,
+		TAG_NUMBER,
+		TAG_STRING
+	};
+
+	/**
+	 * \brief Enumeration of the comparison operators.
+	 */
+	enum class Comparison
+	{
+		EQ,
+		NE,
+		LT,
+		LE,
+		GT,
+		GE
+	};
+
+	/**
+	 * \brief Struct representing a single test of the program.
+	 */
+	struct Instruction
+	{
+		/**
+		 * Kind of test.
+		 */
+		Opcode            opcode     = Opcode::FLAG;
+		/**
+		 * Comparison operator of the test.
+		 */
+		Comparison        comparison = Comparison::EQ;
+		/**
+		 * Name of the optional field tested.
+		 */
+		char              tag[2]     = {0, 0};
+		/**
+		 * Flag mask tested.
+		 */
+		uint16_t          mask       = 0;
+		/**
+		 * Number the record field is compared with.
+		 */
+		double            number     = 0;
+		/**
+		 * String the optional field is compared with.
+		 */
+		std::string       text;
+		/**
+		 * Reference identifier of the region tested.
+		 */
+		int32_t           refId      = -1;
+		/**
+		 * 0-based first position of the region tested.
+		 */
+		int64_t           begin      = 0;
+		/**
+		 * 0-based position past the end of the region tested.
+		 */
+		int64_t           end        = 0;
+		/**
+		 * Membership of every reference sequence to the contig set tested.
+		 */
+		std::vector<bool> contigs;
+		/**
+		 * Source text of the test, reported as filtering reason.
+		 */
+		std::string       description;
+		/**
+		 * Index of the test evaluated next when the current one succeeds.
+		 */
+		int32_t           onTrue     = ACCEPT;
+		/**
+		 * Index of the test evaluated next when the current one fails.
+		 */
+		int32_t           onFalse    = REJECT;
+	};
+
+	/**
+	 * \brief Struct representing a node of the parsed expression tree.
+	 */
+	struct Node
+	{
+		/**
+		 * \brief Enumeration of the kinds of nodes.
+		 */
+		enum class Kind
+		{
+			AND,
+			OR,
+			NOT,
+			LEAF
+		};
+
+		/**
+		 * Kind of node.
+		 */
+		Kind                               kind = Kind::LEAF;
+		/**
+		 * Operands of the node.
+		 */
+		std::vector<std::unique_ptr<Node>> children;
+		/**
+		 * Test performed by leaf nodes.
+		 */
+		Instruction                        test;
+		/**
+		 * Estimated cost of evaluating the node.
+		 */
+		uint64_t                           cost = 0;
+	};
+
+	/**
+	 * \brief Enumeration of the kinds of tokens of an expression.
+	 */
+	enum class TokenKind
+	{
+		WORD,
+		STRING,
+		LPAREN,
+		RPAREN,
+		COMMA,
+		NOT,
+		AND,
+		OR,
+		AMPERSAND,
+		COMPARISON,
+		END
+	};
+
+	/**
+	 * \brief Struct representing a token of an expression.
+	 */
+	struct Token
+	{
+		/**
+		 * Kind of token.
+		 */
+		TokenKind  kind;
+		/**
+		 * Text of the token.
+		 */
+		std::string text;
+		/**
+		 * Operator represented by comparison tokens.
+		 */
+		Comparison comparison;
+		/**
+		 * Offset of the token in the expression.
+		 */
+		uint64_t   offset;
+	};
+
+	/**
+	 * Compiled program.
+	 */
+	std::vector<Instruction> program_;
+	/**
+	 * Index of the first test of the program.
+	 */
+	int32_t                  entry_      = ACCEPT;
+	/**
+	 * Expression being compiled.
+	 */
+	std::string              expression_;
+	/**
+	 * Names of the reference sequences.
+	 */
+	std::vector<std::string> contigNames_;
+	/**
+	 * Tokens of the expression being compiled.
+	 */
+	std::vector<Token>       tokens_;
+	/**
+	 * Index of the token being parsed.
+	 */
+	uint64_t                 tokenIndex_ = 0;
+
+	/**
+	 * \brief Compare two values.
+	 *
+	 * \param comparison is the comparison operator.
+	 * \param lhs is the left-hand side operand.
+	 * \param rhs is the right-hand side operand.
+	 * \return the outcome of the comparison.
+	 */
+	template <typename TValue>
+	static inline bool
+	compare_ (Comparison comparison,
+	          TValue lhs,
+	          TValue rhs) noexcept
+	{
+		switch (comparison)
+		{
+		case Comparison::EQ:
+			return lhs == rhs;
+		case Comparison::NE:
+			return lhs != rhs;
+		case Comparison::LT:
+			return lhs < rhs;
+		case Comparison::LE:
+			return lhs <= rhs;
+		case Comparison::GT:
+			return lhs > rhs;
+		case Comparison::GE:
+			return lhs >= rhs;
+		}
+
+		return false;
+	}
+
+	/**
+	 * \brief Evaluate a single test on a record.
+	 *
+	 * \param i is the test to be evaluated.
+	 * \param record is the view over the record to be tested.
+	 * \return the outcome of the test.
+	 */
+	static inline bool
+	test_ (const Instruction& i,
+	       const BamRecordView& record) noexcept
+	{
+		switch (i.opcode)
+		{
+		case Opcode::MAPQ:
+			return compare_<double>(i.comparison,
+			                        record.mapQuality(),
+			                        i.number);
+		case Opcode::FLAG:
+			return (record.flag() & i.mask) != 0;
+		case Opcode::CONTIG:
+		{
+			int32_t refId = record.refId();
+
+			return refId >= 0 &&
+			       static_cast<uint64_t>(refId) < i.contigs.size() &&
+			       i.contigs[refId];
+		}
+		case Opcode::REGION:
+			return record.refId() == i.refId &&
+			       record.position() < i.end &&
+			       record.referenceEnd() > i.begin;
+		case Opcode::TAG_PRESENT:
+			return record.findTag(i.tag) != nullptr;
+		case Opcode::TAG_NUMBER:
+		{
+			const char* type  = record.findTag(i.tag);
+			double      value = 0;
+
+			return type != nullptr &&
+			       BamRecordView::tagNumber(type,
+			                                value) &&
+			       compare_<double>(i.comparison,
+			                        value,
+			                        i.number);
+		}
+		case Opcode::TAG_STRING:
+		{
+			const char* type   = record.findTag(i.tag);
+			const char* value  = nullptr;
+			uint64_t    length = 0;
+
+			return type != nullptr &&
+			       BamRecordView::tagString(type,
+			                                value,
+			                                length) &&
+			       compare_<int>(i.comparison,
+			                     std::string(value,
+			                                 length).compare(i.text),
+			                     0);
+		}
+		}
+
+		return false;
+	}
+
+	/**
+	 * \brief Estimate the cost of a test.
+	 *
+	 * \param i is the test.
+	 * \return the relative cost of the test.
+	 */
+	static inline uint64_t
+	cost_ (const Instruction& i) noexcept
+	{
+		switch (i.opcode)
+		{
+		case Opcode::MAPQ:
+		case Opcode::FLAG:
+		case Opcode::CONTIG:
+			return 1;
+		case Opcode::REGION:
+			return 4;
+		case Opcode::TAG_PRESENT:
+		case Opcode::TAG_NUMBER:
+		case Opcode::TAG_STRING:
+			return 16;
+		}
+
+		return 1;
+	}
+
+	/**
+	 * \brief Compute the cost of every node and sort the operands of every
+	 * conjunction and disjunction by increasing cost.
+	 *
+	 * \param node is the root of the subtree to be sorted.
+	 */
+	static inline void
+	sortByCost_ (Node& node)
+	{
+		if (node.kind == Node::Kind::LEAF)
+		{
+			node.cost = cost_(node.test);
+			return;
+		}
+		node.cost = 0;
+		for (auto& c : node.children)
+		{
+			sortByCost_(*c);
+			node.cost += c->cost;
+		}
+		std::stable_sort(node.children.begin(),
+		                 node.children.end(),
+		                 [] (const std::unique_ptr<Node>& lhs,
+		                     const std::unique_ptr<Node>& rhs)
+		                 {
+			                 return lhs->cost < rhs->cost;
+		                 });
+	}
+
+	/**
+	 * \brief Emit the tests of a subtree.
+	 *
+	 * \param node is the root of the subtree.
+	 * \param onTrue is the jump target when the subtree is satisfied.
+	 * \param onFalse is the jump target when the subtree is not satisfied.
+	 * \param isNegated is a flag stating if the subtree is under an odd number
+	 * of negations.
+	 * \param reversed is the program being emitted, in reverse order.
+	 * \return the index of the first test of the subtree.
+	 */
+	static inline int32_t
+	emit_ (const Node& node,
+	       int32_t onTrue,
+	       int32_t onFalse,
+	       bool isNegated,
+	       std::vector<Instruction>& reversed)
+	{
+		int32_t next = 0;
+
+		switch (node.kind)
+		{
+		case Node::Kind::LEAF:
+			reversed.push_back(node.test);
+			reversed.back().onTrue  = onTrue;
+			reversed.back().onFalse = onFalse;
+			if (isNegated)
+			{
+				reversed.back().description = "!(" +
+				                              node.test.description +
+				                              ")";
+			}
+			return static_cast<int32_t>(reversed.size() - 1);
+		case Node::Kind::NOT:
+			return emit_(*node.children.front(),
+			             onFalse,
+			             onTrue,
+			             !isNegated,
+			             reversed);
+		case Node::Kind::AND:
+			next = onTrue;
+			for (auto it = node.children.rbegin(); it != node.children.rend(); it++)
+			{
+				next = emit_(**it,
+				             next,
+				             onFalse,
+				             isNegated,
+				             reversed);
+			}
+			return next;
+		case Node::Kind::OR:
+			next = onFalse;
+			for (auto it = node.children.rbegin(); it != node.children.rend(); it++)
+			{
+				next = emit_(**it,
+				             onTrue,
+				             next,
+				             isNegated,
+				             reversed);
+			}
+			return next;
+		}
+
+		return next;
+	}
+
+	/**
+	 * \brief Convert a jump target of the reversed program.
+	 *
+	 * \param target is the jump target in the reversed program.
+	 * \return the jump target in the final program.
+	 */
+	inline int32_t
+	remap_ (int32_t target) const noexcept
+	{
+		return target < 0 ? target : static_cast<int32_t>(program_.size()) - 1 - target;
+	}
+
+	/**
+	 * \brief Report a syntax error.
+	 *
+	 * \param message is the description of the error.
+	 */
+	[[noreturn]] inline void
+	fail_ (const std::string& message) const
+	{
+		failAt_(tokens_[tokenIndex_].offset,
+		        message);
+	}
+
+	/**
+	 * \brief Report a syntax error at a given position of the expression.
+	 *
+	 * \param offset is the position of the error in the expression.
+	 * \param message is the description of the error.
+	 */
+	[[noreturn]] inline void
+	failAt_ (uint64_t offset,
+	         const std::string& message) const
+	{
+		throw std::invalid_argument("invalid filter expression '" +
+		                            expression_ +
+		                            "' at offset " +
+		                            std::to_string(offset) +
+		                            ": " +
+		                            message);
+	}
+
+	/**
+	 * \brief Check if a character may belong to a word token.
+	 *
+	 * \param c is the character to be checked.
+	 * \return true if the character is part of words.
+	 */
+	static inline bool
+	isWordCharacter_ (char c) noexcept
+	{
+		return std::isalnum(static_cast<unsigned char>(c)) ||
+		       std::strchr("_.:*+-",
+		                   c) != nullptr;
+	}
+
+	/**
+	 * \brief Split the expression in tokens.
+	 */
+	inline void
+	tokenize_ ()
+	{
+		uint64_t i = 0;
+
+		tokens_.clear();
+		while (i < expression_.size())
+		{
+			char     c     = expression_[i];
+			uint64_t start = i;
+
+			if (std::isspace(static_cast<unsigned char>(c)))
+			{
+				i++;
+				continue;
+			}
+			if (isWordCharacter_(c))
+			{
+				while (i < expression_.size() && isWordCharacter_(expression_[i]))
+				{
+					i++;
+				}
+				tokens_.push_back({TokenKind::WORD,
+				                   expression_.substr(start,
+				                                      i - start),
+				                   Comparison::EQ,
+				                   start});
+				continue;
+			}
+			if (c == '"' || c == '\'')
+			{
+				uint64_t close = expression_.find(c,
+				                                  i + 1);
+
+				if (close == std::string::npos)
+				{
+					failAt_(start,
+					        "unterminated string");
+				}
+				tokens_.push_back({TokenKind::STRING,
+				                   expression_.substr(i + 1,
+				                                      close - i - 1),
+				                   Comparison::EQ,
+				                   start});
+				i = close + 1;
+				continue;
+			}
+
+			std::string next = expression_.substr(i,
+			                                      2);
+
+			if (next == "&&" || next == "||" || next == "==" || next == "!=" ||
+			    next == "<=" || next == ">=")
+			{
+				Token token = {TokenKind::COMPARISON, next, Comparison::EQ, start};
+
+				if (next == "&&")
+				{
+					token.kind = TokenKind::AND;
+				}
+				else if (next == "||")
+				{
+					token.kind = TokenKind::OR;
+				}
+				else
+				{
+					token.comparison = next == "==" ? Comparison::EQ :
+					                   next == "!=" ? Comparison::NE :
+					                   next == "<=" ? Comparison::LE :
+					                   Comparison::GE;
+				}
+				tokens_.push_back(token);
+				i += 2;
+				continue;
+			}
+			switch (c)
+			{
+			case '(':
+				tokens_.push_back({TokenKind::LPAREN, "(", Comparison::EQ, start});
+				break;
+			case ')':
+				tokens_.push_back({TokenKind::RPAREN, ")", Comparison::EQ, start});
+				break;
+			case ',':
+				tokens_.push_back({TokenKind::COMMA, ",", Comparison::EQ, start});
+				break;
+			case '!':
+				tokens_.push_back({TokenKind::NOT, "!", Comparison::EQ, start});
+				break;
+			case '&':
+				tokens_.push_back({TokenKind::AMPERSAND, "&", Comparison::EQ, start});
+				break;
+			case '=':
+				tokens_.push_back({TokenKind::COMPARISON, "=", Comparison::EQ, start});
+				break;
+			case '<':
+				tokens_.push_back({TokenKind::COMPARISON, "<", Comparison::LT, start});
+				break;
+			case '>':
+				tokens_.push_back({TokenKind::COMPARISON, ">", Comparison::GT, start});
+				break;
+			default:
+				failAt_(start,
+				        std::string("unexpected character '") +
+				        c +
+				        "'");
+			}
+			i++;
+		}
+		tokens_.push_back({TokenKind::END, "", Comparison::EQ, expression_.size()});
+	}
+
+	/**
+	 * \brief Consume a token of the given kind.
+	 *
+	 * \param kind is the expected kind of token.
+	 * \param what is the description of the expected token.
+	 * \return the consumed token.
+	 */
+	inline const Token&
+	expect_ (TokenKind kind,
+	         const std::string& what)
+	{
+		if (tokens_[tokenIndex_].kind != kind)
+		{
+			fail_("expected " +
+			      what);
+		}
+
+		return tokens_[tokenIndex_++];
+	}
+
+	/**
+	 * \brief Consume a token if it is of the given kind.
+	 *
+	 * \param kind is the kind of token to be consumed.
+	 * \return true if the token has been consumed.
+	 */
+	inline bool
+	accept_ (TokenKind kind) noexcept
+	{
+		if (tokens_[tokenIndex_].kind == kind)
+		{
+			tokenIndex_++;
+			return true;
+		}
+
+		return false;
+	}
+
+	/**
+	 * \brief Parse a number.
+	 *
+	 * \param what is the description of the expected number.
+	 * \return the parsed number.
+	 */
+	inline double
+	parseNumber_ (const std::string& what)
+	{
+		const Token& token = expect_(TokenKind::WORD,
+		                             what);
+		uint64_t     parsed = 0;
+		double       value  = 0;
+
+		try
+		{
+			value = token.text.compare(0, 2, "0x") == 0 ?
+			        static_cast<double>(std::stoul(token.text,
+			                                       &parsed,
+			                                       16)) :
+			        std::stod(token.text,
+			                  &parsed);
+		}
+		catch (const std::exception&)
+		{
+			parsed = 0;
+		}
+		if (parsed != token.text.size())
+		{
+			tokenIndex_--;
+			fail_("expected " +
+			      what);
+		}
+
+		return value;
+	}
+
+	/**
+	 * \brief Parse a contig or region name, either bare or quoted.
+	 *
+	 * \return the parsed name.
+	 */
+	inline std::string
+	parseName_ ()
+	{
+		if (tokens_[tokenIndex_].kind == TokenKind::STRING)
+		{
+			return tokens_[tokenIndex_++].text;
+		}
+
+		return expect_(TokenKind::WORD,
+		               "a name").text;
+	}
+
+	/**
+	 * \brief Resolve a contig name to its identifier.
+	 *
+	 * \param name is the contig name.
+	 * \return the contig identifier, or -1 if it is unknown.
+	 */
+	inline int32_t
+	findContig_ (const std::string& name) const noexcept
+	{
+		auto it = std::find(contigNames_.begin(),
+		                    contigNames_.end(),
+		                    name);
+
+		return it == contigNames_.end() ? -1 : static_cast<int32_t>(it - contigNames_.begin());
+	}
+
+	/**
+	 * \brief Parse a disjunction.
+	 *
+	 * \return the parsed subtree.
+	 */
+	inline std::unique_ptr<Node>
+	parseOr_ ()
+	{
+		auto node = parseAnd_();
+
+		if (tokens_[tokenIndex_].kind != TokenKind::OR)
+		{
+			return node;
+		}
+
+		std::unique_ptr<Node> orNode(new Node());
+
+		orNode->kind = Node::Kind::OR;
+		orNode->children.push_back(std::move(node));
+		while (accept_(TokenKind::OR))
+		{
+			orNode->children.push_back(parseAnd_());
+		}
+
+		return orNode;
+	}
+
+	/**
+	 * \brief Parse a conjunction.
+	 *
+	 * \return the parsed subtree.
+	 */
+	inline std::unique_ptr<Node>
+	parseAnd_ ()
+	{
+		auto node = parseUnary_();
+
+		if (tokens_[tokenIndex_].kind != TokenKind::AND)
+		{
+			return node;
+		}
+
+		std::unique_ptr<Node> andNode(new Node());
+
+		andNode->kind = Node::Kind::AND;
+		andNode->children.push_back(std::move(node));
+		while (accept_(TokenKind::AND))
+		{
+			andNode->children.push_back(parseUnary_());
+		}
+
+		return andNode;
+	}
+
+	/**
+	 * \brief Parse a negation, a parenthesized expression or a predicate.
+	 *
+	 * \return the parsed subtree.
+	 */
+	inline std::unique_ptr<Node>
+	parseUnary_ ()
+	{
+		if (accept_(TokenKind::NOT))
+		{
+			std::unique_ptr<Node> notNode(new Node());
+
+			notNode->kind = Node::Kind::NOT;
+			notNode->children.push_back(parseUnary_());
+
+			return notNode;
+		}
+		if (accept_(TokenKind::LPAREN))
+		{
+			auto node = parseOr_();
+
+			expect_(TokenKind::RPAREN,
+			        "')'");
+
+			return node;
+		}
+
+		uint64_t start = tokens_[tokenIndex_].offset;
+		auto     node  = parsePredicate_();
+
+		// Predicates expanding to several tests describe them on their own.
+		if (node->kind == Node::Kind::LEAF && node->test.description.empty())
+		{
+			uint64_t end = tokens_[tokenIndex_].offset;
+
+			while (end > start && std::isspace(static_cast<unsigned char>(expression_[end - 1])))
+			{
+				end--;
+			}
+			node->test.description = expression_.substr(start,
+			                                            end - start);
+		}
+
+		return node;
+	}
+
+	/**
+	 * \brief Parse a predicate.
+	 *
+	 * \return the parsed leaf, or the subtree the predicate expands to.
+	 */
+	inline std::unique_ptr<Node>
+	parsePredicate_ ()
+	{
+		// An aggregate table copies the flag constants, so that they are not
+		// bound to references and need no out-of-class definition.
+		static const struct
+		{
+			const char* name;
+			uint16_t    mask;
+		} namedFlags[] = {
+			{"paired",        BamRecordView::FLAG_PAIRED},
+			{"proper",        BamRecordView::FLAG_PROPER_PAIR},
+			{"unmapped",      BamRecordView::FLAG_UNMAPPED},
+			{"mate_unmapped", BamRecordView::FLAG_MATE_UNMAPPED},
+			{"reverse",       BamRecordView::FLAG_REVERSE},
+			{"mate_reverse",  BamRecordView::FLAG_MATE_REVERSE},
+			{"read1",         BamRecordView::FLAG_READ1},
+			{"read2",         BamRecordView::FLAG_READ2},
+			{"secondary",     BamRecordView::FLAG_SECONDARY},
+			{"qcfail",        BamRecordView::FLAG_QC_FAIL},
+			{"duplicate",     BamRecordView::FLAG_DUPLICATE},
+			{"supplementary", BamRecordView::FLAG_SUPPLEMENTARY}
+		};
+		std::unique_ptr<Node> node(new Node());
+		std::string           word = expect_(TokenKind::WORD,
+		                                     "a predicate").text;
+
+		for (const auto& f : namedFlags)
+		{
+			if (word == f.name)
+			{
+				node->test.opcode = Opcode::FLAG;
+				node->test.mask   = f.mask;
+				return node;
+			}
+		}
+
+		if (word == "mapq")
+		{
+			node->test.opcode     = Opcode::MAPQ;
+			node->test.comparison = expect_(TokenKind::COMPARISON,
+			                                "a comparison operator").comparison;
+			node->test.number     = parseNumber_("a mapping quality");
+		}
+		else if (word == "flag")
+		{
+			double mask = 0;
+
+			expect_(TokenKind::AMPERSAND,
+			        "'&'");
+			mask = parseNumber_("a flag mask");
+			if (mask <= 0 || mask > 0xffff || mask != static_cast<uint16_t>(mask))
+			{
+				tokenIndex_--;
+				fail_("invalid flag mask");
+			}
+			node->test.opcode = Opcode::FLAG;
+			node->test.mask   = static_cast<uint16_t>(mask);
+		}
+		else if (word == "contig")
+		{
+			bool negate = false;
+
+			node->test.opcode = Opcode::CONTIG;
+			node->test.contigs.assign(contigNames_.size(),
+			                          false);
+			if (tokens_[tokenIndex_].kind == TokenKind::WORD && tokens_[tokenIndex_].text == "in")
+			{
+				tokenIndex_++;
+				expect_(TokenKind::LPAREN,
+				        "'('");
+				do
+				{
+					addContig_(node->test);
+				}
+				while (accept_(TokenKind::COMMA));
+				expect_(TokenKind::RPAREN,
+				        "')'");
+			}
+			else
+			{
+				auto comparison = expect_(TokenKind::COMPARISON,
+				                          "'==', '!=' or 'in'").comparison;
+
+				if (comparison != Comparison::EQ && comparison != Comparison::NE)
+				{
+					tokenIndex_--;
+					fail_("contigs can only be compared with '==' and '!='");
+				}
+				negate = comparison == Comparison::NE;
+				addContig_(node->test);
+				node->test.description = "contig == " +
+				                         tokens_[tokenIndex_ - 1].text;
+			}
+			if (negate)
+			{
+				std::unique_ptr<Node> notNode(new Node());
+
+				notNode->kind = Node::Kind::NOT;
+				notNode->children.push_back(std::move(node));
+				return notNode;
+			}
+		}
+		else if (word == "region")
+		{
+			std::unique_ptr<Node> orNode(new Node());
+
+			orNode->kind = Node::Kind::OR;
+			expect_(TokenKind::LPAREN,
+			        "'('");
+			do
+			{
+				orNode->children.push_back(parseRegion_());
+			}
+			while (accept_(TokenKind::COMMA));
+			expect_(TokenKind::RPAREN,
+			        "')'");
+			return orNode->children.size() == 1 ? std::move(orNode->children.front()) : std::move(orNode);
+		}
+		else if (word == "has")
+		{
+			expect_(TokenKind::LPAREN,
+			        "'('");
+			node->test.opcode = Opcode::TAG_PRESENT;
+			setTag_(node->test,
+			        expect_(TokenKind::WORD,
+			                "a tag name").text);
+			expect_(TokenKind::RPAREN,
+			        "')'");
+		}
+		else
+		{
+			setTag_(node->test,
+			        word);
+			node->test.comparison = expect_(TokenKind::COMPARISON,
+			                                "a comparison operator").comparison;
+			if (tokens_[tokenIndex_].kind == TokenKind::STRING)
+			{
+				node->test.opcode = Opcode::TAG_STRING;
+				node->test.text   = tokens_[tokenIndex_++].text;
+			}
+			else
+			{
+				node->test.opcode = Opcode::TAG_NUMBER;
+				node->test.number = parseNumber_("a number or a quoted string");
+			}
+		}
+
+		return node;
+	}
+
+	/**
+	 * \brief Parse a contig name and add it to the contig set of a test.
+	 *
+	 * \param test is the contig membership test.
+	 */
+	inline void
+	addContig_ (Instruction& test)
+	{
+		std::string name  = parseName_();
+		int32_t     refId = findContig_(name);
+
+		if (refId < 0)
+		{
+			tokenIndex_--;
+			fail_("unknown contig '" +
+			      name +
+			      "'");
+		}
+		test.contigs[refId] = true;
+	}
+
+	/**
+	 * \brief Parse a region, in the 'CONTIG[:BEGIN[-END]]' format with 1-based
+	 * inclusive coordinates.
+	 *
+	 * \return the parsed region test.
+	 */
+	inline std::unique_ptr<Node>
+	parseRegion_ ()
+	{
+		std::unique_ptr<Node> node(new Node());
+		std::string           region = parseName_();
+		uint64_t              colon  = region.find_last_of(':');
+
+		node->test.opcode      = Opcode::REGION;
+		node->test.description = "region(" +
+		                         region +
+		                         ")";
+		node->test.begin       = 0;
+		node->test.end         = std::numeric_limits<int64_t>::max();
+		node->test.refId       = findContig_(region);
+		if (node->test.refId < 0 && colon != std::string::npos)
+		{
+			std::string range = region.substr(colon + 1);
+			uint64_t    dash  = range.find('-');
+
+			node->test.refId = findContig_(region.substr(0,
+			                                             colon));
+			try
+			{
+				node->test.begin = std::stoll(range.substr(0,
+				                                           dash)) - 1;
+				if (dash != std::string::npos && dash + 1 < range.size())
+				{
+					node->test.end = std::stoll(range.substr(dash + 1));
+				}
+			}
+			catch (const std::exception&)
+			{
+				tokenIndex_--;
+				fail_("invalid region '" +
+				      region +
+				      "'");
+			}
+			if (node->test.begin < 0 || node->test.end <= node->test.begin)
+			{
+				tokenIndex_--;
+				fail_("invalid region '" +
+				      region +
+				      "'");
+			}
+		}
+		if (node->test.refId < 0)
+		{
+			tokenIndex_--;
+			fail_("unknown contig in region '" +
+			      region +
+			      "'");
+		}
+
+		return node;
+	}
+
+	/**
+	 * \brief Set the optional field name of a test.
+	 *
+	 * \param test is the test.
+	 * \param tag is the name of the optional field.
+	 */
+	inline void
+	setTag_ (Instruction& test,
+	         const std::string& tag)
+	{
+		if (tag.size() != 2 ||
+		    !std::isalpha(static_cast<unsigned char>(tag[0])) ||
+		    !std::isalnum(static_cast<unsigned char>(tag[1])))
+		{
+			tokenIndex_--;
+			fail_("unknown predicate or tag '" +
+			      tag +
+			      "'");
+		}
+		test.tag[0] = tag[0];
+		test.tag[1] = tag[1];
+	}
+};
+
+} // sctools
+
+#endif // SCTOOLS_INCLUDE_SCTOOLS_RECORD_FILTER_H
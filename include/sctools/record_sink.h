@@ -0,0 +1,410 @@
+/**
+ * \file   include/sctools/record_sink.h
+ * \author Elena Grassi
+ * \author Marilisa Montemurro
+ * \author Emanuele Parisi
+ * \date   February, 2019
+ *
+ * File containing the interface de-multiplexed alignment records are
+ * delivered through, along with in-memory, callback and counting
+ * implementations.
+ */
+
+#ifndef SCTOOLS_INCLUDE_SCTOOLS_RECORD_SINK_H
+#define SCTOOLS_INCLUDE_SCTOOLS_RECORD_SINK_H
+
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <seqan/bam_io.h>
+
+#include "alignments_reader.h"
+
+namespace sctools
+{
+
+/**
+ * \brief Struct storing the outcome of a de-multiplexing run.
+ */
+struct DemultiplexerStatistics
+{
+	/**
+	 * Number of records read from the input files and accepted by the filter.
+	 */
+	uint64_t              recordsCount       = 0;
+	/**
+	 * Number of records de-multiplexed to every target barcode, indexed as
+	 * the barcodes list of the configuration.
+	 */
+	std::vector<uint64_t> cellCounts;
+	/**
+	 * Number of records whose barcode is not among the target ones.
+	 */
+	uint64_t              noiseCount         = 0;
+	/**
+	 * Number of records of target barcodes dropped by downsampling.
+	 */
+	uint64_t              sampledOut         = 0;
+	/**
+	 * Number of records whose raw barcode has been corrected to a target one.
+	 */
+	uint64_t              correctedCount     = 0;
+	/**
+	 * Number of records whose raw barcode is equally close to several target
+	 * ones.
+	 */
+	uint64_t              ambiguousCount     = 0;
+	/**
+	 * Number of records whose raw barcode is not close to any target one.
+	 */
+	uint64_t              uncorrectableCount = 0;
+	/**
+	 * Number of records of target barcodes collapsed into another read of
+	 * the same molecule.
+	 */
+	uint64_t              duplicatesCount    = 0;
+	/**
+	 * Number of mapped records of target barcodes without UMI, when reads
+	 * are deduplicated.
+	 */
+	uint64_t              missingUmiCount    = 0;
+};
+
+/**
+ * \brief Interface of the destinations of de-multiplexed alignment records.
+ *
+ * Records are delivered batch by batch: for every batch, write() is called
+ * once for each target barcode having records in the batch, writeNoise() is
+ * called once with the records of the other barcodes, and endBatch() closes
+ * the batch. The record vectors are owned by the caller and cleared after
+ * each call, so sinks may take their content away by swapping it.
+ *
+ * Sinks accepting SAM lines, as stated by acceptsText(), may get
+ * writeText() and writeNoiseText() in place of write() and writeNoise() when
+ * the input files are SAM files, so that lines are forwarded verbatim rather
+ * than decoded and encoded again.
+ */
+class RecordSink
+{
+
+public:
+
+	/**
+	 * \brief Class destructor.
+	 */
+	virtual
+	~RecordSink () = default;
+
+	/**
+	 * \brief Prepare the sink, before any record is delivered.
+	 *
+	 * \param reference is the reader providing the header and the context of
+	 * the records.
+	 * \param barcodes are the target barcodes, indexed by cell identifier.
+	 */
+	virtual void
+	begin (const AlignmentsReader& reference,
+	       const std::vector<std::string>& barcodes)
+	{
+		(void) reference;
+		(void) barcodes;
+	}
+
+	/**
+	 * \brief Deliver the records of a target barcode.
+	 *
+	 * \param cellId is the index of the barcode in the barcodes list.
+	 * \param barcode is the barcode the records belong to.
+	 * \param records are the records of the barcode in the current batch.
+	 */
+	virtual void
+	write (uint64_t cellId,
+	       const std::string& barcode,
+	       std::vector<seqan::BamAlignmentRecord>& records) = 0;
+
+	/**
+	 * \brief Deliver the records whose barcode is not among the target ones.
+	 *
+	 * \param records are the noise records of the current batch.
+	 */
+	virtual void
+	writeNoise (std::vector<seqan::BamAlignmentRecord>& records)
+	{
+		(void) records;
+	}
+
+	/**
+	 * \brief Check if the sink takes the lines of SAM input files verbatim.
+	 *
+	 * \return true if writeText() and writeNoiseText() may be called in place
+	 * of write() and writeNoise().
+	 */
+	virtual bool
+	acceptsText () const
+	{
+		return false;
+	}
+
+	/**
+	 * \brief Deliver the SAM lines of a target barcode.
+	 *
+	 * \param cellId is the index of the barcode in the barcodes list.
+	 * \param barcode is the barcode the lines belong to.
+	 * \param lines are the lines of the barcode in the current batch, each one
+	 * terminated by a newline.
+	 */
+	virtual void
+	writeText (uint64_t cellId,
+	           const std::string& barcode,
+	           std::string& lines)
+	{
+		(void) cellId;
+		(void) barcode;
+		(void) lines;
+		throw std::logic_error("the sink does not accept SAM lines");
+	}
+
+	/**
+	 * \brief Deliver the SAM lines whose barcode is not among the target ones.
+	 *
+	 * \param lines are the noise lines of the current batch, each one
+	 * terminated by a newline.
+	 */
+	virtual void
+	writeNoiseText (std::string& lines)
+	{
+		(void) lines;
+	}
+
+	/**
+	 * \brief Close the current batch of records.
+	 */
+	virtual void
+	endBatch ()
+	{
+	}
+
+	/**
+	 * \brief Complete the sink, after every record has been delivered.
+	 *
+	 * \param statistics is the outcome of the de-multiplexing run.
+	 */
+	virtual void
+	finish (const DemultiplexerStatistics& statistics)
+	{
+		(void) statistics;
+	}
+};
+
+/**
+ * \brief Sink collecting de-multiplexed records in main memory.
+ */
+class MemorySink : public RecordSink
+{
+
+public:
+
+	/**
+	 * \brief Class constructor.
+	 *
+	 * \param keepNoise is a flag which also collects noise records, if it is
+	 * true.
+	 */
+	explicit MemorySink (bool keepNoise = false) :
+		keepNoise_(keepNoise)
+	{
+	}
+
+	void
+	begin (const AlignmentsReader& reference,
+	       const std::vector<std::string>& barcodes) override
+	{
+		(void) reference;
+		cells_.clear();
+		cells_.resize(barcodes.size());
+		noise_.clear();
+	}
+
+	void
+	write (uint64_t cellId,
+	       const std::string& barcode,
+	       std::vector<seqan::BamAlignmentRecord>& records) override
+	{
+		(void) barcode;
+		append_(cells_[cellId],
+		        records);
+	}
+
+	void
+	writeNoise (std::vector<seqan::BamAlignmentRecord>& records) override
+	{
+		if (keepNoise_)
+		{
+			append_(noise_,
+			        records);
+		}
+	}
+
+	/**
+	 * \brief Access the records of a target barcode.
+	 *
+	 * \param cellId is the index of the barcode in the barcodes list.
+	 * \return the records of the barcode, in input order.
+	 */
+	inline std::vector<seqan::BamAlignmentRecord>&
+	getRecords (uint64_t cellId) noexcept
+	{
+		return cells_[cellId];
+	}
+
+	/**
+	 * \brief Access the noise records.
+	 *
+	 * \return the noise records, in input order.
+	 */
+	inline std::vector<seqan::BamAlignmentRecord>&
+	getNoise () noexcept
+	{
+		return noise_;
+	}
+
+private:
+	/**
+	 * Flag stating if noise records are collected.
+	 */
+	bool                                                keepNoise_;
+	/**
+	 * Records of every target barcode.
+	 */
+	std::vector<std::vector<seqan::BamAlignmentRecord>> cells_;
+	/**
+	 * Noise records.
+	 */
+	std::vector<seqan::BamAlignmentRecord>              noise_;
+
+	/**
+	 * \brief Move a batch of records at the end of a collection.
+	 *
+	 * \param sink is the collection the records are appended to.
+	 * \param records are the records to be appended.
+	 */
+	static inline void
+	append_ (std::vector<seqan::BamAlignmentRecord>& sink,
+	         std::vector<seqan::BamAlignmentRecord>& records)
+	{
+		if (sink.empty())
+		{
+			sink.swap(records);
+		}
+		else
+		{
+			sink.insert(sink.end(),
+			            records.begin(),
+			            records.end());
+		}
+	}
+};
+
+/**
+ * \brief Sink handing de-multiplexed records to user functions.
+ */
+class CallbackSink : public RecordSink
+{
+
+public:
+
+	/**
+	 * Type of the function receiving the records of a target barcode.
+	 */
+	using TCellCallback  = std::function<void(uint64_t,
+	                                          const std::string&,
+	                                          std::vector<seqan::BamAlignmentRecord>&)>;
+	/**
+	 * Type of the function receiving noise records.
+	 */
+	using TNoiseCallback = std::function<void(std::vector<seqan::BamAlignmentRecord>&)>;
+
+	/**
+	 * \brief Class constructor.
+	 *
+	 * \param cellCallback is called with the records of every target barcode.
+	 * \param noiseCallback is called with noise records, if it is set.
+	 */
+	explicit CallbackSink (TCellCallback cellCallback,
+	                       TNoiseCallback noiseCallback = nullptr) :
+		cellCallback_(std::move(cellCallback)),
+		noiseCallback_(std::move(noiseCallback))
+	{
+	}
+
+	void
+	write (uint64_t cellId,
+	       const std::string& barcode,
+	       std::vector<seqan::BamAlignmentRecord>& records) override
+	{
+		cellCallback_(cellId,
+		              barcode,
+		              records);
+	}
+
+	void
+	writeNoise (std::vector<seqan::BamAlignmentRecord>& records) override
+	{
+		if (noiseCallback_)
+		{
+			noiseCallback_(records);
+		}
+	}
+
+private:
+	/**
+	 * Function receiving the records of a target barcode.
+	 */
+	TCellCallback  cellCallback_;
+	/**
+	 * Function receiving noise records.
+	 */
+	TNoiseCallback noiseCallback_;
+};
+
+/**
+ * \brief Sink discarding de-multiplexed records, for runs only interested in
+ * the per-barcode counts reported by the statistics.
+ */
+class CountingSink : public RecordSink
+{
+
+public:
+
+	void
+	write (uint64_t cellId,
+	       const std::string& barcode,
+	       std::vector<seqan::BamAlignmentRecord>& records) override
+	{
+		(void) cellId;
+		(void) barcode;
+		(void) records;
+	}
+
+	bool
+	acceptsText () const override
+	{
+		return true;
+	}
+
+	void
+	writeText (uint64_t cellId,
+	           const std::string& barcode,
+	           std::string& lines) override
+	{
+		(void) cellId;
+		(void) barcode;
+		(void) lines;
+	}
+};
+
+} // sctools
+
+#endif // SCTOOLS_INCLUDE_SCTOOLS_RECORD_SINK_H
@@ -0,0 +1,875 @@
+/**
+ * \file   include/sctools/sam_scanner.h
+ * \author Elena Grassi
+ * \author Marilisa Montemurro
+ * \author Emanuele Parisi
+ * \date   February, 2019
+ *
+ * File containing facilities for visiting the lines of SAM files in parallel.
+ */
+
+#ifndef SCTOOLS_INCLUDE_SCTOOLS_SAM_SCANNER_H
+#define SCTOOLS_INCLUDE_SCTOOLS_SAM_SCANNER_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <experimental/filesystem>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "bam_record_view.h"
+
+namespace fs = std::experimental::filesystem;
+
+namespace sctools
+{
+
+/**
+ * \brief Class visiting every line of a SAM file, along with a binary
+ * representation of its record.
+ *
+ * The file is mapped in memory and split into chunks ending at line
+ * boundaries, which are parsed concurrently, each one by a single thread.
+ * Tabs and newlines are found 16 bytes at a time. Every line is encoded into
+ * a skeleton BAM record holding the fixed fields, the CIGAR and the optional
+ * fields, so that the same filters and barcode lookups of BAM records apply:
+ * the sequence and the qualities are never parsed, and array fields are
+ * encoded empty. Lines are visited in place, within the mapping.
+ */
+class SamScanner
+{
+
+public:
+
+	/**
+	 * Default size of the chunks, in bytes.
+	 */
+	static constexpr uint64_t DEFAULT_CHUNK_SIZE = 4ull << 20;
+
+	/**
+	 * Class constructor.
+	 */
+	SamScanner () = default;
+
+	/**
+	 * \brief Class copy constructor.
+	 *
+	 * \param other is the object the current instance is initialized from.
+	 */
+	SamScanner (const SamScanner& other) = delete;
+
+	/**
+	 * \brief Class copy assignment operator.
+	 *
+	 * \param other is the object the current instance is initialized from.
+	 * \return a reference to the assigned object.
+	 */
+	SamScanner&
+	operator= (const SamScanner& other) = delete;
+
+	/**
+	 * \brief Initialize the scanner.
+	 *
+	 * \param contigNames are the names of the reference sequences, indexed by
+	 * their identifier.
+	 * \param chunkSize is the approximate size of the chunks, in bytes.
+	 */
+	inline void
+	configure (const std::vector<std::string>& contigNames,
+	           uint64_t chunkSize = DEFAULT_CHUNK_SIZE)
+	{
+		if (chunkSize == 0)
+		{
+			throw std::invalid_argument("chunks must hold at least one byte");
+		}
+		chunkSize_ = chunkSize;
+		contigIds_.clear();
+		for (auto i = 0ul; i < contigNames.size(); i++)
+		{
+			contigIds_.emplace(contigNames[i],
+			                   static_cast<int32_t>(i));
+		}
+		workers_.assign(getThreadsCount(),
+		                Worker_());
+	}
+
+	/**
+	 * \brief Access the number of threads lines may be visited by.
+	 *
+	 * \return the number of threads, which bounds the thread index passed to
+	 * visitors.
+	 */
+	static inline uint64_t
+	getThreadsCount () noexcept
+	{
+#ifdef _OPENMP
+		return omp_get_max_threads();
+#else
+		return 1;
+#endif
+	}
+
+	/**
+	 * \brief Visit the record of every line of a SAM file.
+	 *
+	 * \param path is the path to the SAM file.
+	 * \param visitor is called as visitor(record, threadIndex) for every
+	 * record, concurrently from multiple threads.
+	 */
+	template <typename TVisitor>
+	inline void
+	scan (const fs::path& path,
+	      TVisitor&& visitor)
+	{
+		scanLines(path,
+		          [&visitor] (const BamRecordView& record,
+		                      const char*,
+		                      uint64_t,
+		                      uint64_t,
+		                      uint64_t threadIndex)
+		          {
+			          visitor(record,
+			                  threadIndex);
+		          },
+		          [] (uint64_t)
+		          {
+		          });
+	}
+
+	/**
+	 * \brief Visit every line of a SAM file, along with its record.
+	 *
+	 * Chunks are parsed in rounds of at most one chunk per thread. Every
+	 * thread visits the lines of a chunk in file order, and a round is over
+	 * only when all its chunks are, so the lines of a round can be collected
+	 * per chunk and consumed in file order when it ends.
+	 *
+	 * \param path is the path to the SAM file.
+	 * \param visitor is called as visitor(record, line, length, chunkIndex,
+	 * threadIndex) for every line of the body, concurrently from multiple
+	 * threads, where line points to the first of the length bytes of the line,
+	 * newline excluded, and chunkIndex is the index of its chunk within the
+	 * round. Lines stay valid until the end of the round.
+	 * \param roundEnd is called as roundEnd(chunksCount) at the end of every
+	 * round, from the calling thread.
+	 */
+	template <typename TVisitor,
+	          typename TRoundEnd>
+	inline void
+	scanLines (const fs::path& path,
+	           TVisitor&& visitor,
+	           TRoundEnd&& roundEnd)
+	{
+		Mapping_                        mapping(path);
+		std::vector<const char*>        bounds;
+		std::vector<std::exception_ptr> errors(workers_.size());
+		const char*                     end    = mapping.data + mapping.size;
+		const char*                     cursor = skipHeader_(mapping.data,
+		                                                     end);
+
+		while (cursor < end)
+		{
+			// Split the next round into chunks ending at line boundaries.
+			bounds.assign(1,
+			              cursor);
+			while (cursor < end && bounds.size() <= workers_.size())
+			{
+				cursor = static_cast<uint64_t>(end - cursor) <= chunkSize_ ?
+				         end :
+				         std::min(find_(cursor + chunkSize_ - 1,
+				                        end,
+				                        '\n') + 1,
+				                  end);
+				bounds.emplace_back(cursor);
+			}
+
+			#pragma omp parallel for schedule(dynamic, 1)
+			for (auto i = 0l; i < static_cast<int64_t>(bounds.size()) - 1; i++)
+			{
+				auto threadIndex = threadIndex_();
+
+				try
+				{
+					parseChunk_(path,
+					            bounds[i],
+					            bounds[i + 1],
+					            i,
+					            threadIndex,
+					            visitor);
+				}
+				catch (...)
+				{
+					errors[threadIndex] = std::current_exception();
+				}
+			}
+			rethrowFirst_(errors);
+			roundEnd(bounds.size() - 1);
+		}
+	}
+
+private:
+	/**
+	 * \brief Read-only memory mapping of a whole file.
+	 */
+	struct Mapping_
+	{
+		/**
+		 * First byte of the file, or nullptr if the file is empty.
+		 */
+		const char* data = nullptr;
+		/**
+		 * Size of the file.
+		 */
+		uint64_t    size = 0;
+
+		/**
+		 * \brief Map a file in memory.
+		 *
+		 * \param path is the path to the file.
+		 */
+		explicit Mapping_ (const fs::path& path)
+		{
+			struct stat status;
+			int         descriptor = open(path.c_str(),
+			                              O_RDONLY);
+
+			if (descriptor < 0 || fstat(descriptor,
+			                            &status) != 0)
+			{
+				if (descriptor >= 0)
+				{
+					close(descriptor);
+				}
+				throw std::runtime_error("cannot open '" +
+				                         path.string() +
+				                         "'");
+			}
+			size = status.st_size;
+			if (size > 0)
+			{
+				void* address = mmap(nullptr,
+				                     size,
+				                     PROT_READ,
+				                     MAP_PRIVATE,
+				                     descriptor,
+				                     0);
+
+				if (address == MAP_FAILED)
+				{
+					close(descriptor);
+					throw std::runtime_error("cannot map '" +
+					                         path.string() +
+					                         "' in memory");
+				}
+				madvise(address,
+				        size,
+				        MADV_SEQUENTIAL);
+				data = static_cast<const char*>(address);
+			}
+			close(descriptor);
+		}
+
+		Mapping_ (const Mapping_& other) = delete;
+
+		Mapping_&
+		operator= (const Mapping_& other) = delete;
+
+		~Mapping_ ()
+		{
+			if (data != nullptr)
+			{
+				munmap(const_cast<char*>(data),
+				       size);
+			}
+		}
+	};
+
+	/**
+	 * \brief Buffers a thread parses lines with.
+	 */
+	struct Worker_
+	{
+		/**
+		 * Binary representation of the current record, block size included.
+		 */
+		std::string record;
+		/**
+		 * Name of the reference sequence being looked up.
+		 */
+		std::string contigName;
+	};
+
+	/**
+	 * Approximate size of the chunks, in bytes.
+	 */
+	uint64_t                                 chunkSize_ = DEFAULT_CHUNK_SIZE;
+	/**
+	 * Identifier of every reference sequence, by name.
+	 */
+	std::unordered_map<std::string, int32_t> contigIds_;
+	/**
+	 * Buffers of every thread.
+	 */
+	std::vector<Worker_>                     workers_;
+
+	/**
+	 * \brief Access the index of the calling thread.
+	 *
+	 * \return the index of the thread within the current parallel region.
+	 */
+	static inline uint64_t
+	threadIndex_ () noexcept
+	{
+#ifdef _OPENMP
+		return omp_get_thread_num();
+#else
+		return 0;
+#endif
+	}
+
+	/**
+	 * \brief Rethrow the first exception raised by a thread, if any.
+	 *
+	 * \param errors are the exceptions raised by every thread.
+	 */
+	static inline void
+	rethrowFirst_ (std::vector<std::exception_ptr>& errors)
+	{
+		for (auto& e : errors)
+		{
+			if (e != nullptr)
+			{
+				auto error = e;
+
+				std::fill(errors.begin(),
+				          errors.end(),
+				          nullptr);
+				std::rethrow_exception(error);
+			}
+		}
+	}
+
+	/**
+	 * \brief Find the first occurrence of a byte.
+	 *
+	 * \param begin is the first byte searched.
+	 * \param end is the byte past the last one searched.
+	 * \param value is the byte looked for.
+	 * \return the address of the first occurrence, or end if there is none.
+	 */
+	static inline const char*
+	find_ (const char* begin,
+	       const char* end,
+	       char value) noexcept
+	{
+#ifdef __SSE2__
+		const __m128i pattern = _mm_set1_epi8(value);
+
+		while (end - begin >= 16)
+		{
+			int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(begin)),
+			                                            pattern));
+
+			if (mask != 0)
+			{
+				return begin + __builtin_ctz(mask);
+			}
+			begin += 16;
+		}
+#endif
+		const void* found = std::memchr(begin,
+		                                value,
+		                                end - begin);
+
+		return found == nullptr ? end : static_cast<const char*>(found);
+	}
+
+	/**
+	 * \brief Skip the header lines at the beginning of a SAM file.
+	 *
+	 * \param begin is the first byte of the file.
+	 * \param end is the byte past the last one of the file.
+	 * \return the address of the first line of the body.
+	 */
+	static inline const char*
+	skipHeader_ (const char* begin,
+	             const char* end) noexcept
+	{
+		while (begin < end && *begin == '@')
+		{
+			begin = std::min(find_(begin,
+			                       end,
+			                       '\n') + 1,
+			                 end);
+		}
+
+		return begin;
+	}
+
+	/**
+	 * \brief Parse the lines of a chunk, and visit them in order.
+	 *
+	 * \param path is the path to the SAM file, for error reporting.
+	 * \param begin is the first byte of the chunk.
+	 * \param end is the byte past the last one of the chunk.
+	 * \param chunkIndex is the index of the chunk within the round.
+	 * \param threadIndex is the index of the calling thread.
+	 * \param visitor is the function lines are visited with.
+	 */
+	template <typename TVisitor>
+	inline void
+	parseChunk_ (const fs::path& path,
+	             const char* begin,
+	             const char* end,
+	             uint64_t chunkIndex,
+	             uint64_t threadIndex,
+	             TVisitor& visitor)
+	{
+		auto& worker = workers_[threadIndex];
+
+		while (begin < end)
+		{
+			const char* lineEnd = find_(begin,
+			                            end,
+			                            '\n');
+			uint64_t    length  = lineEnd - begin;
+
+			// Carriage returns of files written on Windows are not part of
+			// the line.
+			if (length > 0 && begin[length - 1] == '\r')
+			{
+				length -= 1;
+			}
+			if (length > 0)
+			{
+				if (!encode_(begin,
+				             begin + length,
+				             worker))
+				{
+					throw std::runtime_error("malformed record '" +
+					                         std::string(begin,
+					                                     find_(begin,
+					                                           begin + length,
+					                                           '\t')) +
+					                         "' in '" +
+					                         path.string() +
+					                         "'");
+				}
+				visitor(BamRecordView::fromSized(&worker.record[0]),
+				        begin,
+				        length,
+				        chunkIndex,
+				        threadIndex);
+			}
+			begin = lineEnd + 1;
+		}
+	}
+
+	/**
+	 * \brief Encode a line into a skeleton BAM record.
+	 *
+	 * The bin is left to 0, and the sequence and the qualities are left
+	 * empty.
+	 *
+	 * \param begin is the first byte of the line.
+	 * \param end is the byte past the last one of the line.
+	 * \param worker holds the buffers of the calling thread, whose record is
+	 * set to the encoded one.
+	 * \return false if the line is malformed.
+	 */
+	inline bool
+	encode_ (const char* begin,
+	         const char* end,
+	         Worker_& worker) const
+	{
+		const char* fields[12];
+		int64_t     flag      = 0;
+		int64_t     position  = 0;
+		int64_t     mapq      = 0;
+		int64_t     nextPos   = 0;
+		int64_t     tlen      = 0;
+		int32_t     refId     = -1;
+		int32_t     nextRefId = -1;
+		uint64_t    nameSize  = 0;
+		auto&       record    = worker.record;
+
+		// Find the end of the mandatory fields, the last one excluded.
+		for (auto i = 0; i < 11; i++)
+		{
+			fields[i] = begin;
+			begin     = find_(begin,
+			                  end,
+			                  '\t');
+			if (begin == end && i < 10)
+			{
+				return false;
+			}
+			begin += 1;
+		}
+		fields[11] = std::min(begin,
+		                      end + 1);
+		nameSize   = fields[1] - fields[0] - 1;
+		if (nameSize == 0 || nameSize > 254 ||
+		    !parseInteger_(fields[1],
+		                   fields[2] - 1,
+		                   flag) ||
+		    !parseInteger_(fields[3],
+		                   fields[4] - 1,
+		                   position) ||
+		    !parseInteger_(fields[4],
+		                   fields[5] - 1,
+		                   mapq) ||
+		    !parseInteger_(fields[7],
+		                   fields[8] - 1,
+		                   nextPos) ||
+		    !parseInteger_(fields[8],
+		                   fields[9] - 1,
+		                   tlen) ||
+		    !findContig_(fields[2],
+		                 fields[3] - 1,
+		                 -1,
+		                 worker,
+		                 refId) ||
+		    !findContig_(fields[6],
+		                 fields[7] - 1,
+		                 refId,
+		                 worker,
+		                 nextRefId) ||
+		    flag < 0 || flag > UINT16_MAX || mapq < 0 || mapq > UINT8_MAX)
+		{
+			return false;
+		}
+
+		// Lay out the fixed fields, the read name and the CIGAR.
+		record.assign(36,
+		              '\0');
+		record.append(fields[0],
+		              nameSize);
+		record.push_back('\0');
+
+		auto cigarCount = encodeCigar_(fields[5],
+		                               fields[6] - 1,
+		                               record);
+
+		if (cigarCount < 0 || cigarCount > UINT16_MAX)
+		{
+			return false;
+		}
+		put_<int32_t>(record, 4, refId);
+		put_<int32_t>(record, 8, static_cast<int32_t>(position - 1));
+		put_<uint8_t>(record, 12, static_cast<uint8_t>(nameSize + 1));
+		put_<uint8_t>(record, 13, static_cast<uint8_t>(mapq));
+		put_<uint16_t>(record, 16, static_cast<uint16_t>(cigarCount));
+		put_<uint16_t>(record, 18, static_cast<uint16_t>(flag));
+		put_<int32_t>(record, 24, nextRefId);
+		put_<int32_t>(record, 28, static_cast<int32_t>(nextPos - 1));
+		put_<int32_t>(record, 32, static_cast<int32_t>(tlen));
+
+		// Encode the optional fields, one per tab-separated field.
+		begin = fields[11];
+		while (begin < end)
+		{
+			const char* fieldEnd = find_(begin,
+			                             end,
+			                             '\t');
+
+			if (!encodeTag_(begin,
+			                fieldEnd,
+			                record))
+			{
+				return false;
+			}
+			begin = fieldEnd + 1;
+		}
+		put_<uint32_t>(record, 0, static_cast<uint32_t>(record.size() - 4));
+
+		return true;
+	}
+
+	/**
+	 * \brief Look up a reference sequence by name.
+	 *
+	 * \param begin is the first byte of the name.
+	 * \param end is the byte past the last one of the name.
+	 * \param sameId is the identifier "=" stands for.
+	 * \param worker holds the buffers of the calling thread.
+	 * \param refId is set to the identifier of the reference sequence, or to
+	 * -1 for "*".
+	 * \return false if the reference sequence is unknown.
+	 */
+	inline bool
+	findContig_ (const char* begin,
+	             const char* end,
+	             int32_t sameId,
+	             Worker_& worker,
+	             int32_t& refId) const
+	{
+		if (end - begin == 1 && (*begin == '*' || *begin == '='))
+		{
+			refId = *begin == '*' ? -1 : sameId;
+			return true;
+		}
+		worker.contigName.assign(begin,
+		                         end);
+
+		auto contigIt = contigIds_.find(worker.contigName);
+
+		if (contigIt == contigIds_.end())
+		{
+			return false;
+		}
+		refId = contigIt->second;
+
+		return true;
+	}
+
+	/**
+	 * \brief Encode the CIGAR of a line.
+	 *
+	 * \param begin is the first byte of the CIGAR field.
+	 * \param end is the byte past the last one of the CIGAR field.
+	 * \param record is the record the operations are appended to.
+	 * \return the number of operations, or -1 if the CIGAR is malformed.
+	 */
+	static inline int64_t
+	encodeCigar_ (const char* begin,
+	              const char* end,
+	              std::string& record)
+	{
+		static const char operations[] = "MIDNSHP=X";
+		int64_t           count        = 0;
+
+		if (end - begin == 1 && *begin == '*')
+		{
+			return 0;
+		}
+		while (begin < end)
+		{
+			uint64_t length = 0;
+
+			while (begin < end && *begin >= '0' && *begin <= '9')
+			{
+				length = length * 10 + (*begin - '0');
+				begin += 1;
+			}
+
+			const char* operation = begin < end ?
+			                        static_cast<const char*>(std::memchr(operations,
+			                                                             *begin,
+			                                                             9)) :
+			                        nullptr;
+
+			if (operation == nullptr || length >= (1u << 28))
+			{
+				return -1;
+			}
+			uint32_t value = static_cast<uint32_t>(length << 4 | (operation - operations));
+
+			record.append(reinterpret_cast<const char*>(&value),
+			              4);
+			count += 1;
+			begin += 1;
+		}
+
+		return count;
+	}
+
+	/**
+	 * \brief Encode an optional field.
+	 *
+	 * Integers get the smallest of the signed and unsigned 32 bits types,
+	 * and arrays are encoded with no element, so that only their presence is
+	 * known.
+	 *
+	 * \param begin is the first byte of the field, as TG:T:VALUE.
+	 * \param end is the byte past the last one of the field.
+	 * \param record is the record the field is appended to.
+	 * \return false if the field is malformed.
+	 */
+	static inline bool
+	encodeTag_ (const char* begin,
+	            const char* end,
+	            std::string& record)
+	{
+		const char* value = begin + 5;
+		int64_t     integer = 0;
+
+		if (end - begin < 5 || begin[2] != ':' || begin[4] != ':')
+		{
+			return false;
+		}
+		record.append(begin,
+		              2);
+		switch (begin[3])
+		{
+		case 'A':
+			if (end - value != 1)
+			{
+				return false;
+			}
+			record.push_back('A');
+			record.push_back(*value);
+			return true;
+		case 'i':
+			if (!parseInteger_(value,
+			                   end,
+			                   integer) ||
+			    integer < std::numeric_limits<int32_t>::min() ||
+			    integer > std::numeric_limits<uint32_t>::max())
+			{
+				return false;
+			}
+			if (integer > std::numeric_limits<int32_t>::max())
+			{
+				record.push_back('I');
+				appendValue_<uint32_t>(record,
+				                       static_cast<uint32_t>(integer));
+			}
+			else
+			{
+				record.push_back('i');
+				appendValue_<int32_t>(record,
+				                      static_cast<int32_t>(integer));
+			}
+			return true;
+		case 'f':
+		{
+			// The value is copied, since the mapping is not null-terminated.
+			char  buffer[64];
+			char* parsedEnd = nullptr;
+
+			if (end - value == 0 || end - value >= 64)
+			{
+				return false;
+			}
+			std::memcpy(buffer,
+			            value,
+			            end - value);
+			buffer[end - value] = '\0';
+
+			float real = std::strtof(buffer,
+			                         &parsedEnd);
+
+			if (parsedEnd != buffer + (end - value))
+			{
+				return false;
+			}
+			record.push_back('f');
+			appendValue_<float>(record,
+			                    real);
+			return true;
+		}
+		case 'Z':
+		case 'H':
+			record.push_back(begin[3]);
+			record.append(value,
+			              end);
+			record.push_back('\0');
+			return true;
+		case 'B':
+			record.push_back('B');
+			record.push_back('c');
+			appendValue_<uint32_t>(record,
+			                       0);
+			return true;
+		default:
+			return false;
+		}
+	}
+
+	/**
+	 * \brief Parse a decimal integer.
+	 *
+	 * \param begin is the first byte of the integer.
+	 * \param end is the byte past the last one of the integer.
+	 * \param value is set to the integer.
+	 * \return false if the bytes are not a decimal integer.
+	 */
+	static inline bool
+	parseInteger_ (const char* begin,
+	               const char* end,
+	               int64_t& value) noexcept
+	{
+		bool isNegative = begin < end && *begin == '-';
+
+		if (isNegative || (begin < end && *begin == '+'))
+		{
+			begin += 1;
+		}
+		if (begin == end || end - begin > 18)
+		{
+			return false;
+		}
+		value = 0;
+		for (; begin < end; begin++)
+		{
+			if (*begin < '0' || *begin > '9')
+			{
+				return false;
+			}
+			value = value * 10 + (*begin - '0');
+		}
+		if (isNegative)
+		{
+			value = -value;
+		}
+
+		return true;
+	}
+
+	/**
+	 * \brief Store a little-endian value at a given offset.
+	 *
+	 * \param record is the record the value is stored in.
+	 * \param offset is the offset of the value.
+	 * \param value is the value.
+	 */
+	template <typename TValue>
+	static inline void
+	put_ (std::string& record,
+	      uint64_t offset,
+	      TValue value) noexcept
+	{
+		std::memcpy(&record[offset],
+		            &value,
+		            sizeof(value));
+	}
+
+	/**
+	 * \brief Append a little-endian value.
+	 *
+	 * \param record is the record the value is appended to.
+	 * \param value is the value.
+	 */
+	template <typename TValue>
+	static inline void
+	appendValue_ (std::string& record,
+	              TValue value)
+	{
+		record.append(reinterpret_cast<const char*>(&value),
+		              sizeof(value));
+	}
+};
+
+} // sctools
+
+#endif // SCTOOLS_INCLUDE_SCTOOLS_SAM_SCANNER_H
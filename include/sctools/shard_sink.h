@@ -0,0 +1,453 @@
+/**
+ * \file   include/sctools/shard_sink.h
+ * \author Elena Grassi
+ * \author Marilisa Montemurro
+ * \author Emanuele Parisi
+ * \date   February, 2019
+ *
+ * File containing the sink writing de-multiplexed alignment records to a
+ * fixed number of shard files.
+ */
+
+#ifndef SCTOOLS_INCLUDE_SCTOOLS_SHARD_SINK_H
+#define SCTOOLS_INCLUDE_SCTOOLS_SHARD_SINK_H
+
+#include <algorithm>
+#include <experimental/filesystem>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "alignments_reader.h"
+#include "alignments_writer.h"
+#include "compression_backend.h"
+#include "output_scheduler.h"
+#include "record_sink.h"
+
+namespace fs = std::experimental::filesystem;
+
+namespace sctools
+{
+
+/**
+ * \brief Struct storing the configuration of a shard sink.
+ */
+struct ShardSinkConfig
+{
+	/**
+	 * Path to the directory where the shard files are stored.
+	 */
+	fs::path               outputDirPath      = ".";
+	/**
+	 * Number of shard files target barcodes are spread over.
+	 */
+	uint64_t               shardsCount        = 64;
+	/**
+	 * Maximum number of records buffered by all the shards together.
+	 */
+	uint64_t               bufferedRecords    = 1024ull * 1024ull;
+	/**
+	 * Deflate implementation used for compressing BAM files.
+	 */
+	CompressionBackendType compressionBackend = CompressionBackendType::ZLIB;
+	/**
+	 * Compression level of BAM files, from 0 to 9.
+	 */
+	int                    compressionLevel   = AlignmentsWriter::DEFAULT_COMPRESSION_LEVEL;
+	/**
+	 * Maximum number of output writes submitted in a single batch.
+	 */
+	uint64_t               outputQueueDepth   = 32;
+	/**
+	 * Flag which submits output writes through io_uring, when available.
+	 */
+	bool                   useIoUring         = true;
+};
+
+/**
+ * \brief Sink spreading the records of the target barcodes over a fixed
+ * number of BAM files, and the remaining ones to the noise file.
+ *
+ * Every barcode is assigned to the shard selected by the hash of its value.
+ * Records are buffered per shard, and the buffer of a shard is written, cell
+ * by cell, when it holds its share of the buffered records or when the sink
+ * is finished. Every cell starts a new BGZF block, so that its records occupy
+ * a range of whole blocks: copying the header, the range and the end-of-file
+ * marker gives a valid BAM file. The ranges of every barcode are listed in the
+ * shards_manifest.tsv file of the output directory.
+ */
+class ShardSink : public RecordSink
+{
+
+public:
+
+	/**
+	 * \brief Struct storing a range of a shard file holding records of a
+	 * single barcode.
+	 */
+	struct Range
+	{
+		/**
+		 * Index of the barcode in the barcodes list.
+		 */
+		uint64_t cellId  = 0;
+		/**
+		 * Index of the shard file.
+		 */
+		uint64_t shardId = 0;
+		/**
+		 * Offset of the first block of the range.
+		 */
+		uint64_t begin   = 0;
+		/**
+		 * Offset following the last block of the range.
+		 */
+		uint64_t end     = 0;
+	};
+
+	/**
+	 * Class constructor.
+	 */
+	ShardSink () = default;
+
+	/**
+	 * \brief Class copy constructor.
+	 *
+	 * \param other is the object the current instance is initialized from.
+	 */
+	ShardSink (const ShardSink& other) = delete;
+
+	/**
+	 * \brief Class copy assignment operator.
+	 *
+	 * \param other is the object the current instance is initialized from.
+	 * \return a reference to the assigned object.
+	 */
+	ShardSink&
+	operator= (const ShardSink& other) = delete;
+
+	/**
+	 * \brief Initialize the sink.
+	 *
+	 * \param config is the configuration of the sink.
+	 */
+	inline void
+	configure (const ShardSinkConfig& config)
+	{
+		if (!fs::is_directory(config.outputDirPath))
+		{
+			throw std::invalid_argument("output directory '" +
+			                            config.outputDirPath.string() +
+			                            "' does not exist");
+		}
+		if (config.shardsCount == 0)
+		{
+			throw std::invalid_argument("the number of shards must be positive");
+		}
+		config_ = config;
+	}
+
+	/**
+	 * \brief Select the shard of a barcode.
+	 *
+	 * The FNV-1a hash is used, so that barcodes are assigned to the same
+	 * shards across runs and platforms.
+	 *
+	 * \param barcode is the value of the barcode.
+	 * \param shardsCount is the number of shards.
+	 * \return the index of the shard.
+	 */
+	static inline uint64_t
+	shardOf (const std::string& barcode,
+	         uint64_t shardsCount) noexcept
+	{
+		uint64_t hash = 0xcbf29ce484222325ull;
+
+		for (auto c : barcode)
+		{
+			hash ^= static_cast<uint8_t>(c);
+			hash *= 0x100000001b3ull;
+		}
+
+		return hash % shardsCount;
+	}
+
+	void
+	begin (const AlignmentsReader& reference,
+	       const std::vector<std::string>& barcodes) override
+	{
+		std::string headerBlob;
+
+		if (!reference.isBinary())
+		{
+			throw std::invalid_argument("shard files can only be written from BAM input files");
+		}
+
+		// Assign every barcode to its shard.
+		barcodes_ = barcodes;
+		shardIds_.clear();
+		for (const auto& b : barcodes_)
+		{
+			shardIds_.emplace_back(shardOf(b,
+			                               config_.shardsCount));
+		}
+		cellBuffers_.assign(barcodes_.size(),
+		                    {});
+		shardCells_.assign(config_.shardsCount,
+		                   {});
+		shardRecords_.assign(config_.shardsCount,
+		                     0);
+		shardCapacity_ = std::max<uint64_t>(config_.bufferedRecords / config_.shardsCount,
+		                                    1);
+		ranges_.clear();
+
+		// Create every shard file and the noise file, all kept open during
+		// the whole run.
+		headerBlob = AlignmentsWriter::encodeHeader(reference,
+		                                            config_.compressionBackend,
+		                                            config_.compressionLevel);
+		scheduler_.configure(config_.outputQueueDepth,
+		                     config_.shardsCount + 1,
+		                     config_.useIoUring);
+		shardWriters_.clear();
+		for (auto i = 0ul; i < config_.shardsCount; i++)
+		{
+			shardWriters_.emplace_back(new AlignmentsWriter());
+			shardWriters_.back()->configure(getShardPath(i),
+			                                reference,
+			                                false,
+			                                false,
+			                                config_.compressionBackend,
+			                                config_.compressionLevel,
+			                                &scheduler_);
+			shardWriters_.back()->writeHeaderBlob(headerBlob);
+		}
+		noiseWriter_.configure(config_.outputDirPath / "noise.bam",
+		                       reference,
+		                       false,
+		                       false,
+		                       config_.compressionBackend,
+		                       config_.compressionLevel,
+		                       &scheduler_);
+		noiseWriter_.writeHeaderBlob(headerBlob);
+	}
+
+	void
+	write (uint64_t cellId,
+	       const std::string& barcode,
+	       std::vector<seqan::BamAlignmentRecord>& records) override
+	{
+		auto  shardId    = shardIds_[cellId];
+		auto& cellBuffer = cellBuffers_[cellId];
+
+		(void) barcode;
+		shardRecords_[shardId] += records.size();
+		if (cellBuffer.empty())
+		{
+			cellBuffer.swap(records);
+			shardCells_[shardId].emplace_back(cellId);
+		}
+		else
+		{
+			cellBuffer.insert(cellBuffer.end(),
+			                  records.begin(),
+			                  records.end());
+		}
+		if (shardRecords_[shardId] >= shardCapacity_)
+		{
+			flushShard_(shardId);
+		}
+	}
+
+	void
+	writeNoise (std::vector<seqan::BamAlignmentRecord>& records) override
+	{
+		noiseWriter_.write(records.begin(),
+		                   records.end());
+	}
+
+	void
+	endBatch () override
+	{
+		// Submit the blocks compressed during this batch, for all the shards
+		// at once; buffered records wait for their shard to fill.
+		scheduler_.flush();
+	}
+
+	void
+	finish (const DemultiplexerStatistics& statistics) override
+	{
+		(void) statistics;
+
+		// Write the records left in the buffers, and terminate every file.
+		for (auto i = 0ul; i < config_.shardsCount; i++)
+		{
+			flushShard_(i);
+			shardWriters_[i]->reset();
+		}
+		noiseWriter_.reset();
+		scheduler_.flush();
+		writeManifest_();
+	}
+
+	/**
+	 * \brief Access the path of a shard file.
+	 *
+	 * \param shardId is the index of the shard.
+	 * \return the path of the shard file.
+	 */
+	inline fs::path
+	getShardPath (uint64_t shardId) const
+	{
+		return config_.outputDirPath / ("shard_" + std::to_string(shardId) + ".bam");
+	}
+
+	/**
+	 * \brief Access the ranges written so far.
+	 *
+	 * \return the ranges of every barcode, sorted by barcode and offset once
+	 * the sink is finished.
+	 */
+	inline const std::vector<Range>&
+	getRanges () const noexcept
+	{
+		return ranges_;
+	}
+
+	/**
+	 * \brief Access the scheduler output writes are issued through.
+	 *
+	 * \return a reference to the output scheduler.
+	 */
+	inline const OutputScheduler&
+	getScheduler () const noexcept
+	{
+		return scheduler_;
+	}
+
+private:
+	/**
+	 * Configuration of the sink.
+	 */
+	ShardSinkConfig                                     config_;
+	/**
+	 * Target barcodes, indexed by cell identifier.
+	 */
+	std::vector<std::string>                            barcodes_;
+	/**
+	 * Shard of every target barcode.
+	 */
+	std::vector<uint64_t>                               shardIds_;
+	/**
+	 * Buffered records of every target barcode.
+	 */
+	std::vector<std::vector<seqan::BamAlignmentRecord>> cellBuffers_;
+	/**
+	 * Cells with buffered records in every shard, by first arrival.
+	 */
+	std::vector<std::vector<uint64_t>>                  shardCells_;
+	/**
+	 * Number of buffered records of every shard.
+	 */
+	std::vector<uint64_t>                               shardRecords_;
+	/**
+	 * Number of buffered records a shard is written at.
+	 */
+	uint64_t                                            shardCapacity_ = 1;
+	/**
+	 * Ranges written so far.
+	 */
+	std::vector<Range>                                  ranges_;
+	/**
+	 * Scheduler batching the writes of all the files.
+	 */
+	OutputScheduler                                     scheduler_;
+	/**
+	 * Writer of every shard file.
+	 */
+	std::vector<std::unique_ptr<AlignmentsWriter>>      shardWriters_;
+	/**
+	 * Writer of the noise file.
+	 */
+	AlignmentsWriter                                    noiseWriter_;
+
+	/**
+	 * \brief Write the buffered records of a shard, one cell after the other.
+	 *
+	 * \param shardId is the index of the shard.
+	 */
+	inline void
+	flushShard_ (uint64_t shardId)
+	{
+		auto& writer = *shardWriters_[shardId];
+
+		for (auto cellId : shardCells_[shardId])
+		{
+			Range range;
+
+			range.cellId  = cellId;
+			range.shardId = shardId;
+			range.begin   = writer.getCompressedSize();
+			writer.write(cellBuffers_[cellId].begin(),
+			             cellBuffers_[cellId].end());
+			writer.flushBlock();
+			range.end     = writer.getCompressedSize();
+			ranges_.emplace_back(range);
+			cellBuffers_[cellId].clear();
+			cellBuffers_[cellId].shrink_to_fit();
+		}
+		shardCells_[shardId].clear();
+		shardRecords_[shardId] = 0;
+	}
+
+	/**
+	 * \brief Write the manifest listing the ranges of every barcode.
+	 *
+	 * Adjacent ranges of the same barcode are merged.
+	 */
+	inline void
+	writeManifest_ ()
+	{
+		std::vector<Range> merged;
+		std::ofstream      manifestWriter(config_.outputDirPath / "shards_manifest.tsv");
+
+		std::sort(ranges_.begin(),
+		          ranges_.end(),
+		          [] (const Range& lhs,
+		              const Range& rhs)
+		          {
+			          return lhs.cellId < rhs.cellId || (lhs.cellId == rhs.cellId && lhs.begin < rhs.begin);
+		          });
+		for (const auto& r : ranges_)
+		{
+			if (!merged.empty() && merged.back().cellId == r.cellId && merged.back().end == r.begin)
+			{
+				merged.back().end = r.end;
+			}
+			else
+			{
+				merged.emplace_back(r);
+			}
+		}
+		ranges_.swap(merged);
+
+		manifestWriter << "#barcode\tshard\tbegin\tend\n";
+		for (const auto& r : ranges_)
+		{
+			manifestWriter << barcodes_[r.cellId] << "\t"
+			               << getShardPath(r.shardId).filename().string() << "\t"
+			               << r.begin << "\t"
+			               << r.end << "\n";
+		}
+		if (!manifestWriter)
+		{
+			throw std::runtime_error("cannot write the shards manifest");
+		}
+	}
+};
+
+} // sctools
+
+#endif // SCTOOLS_INCLUDE_SCTOOLS_SHARD_SINK_H
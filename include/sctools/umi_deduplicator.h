@@ -0,0 +1,739 @@
+/**
+ * \file   include/sctools/umi_deduplicator.h
+ * \author Elena Grassi
+ * \author Marilisa Montemurro
+ * \author Emanuele Parisi
+ * \date   February, 2019
+ *
+ * File containing the per-cell collapsing of the reads of the same molecule,
+ * identified by their UMI and alignment position.
+ */
+
+#ifndef SCTOOLS_INCLUDE_SCTOOLS_UMI_DEDUPLICATOR_H
+#define SCTOOLS_INCLUDE_SCTOOLS_UMI_DEDUPLICATOR_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <limits>
+#include <queue>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <seqan/bam_io.h>
+
+namespace sctools
+{
+
+/**
+ * \brief Class keeping a single read for every molecule of every cell, from
+ * a coordinate-sorted stream of alignment records.
+ *
+ * A molecule is identified by the cell, the UMI, the strand and the 5' end
+ * of its reads, clipped bases included: the unclipped start of forward reads
+ * and the unclipped end of reverse ones, so that reads differing only in
+ * length or clipping are collapsed. For every molecule, the read with the
+ * highest mapping quality is emitted, the first one on ties.
+ *
+ * Molecules are held until no further read can belong to them. Reverse
+ * molecules are complete once the stream is past their end. Forward
+ * molecules are complete once the stream is WINDOW bases past their start,
+ * so reads whose leading clips are longer than WINDOW may form a molecule of
+ * their own. Records are emitted in coordinate order, every one waiting for
+ * the molecules which may still be represented by an earlier read; memory
+ * thus grows with the window and the span of the alignments, not with the
+ * stream.
+ *
+ * If neighbour merging is enabled, the UMIs of the same cell, strand and
+ * position are clustered with the directional method: a UMI absorbs the ones
+ * differing by a single base whose count is at most half of its own, plus
+ * one, transitively. Every cluster is then a single molecule, represented by
+ * its most frequent UMI.
+ *
+ * Unmapped records and records without UMI are emitted untouched.
+ */
+class UmiDeduplicator
+{
+
+public:
+
+	/**
+	 * Number of bases the stream must be past the start of a forward
+	 * molecule before it is complete.
+	 */
+	static constexpr int64_t WINDOW = 1000;
+
+	/**
+	 * Class constructor.
+	 */
+	UmiDeduplicator () = default;
+
+	/**
+	 * \brief Class copy constructor.
+	 *
+	 * \param other is the object the current instance is initialized from.
+	 */
+	UmiDeduplicator (const UmiDeduplicator& other) = delete;
+
+	/**
+	 * \brief Class copy assignment operator.
+	 *
+	 * \param other is the object the current instance is initialized from.
+	 * \return a reference to the assigned object.
+	 */
+	UmiDeduplicator&
+	operator= (const UmiDeduplicator& other) = delete;
+
+	/**
+	 * \brief Reset the deduplicator, so that it forwards every record.
+	 */
+	inline void
+	reset () noexcept
+	{
+		isEnabled_       = false;
+		mergeNeighbours_ = false;
+		rID_             = 0;
+		beginPos_        = 0;
+		duplicatesCount_ = 0;
+		missingUmiCount_ = 0;
+		moleculesCount_  = 0;
+		sequence_        = 0;
+		freeEntries_.clear();
+		for (auto i = entries_.size(); i > 0; i--)
+		{
+			freeEntries_.emplace_back(i - 1);
+		}
+		entryIds_.clear();
+		pending_   = TPendingQueue();
+		blocking_  = TBlockingQueue();
+		ready_     = TReadyQueue();
+	}
+
+	/**
+	 * \brief Initialize the deduplicator.
+	 *
+	 * \param mergeNeighbours is the flag which merges the UMIs differing by a
+	 * single base, with the directional method.
+	 */
+	inline void
+	configure (bool mergeNeighbours)
+	{
+		reset();
+		isEnabled_       = true;
+		mergeNeighbours_ = mergeNeighbours;
+	}
+
+	/**
+	 * \brief Check if the deduplicator collapses any record.
+	 *
+	 * \return true if the deduplicator has been configured.
+	 */
+	inline bool
+	isEnabled () const noexcept
+	{
+		return isEnabled_;
+	}
+
+	/**
+	 * \brief Add a record of a target barcode.
+	 *
+	 * Records must be added in coordinate order. Records are not emitted as
+	 * they are added, but when their molecule is complete and every record
+	 * before them has been emitted, or when the deduplicator is flushed.
+	 *
+	 * \param cellId is the index of the barcode of the record.
+	 * \param record is the alignment record.
+	 * \param umi is the UMI of the record, or the empty string if it has none.
+	 * \param emit is the function called as emit(cellId, record) for every
+	 * emitted record, which may take the record away by moving it.
+	 */
+	template <typename Emit>
+	inline void
+	add (uint64_t cellId,
+	     const seqan::BamAlignmentRecord& record,
+	     const std::string& umi,
+	     Emit&& emit)
+	{
+		// Records without reference sequence are sorted last.
+		uint32_t rID = static_cast<uint32_t>(record.rID);
+
+		if (rID != rID_ || record.beginPos != beginPos_)
+		{
+			if (rID < rID_ || (rID == rID_ && record.beginPos < beginPos_))
+			{
+				throw std::runtime_error("UMI deduplication requires coordinate-sorted input files");
+			}
+			complete_(rID == rID_ ? record.beginPos : std::numeric_limits<int64_t>::max());
+			rID_      = rID;
+			beginPos_ = record.beginPos;
+			emitReady_(emit);
+		}
+		sequence_ += 1;
+		if (seqan::hasFlagUnmapped(record) || umi.empty())
+		{
+			auto  entryId = allocateEntry_();
+			auto& entry   = entries_[entryId];
+
+			missingUmiCount_ += seqan::hasFlagUnmapped(record) ? 0 : 1;
+			entry.cellId      = cellId;
+			entry.isMolecule  = false;
+			entry.record      = record;
+			entry.sequence    = sequence_;
+			ready_.emplace(record.beginPos,
+			               sequence_,
+			               entryId);
+			emitReady_(emit);
+			return;
+		}
+
+		// Look the molecule up, and keep its best read so far.
+		bool    isReverse = seqan::hasFlagRC(record);
+		int64_t position  = isReverse ? unclippedEnd_(record) : unclippedBegin_(record);
+
+		makeKey_(cellId,
+		         isReverse,
+		         position,
+		         umi);
+
+		auto entryIt = entryIds_.find(key_);
+
+		if (entryIt == entryIds_.end())
+		{
+			auto  entryId = allocateEntry_();
+			auto& entry   = entries_[entryId];
+
+			entry.cellId     = cellId;
+			entry.isMolecule = true;
+			entry.isReverse  = isReverse;
+			entry.position   = position;
+			entry.umi        = umi;
+			entry.count      = 1;
+			entry.record     = record;
+			entry.sequence   = sequence_;
+			entry.isPending  = true;
+			entryIds_.emplace(key_,
+			                  entryId);
+			pending_.emplace(isReverse ? position + 1 : position + WINDOW + 1,
+			                 entryId);
+			blocking_.emplace(record.beginPos,
+			                  entryId);
+			return;
+		}
+
+		auto& entry = entries_[entryIt->second];
+
+		entry.count += 1;
+		if (record.mapQ > entry.record.mapQ)
+		{
+			entry.record   = record;
+			entry.sequence = sequence_;
+			blocking_.emplace(record.beginPos,
+			                  entryIt->second);
+		}
+	}
+
+	/**
+	 * \brief Emit every record held.
+	 *
+	 * \param emit is the function called as emit(cellId, record) for every
+	 * emitted record.
+	 */
+	template <typename Emit>
+	inline void
+	flush (Emit&& emit)
+	{
+		complete_(std::numeric_limits<int64_t>::max());
+		emitReady_(emit);
+	}
+
+	/**
+	 * \brief Access the number of records collapsed into another one.
+	 *
+	 * \return the number of duplicate records dropped so far.
+	 */
+	inline uint64_t
+	getDuplicatesCount () const noexcept
+	{
+		return duplicatesCount_;
+	}
+
+	/**
+	 * \brief Access the number of mapped records without UMI.
+	 *
+	 * \return the number of records forwarded because they have no UMI.
+	 */
+	inline uint64_t
+	getMissingUmiCount () const noexcept
+	{
+		return missingUmiCount_;
+	}
+
+	/**
+	 * \brief Access the number of molecules emitted.
+	 *
+	 * \return the number of records emitted on behalf of a molecule.
+	 */
+	inline uint64_t
+	getMoleculesCount () const noexcept
+	{
+		return moleculesCount_;
+	}
+
+private:
+	/**
+	 * \brief Struct storing a molecule, or a record which is not
+	 * deduplicated.
+	 */
+	struct Entry_
+	{
+		/**
+		 * Index of the barcode of the molecule.
+		 */
+		uint64_t                  cellId     = 0;
+		/**
+		 * Flag which is false if the entry holds a record which is not
+		 * deduplicated.
+		 */
+		bool                      isMolecule = false;
+		/**
+		 * Flag which is true if the reads of the molecule are reverse
+		 * complemented.
+		 */
+		bool                      isReverse  = false;
+		/**
+		 * Unclipped 5' end of the reads of the molecule.
+		 */
+		int64_t                   position   = 0;
+		/**
+		 * UMI of the molecule.
+		 */
+		std::string               umi;
+		/**
+		 * Number of reads of the molecule.
+		 */
+		uint64_t                  count      = 0;
+		/**
+		 * Read with the highest mapping quality.
+		 */
+		seqan::BamAlignmentRecord record;
+		/**
+		 * Order in which the read has been added.
+		 */
+		uint64_t                  sequence   = 0;
+		/**
+		 * Flag which is true while further reads may join the molecule.
+		 */
+		bool                      isPending  = false;
+		/**
+		 * Flag which is true if the molecule has been merged into a more
+		 * frequent one.
+		 */
+		bool                      isAbsorbed = false;
+		/**
+		 * Flag which is true once the molecule has been clustered.
+		 */
+		bool                      isVisited  = false;
+	};
+
+	/**
+	 * Queue of the pending molecules, by position of the stream they are
+	 * complete at.
+	 */
+	using TPendingQueue  = std::priority_queue<std::pair<int64_t, uint64_t>,
+	                                           std::vector<std::pair<int64_t, uint64_t>>,
+	                                           std::greater<std::pair<int64_t, uint64_t>>>;
+	/**
+	 * Queue of the pending molecules, by position of their best read so far.
+	 * Entries are left behind when the best read changes, and skipped.
+	 */
+	using TBlockingQueue = std::priority_queue<std::pair<int32_t, uint64_t>,
+	                                           std::vector<std::pair<int32_t, uint64_t>>,
+	                                           std::greater<std::pair<int32_t, uint64_t>>>;
+	/**
+	 * Queue of the records to be emitted, by position and order of addition.
+	 */
+	using TReadyQueue    = std::priority_queue<std::tuple<int32_t, uint64_t, uint64_t>,
+	                                           std::vector<std::tuple<int32_t, uint64_t, uint64_t>>,
+	                                           std::greater<std::tuple<int32_t, uint64_t, uint64_t>>>;
+
+	/**
+	 * Flag which is true if the deduplicator has been configured.
+	 */
+	bool                                      isEnabled_       = false;
+	/**
+	 * Flag which merges the UMIs differing by a single base.
+	 */
+	bool                                      mergeNeighbours_ = false;
+	/**
+	 * Reference sequence of the last record added.
+	 */
+	uint32_t                                  rID_             = 0;
+	/**
+	 * Leftmost aligned base of the last record added.
+	 */
+	int32_t                                   beginPos_        = 0;
+	/**
+	 * Number of records collapsed into another one.
+	 */
+	uint64_t                                  duplicatesCount_ = 0;
+	/**
+	 * Number of mapped records without UMI.
+	 */
+	uint64_t                                  missingUmiCount_ = 0;
+	/**
+	 * Number of molecules emitted.
+	 */
+	uint64_t                                  moleculesCount_  = 0;
+	/**
+	 * Number of records added.
+	 */
+	uint64_t                                  sequence_        = 0;
+	/**
+	 * Molecules and records held. Free entries are kept for reusing their
+	 * storage.
+	 */
+	std::vector<Entry_>                       entries_;
+	/**
+	 * Indices of the free entries.
+	 */
+	std::vector<uint64_t>                     freeEntries_;
+	/**
+	 * Map associating the key of every pending molecule with its entry.
+	 */
+	std::unordered_map<std::string, uint64_t> entryIds_;
+	/**
+	 * Buffer the key of a molecule is built in.
+	 */
+	std::string                               key_;
+	/**
+	 * Pending molecules, by position of the stream they are complete at.
+	 */
+	TPendingQueue                             pending_;
+	/**
+	 * Pending molecules, by position of their best read so far.
+	 */
+	TBlockingQueue                            blocking_;
+	/**
+	 * Records to be emitted, by position.
+	 */
+	TReadyQueue                               ready_;
+	/**
+	 * Indices of the molecules completed together, sorted for clustering.
+	 */
+	std::vector<uint64_t>                     order_;
+	/**
+	 * Entries waiting to absorb their neighbours.
+	 */
+	std::vector<uint64_t>                     queue_;
+
+	/**
+	 * \brief Take a free entry.
+	 *
+	 * \return the index of the entry.
+	 */
+	inline uint64_t
+	allocateEntry_ ()
+	{
+		if (freeEntries_.empty())
+		{
+			entries_.emplace_back();
+
+			return entries_.size() - 1;
+		}
+
+		auto  entryId = freeEntries_.back();
+		auto& entry   = entries_[entryId];
+
+		freeEntries_.pop_back();
+		entry.isPending  = false;
+		entry.isAbsorbed = false;
+		entry.isVisited  = false;
+
+		return entryId;
+	}
+
+	/**
+	 * \brief Build the key of a molecule.
+	 *
+	 * \param cellId is the index of the barcode of the molecule.
+	 * \param isReverse is true if the reads of the molecule are reverse
+	 * complemented.
+	 * \param position is the unclipped 5' end of the reads of the molecule.
+	 * \param umi is the UMI of the molecule.
+	 */
+	inline void
+	makeKey_ (uint64_t cellId,
+	          bool isReverse,
+	          int64_t position,
+	          const std::string& umi)
+	{
+		key_.assign(reinterpret_cast<const char*>(&cellId),
+		            sizeof(cellId));
+		key_.push_back(isReverse ? '-' : '+');
+		key_.append(reinterpret_cast<const char*>(&position),
+		            sizeof(position));
+		key_.append(umi);
+	}
+
+	/**
+	 * \brief Compute the first reference base of a record, clipped bases
+	 * included.
+	 *
+	 * \param record is the alignment record.
+	 * \return the unclipped start of the record.
+	 */
+	static inline int64_t
+	unclippedBegin_ (const seqan::BamAlignmentRecord& record)
+	{
+		int64_t position = record.beginPos;
+
+		for (auto i = 0ul; i < seqan::length(record.cigar); i++)
+		{
+			auto operation = record.cigar[i].operation;
+
+			if (operation != 'S' && operation != 'H')
+			{
+				break;
+			}
+			position -= record.cigar[i].count;
+		}
+
+		return position;
+	}
+
+	/**
+	 * \brief Compute the last reference base of a record, clipped bases
+	 * included.
+	 *
+	 * \param record is the alignment record.
+	 * \return the unclipped end of the record.
+	 */
+	static inline int64_t
+	unclippedEnd_ (const seqan::BamAlignmentRecord& record)
+	{
+		int64_t position = record.beginPos - 1;
+
+		for (auto i = 0ul; i < seqan::length(record.cigar); i++)
+		{
+			switch (record.cigar[i].operation)
+			{
+				case 'M':
+				case 'D':
+				case 'N':
+				case '=':
+				case 'X':
+				case 'S':
+				case 'H':
+					position += record.cigar[i].count;
+					break;
+				default:
+					break;
+			}
+		}
+
+		// Leading clips precede the start, and are not part of the end.
+		return position + record.beginPos - unclippedBegin_(record);
+	}
+
+	/**
+	 * \brief Complete the pending molecules no further read can join.
+	 *
+	 * The molecules completed are clustered if neighbour merging is enabled,
+	 * and the surviving ones are queued for emission.
+	 *
+	 * \param position is the position of the next record, or the largest
+	 * position if no further record can join any molecule.
+	 */
+	inline void
+	complete_ (int64_t position)
+	{
+		order_.clear();
+		while (!pending_.empty() && pending_.top().first <= position)
+		{
+			order_.emplace_back(pending_.top().second);
+			pending_.pop();
+		}
+		if (order_.empty())
+		{
+			return;
+		}
+		if (mergeNeighbours_)
+		{
+			clusterUmis_();
+		}
+		for (auto i : order_)
+		{
+			auto& entry = entries_[i];
+
+			makeKey_(entry.cellId,
+			         entry.isReverse,
+			         entry.position,
+			         entry.umi);
+			entryIds_.erase(key_);
+			entry.isPending = false;
+			entry.isVisited = false;
+			if (entry.isAbsorbed)
+			{
+				duplicatesCount_ += entry.count;
+				entry.isAbsorbed  = false;
+				freeEntries_.emplace_back(i);
+				continue;
+			}
+			duplicatesCount_ += entry.count - 1;
+			moleculesCount_  += 1;
+			ready_.emplace(entry.record.beginPos,
+			               entry.sequence,
+			               i);
+		}
+	}
+
+	/**
+	 * \brief Emit the records which no pending molecule may precede.
+	 *
+	 * \param emit is the function the records are emitted through.
+	 */
+	template <typename Emit>
+	inline void
+	emitReady_ (Emit&& emit)
+	{
+		// Skip the positions left behind by completed molecules, or by
+		// molecules whose best read changed.
+		while (!blocking_.empty() &&
+		       (!entries_[blocking_.top().second].isPending ||
+		        entries_[blocking_.top().second].record.beginPos != blocking_.top().first))
+		{
+			blocking_.pop();
+		}
+		while (!ready_.empty() &&
+		       (blocking_.empty() || std::get<0>(ready_.top()) <= blocking_.top().first))
+		{
+			auto  entryId = std::get<2>(ready_.top());
+			auto& entry   = entries_[entryId];
+
+			ready_.pop();
+			emit(entry.cellId,
+			     entry.record);
+			freeEntries_.emplace_back(entryId);
+		}
+	}
+
+	/**
+	 * \brief Mark the molecules absorbed by a more frequent neighbour.
+	 *
+	 * The molecules completed together are visited by cell, strand, position
+	 * and decreasing count: every entry which has not been absorbed yet
+	 * starts a cluster, which grows through the directional edges of its
+	 * members.
+	 */
+	inline void
+	clusterUmis_ ()
+	{
+		auto isSameGroup = [this] (uint64_t lhs,
+		                           uint64_t rhs)
+		{
+			const auto& l = entries_[lhs];
+			const auto& r = entries_[rhs];
+
+			return l.cellId == r.cellId && l.isReverse == r.isReverse && l.position == r.position;
+		};
+
+		std::sort(order_.begin(),
+		          order_.end(),
+		          [this] (uint64_t lhs,
+		                  uint64_t rhs)
+		          {
+			          const auto& l = entries_[lhs];
+			          const auto& r = entries_[rhs];
+
+			          if (l.cellId != r.cellId)
+			          {
+				          return l.cellId < r.cellId;
+			          }
+			          if (l.isReverse != r.isReverse)
+			          {
+				          return l.isReverse < r.isReverse;
+			          }
+			          if (l.position != r.position)
+			          {
+				          return l.position < r.position;
+			          }
+
+			          return l.count > r.count || (l.count == r.count && l.sequence < r.sequence);
+		          });
+		for (auto groupBegin = 0ul; groupBegin < order_.size();)
+		{
+			auto groupEnd = groupBegin + 1;
+
+			while (groupEnd < order_.size() &&
+			       isSameGroup(order_[groupBegin],
+			                   order_[groupEnd]))
+			{
+				groupEnd += 1;
+			}
+			for (auto i = groupBegin; i < groupEnd; i++)
+			{
+				if (entries_[order_[i]].isVisited)
+				{
+					continue;
+				}
+				entries_[order_[i]].isVisited = true;
+				queue_.assign(1,
+				              order_[i]);
+				while (!queue_.empty())
+				{
+					auto& parent = entries_[queue_.back()];
+
+					queue_.pop_back();
+					for (auto j = groupBegin; j < groupEnd; j++)
+					{
+						auto& child = entries_[order_[j]];
+
+						if (!child.isVisited && parent.count + 1 >= 2 * child.count &&
+						    isNeighbour_(parent.umi,
+						                 child.umi))
+						{
+							child.isVisited  = true;
+							child.isAbsorbed = true;
+							queue_.emplace_back(order_[j]);
+						}
+					}
+				}
+			}
+			groupBegin = groupEnd;
+		}
+	}
+
+	/**
+	 * \brief Check if two UMIs differ by exactly one base.
+	 *
+	 * \param lhs is the first UMI.
+	 * \param rhs is the second UMI.
+	 * \return true if the UMIs have the same length and a single mismatch.
+	 */
+	static inline bool
+	isNeighbour_ (const std::string& lhs,
+	              const std::string& rhs) noexcept
+	{
+		uint64_t mismatches = 0;
+
+		if (lhs.size() != rhs.size())
+		{
+			return false;
+		}
+		for (auto i = 0ul; i < lhs.size() && mismatches < 2; i++)
+		{
+			mismatches += lhs[i] != rhs[i] ? 1 : 0;
+		}
+
+		return mismatches == 1;
+	}
+};
+
+} // sctools
+
+#endif // SCTOOLS_INCLUDE_SCTOOLS_UMI_DEDUPLICATOR_H
@@ -0,0 +1,331 @@
+/**
+ * \file   include/sctools/write_pool.h
+ * \author Elena Grassi
+ * \author Marilisa Montemurro
+ * \author Emanuele Parisi
+ * \date   February, 2019
+ *
+ * File containing facilities for writing many output files concurrently.
+ */
+
+#ifndef SCTOOLS_INCLUDE_SCTOOLS_WRITE_POOL_H
+#define SCTOOLS_INCLUDE_SCTOOLS_WRITE_POOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <numeric>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+namespace sctools
+{
+
+/**
+ * \brief Class running the writes of a batch on multiple threads, one task per
+ * output file.
+ *
+ * Every output file is owned by a thread, chosen from its identifier, so the
+ * same thread serves it batch after batch. A thread runs its own tasks from
+ * the most expensive to the least expensive one, then steals the least
+ * expensive tasks left to the other threads. Tasks are claimed whole and run
+ * by a single thread, so the writes of a file keep their order without any
+ * lock.
+ */
+class WritePool
+{
+
+public:
+
+	/**
+	 * Class constructor.
+	 */
+	WritePool () = default;
+
+	/**
+	 * \brief Class copy constructor.
+	 *
+	 * \param other is the object the current instance is initialized from.
+	 */
+	WritePool (const WritePool& other) = delete;
+
+	/**
+	 * \brief Class copy assignment operator.
+	 *
+	 * \param other is the object the current instance is initialized from.
+	 * \return a reference to the assigned object.
+	 */
+	WritePool&
+	operator= (const WritePool& other) = delete;
+
+	/**
+	 * \brief Initialize the pool.
+	 *
+	 * \param threadsCount is the number of threads running the tasks, or 0
+	 * for as many threads as OpenMP provides.
+	 */
+	inline void
+	configure (uint64_t threadsCount = 0)
+	{
+#ifdef _OPENMP
+		threadsCount_ = threadsCount == 0 ? omp_get_max_threads() : threadsCount;
+#else
+		(void) threadsCount;
+		threadsCount_ = 1;
+#endif
+		bounds_.reset(new std::atomic<uint64_t>[threadsCount_ * BOUNDS_STRIDE_]);
+		errors_.assign(threadsCount_,
+		               nullptr);
+		stolenCount_ = 0;
+	}
+
+	/**
+	 * \brief Access the number of threads running the tasks.
+	 *
+	 * \return the number of threads, which bounds the thread index passed to
+	 * tasks.
+	 */
+	inline uint64_t
+	getThreadsCount () const noexcept
+	{
+		return threadsCount_;
+	}
+
+	/**
+	 * \brief Access the number of tasks run by a thread other than their
+	 * owner.
+	 *
+	 * \return the number of stolen tasks since the pool was configured.
+	 */
+	inline uint64_t
+	getStolenCount () const noexcept
+	{
+		return stolenCount_;
+	}
+
+	/**
+	 * \brief Run the tasks of a batch, and wait for their completion.
+	 *
+	 * \param outputIds are the output files written by the batch, each one
+	 * listed once.
+	 * \param costs is the expected cost of the task of every output file,
+	 * such as its number of records.
+	 * \param task is called as task(outputId, threadIndex) for every output
+	 * file, concurrently from multiple threads.
+	 */
+	template <typename TTask>
+	inline void
+	run (const std::vector<uint64_t>& outputIds,
+	     const std::vector<uint64_t>& costs,
+	     TTask&& task)
+	{
+		uint64_t stolenCount = 0;
+
+		if (threadsCount_ <= 1 || outputIds.size() <= 1)
+		{
+			for (auto outputId : outputIds)
+			{
+				task(outputId,
+				     0);
+			}
+			return;
+		}
+
+		// Queue the tasks of every thread, the most expensive first.
+		offsets_.assign(threadsCount_ + 1,
+		                0);
+		for (auto outputId : outputIds)
+		{
+			offsets_[outputId % threadsCount_ + 1] += 1;
+		}
+		std::partial_sum(offsets_.begin(),
+		                 offsets_.end(),
+		                 offsets_.begin());
+		cursors_.assign(offsets_.begin(),
+		                offsets_.end() - 1);
+		tasks_.resize(outputIds.size());
+		for (auto i = 0ul; i < outputIds.size(); i++)
+		{
+			tasks_[cursors_[outputIds[i] % threadsCount_]++] = i;
+		}
+		for (auto t = 0ul; t < threadsCount_; t++)
+		{
+			std::sort(tasks_.begin() + offsets_[t],
+			          tasks_.begin() + offsets_[t + 1],
+			          [&costs] (uint64_t lhs,
+			                    uint64_t rhs)
+			          {
+				          return costs[lhs] > costs[rhs];
+			          });
+			bounds_[t * BOUNDS_STRIDE_].store((offsets_[t] << 32) | offsets_[t + 1],
+			                                  std::memory_order_relaxed);
+		}
+
+		#pragma omp parallel num_threads(threadsCount_) reduction(+:stolenCount)
+		{
+			auto     threadIndex = threadIndex_();
+			uint64_t taskIndex   = 0;
+
+			try
+			{
+				while (claim_(threadIndex,
+				              true,
+				              taskIndex))
+				{
+					task(outputIds[taskIndex],
+					     threadIndex);
+				}
+
+				// Tasks are never added while the batch runs, so a single
+				// pass over the other queues drains them.
+				for (auto i = 1ul; i < threadsCount_; i++)
+				{
+					auto victim = (threadIndex + i) % threadsCount_;
+
+					while (claim_(victim,
+					              false,
+					              taskIndex))
+					{
+						task(outputIds[taskIndex],
+						     threadIndex);
+						stolenCount += 1;
+					}
+				}
+			}
+			catch (...)
+			{
+				errors_[threadIndex] = std::current_exception();
+			}
+		}
+		stolenCount_ += stolenCount;
+		rethrowFirst_();
+	}
+
+private:
+	/**
+	 * Distance between the bounds of two queues, so that they never share a
+	 * cache line.
+	 */
+	static constexpr uint64_t                  BOUNDS_STRIDE_ = 8;
+
+	/**
+	 * Number of threads running the tasks.
+	 */
+	uint64_t                                   threadsCount_  = 1;
+	/**
+	 * Bounds of the queue of every thread, with the index of its first task
+	 * in the upper half and the index past its last task in the lower one.
+	 */
+	std::unique_ptr<std::atomic<uint64_t>[]>   bounds_;
+	/**
+	 * Tasks of all the threads, as indices in the batch, queue after queue.
+	 */
+	std::vector<uint64_t>                      tasks_;
+	/**
+	 * Offset of the queue of every thread, followed by the number of tasks.
+	 */
+	std::vector<uint64_t>                      offsets_;
+	/**
+	 * Insertion point of every queue, while they are filled.
+	 */
+	std::vector<uint64_t>                      cursors_;
+	/**
+	 * Exception raised by every thread.
+	 */
+	std::vector<std::exception_ptr>            errors_;
+	/**
+	 * Number of tasks run by a thread other than their owner.
+	 */
+	uint64_t                                   stolenCount_   = 0;
+
+	/**
+	 * \brief Access the index of the calling thread.
+	 *
+	 * \return the index of the thread within the current parallel region.
+	 */
+	static inline uint64_t
+	threadIndex_ () noexcept
+	{
+#ifdef _OPENMP
+		return omp_get_thread_num();
+#else
+		return 0;
+#endif
+	}
+
+	/**
+	 * \brief Claim a task from a queue.
+	 *
+	 * The owner of a queue claims from its front, and the other threads from
+	 * its back, both with a single compare-and-swap on its bounds.
+	 *
+	 * \param queue is the index of the thread owning the queue.
+	 * \param front is a flag which claims the first task, if it is true, and
+	 * the last one otherwise.
+	 * \param taskIndex is set to the index of the task in the batch.
+	 * \return false if the queue is empty.
+	 */
+	inline bool
+	claim_ (uint64_t queue,
+	        bool front,
+	        uint64_t& taskIndex) noexcept
+	{
+		auto& bounds  = bounds_[queue * BOUNDS_STRIDE_];
+		auto  current = bounds.load(std::memory_order_relaxed);
+
+		while (true)
+		{
+			auto first = current >> 32;
+			auto last  = current & 0xffffffffull;
+
+			if (first >= last)
+			{
+				return false;
+			}
+			if (front)
+			{
+				first += 1;
+			}
+			else
+			{
+				last -= 1;
+			}
+			if (bounds.compare_exchange_weak(current,
+			                                 (first << 32) | last,
+			                                 std::memory_order_relaxed))
+			{
+				taskIndex = tasks_[front ? first - 1 : last];
+				return true;
+			}
+		}
+	}
+
+	/**
+	 * \brief Rethrow the first exception raised by a thread, if any.
+	 */
+	inline void
+	rethrowFirst_ ()
+	{
+		for (auto& e : errors_)
+		{
+			if (e != nullptr)
+			{
+				auto error = e;
+
+				std::fill(errors_.begin(),
+				          errors_.end(),
+				          nullptr);
+				std::rethrow_exception(error);
+			}
+		}
+	}
+};
+
+} // sctools
+
+#endif // SCTOOLS_INCLUDE_SCTOOLS_WRITE_POOL_H
@@ -0,0 +1,223 @@
+/**
+ * \file   tests/perf/generate_inputs.cpp
+ * \author Elena Grassi
+ * \author Marilisa Montemurro
+ * \author Emanuele Parisi
+ * \date   February, 2019
+ *
+ * Generator of the deterministic inputs the performance tests run on.
+ */
+
+#include <cstdint>
+#include <experimental/filesystem>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <seqan/bam_io.h>
+
+namespace fs = std::experimental::filesystem;
+
+namespace
+{
+
+/**
+ * Number of contigs of the generated reference.
+ */
+constexpr uint64_t CONTIGS_COUNT  = 4;
+/**
+ * Length of every contig of the generated reference.
+ */
+constexpr uint64_t CONTIG_LENGTH  = 100000000;
+/**
+ * Length of every generated read.
+ */
+constexpr uint64_t READ_LENGTH    = 100;
+/**
+ * Length of every generated barcode.
+ */
+constexpr uint64_t BARCODE_LENGTH = 16;
+
+/**
+ * \brief Draw a random barcode.
+ *
+ * \param generator is the random number generator.
+ * \return the barcode.
+ */
+std::string
+randomBarcode (std::mt19937_64& generator)
+{
+	static const char bases[] = "ACGT";
+	std::string       barcode;
+
+	for (auto i = 0ul; i < BARCODE_LENGTH; i++)
+	{
+		barcode.push_back(bases[generator() % 4]);
+	}
+
+	return barcode;
+}
+
+/**
+ * \brief Write the header of the generated BAM file.
+ *
+ * \param bamFileOut is the output BAM file.
+ */
+void
+writeHeader (seqan::BamFileOut& bamFileOut)
+{
+	seqan::BamHeader       header;
+	seqan::BamHeaderRecord firstRecord;
+
+	firstRecord.type = seqan::BAM_HEADER_FIRST;
+	seqan::appendValue(firstRecord.tags,
+	                   seqan::Pair<seqan::CharString>("VN",
+	                                                  "1.6"));
+	seqan::appendValue(firstRecord.tags,
+	                   seqan::Pair<seqan::CharString>("SO",
+	                                                  "coordinate"));
+	seqan::appendValue(header,
+	                   firstRecord);
+	for (auto i = 0ul; i < CONTIGS_COUNT; i++)
+	{
+		seqan::BamHeaderRecord contigRecord;
+		std::string            contigName = "chr" + std::to_string(i + 1);
+
+		contigRecord.type = seqan::BAM_HEADER_REFERENCE;
+		seqan::appendValue(contigRecord.tags,
+		                   seqan::Pair<seqan::CharString>("SN",
+		                                                  contigName));
+		seqan::appendValue(contigRecord.tags,
+		                   seqan::Pair<seqan::CharString>("LN",
+		                                                  std::to_string(CONTIG_LENGTH)));
+		seqan::appendValue(header,
+		                   contigRecord);
+		seqan::appendValue(seqan::contigNames(seqan::context(bamFileOut)),
+		                   contigName);
+		seqan::appendValue(seqan::contigLengths(seqan::context(bamFileOut)),
+		                   CONTIG_LENGTH);
+	}
+	seqan::writeHeader(bamFileOut,
+	                   header);
+}
+
+} // namespace
+
+/**
+ * Entry point of the generator.
+ *
+ * It writes a coordinate-sorted BAM file, input.bam, and the per-cell summary
+ * metrics of its target barcodes, cells.csv, to the output directory. Most
+ * records carry the 'CB' tag of a target barcode; the remaining ones carry a
+ * noise barcode. The same arguments always produce the same files.
+ *
+ * \param argc is the number of arguments provided on the command line.
+ * \param argv are the output directory, the number of records, the number of
+ * target barcodes and the seed.
+ * \return the code 0 if the inputs are generated; otherwise, it returns -1.
+ */
+int
+main (int argc,
+      char** argv)
+{
+	if (argc != 5)
+	{
+		std::cerr << "usage: " << argv[0] << " OUTPUT-DIRECTORY RECORDS CELLS SEED" << std::endl;
+		return -1;
+	}
+
+	fs::path                 outputDirPath = argv[1];
+	uint64_t                 recordsCount  = std::stoull(argv[2]);
+	uint64_t                 cellsCount    = std::stoull(argv[3]);
+	std::mt19937_64          generator(std::stoull(argv[4]));
+	std::vector<std::string> barcodes;
+	std::vector<uint64_t>    readsCounts(cellsCount,
+	                                     0);
+
+	fs::create_directories(outputDirPath);
+	for (auto i = 0ul; i < cellsCount; i++)
+	{
+		barcodes.emplace_back(randomBarcode(generator));
+	}
+
+	// Write the records, evenly spaced along the contigs so that the file is
+	// coordinate-sorted. About 10% of them belong to noise barcodes.
+	seqan::BamFileOut bamFileOut;
+
+	if (!seqan::open(bamFileOut,
+	                 (outputDirPath / "input.bam").c_str()))
+	{
+		std::cerr << "cannot create " << (outputDirPath / "input.bam") << std::endl;
+		return -1;
+	}
+	writeHeader(bamFileOut);
+
+	uint64_t                  recordsPerContig = (recordsCount + CONTIGS_COUNT - 1) / CONTIGS_COUNT;
+	seqan::BamAlignmentRecord record;
+
+	for (auto i = 0ul; i < recordsCount; i++)
+	{
+		std::string barcode;
+
+		seqan::clear(record);
+		record.qName    = "read" + std::to_string(i);
+		record.flag     = 0;
+		record.rID      = i / recordsPerContig;
+		record.beginPos = (i % recordsPerContig) * (CONTIG_LENGTH - READ_LENGTH) / recordsPerContig;
+		record.mapQ     = 60;
+		record.rNextId  = seqan::BamAlignmentRecord::INVALID_REFID;
+		record.pNext    = seqan::BamAlignmentRecord::INVALID_POS;
+		record.tLen     = seqan::BamAlignmentRecord::INVALID_LEN;
+		seqan::appendValue(record.cigar,
+		                   seqan::CigarElement<>('M',
+		                                         READ_LENGTH));
+		for (auto j = 0ul; j < READ_LENGTH; j++)
+		{
+			seqan::appendValue(record.seq,
+			                   seqan::Dna5(generator() % 4));
+			seqan::appendValue(record.qual,
+			                   static_cast<char>('#' + generator() % 40));
+		}
+		if (generator() % 10 == 0)
+		{
+			barcode = randomBarcode(generator);
+		}
+		else
+		{
+			auto cellId = generator() % cellsCount;
+
+			barcode               = barcodes[cellId];
+			readsCounts[cellId] += 1;
+		}
+
+		seqan::BamTagsDict tagsDict(record.tags);
+
+		seqan::setTagValue(tagsDict,
+		                   "CB",
+		                   barcode + "-1");
+		seqan::setTagValue(tagsDict,
+		                   "NM",
+		                   static_cast<int>(generator() % 5));
+		seqan::writeRecord(bamFileOut,
+		                   record);
+	}
+	seqan::close(bamFileOut);
+
+	// Write the per-cell summary metrics of the target barcodes.
+	std::ofstream csvWriter(outputDirPath / "cells.csv");
+
+	csvWriter << "barcode,cell_id,total_num_reads,num_unmapped_reads,num_lowmapq_reads,"
+	             "num_duplicate_reads,num_mapped_dedup_reads,frac_mapped_duplicates,"
+	             "effective_depth_of_coverage,effective_reads_per_1Mbp,raw_mapd,"
+	             "normalized_mapd,raw_dimapd,normalized_dimapd,mean_ploidy,"
+	             "ploidy_confidence,is_high_dimapd,is_noisy\n";
+	for (auto i = 0ul; i < cellsCount; i++)
+	{
+		csvWriter << barcodes[i] << "-1," << i << "," << readsCounts[i]
+		          << ",0,0,0," << readsCounts[i] << ",0,0,0,0,0,0,0,2,0,0,0\n";
+	}
+
+	return csvWriter ? 0 : -1;
+}
@@ -0,0 +1,379 @@
+/**
+ * \file   tests/perf/perf_runner.cpp
+ * \author Elena Grassi
+ * \author Marilisa Montemurro
+ * \author Emanuele Parisi
+ * \date   February, 2019
+ *
+ * Runner measuring the throughput and the peak memory of a command, and
+ * comparing them against a recorded baseline.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <experimental/filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace fs = std::experimental::filesystem;
+
+namespace
+{
+
+/**
+ * \brief Struct storing the options of the runner.
+ */
+struct Options
+{
+	/**
+	 * Name of the performance test.
+	 */
+	std::string              name;
+	/**
+	 * Path to the JSON file storing the baseline of the test.
+	 */
+	fs::path                 baselinePath;
+	/**
+	 * Path to the JSON file the measurements are written to.
+	 */
+	fs::path                 resultPath;
+	/**
+	 * Directory emptied before every run of the command.
+	 */
+	fs::path                 cleanDirPath;
+	/**
+	 * Relative deviation from the baseline tolerated before failing.
+	 */
+	double                   tolerance    = 0.25;
+	/**
+	 * Number of records processed by every run of the command.
+	 */
+	uint64_t                 recordsCount = 0;
+	/**
+	 * Number of runs of the command, the best of which is kept.
+	 */
+	uint64_t                 repeat       = 3;
+	/**
+	 * Command to be measured.
+	 */
+	std::vector<std::string> command;
+};
+
+/**
+ * \brief Struct storing the measurements of a command.
+ */
+struct Measure
+{
+	/**
+	 * Number of records processed per second.
+	 */
+	double   recordsPerSecond = 0.0;
+	/**
+	 * Peak resident set size, in KiB.
+	 */
+	uint64_t peakRssKiB       = 0;
+};
+
+/**
+ * \brief Parse the command line of the runner.
+ *
+ * \param argc is the number of arguments.
+ * \param argv are the arguments: options, then "--" and the command.
+ * \return the parsed options.
+ */
+Options
+parseOptions (int argc,
+              char** argv)
+{
+	Options options;
+	int     i = 1;
+
+	for (; i < argc && std::strcmp(argv[i], "--") != 0; i += 2)
+	{
+		std::string option = argv[i];
+
+		if (i + 1 >= argc)
+		{
+			throw std::invalid_argument("missing value of option " + option);
+		}
+
+		std::string value = argv[i + 1];
+
+		if (option == "--name")
+		{
+			options.name = value;
+		}
+		else if (option == "--baseline")
+		{
+			options.baselinePath = value;
+		}
+		else if (option == "--result")
+		{
+			options.resultPath = value;
+		}
+		else if (option == "--clean")
+		{
+			options.cleanDirPath = value;
+		}
+		else if (option == "--tolerance")
+		{
+			options.tolerance = std::stod(value);
+		}
+		else if (option == "--records")
+		{
+			options.recordsCount = std::stoull(value);
+		}
+		else if (option == "--repeat")
+		{
+			options.repeat = std::max<uint64_t>(std::stoull(value),
+			                                    1);
+		}
+		else
+		{
+			throw std::invalid_argument("unknown option " + option);
+		}
+	}
+	for (i += 1; i < argc; i++)
+	{
+		options.command.emplace_back(argv[i]);
+	}
+	if (options.name.empty() || options.baselinePath.empty() || options.recordsCount == 0 || options.command.empty())
+	{
+		throw std::invalid_argument("usage: sctools_perf_runner --name NAME --baseline JSON "
+		                            "--records N [--tolerance T] [--repeat R] [--clean DIR] "
+		                            "[--result JSON] -- COMMAND...");
+	}
+
+	return options;
+}
+
+/**
+ * \brief Run the command once, measuring its wall time and peak memory.
+ *
+ * \param options are the options of the runner.
+ * \return the measurements of the run.
+ */
+Measure
+runOnce (const Options& options)
+{
+	std::vector<char*> arguments;
+	struct rusage      usage;
+	int                status = 0;
+
+	if (!options.cleanDirPath.empty())
+	{
+		fs::remove_all(options.cleanDirPath);
+		fs::create_directories(options.cleanDirPath);
+	}
+	for (const auto& c : options.command)
+	{
+		arguments.emplace_back(const_cast<char*>(c.c_str()));
+	}
+	arguments.emplace_back(nullptr);
+
+	auto   start = std::chrono::steady_clock::now();
+	pid_t  child = fork();
+
+	if (child < 0)
+	{
+		throw std::runtime_error("cannot fork the command");
+	}
+	if (child == 0)
+	{
+		// Keep the output of the command out of the test log, except errors.
+		if (std::freopen("/dev/null",
+		                 "w",
+		                 stdout) == nullptr)
+		{
+			_exit(127);
+		}
+		execv(arguments.front(),
+		      arguments.data());
+		_exit(127);
+	}
+	if (wait4(child,
+	          &status,
+	          0,
+	          &usage) != child)
+	{
+		throw std::runtime_error("cannot wait for the command");
+	}
+
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+	{
+		throw std::runtime_error("the command failed");
+	}
+
+	Measure measure;
+
+	measure.recordsPerSecond = options.recordsCount / std::max(elapsed.count(),
+	                                                           1e-9);
+	measure.peakRssKiB       = usage.ru_maxrss;
+
+	return measure;
+}
+
+/**
+ * \brief Extract a number from a flat JSON object.
+ *
+ * \param json is the text of the object.
+ * \param key is the key of the number.
+ * \return the value of the number.
+ */
+double
+jsonNumber (const std::string& json,
+            const std::string& key)
+{
+	auto keyPosition = json.find("\"" + key + "\"");
+
+	if (keyPosition == std::string::npos)
+	{
+		throw std::runtime_error("baseline has no '" + key + "' value");
+	}
+
+	auto colonPosition = json.find(':',
+	                               keyPosition);
+
+	return std::stod(json.substr(colonPosition + 1));
+}
+
+/**
+ * \brief Write measurements as a flat JSON object.
+ *
+ * \param path is the path to the JSON file.
+ * \param name is the name of the performance test.
+ * \param measure are the measurements.
+ */
+void
+writeJson (const fs::path& path,
+           const std::string& name,
+           const Measure& measure)
+{
+	std::ofstream jsonWriter;
+
+	fs::create_directories(path.parent_path());
+	jsonWriter.open(path);
+	jsonWriter << "{\n"
+	           << "\t\"name\": \"" << name << "\",\n"
+	           << "\t\"records_per_second\": " << static_cast<uint64_t>(measure.recordsPerSecond) << ",\n"
+	           << "\t\"peak_rss_kib\": " << measure.peakRssKiB << "\n"
+	           << "}\n";
+	if (!jsonWriter)
+	{
+		throw std::runtime_error("cannot write " + path.string());
+	}
+}
+
+} // namespace
+
+/**
+ * Entry point of the performance test runner.
+ *
+ * The command is run the requested number of times, keeping the best
+ * throughput and the lowest peak memory. The test fails if the throughput is
+ * lower than the baseline, or the peak memory higher, by more than the
+ * tolerance, or if no baseline has been recorded. If the
+ * SCTOOLS_PERF_UPDATE_BASELINES environment variable is set, the baseline is
+ * written with the measurements instead.
+ *
+ * \param argc is the number of arguments provided on the command line.
+ * \param argv is the values of the arguments provided on the command line.
+ * \return the code 0 if the test passes; otherwise, it returns 1.
+ */
+int
+main (int argc,
+      char** argv)
+{
+	try
+	{
+		Options options = parseOptions(argc,
+		                               argv);
+		Measure best;
+
+		best.peakRssKiB = UINT64_MAX;
+		for (auto i = 0ul; i < options.repeat; i++)
+		{
+			Measure measure = runOnce(options);
+
+			best.recordsPerSecond = std::max(best.recordsPerSecond,
+			                                 measure.recordsPerSecond);
+			best.peakRssKiB       = std::min(best.peakRssKiB,
+			                                 measure.peakRssKiB);
+		}
+		if (!options.resultPath.empty())
+		{
+			writeJson(options.resultPath,
+			          options.name,
+			          best);
+		}
+		std::cout << options.name << ": " << static_cast<uint64_t>(best.recordsPerSecond)
+		          << " records/s, " << best.peakRssKiB << " KiB peak RSS" << std::endl;
+
+		if (std::getenv("SCTOOLS_PERF_UPDATE_BASELINES") != nullptr)
+		{
+			writeJson(options.baselinePath,
+			          options.name,
+			          best);
+			std::cout << "baseline updated: " << options.baselinePath << std::endl;
+			return 0;
+		}
+		if (!fs::exists(options.baselinePath))
+		{
+			std::cout << "FAILED: no baseline at " << options.baselinePath
+			          << "; record it by running the test with SCTOOLS_PERF_UPDATE_BASELINES set"
+			          << std::endl;
+			return 1;
+		}
+
+		std::ifstream     baselineReader(options.baselinePath);
+		std::stringstream baseline;
+
+		if (!baselineReader)
+		{
+			throw std::runtime_error("cannot read baseline " + options.baselinePath.string());
+		}
+		baseline << baselineReader.rdbuf();
+
+		double baselineThroughput = jsonNumber(baseline.str(),
+		                                       "records_per_second");
+		double baselineRss        = jsonNumber(baseline.str(),
+		                                       "peak_rss_kib");
+		bool   isPassed           = true;
+
+		std::cout << "baseline: " << static_cast<uint64_t>(baselineThroughput) << " records/s, "
+		          << static_cast<uint64_t>(baselineRss) << " KiB peak RSS, tolerance "
+		          << options.tolerance * 100 << "%" << std::endl;
+		if (best.recordsPerSecond < baselineThroughput * (1.0 - options.tolerance))
+		{
+			std::cout << "FAILED: throughput dropped by "
+			          << (1.0 - best.recordsPerSecond / baselineThroughput) * 100 << "%" << std::endl;
+			isPassed = false;
+		}
+		if (best.peakRssKiB > baselineRss * (1.0 + options.tolerance))
+		{
+			std::cout << "FAILED: peak RSS grew by "
+			          << (best.peakRssKiB / baselineRss - 1.0) * 100 << "%" << std::endl;
+			isPassed = false;
+		}
+
+		return isPassed ? 0 : 1;
+	}
+	catch (std::exception& e)
+	{
+		std::cerr << "sctools_perf_runner: " << e.what() << std::endl;
+		return 1;
+	}
+}
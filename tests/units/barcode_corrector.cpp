@@ -0,0 +1,159 @@
+/**
+ * \file   tests/units/barcode_corrector.cpp
+ * \author Elena Grassi
+ * \author Marilisa Montemurro
+ * \author Emanuele Parisi
+ * \date   February, 2019
+ *
+ * Unit tests of the corrector of raw barcodes.
+ */
+
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+
+#include <gtest/gtest.h>
+
+#include "sctools/barcode_corrector.h"
+
+using namespace sctools;
+
+namespace
+{
+
+/**
+ * \brief Correct a raw barcode.
+ *
+ * \param corrector is the configured corrector.
+ * \param barcode is the raw barcode.
+ * \param qualities are the Phred+33 base qualities, or nullptr.
+ * \param cellId is set to the identifier of the corrected barcode.
+ * \return the outcome of the correction.
+ */
+BarcodeCorrector::Outcome
+correct (const BarcodeCorrector& corrector,
+         const std::string& barcode,
+         const char* qualities,
+         uint64_t& cellId)
+{
+	return corrector.correct(barcode.data(),
+	                         barcode.size(),
+	                         qualities,
+	                         cellId);
+}
+
+} // namespace
+
+TEST(BarcodeCorrector, IsDisabledUntilConfigured)
+{
+	BarcodeCorrector corrector;
+	uint64_t         cellId = 0;
+
+	EXPECT_FALSE(corrector.isEnabled());
+	EXPECT_EQ(correct(corrector, "ACGT", nullptr, cellId),
+	          BarcodeCorrector::Outcome::UNCORRECTABLE);
+	corrector.configure({});
+	EXPECT_FALSE(corrector.isEnabled());
+}
+
+TEST(BarcodeCorrector, RejectsInvalidWhitelists)
+{
+	BarcodeCorrector corrector;
+
+	EXPECT_THROW(corrector.configure({"ACGT", "ACG"}),
+	             std::invalid_argument);
+	EXPECT_THROW(corrector.configure({"ACGT", "ACGN"}),
+	             std::invalid_argument);
+	EXPECT_THROW(corrector.configure({std::string(BarcodeCorrector::MAX_LENGTH + 1, 'A')}),
+	             std::invalid_argument);
+}
+
+TEST(BarcodeCorrector, CorrectsSingleNeighbours)
+{
+	BarcodeCorrector corrector;
+	uint64_t         cellId = 0;
+
+	corrector.configure({"AAAAAAAA", "CCCCCCCC", "TTTTTTTT"});
+	EXPECT_EQ(correct(corrector, "CCCCCCCC", nullptr, cellId),
+	          BarcodeCorrector::Outcome::EXACT);
+	EXPECT_EQ(cellId, 1u);
+
+	// Every single substitution is corrected back.
+	for (auto p = 0ul; p < 8; p++)
+	{
+		for (char b : std::string("ACGT"))
+		{
+			std::string neighbour = "TTTTTTTT";
+
+			if (b == 'T')
+			{
+				continue;
+			}
+			neighbour[p] = b;
+			cellId       = 0;
+			EXPECT_EQ(correct(corrector, neighbour, nullptr, cellId),
+			          BarcodeCorrector::Outcome::CORRECTED) << neighbour;
+			EXPECT_EQ(cellId, 2u);
+		}
+	}
+
+	// Two substitutions, or a different length, cannot be corrected.
+	EXPECT_EQ(correct(corrector, "AAAAAACC", nullptr, cellId),
+	          BarcodeCorrector::Outcome::UNCORRECTABLE);
+	EXPECT_EQ(correct(corrector, "AAAAAAA", nullptr, cellId),
+	          BarcodeCorrector::Outcome::UNCORRECTABLE);
+}
+
+TEST(BarcodeCorrector, CorrectsFullLengthBarcodes)
+{
+	BarcodeCorrector corrector;
+	std::string      barcode = "ACGTACGTACGTACGTACGTACGTACGTACGT";
+	std::string      raw     = barcode;
+	uint64_t         cellId  = 1;
+
+	corrector.configure({barcode});
+	raw.back() = 'A';
+	EXPECT_EQ(correct(corrector, raw, nullptr, cellId),
+	          BarcodeCorrector::Outcome::CORRECTED);
+	EXPECT_EQ(cellId, 0u);
+}
+
+TEST(BarcodeCorrector, WeighsAmbiguousNeighboursByQuality)
+{
+	BarcodeCorrector corrector;
+	uint64_t         cellId = 0;
+
+	// CAAA differs from AAAA by its first base, and from CACA by its third.
+	corrector.configure({"AAAA", "CACA"});
+	EXPECT_EQ(correct(corrector, "CAAA", nullptr, cellId),
+	          BarcodeCorrector::Outcome::AMBIGUOUS);
+	EXPECT_EQ(correct(corrector, "CAAA", "IIII", cellId),
+	          BarcodeCorrector::Outcome::AMBIGUOUS);
+	EXPECT_EQ(correct(corrector, "CAAA", "#III", cellId),
+	          BarcodeCorrector::Outcome::CORRECTED);
+	EXPECT_EQ(cellId, 0u);
+	EXPECT_EQ(correct(corrector, "CAAA", "II#I", cellId),
+	          BarcodeCorrector::Outcome::CORRECTED);
+	EXPECT_EQ(cellId, 1u);
+
+	// Close qualities do not reach the required posterior.
+	EXPECT_EQ(correct(corrector, "CAAA", "5I6I", cellId),
+	          BarcodeCorrector::Outcome::AMBIGUOUS);
+}
+
+TEST(BarcodeCorrector, ReplacesASingleUnknownBase)
+{
+	BarcodeCorrector corrector;
+	uint64_t         cellId = 0;
+
+	corrector.configure({"ACGT", "AGGT", "TTTT"});
+	EXPECT_EQ(correct(corrector, "TTNT", nullptr, cellId),
+	          BarcodeCorrector::Outcome::CORRECTED);
+	EXPECT_EQ(cellId, 2u);
+	EXPECT_EQ(correct(corrector, "ANGT", nullptr, cellId),
+	          BarcodeCorrector::Outcome::AMBIGUOUS);
+	EXPECT_EQ(correct(corrector, "CNGT", nullptr, cellId),
+	          BarcodeCorrector::Outcome::UNCORRECTABLE);
+	EXPECT_EQ(correct(corrector, "NNGT", nullptr, cellId),
+	          BarcodeCorrector::Outcome::UNCORRECTABLE);
+}
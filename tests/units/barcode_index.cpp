@@ -0,0 +1,156 @@
+/**
+ * \file   tests/units/barcode_index.cpp
+ * \author Elena Grassi
+ * \author Marilisa Montemurro
+ * \author Emanuele Parisi
+ * \date   February, 2019
+ *
+ * Unit tests of the index of target barcodes.
+ */
+
+#include <cstdint>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "sctools/barcode_index.h"
+
+using namespace sctools;
+
+namespace
+{
+
+/**
+ * \brief Draw distinct random barcodes.
+ *
+ * \param count is the number of barcodes.
+ * \param length is the number of bases of every barcode.
+ * \param generator is the random number generator.
+ * \return the barcodes.
+ */
+std::vector<std::string>
+randomBarcodes (uint64_t count,
+                uint64_t length,
+                std::mt19937_64& generator)
+{
+	std::vector<std::string>        barcodes;
+	std::unordered_set<std::string> drawn;
+
+	while (barcodes.size() < count)
+	{
+		std::string barcode;
+
+		for (auto i = 0ul; i < length; i++)
+		{
+			barcode += "ACGT"[generator() % 4];
+		}
+		if (drawn.insert(barcode).second)
+		{
+			barcodes.emplace_back(barcode);
+		}
+	}
+
+	return barcodes;
+}
+
+} // namespace
+
+TEST(BarcodeIndex, FindsPackedBarcodesOfEveryLength)
+{
+	std::mt19937_64 generator(19);
+
+	// Lengths cover whole and partial 8 bases words, up to the packing limit.
+	for (auto length = 1ul; length <= BarcodeIndex::MAX_PACKED_LENGTH; length++)
+	{
+		auto                            count    = length < 5 ? 1ul << (2 * length - 1) : 1000ul;
+		auto                            barcodes = randomBarcodes(count,
+		                                                          length,
+		                                                          generator);
+		std::unordered_set<std::string> listed(barcodes.begin(),
+		                                       barcodes.end());
+		BarcodeIndex                    index;
+
+		index.configure(barcodes);
+		for (auto i = 0ul; i < barcodes.size(); i++)
+		{
+			uint64_t cellId = 0;
+
+			ASSERT_TRUE(index.find(barcodes[i],
+			                       cellId)) << barcodes[i];
+			EXPECT_EQ(cellId, i);
+		}
+
+		// Barcodes differing by their last base, or by their length, are not
+		// found.
+		for (const auto& b : barcodes)
+		{
+			std::string other  = b;
+			uint64_t    cellId = 0;
+
+			other.back() = other.back() == 'T' ? 'A' : 'T';
+			if (listed.count(other) == 0)
+			{
+				EXPECT_FALSE(index.find(other,
+				                        cellId)) << other;
+			}
+			EXPECT_FALSE(index.find(b + "A",
+			                        cellId));
+			EXPECT_FALSE(index.find(b.data(),
+			                        b.size() - 1,
+			                        cellId));
+		}
+	}
+}
+
+TEST(BarcodeIndex, RejectsUnpackableQueries)
+{
+	BarcodeIndex index;
+	uint64_t     cellId = 0;
+
+	index.configure({"ACGTACGTAC", "TTTTTTTTTT"});
+	EXPECT_FALSE(index.find("ACGTNCGTAC",
+	                        cellId));
+	EXPECT_FALSE(index.find("acgtacgtac",
+	                        cellId));
+	ASSERT_TRUE(index.find("TTTTTTTTTT",
+	                       cellId));
+	EXPECT_EQ(cellId, 1u);
+}
+
+TEST(BarcodeIndex, FallsBackToHashing)
+{
+	BarcodeIndex index;
+	uint64_t     cellId = 0;
+	std::string  longBarcode(40,
+	                         'G');
+
+	// Unknown bases, mixed lengths and long barcodes cannot be packed.
+	index.configure({"ACGN", "ACGTAC", longBarcode});
+	ASSERT_TRUE(index.find("ACGN",
+	                       cellId));
+	EXPECT_EQ(cellId, 0u);
+	ASSERT_TRUE(index.find("ACGTAC",
+	                       cellId));
+	EXPECT_EQ(cellId, 1u);
+	ASSERT_TRUE(index.find(longBarcode,
+	                       cellId));
+	EXPECT_EQ(cellId, 2u);
+	EXPECT_FALSE(index.find("ACGT",
+	                        cellId));
+}
+
+TEST(BarcodeIndex, RejectsDuplicates)
+{
+	BarcodeIndex index;
+	uint64_t     cellId = 0;
+
+	EXPECT_THROW(index.configure({"ACGT", "CCCC", "ACGT"}),
+	             std::invalid_argument);
+	index.configure({});
+	EXPECT_FALSE(index.find("ACGT",
+	                        cellId));
+}
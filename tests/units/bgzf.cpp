@@ -0,0 +1,248 @@
+/**
+ * \file   tests/units/bgzf.cpp
+ * \author Elena Grassi
+ * \author Marilisa Montemurro
+ * \author Emanuele Parisi
+ * \date   February, 2019
+ *
+ * Unit tests of the BGZF stream reader and writer.
+ */
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "sctools/bgzf.h"
+#include "sctools/compression_backend.h"
+
+#include "test_files.h"
+
+using namespace sctools;
+
+namespace
+{
+
+/**
+ * \brief Compress a byte stream into a BGZF file.
+ *
+ * \param path is the path of the file.
+ * \param payload is the byte stream.
+ * \param level is the compression level.
+ * \return the compressed blocks, end-of-file marker included.
+ */
+std::string
+compress (const fs::path& path,
+          const std::string& payload,
+          int level)
+{
+	auto          backend = CompressionBackend::create(CompressionBackendType::ZLIB,
+	                                                   level);
+	BgzfWriter    writer;
+	std::string   blocks;
+	std::ofstream file(path,
+	                   std::ios::binary);
+
+	writer.configure(*backend,
+	                 [&blocks] (const char* block,
+	                            uint64_t size)
+	                 {
+		                 blocks.append(block,
+		                               size);
+	                 });
+
+	// Uneven writes cross the block boundaries.
+	for (uint64_t offset = 0; offset < payload.size(); offset += 40000)
+	{
+		writer.write(payload.data() + offset,
+		             std::min<uint64_t>(40000,
+		                                payload.size() - offset));
+	}
+	writer.close(true);
+	file << blocks;
+
+	return blocks;
+}
+
+/**
+ * \brief Decompress a whole BGZF file.
+ *
+ * \param path is the path of the file.
+ * \return the decompressed byte stream.
+ */
+std::string
+decompress (const fs::path& path)
+{
+	auto        backend = CompressionBackend::create(CompressionBackendType::ZLIB,
+	                                                 6);
+	BgzfReader  reader;
+	std::string payload;
+	char        buffer[10000];
+	uint64_t    readBytes = 0;
+
+	reader.configure(path,
+	                 *backend);
+	while ((readBytes = reader.read(buffer,
+	                                sizeof(buffer))) > 0)
+	{
+		payload.append(buffer,
+		               readBytes);
+	}
+
+	return payload;
+}
+
+/**
+ * \brief Draw a byte stream made of random and repeated runs.
+ *
+ * \param size is the size of the stream.
+ * \return the byte stream.
+ */
+std::string
+randomPayload (uint64_t size)
+{
+	std::mt19937_64 generator(27);
+	std::string     payload;
+
+	while (payload.size() < size)
+	{
+		char byte = static_cast<char>(generator());
+
+		payload.append(generator() % 2 == 0 ? 1 : generator() % 64,
+		               byte);
+	}
+	payload.resize(size);
+
+	return payload;
+}
+
+} // namespace
+
+TEST(Bgzf, RoundTripsStreams)
+{
+	tests::TemporaryDirectory directory;
+	auto                      payload = randomPayload(5 * Bgzf::MAX_PAYLOAD_SIZE + 123);
+
+	// Level 0 stores blocks as they are.
+	for (int level : {0, 1, 6})
+	{
+		auto path   = directory / ("stream" + std::to_string(level) + ".bgzf");
+		auto blocks = compress(path,
+		                       payload,
+		                       level);
+
+		EXPECT_EQ(blocks.compare(blocks.size() - Bgzf::eofBlock().size(),
+		                         Bgzf::eofBlock().size(),
+		                         Bgzf::eofBlock()),
+		          0);
+		EXPECT_EQ(decompress(path), payload);
+	}
+	compress(directory / "empty.bgzf",
+	         std::string(),
+	         6);
+	EXPECT_EQ(decompress(directory / "empty.bgzf"), std::string());
+}
+
+TEST(Bgzf, SeeksVirtualOffsets)
+{
+	tests::TemporaryDirectory directory;
+	auto                      payload = randomPayload(3 * Bgzf::MAX_PAYLOAD_SIZE);
+	auto                      backend = CompressionBackend::create(CompressionBackendType::ZLIB,
+	                                                               6);
+	BgzfReader                reader;
+	std::vector<uint64_t>     offsets;
+	uint64_t                  position = 0;
+	char                      byte;
+
+	compress(directory / "stream.bgzf",
+	         payload,
+	         6);
+	reader.configure(directory / "stream.bgzf",
+	                 *backend);
+	for (uint64_t i = 0; i < payload.size(); i += 9973)
+	{
+		ASSERT_EQ(reader.skip(i - position), i - position);
+		offsets.emplace_back(reader.tell());
+		ASSERT_EQ(reader.read(&byte,
+		                      1), 1u);
+		position = i + 1;
+		EXPECT_EQ(byte, payload[i]);
+	}
+	for (auto j = offsets.size(); j-- > 0;)
+	{
+		reader.seek(offsets[j]);
+		ASSERT_EQ(reader.read(&byte,
+		                      1), 1u);
+		EXPECT_EQ(byte, payload[j * 9973]);
+	}
+}
+
+TEST(Bgzf, FindsBlockSizeAmongExtraSubfields)
+{
+	tests::TemporaryDirectory directory;
+	auto                      blocks = compress(directory / "plain.bgzf",
+	                                            "extra subfields",
+	                                            6);
+	std::string               block  = blocks.substr(0,
+	                                                 blocks.size() - Bgzf::eofBlock().size());
+	uint64_t                  size   = block.size() + 6;
+
+	// Prepend an unrelated 2 bytes subfield to the BC one.
+	block.insert(Bgzf::FIXED_SIZE,
+	             std::string("XY\x02\x00\xab\xcd", 6));
+	block[10] = '\x0c';
+	block[Bgzf::HEADER_SIZE + 4] = static_cast<char>((size - 1) & 0xff);
+	block[Bgzf::HEADER_SIZE + 5] = static_cast<char>((size - 1) >> 8);
+	std::ofstream(directory / "extra.bgzf",
+	              std::ios::binary) << block << Bgzf::eofBlock();
+	EXPECT_EQ(decompress(directory / "extra.bgzf"), "extra subfields");
+
+	// Without the BC subfield the block size is unknown.
+	block[Bgzf::HEADER_SIZE] = 'X';
+	std::ofstream(directory / "missing.bgzf",
+	              std::ios::binary) << block;
+	EXPECT_THROW(decompress(directory / "missing.bgzf"),
+	             std::runtime_error);
+}
+
+TEST(Bgzf, VerifiesFooters)
+{
+	tests::TemporaryDirectory directory;
+	auto                      blocks = compress(directory / "plain.bgzf",
+	                                            randomPayload(1000),
+	                                            6);
+	auto                      footer = blocks.size() - Bgzf::eofBlock().size() - Bgzf::FOOTER_SIZE;
+	std::string               corrupted;
+
+	corrupted               = blocks;
+	corrupted[footer]      ^= 1;
+	std::ofstream(directory / "crc.bgzf",
+	              std::ios::binary) << corrupted;
+	EXPECT_THROW(decompress(directory / "crc.bgzf"),
+	             std::runtime_error);
+
+	corrupted               = blocks;
+	corrupted[footer + 4]  ^= 1;
+	std::ofstream(directory / "isize.bgzf",
+	              std::ios::binary) << corrupted;
+	EXPECT_THROW(decompress(directory / "isize.bgzf"),
+	             std::runtime_error);
+
+	corrupted               = blocks;
+	corrupted[footer + 6]   = '\x7f';
+	std::ofstream(directory / "huge.bgzf",
+	              std::ios::binary) << corrupted;
+	EXPECT_THROW(decompress(directory / "huge.bgzf"),
+	             std::runtime_error);
+
+	std::ofstream(directory / "truncated.bgzf",
+	              std::ios::binary) << blocks.substr(0,
+	                                                 footer);
+	EXPECT_THROW(decompress(directory / "truncated.bgzf"),
+	             std::runtime_error);
+}
@@ -0,0 +1,446 @@
+/**
+ * \file   tests/units/cell_index.cpp
+ * \author Elena Grassi
+ * \author Marilisa Montemurro
+ * \author Emanuele Parisi
+ * \date   February, 2019
+ *
+ * Unit tests of the index of the BGZF blocks holding the records of every
+ * cell barcode.
+ */
+
+#include <cstdint>
+#include <cstring>
+#include <experimental/filesystem>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "sctools/bam_record_view.h"
+#include "sctools/bgzf.h"
+#include "sctools/cell_index.h"
+#include "sctools/compression_backend.h"
+
+#include "test_files.h"
+
+namespace fs = std::experimental::filesystem;
+
+using namespace sctools;
+
+namespace
+{
+
+/**
+ * \brief Append a little-endian integer to a byte stream.
+ *
+ * \param sink is the byte stream.
+ * \param value is the integer.
+ * \param size is the number of bytes of the integer.
+ */
+void
+putInteger (std::string& sink,
+            uint64_t value,
+            uint64_t size)
+{
+	for (auto i = 0ul; i < size; i++)
+	{
+		sink.push_back(static_cast<char>((value >> (8 * i)) & 0xff));
+	}
+}
+
+/**
+ * \brief Write a BAM file holding unmapped records with no sequence.
+ *
+ * \param path is the path of the file.
+ * \param names are the read names of the records, in file order.
+ */
+void
+writeBam (const fs::path& path,
+          const std::vector<std::string>& names)
+{
+	auto          backend = CompressionBackend::create(CompressionBackendType::ZLIB,
+	                                                   6);
+	BgzfWriter    writer;
+	std::string   payload("BAM\1");
+	std::ofstream file(path,
+	                   std::ios::binary);
+
+	// The header lists a single reference sequence.
+	putInteger(payload,
+	           0,
+	           4);
+	putInteger(payload,
+	           1,
+	           4);
+	putInteger(payload,
+	           4,
+	           4);
+	payload.append("chr",
+	               4);
+	putInteger(payload,
+	           1000,
+	           4);
+	for (const auto& n : names)
+	{
+		putInteger(payload,
+		           32 + n.size() + 1,
+		           4);
+		putInteger(payload,
+		           0xffffffff,
+		           4);
+		putInteger(payload,
+		           0xffffffff,
+		           4);
+		putInteger(payload,
+		           n.size() + 1,
+		           1);
+		putInteger(payload,
+		           0,
+		           1);
+		putInteger(payload,
+		           4680,
+		           2);
+		putInteger(payload,
+		           0,
+		           2);
+		putInteger(payload,
+		           4,
+		           2);
+		putInteger(payload,
+		           0,
+		           4);
+		putInteger(payload,
+		           0xffffffff,
+		           4);
+		putInteger(payload,
+		           0xffffffff,
+		           4);
+		putInteger(payload,
+		           0,
+		           4);
+		payload.append(n.c_str(),
+		               n.size() + 1);
+	}
+	writer.configure(*backend,
+	                 [&file] (const char* block,
+	                          uint64_t size)
+	                 {
+		                 file.write(block,
+		                            size);
+	                 });
+	writer.write(payload.data(),
+	             payload.size());
+	writer.close(true);
+}
+
+/**
+ * \brief Extract the barcode prefixing the read name of a record, records
+ * named after no barcode having none.
+ *
+ * \param record is the record.
+ * \param barcode is set to the barcode of the record.
+ */
+void
+extractBarcode (const BamRecordView& record,
+                std::string& barcode)
+{
+	std::string name(record.readName(),
+	                 record.readNameLength());
+
+	barcode = name.substr(0,
+	                      name.find(':'));
+	if (barcode == "none")
+	{
+		barcode.clear();
+	}
+}
+
+/**
+ * \brief Read the names of the records stored in some ranges of a BAM file.
+ *
+ * \param path is the path of the file.
+ * \param ranges are the ranges.
+ * \return the read names, in file order.
+ */
+std::vector<std::string>
+readRanges (const fs::path& path,
+            const std::vector<BgzfRange>& ranges)
+{
+	auto                     backend = CompressionBackend::create(CompressionBackendType::ZLIB,
+	                                                              6);
+	BgzfReader               reader;
+	std::vector<std::string> names;
+	std::string              record;
+
+	reader.configure(path,
+	                 *backend);
+	for (const auto& r : ranges)
+	{
+		reader.seek(r.begin);
+		while (reader.tell() < r.end)
+		{
+			uint32_t blockSize = 0;
+
+			EXPECT_EQ(reader.read(reinterpret_cast<char*>(&blockSize),
+			                      4),
+			          4u);
+			record.resize(4 + blockSize);
+			std::memcpy(&record[0],
+			            &blockSize,
+			            4);
+			EXPECT_EQ(reader.read(&record[4],
+			                      blockSize),
+			          blockSize);
+
+			auto view = BamRecordView::fromSized(record.data());
+
+			names.emplace_back(view.readName(),
+			                   view.readNameLength());
+		}
+	}
+
+	return names;
+}
+
+/**
+ * \brief Class writing a BAM file spanning several blocks, whose cells hold
+ * runs of records of different lengths.
+ */
+class CellIndexTest : public ::testing::Test
+{
+
+protected:
+
+	/**
+	 * Directory the test files are written in.
+	 */
+	tests::TemporaryDirectory directory;
+	/**
+	 * Path of the BAM file.
+	 */
+	fs::path                  bamPath;
+	/**
+	 * Read names of the records of the BAM file, in file order.
+	 */
+	std::vector<std::string>  names;
+
+	/**
+	 * \brief Write the BAM file.
+	 */
+	void
+	SetUp () override
+	{
+		static const std::vector<std::string> barcodes = {"AAAA", "CCCC", "GGGG", "none"};
+
+		// The TTTT cell only appears at the beginning and at the end.
+		for (auto i = 0ul; i < 4000; i++)
+		{
+			auto barcode = i < 20 || i >= 3980 ? std::string("TTTT") : barcodes[(i / 50 + i % 3) % 4];
+
+			names.emplace_back(barcode +
+			                   ":" +
+			                   std::to_string(i) +
+			                   ":" +
+			                   std::string(100 + i % 100,
+			                               'x'));
+		}
+		bamPath = directory / "cells.bam";
+		writeBam(bamPath,
+		         names);
+	}
+
+	/**
+	 * \brief Select the read names of a barcode.
+	 *
+	 * \param barcode is the barcode.
+	 * \return the read names of the barcode, in file order.
+	 */
+	std::vector<std::string>
+	namesOf (const std::string& barcode) const
+	{
+		std::vector<std::string> selected;
+
+		for (const auto& n : names)
+		{
+			if (n.compare(0,
+			              barcode.size() + 1,
+			              barcode + ":") == 0)
+			{
+				selected.emplace_back(n);
+			}
+		}
+
+		return selected;
+	}
+
+	/**
+	 * \brief Select the read names of a barcode among the ones read back.
+	 *
+	 * \param barcode is the barcode.
+	 * \param readNames are the read names read back.
+	 * \return the read names of the barcode, in the order they were read.
+	 */
+	static std::vector<std::string>
+	filter (const std::string& barcode,
+	        const std::vector<std::string>& readNames)
+	{
+		std::vector<std::string> selected;
+
+		for (const auto& n : readNames)
+		{
+			if (n.compare(0,
+			              barcode.size() + 1,
+			              barcode + ":") == 0)
+			{
+				selected.emplace_back(n);
+			}
+		}
+
+		return selected;
+	}
+};
+
+} // namespace
+
+TEST_F(CellIndexTest, CoversEveryRecordOfTheBarcodes)
+{
+	CellIndex index;
+
+	index.build(bamPath,
+	            CompressionBackendType::ZLIB,
+	            extractBarcode);
+	EXPECT_GT(index.getBlocksCount(),
+	          5u);
+	EXPECT_EQ(index.getBarcodesCount(),
+	          4u);
+	for (const auto& b : {"AAAA", "CCCC", "GGGG", "TTTT"})
+	{
+		auto ranges = index.getRanges({b});
+
+		ASSERT_FALSE(ranges.empty());
+		for (auto i = 1ul; i < ranges.size(); i++)
+		{
+			EXPECT_LT(ranges[i - 1].end,
+			          ranges[i].begin);
+		}
+		EXPECT_EQ(filter(b,
+		                 readRanges(bamPath,
+		                            ranges)),
+		          namesOf(b));
+	}
+
+	// The cell at the two ends of the file skips the blocks in between.
+	EXPECT_EQ(index.getRanges({"TTTT"}).size(),
+	          2u);
+	EXPECT_LT(readRanges(bamPath,
+	                     index.getRanges({"TTTT"})).size(),
+	          names.size() / 2);
+	EXPECT_TRUE(index.getRanges({"none"}).empty());
+	EXPECT_TRUE(index.getRanges({"ACGT"}).empty());
+}
+
+TEST_F(CellIndexTest, MergesTheRangesOfSeveralBarcodes)
+{
+	CellIndex              index;
+	std::vector<BgzfRange> ranges;
+
+	index.build(bamPath,
+	            CompressionBackendType::ZLIB,
+	            extractBarcode);
+	ranges = index.getRanges({"TTTT", "AAAA"});
+	for (auto i = 1ul; i < ranges.size(); i++)
+	{
+		EXPECT_LT(ranges[i - 1].end,
+		          ranges[i].begin);
+	}
+
+	auto readNames = readRanges(bamPath,
+	                            ranges);
+
+	EXPECT_EQ(filter("TTTT",
+	                 readNames),
+	          namesOf("TTTT"));
+	EXPECT_EQ(filter("AAAA",
+	                 readNames),
+	          namesOf("AAAA"));
+}
+
+TEST_F(CellIndexTest, RoundTripsThroughItsSidecar)
+{
+	CellIndex index;
+	CellIndex loaded;
+	auto      indexPath = CellIndex::getSidecarPath(bamPath);
+
+	EXPECT_EQ(indexPath.filename().string(),
+	          "cells.bam.sci");
+	index.build(bamPath,
+	            CompressionBackendType::ZLIB,
+	            extractBarcode);
+	index.save(indexPath);
+	loaded.load(indexPath,
+	            bamPath);
+	EXPECT_EQ(loaded.getBlocksCount(),
+	          index.getBlocksCount());
+	EXPECT_EQ(loaded.getBarcodesCount(),
+	          index.getBarcodesCount());
+	for (const auto& b : {"AAAA", "CCCC", "GGGG", "TTTT"})
+	{
+		auto expected = index.getRanges({b});
+		auto actual   = loaded.getRanges({b});
+
+		ASSERT_EQ(actual.size(),
+		          expected.size());
+		for (auto i = 0ul; i < actual.size(); i++)
+		{
+			EXPECT_EQ(actual[i].begin,
+			          expected[i].begin);
+			EXPECT_EQ(actual[i].end,
+			          expected[i].end);
+		}
+	}
+}
+
+TEST_F(CellIndexTest, RejectsUnusableSidecars)
+{
+	CellIndex   index;
+	auto        indexPath = CellIndex::getSidecarPath(bamPath);
+	std::string content;
+
+	EXPECT_THROW(index.load(indexPath,
+	                        bamPath),
+	             std::runtime_error);
+	EXPECT_THROW(index.load(directory.write("fake.sci",
+	                                        "not an index"),
+	                        bamPath),
+	             std::runtime_error);
+
+	// Truncated indices are detected.
+	index.build(bamPath,
+	            CompressionBackendType::ZLIB,
+	            extractBarcode);
+	index.save(indexPath);
+	{
+		std::ifstream indexReader(indexPath,
+		                          std::ios::binary);
+
+		content.assign(std::istreambuf_iterator<char>(indexReader),
+		               std::istreambuf_iterator<char>());
+	}
+	EXPECT_THROW(index.load(directory.write("truncated.sci",
+	                                        content.substr(0,
+	                                                       content.size() - 3)),
+	                        bamPath),
+	             std::runtime_error);
+
+	// Indices of an older version of the file are stale.
+	names.pop_back();
+	writeBam(bamPath,
+	         names);
+	EXPECT_THROW(index.load(indexPath,
+	                        bamPath),
+	             std::runtime_error);
+}
@@ -0,0 +1,51 @@
+/**
+ * \file   tests/units/cell_metrics_record.cpp
+ * \author Elena Grassi
+ * \author Marilisa Montemurro
+ * \author Emanuele Parisi
+ * \date   February, 2019
+ *
+ * Unit tests of the records of 10x per-cell summary metrics files.
+ */
+
+#include <cstdint>
+
+#include <gtest/gtest.h>
+
+#include "sctools/cell_metrics_record.h"
+
+#include "test_files.h"
+
+using namespace sctools;
+
+TEST(CellMetricsRecord, LoadsSummaryMetricsFile)
+{
+	auto    records  = CellMetricsRecord::readRecords(fs::path(SCTOOLS_TEST_DATA_DIR) / "test_cell_summary_metrics.csv");
+	int64_t negative = 0;
+
+	ASSERT_EQ(records.size(), 462u);
+	EXPECT_EQ(records.front().get<CellMetricsRecord::BARCODE>(), "AAACGGGTCAAAGTGA-1");
+	EXPECT_EQ(records.front().get<CellMetricsRecord::TOTAL_NUM_READS>(), 667774u);
+	EXPECT_EQ(records.front().get<CellMetricsRecord::PLOIDY_CONFIDENCE>(), 8);
+	EXPECT_EQ(records.back().get<CellMetricsRecord::BARCODE>(), "TTTGTCATCCGCACGA-1");
+	EXPECT_EQ(records.back().get<CellMetricsRecord::CELL_ID>(), 461u);
+	EXPECT_EQ(records.back().get<CellMetricsRecord::PLOIDY_CONFIDENCE>(), -2);
+	for (auto& r : records)
+	{
+		negative += r.get<CellMetricsRecord::PLOIDY_CONFIDENCE>() < 0;
+	}
+	EXPECT_EQ(negative, 406);
+}
+
+TEST(CellMetricsRecord, LoadsBarcodesWhitelist)
+{
+	tests::TemporaryDirectory directory;
+	auto                      records = CellMetricsRecord::readRecords(directory.write("barcodes.tsv.gz",
+	                                                                                   "AAAA-1\n"
+	                                                                                   "CCCC-1\n",
+	                                                                                   true));
+
+	ASSERT_EQ(records.size(), 2u);
+	EXPECT_EQ(records[1].get<CellMetricsRecord::BARCODE>(), "CCCC-1");
+	EXPECT_EQ(records[1].get<CellMetricsRecord::TOTAL_NUM_READS>(), 0u);
+}
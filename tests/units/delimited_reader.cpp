@@ -0,0 +1,186 @@
+/**
+ * \file   tests/units/delimited_reader.cpp
+ * \author Elena Grassi
+ * \author Marilisa Montemurro
+ * \author Emanuele Parisi
+ * \date   February, 2019
+ *
+ * Unit tests of the reader of delimited files.
+ */
+
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+
+#include <gtest/gtest.h>
+
+#include "sctools/delimited_reader.h"
+
+#include "test_files.h"
+
+using namespace sctools;
+
+namespace
+{
+
+/**
+ * Type of the reader under test.
+ */
+using TReader = DelimitedReader<std::string,
+                                int64_t,
+                                uint64_t,
+                                double,
+                                bool>;
+
+/**
+ * Columns of the records under test.
+ */
+const TReader::TColumns COLUMNS = {{{"barcode", true},
+                                    {"offset", false},
+                                    {"reads", false},
+                                    {"fraction", false},
+                                    {"noisy", false}}};
+
+} // namespace
+
+TEST(DelimitedReader, MatchesColumnsByHeader)
+{
+	tests::TemporaryDirectory directory;
+	TReader                   reader;
+	TReader::TRecord          record;
+
+	reader.open(directory.write("metrics.csv",
+	                            "noisy,reads,extra,barcode,fraction\n"
+	                            "1,10,x,AAAA-1,0.5\n"
+	                            "\n"
+	                            "# comment\n"
+	                            "false,20,y,\"CCCC-1\",0.25\r\n"),
+	            COLUMNS);
+	EXPECT_TRUE(reader.hasColumn(0));
+	EXPECT_FALSE(reader.hasColumn(1));
+
+	ASSERT_TRUE(reader.read(record));
+	EXPECT_EQ(std::get<0>(record), "AAAA-1");
+	EXPECT_EQ(std::get<1>(record), 0);
+	EXPECT_EQ(std::get<2>(record), 10u);
+	EXPECT_DOUBLE_EQ(std::get<3>(record), 0.5);
+	EXPECT_TRUE(std::get<4>(record));
+	EXPECT_EQ(reader.getLineNumber(), 2u);
+
+	ASSERT_TRUE(reader.read(record));
+	EXPECT_EQ(std::get<0>(record), "CCCC-1");
+	EXPECT_EQ(std::get<2>(record), 20u);
+	EXPECT_DOUBLE_EQ(std::get<3>(record), 0.25);
+	EXPECT_FALSE(std::get<4>(record));
+	EXPECT_EQ(reader.getLineNumber(), 5u);
+
+	EXPECT_FALSE(reader.read(record));
+}
+
+TEST(DelimitedReader, RejectsMissingRequiredColumn)
+{
+	tests::TemporaryDirectory directory;
+	TReader                   reader;
+
+	EXPECT_THROW(reader.open(directory.write("metrics.csv",
+	                                         "reads,fraction\n"
+	                                         "10,0.5\n"),
+	                         COLUMNS),
+	             std::invalid_argument);
+}
+
+TEST(DelimitedReader, ReadsHeaderlessFilesByPosition)
+{
+	tests::TemporaryDirectory directory;
+	TReader                   reader;
+	TReader::TRecord          record;
+
+	reader.open(directory.write("barcodes.tsv",
+	                            "AAAA-1\t-3\t7\n"
+	                            "CCCC-1\n"),
+	            COLUMNS);
+	ASSERT_TRUE(reader.read(record));
+	EXPECT_EQ(std::get<0>(record), "AAAA-1");
+	EXPECT_EQ(std::get<1>(record), -3);
+	EXPECT_EQ(std::get<2>(record), 7u);
+
+	// Missing optional fields are value-initialized.
+	ASSERT_TRUE(reader.read(record));
+	EXPECT_EQ(std::get<0>(record), "CCCC-1");
+	EXPECT_EQ(std::get<1>(record), 0);
+	EXPECT_EQ(std::get<2>(record), 0u);
+	EXPECT_FALSE(std::get<4>(record));
+
+	EXPECT_FALSE(reader.read(record));
+}
+
+TEST(DelimitedReader, InflatesCompressedFiles)
+{
+	tests::TemporaryDirectory directory;
+	TReader                   reader;
+	TReader::TRecord          record;
+	std::string               content = "barcode,reads\n";
+	uint64_t                  count   = 0;
+
+	// Enough lines for the inflated content to span several buffers.
+	for (auto i = 0u; i < 20000; i++)
+	{
+		content += "BARCODE" + std::to_string(i) + "-1," + std::to_string(i) + "\n";
+	}
+	reader.open(directory.write("barcodes.csv.gz",
+	                            content,
+	                            true),
+	            COLUMNS);
+	while (reader.read(record))
+	{
+		EXPECT_EQ(std::get<0>(record), "BARCODE" + std::to_string(count) + "-1");
+		EXPECT_EQ(std::get<2>(record), count);
+		count += 1;
+	}
+	EXPECT_EQ(count, 20000u);
+}
+
+TEST(DelimitedReader, ParsesNegativeAndEmptyFields)
+{
+	tests::TemporaryDirectory directory;
+	TReader                   reader;
+	TReader::TRecord          record;
+
+	reader.open(directory.write("metrics.csv",
+	                            "barcode,offset,reads,fraction,noisy\n"
+	                            "AAAA-1,-2,,-0.5,\n"
+	                            "CCCC-1,,3,,0\n"),
+	            COLUMNS);
+	ASSERT_TRUE(reader.read(record));
+	EXPECT_EQ(std::get<1>(record), -2);
+	EXPECT_EQ(std::get<2>(record), 0u);
+	EXPECT_DOUBLE_EQ(std::get<3>(record), -0.5);
+	EXPECT_FALSE(std::get<4>(record));
+
+	ASSERT_TRUE(reader.read(record));
+	EXPECT_EQ(std::get<1>(record), 0);
+	EXPECT_EQ(std::get<2>(record), 3u);
+	EXPECT_DOUBLE_EQ(std::get<3>(record), 0.0);
+}
+
+TEST(DelimitedReader, RejectsMalformedFields)
+{
+	tests::TemporaryDirectory directory;
+	TReader                   reader;
+	TReader::TRecord          record;
+
+	// Unsigned columns do not accept a sign, nor lone signs are numbers.
+	reader.open(directory.write("metrics.csv",
+	                            "barcode,offset,reads\n"
+	                            "AAAA-1,1,-2\n"
+	                            "CCCC-1,-,2\n"
+	                            "GGGG-1,1x,2\n"),
+	            COLUMNS);
+	EXPECT_THROW(reader.read(record),
+	             std::invalid_argument);
+	EXPECT_THROW(reader.read(record),
+	             std::invalid_argument);
+	EXPECT_THROW(reader.read(record),
+	             std::invalid_argument);
+}
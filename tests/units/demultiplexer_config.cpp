@@ -0,0 +1,64 @@
+/**
+ * \file   tests/units/demultiplexer_config.cpp
+ * \author Elena Grassi
+ * \author Marilisa Montemurro
+ * \author Emanuele Parisi
+ * \date   February, 2019
+ *
+ * Unit tests of the configuration of the de-multiplexer.
+ */
+
+#include <cstdint>
+#include <stdexcept>
+
+#include <gtest/gtest.h>
+
+#include "sctools/demultiplexer.h"
+
+#include "test_files.h"
+
+using namespace sctools;
+
+TEST(DemultiplexerConfig, LoadsExpectedReadsOfSummaryMetrics)
+{
+	DemultiplexerConfig config;
+
+	config.loadBarcodes(fs::path(SCTOOLS_TEST_DATA_DIR) / "test_cell_summary_metrics.csv");
+	ASSERT_EQ(config.barcodes.size(), 462u);
+	ASSERT_EQ(config.expectedReads.size(), 462u);
+	EXPECT_EQ(config.barcodes.front(), "AAACGGGTCAAAGTGA");
+	EXPECT_EQ(config.expectedReads.front(), 667774u);
+}
+
+TEST(DemultiplexerConfig, LeavesExpectedReadsOfWhitelistsEmpty)
+{
+	tests::TemporaryDirectory directory;
+	DemultiplexerConfig       config;
+
+	config.expectedReads = {1, 2};
+	config.loadBarcodes(directory.write("barcodes.tsv",
+	                                    "AAAA-1\n"
+	                                    "CCCC-1\n"));
+	EXPECT_EQ(config.barcodes.size(), 2u);
+	EXPECT_TRUE(config.expectedReads.empty());
+	config.loadBarcodes(directory.write("cells.csv",
+	                                    "barcode,cell_id\n"
+	                                    "AAAA-1,0\n"));
+	EXPECT_EQ(config.barcodes.size(), 1u);
+	EXPECT_TRUE(config.expectedReads.empty());
+}
+
+TEST(DemultiplexerConfig, RejectsDownsamplingWithoutExpectedReads)
+{
+	DemultiplexerConfig config;
+	Demultiplexer       demultiplexer;
+
+	config.alignmentsFilePaths = {"missing.bam"};
+	config.barcodes            = {"AAAA", "CCCC"};
+	config.targetReadsPerCell  = 1000;
+	EXPECT_THROW(demultiplexer.configure(config),
+	             std::invalid_argument);
+	config.expectedReads = {5000};
+	EXPECT_THROW(demultiplexer.configure(config),
+	             std::invalid_argument);
+}
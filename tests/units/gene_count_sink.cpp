@@ -0,0 +1,157 @@
+/**
+ * \file   tests/units/gene_count_sink.cpp
+ * \author Elena Grassi
+ * \author Marilisa Montemurro
+ * \author Emanuele Parisi
+ * \date   February, 2019
+ *
+ * Unit tests of the sink counting the records of every gene.
+ */
+
+#include <cstdint>
+#include <experimental/filesystem>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include <seqan/bam_io.h>
+
+#include "sctools/alignments_reader.h"
+#include "sctools/annotation_index.h"
+#include "sctools/bgzf.h"
+#include "sctools/compression_backend.h"
+#include "sctools/gene_count_sink.h"
+
+#include "test_files.h"
+
+namespace fs = std::experimental::filesystem;
+
+using namespace sctools;
+
+namespace
+{
+
+/**
+ * \brief Write a BAM file holding a single reference sequence and no record.
+ *
+ * \param path is the path of the file.
+ */
+void
+writeReference (const fs::path& path)
+{
+	auto          backend = CompressionBackend::create(CompressionBackendType::ZLIB,
+	                                                   6);
+	BgzfWriter    writer;
+	std::ofstream file(path,
+	                   std::ios::binary);
+	const char    header[] = "BAM\1"
+	                         "\0\0\0\0"
+	                         "\1\0\0\0"
+	                         "\4\0\0\0" "chr\0"
+	                         "\350\3\0\0";
+
+	writer.configure(*backend,
+	                 [&file] (const char* block,
+	                          uint64_t size)
+	                 {
+		                 file.write(block,
+		                            size);
+	                 });
+	writer.write(header,
+	             sizeof(header) - 1);
+	writer.close(true);
+}
+
+/**
+ * \brief Build a record aligned over ten bases.
+ *
+ * \param rID is the reference sequence identifier.
+ * \param beginPos is the alignment position.
+ * \param flag is the alignment flag.
+ * \return the record.
+ */
+seqan::BamAlignmentRecord
+makeRecord (int32_t rID,
+            int32_t beginPos,
+            uint16_t flag = 0)
+{
+	seqan::BamAlignmentRecord record;
+
+	record.rID      = rID;
+	record.beginPos = beginPos;
+	record.flag     = flag;
+	seqan::appendValue(record.cigar,
+	                   seqan::CigarElement<>('M',
+	                                         10));
+
+	return record;
+}
+
+} // namespace
+
+TEST(GeneCountSink, CountsEveryReadOnce)
+{
+	tests::TemporaryDirectory              directory;
+	AnnotationIndex                        annotation;
+	AlignmentsReader                       reader;
+	GeneCountSink                          sink;
+	std::vector<seqan::BamAlignmentRecord> records;
+
+	annotation.load(directory.write("genes.bed",
+	                                "chr\t0\t100\tgeneA\n"
+	                                "chr\t200\t300\tgeneB\n"));
+	writeReference(directory / "reference.bam");
+	reader.configure(directory / "reference.bam");
+	fs::create_directory(directory / "counts");
+	sink.configure(annotation,
+	               directory / "counts");
+	sink.begin(reader,
+	           {"AAAA"});
+
+	// Pairs are counted through their first mapped read.
+	records.emplace_back(makeRecord(0,
+	                                10));
+	records.emplace_back(makeRecord(0,
+	                                20,
+	                                0x41));
+	records.emplace_back(makeRecord(0,
+	                                30,
+	                                0x81));
+	records.emplace_back(makeRecord(0,
+	                                40,
+	                                0x89));
+	records.emplace_back(makeRecord(0,
+	                                50,
+	                                0x100));
+	records.emplace_back(makeRecord(0,
+	                                210,
+	                                0x800));
+	records.emplace_back(makeRecord(0,
+	                                250));
+
+	// Records of unknown reference sequences overlap no gene.
+	records.emplace_back(makeRecord(5,
+	                                10));
+	records.emplace_back(makeRecord(-1,
+	                                10));
+	records.emplace_back(makeRecord(-1,
+	                                -1,
+	                                0x4));
+	sink.write(0,
+	           "AAAA",
+	           records);
+	sink.finish(DemultiplexerStatistics());
+	EXPECT_EQ(sink.getAssignedCount(),
+	          4u);
+	EXPECT_EQ(sink.getSkippedCount(),
+	          3u);
+	EXPECT_EQ(sink.getNoFeatureCount(),
+	          2u);
+	EXPECT_EQ(sink.getAmbiguousCount(),
+	          0u);
+	EXPECT_EQ(sink.getEntriesCount(),
+	          2u);
+	EXPECT_TRUE(fs::exists(directory / "counts" / "gene_counts" / "matrix.mtx"));
+}
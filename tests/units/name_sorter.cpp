@@ -0,0 +1,199 @@
+/**
+ * \file   tests/units/name_sorter.cpp
+ * \author Elena Grassi
+ * \author Marilisa Montemurro
+ * \author Emanuele Parisi
+ * \date   February, 2019
+ *
+ * Unit tests of the sorter of binary records by read name.
+ */
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include <seqan/bam_io.h>
+
+#include "sctools/name_sorter.h"
+
+#include "test_files.h"
+
+using namespace sctools;
+
+namespace
+{
+
+/**
+ * Name and insertion order of a record.
+ */
+using TEntry = std::pair<std::string, int32_t>;
+
+/**
+ * \brief Draw read names sharing long prefixes, some of them repeated.
+ *
+ * \param count is the number of names.
+ * \return the names, paired with their insertion order.
+ */
+std::vector<TEntry>
+randomEntries (uint64_t count)
+{
+	std::mt19937_64     generator(49);
+	std::vector<TEntry> entries;
+
+	for (auto i = 0ul; i < count; i++)
+	{
+		if (!entries.empty() && generator() % 4 == 0)
+		{
+			entries.emplace_back(entries[generator() % entries.size()].first,
+			                     i);
+			continue;
+		}
+		entries.emplace_back("A00123:8:HXXXX:" + std::to_string(generator() % 4) +
+		                     ":" + std::to_string(generator() % 1000) +
+		                     (generator() % 2 == 0 ? "" : ":" + std::to_string(generator() % 100000)),
+		                     i);
+	}
+
+	return entries;
+}
+
+/**
+ * \brief Add records to a sorter, storing their insertion order as their
+ * position.
+ *
+ * \param sorter is the sorter.
+ * \param entries are the names of the records, with their insertion order.
+ * \param spillEvery is the number of records added between spills, or 0 if
+ * records are never spilled.
+ */
+void
+addEntries (NameSorter& sorter,
+            const std::vector<TEntry>& entries,
+            uint64_t spillEvery)
+{
+	seqan::BamIOContext<>     context;
+	seqan::BamAlignmentRecord record;
+
+	for (auto i = 0ul; i < entries.size(); i++)
+	{
+		record.qName    = entries[i].first;
+		record.beginPos = entries[i].second;
+		sorter.add(record,
+		           context);
+		if (spillEvery > 0 && (i + 1) % spillEvery == 0)
+		{
+			sorter.spill();
+		}
+	}
+}
+
+/**
+ * \brief Merge the records of a sorter.
+ *
+ * \param sorter is the sorter.
+ * \return the names of the merged records, with their insertion order.
+ */
+std::vector<TEntry>
+mergeEntries (NameSorter& sorter)
+{
+	std::vector<TEntry> entries;
+
+	sorter.merge([&entries] (const char* rawRecord)
+	             {
+		             int32_t position = 0;
+
+		             std::memcpy(&position,
+		                         rawRecord + 8,
+		                         4);
+		             entries.emplace_back(rawRecord + 36,
+		                                  position);
+	             });
+
+	return entries;
+}
+
+/**
+ * \brief Sort records the way the sorter is expected to.
+ *
+ * \param entries are the names of the records, with their insertion order.
+ * \return the records sorted by name, ties kept in insertion order.
+ */
+std::vector<TEntry>
+expectedOrder (std::vector<TEntry> entries)
+{
+	std::stable_sort(entries.begin(),
+	                 entries.end(),
+	                 [] (const TEntry& lhs,
+	                     const TEntry& rhs)
+	                 {
+		                 return std::strcmp(lhs.first.c_str(),
+		                                    rhs.first.c_str()) < 0;
+	                 });
+
+	return entries;
+}
+
+} // namespace
+
+TEST(NameSorter, SortsRecordsInMemory)
+{
+	tests::TemporaryDirectory directory;
+	NameSorter                sorter;
+
+	// Short ranges are sorted by comparison, long ones by radix.
+	for (uint64_t count : {1ul, 10ul, 5000ul})
+	{
+		auto entries = randomEntries(count);
+
+		sorter.configure(directory / "sorter.run");
+		addEntries(sorter,
+		           entries,
+		           0);
+		EXPECT_EQ(sorter.getRecordsCount(), count);
+		EXPECT_EQ(mergeEntries(sorter), expectedOrder(entries));
+		EXPECT_EQ(sorter.getSpilledCount(), 0u);
+		EXPECT_EQ(sorter.getBufferedBytes(), 0u);
+	}
+	EXPECT_TRUE(fs::is_empty(directory / "."));
+}
+
+TEST(NameSorter, MergesSpilledRuns)
+{
+	tests::TemporaryDirectory directory;
+	NameSorter                sorter;
+	auto                      entries = randomEntries(4000);
+
+	sorter.configure(directory / "sorter.run");
+	addEntries(sorter,
+	           entries,
+	           300);
+	EXPECT_EQ(sorter.getSpilledCount(), 13u);
+	EXPECT_EQ(mergeEntries(sorter), expectedOrder(entries));
+	EXPECT_EQ(sorter.getRecordsCount(), entries.size());
+	EXPECT_TRUE(fs::is_empty(directory / "."));
+}
+
+TEST(NameSorter, MergesRunsBeyondLimit)
+{
+	tests::TemporaryDirectory directory;
+	NameSorter                sorter;
+	auto                      entries = randomEntries(10 * (NameSorter::MAX_RUNS + 5));
+
+	// Once MAX_RUNS runs are on disk, the next spill merges them into one.
+	sorter.configure(directory / "sorter.run");
+	addEntries(sorter,
+	           entries,
+	           10);
+	EXPECT_EQ(sorter.getSpilledCount(), NameSorter::MAX_RUNS + 5);
+	EXPECT_LE(std::distance(fs::directory_iterator(directory / "."),
+	                        fs::directory_iterator()),
+	          static_cast<int64_t>(NameSorter::MAX_RUNS));
+	EXPECT_EQ(mergeEntries(sorter), expectedOrder(entries));
+	EXPECT_TRUE(fs::is_empty(directory / "."));
+}
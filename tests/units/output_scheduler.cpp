@@ -0,0 +1,196 @@
+/**
+ * \file   tests/units/output_scheduler.cpp
+ * \author Elena Grassi
+ * \author Marilisa Montemurro
+ * \author Emanuele Parisi
+ * \date   February, 2019
+ *
+ * Unit tests of the scheduler of output file writes.
+ */
+
+#include <cstdint>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "sctools/output_scheduler.h"
+
+#include "test_files.h"
+
+using namespace sctools;
+
+namespace
+{
+
+/**
+ * \brief Count the descriptors of the process open on files of a directory.
+ *
+ * \param directoryPath is the path of the directory.
+ * \return the number of descriptors.
+ */
+uint64_t
+countOpenFiles (const fs::path& directoryPath)
+{
+	uint64_t count = 0;
+
+	for (const auto& e : fs::directory_iterator("/proc/self/fd"))
+	{
+		std::error_code error;
+		auto            target = fs::read_symlink(e.path(),
+		                                          error);
+
+		count += !error && target.parent_path() == directoryPath ? 1 : 0;
+	}
+
+	return count;
+}
+
+/**
+ * \brief Read a whole file.
+ *
+ * \param path is the path of the file.
+ * \return the content of the file.
+ */
+std::string
+readFile (const fs::path& path)
+{
+	std::ifstream file(path,
+	                   std::ios::binary);
+
+	return std::string(std::istreambuf_iterator<char>(file),
+	                   std::istreambuf_iterator<char>());
+}
+
+} // namespace
+
+TEST(OutputScheduler, KeepsOpenFilesWithinLimit)
+{
+	tests::TemporaryDirectory directory;
+	auto                      directoryPath = fs::canonical(directory / ".");
+	OutputScheduler           scheduler;
+	std::vector<uint64_t>     fileIds;
+	std::vector<std::string>  expected(6);
+
+	scheduler.configure(8,
+	                    2,
+	                    false);
+	for (auto i = 0u; i < expected.size(); i++)
+	{
+		fileIds.emplace_back(scheduler.open(directoryPath / ("file" + std::to_string(i)),
+		                                    false));
+	}
+
+	// Every batch writes all the files, so it is submitted in three parts.
+	for (auto round = 0u; round < 4; round++)
+	{
+		auto batches = scheduler.getStatistics().batches;
+
+		for (auto i = 0u; i < expected.size(); i++)
+		{
+			auto line = "round " + std::to_string(round) + " file " + std::to_string(i) + "\n";
+
+			scheduler.submit(fileIds[i],
+			                 line.data(),
+			                 line.size());
+			expected[i] += line;
+		}
+		scheduler.flush();
+		EXPECT_EQ(scheduler.getStatistics().batches - batches, 3u);
+		EXPECT_LE(scheduler.getStatistics().maxInFlight, 2u);
+		EXPECT_LE(countOpenFiles(directoryPath), 2u);
+	}
+	scheduler.configure(8,
+	                    2,
+	                    false);
+	EXPECT_EQ(countOpenFiles(directoryPath), 0u);
+	for (auto i = 0u; i < expected.size(); i++)
+	{
+		EXPECT_EQ(readFile(directoryPath / ("file" + std::to_string(i))), expected[i]);
+	}
+}
+
+TEST(OutputScheduler, WritesLargeBuffersInOrder)
+{
+	tests::TemporaryDirectory directory;
+	auto                      directoryPath = fs::canonical(directory / ".");
+	OutputScheduler           scheduler;
+	std::string               first(3 * OutputScheduler::SLOT_SIZE + 17,
+	                                'a');
+	std::string               second(OutputScheduler::SLOT_SIZE,
+	                                 'b');
+	uint64_t                  fileIds[2];
+
+	// Slots of a file span several parts once the limit is met.
+	scheduler.configure(2,
+	                    1,
+	                    false);
+	fileIds[0] = scheduler.open(directoryPath / "first",
+	                            false);
+	fileIds[1] = scheduler.open(directoryPath / "second",
+	                            false);
+	for (auto i = 0ul; i < first.size(); i++)
+	{
+		first[i] = static_cast<char>('a' + i % 26);
+	}
+	scheduler.submit(fileIds[0],
+	                 first.data(),
+	                 first.size());
+	scheduler.submit(fileIds[1],
+	                 second.data(),
+	                 second.size());
+	scheduler.submit(fileIds[0],
+	                 "tail",
+	                 4);
+	scheduler.flush();
+	EXPECT_LE(countOpenFiles(directoryPath), 1u);
+	scheduler.configure(1,
+	                    1,
+	                    false);
+	EXPECT_EQ(readFile(directoryPath / "first"), first + "tail");
+	EXPECT_EQ(readFile(directoryPath / "second"), second);
+}
+
+TEST(OutputScheduler, WritesThroughIoUringWhenAvailable)
+{
+	tests::TemporaryDirectory directory;
+	auto                      directoryPath = fs::canonical(directory / ".");
+	OutputScheduler           scheduler;
+	std::vector<uint64_t>     fileIds;
+	std::vector<std::string>  expected(5);
+
+	// Rings are only used with registered buffers; otherwise, and whenever
+	// the kernel rejects them, writes go through pwrite.
+	scheduler.configure(4,
+	                    3,
+	                    true);
+	EXPECT_EQ(scheduler.usesRegisteredBuffers(), scheduler.usesIoUring());
+	for (auto i = 0u; i < expected.size(); i++)
+	{
+		fileIds.emplace_back(scheduler.open(directoryPath / ("file" + std::to_string(i)),
+		                                    false));
+	}
+	for (auto round = 0u; round < 3; round++)
+	{
+		for (auto i = 0u; i < expected.size(); i++)
+		{
+			std::string chunk(OutputScheduler::SLOT_SIZE / 2 + 7 * i + round,
+			                  static_cast<char>('a' + round * 5 + i));
+
+			scheduler.submit(fileIds[i],
+			                 chunk.data(),
+			                 chunk.size());
+			expected[i] += chunk;
+		}
+		scheduler.flush();
+	}
+	scheduler.configure(1,
+	                    1,
+	                    false);
+	for (auto i = 0u; i < expected.size(); i++)
+	{
+		EXPECT_EQ(readFile(directoryPath / ("file" + std::to_string(i))), expected[i]);
+	}
+}
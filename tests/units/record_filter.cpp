@@ -0,0 +1,361 @@
+/**
+ * \file   tests/units/record_filter.cpp
+ * \author Elena Grassi
+ * \author Marilisa Montemurro
+ * \author Emanuele Parisi
+ * \date   February, 2019
+ *
+ * Unit tests of the compiler and evaluator of alignment record filters.
+ */
+
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "sctools/bam_record_view.h"
+#include "sctools/record_filter.h"
+
+using namespace sctools;
+
+namespace
+{
+
+/**
+ * Names of the reference sequences of the records under test.
+ */
+const std::vector<std::string> CONTIGS = {"chr1", "chr2", "chrM"};
+
+/**
+ * \brief Append the bytes of a value to a binary record.
+ *
+ * \param record is the binary record.
+ * \param value is the value to be appended.
+ */
+template <typename TValue>
+void
+append (std::string& record,
+        TValue value)
+{
+	record.append(reinterpret_cast<const char*>(&value),
+	              sizeof(TValue));
+}
+
+/**
+ * \brief Encode a binary BAM record, block size excluded, with a single
+ * alignment match spanning the whole read.
+ *
+ * \param refId is the reference identifier of the record.
+ * \param position is the 0-based leftmost position of the record.
+ * \param mapQuality is the mapping quality of the record.
+ * \param flag is the bitwise flag of the record.
+ * \param length is the number of bases of the read.
+ * \param tags are the encoded optional fields of the record.
+ * \return the binary record.
+ */
+std::string
+makeRecord (int32_t refId,
+            int32_t position,
+            uint8_t mapQuality,
+            uint16_t flag,
+            int32_t length,
+            const std::string& tags = std::string())
+{
+	std::string record;
+	std::string name = "read";
+
+	append<int32_t>(record, refId);
+	append<int32_t>(record, position);
+	append<uint8_t>(record, name.size() + 1);
+	append<uint8_t>(record, mapQuality);
+	append<uint16_t>(record, 0);
+	append<uint16_t>(record, 1);
+	append<uint16_t>(record, flag);
+	append<int32_t>(record, length);
+	append<int32_t>(record, -1);
+	append<int32_t>(record, -1);
+	append<int32_t>(record, 0);
+	record.append(name.c_str(),
+	              name.size() + 1);
+	append<uint32_t>(record, static_cast<uint32_t>(length) << 4);
+	record.append((length + 1) / 2 + length,
+	              '\0');
+	record.append(tags);
+
+	return record;
+}
+
+/**
+ * \brief Encode a string optional field.
+ *
+ * \param tag is the two characters name of the field.
+ * \param value is the value of the field.
+ * \return the encoded field.
+ */
+std::string
+stringTag (const char* tag,
+           const std::string& value)
+{
+	return std::string(tag, 2) + 'Z' + value + '\0';
+}
+
+/**
+ * \brief Encode an integer optional field.
+ *
+ * \param tag is the two characters name of the field.
+ * \param value is the value of the field.
+ * \return the encoded field.
+ */
+std::string
+integerTag (const char* tag,
+            int32_t value)
+{
+	std::string field = std::string(tag, 2) + 'i';
+
+	append<int32_t>(field, value);
+
+	return field;
+}
+
+/**
+ * \brief Evaluate a filter on a binary record.
+ *
+ * \param filter is the compiled filter.
+ * \param record is the binary record, block size excluded.
+ * \return true if the filter accepts the record.
+ */
+bool
+accepts (const RecordFilter& filter,
+         const std::string& record)
+{
+	return filter.accept(BamRecordView(record.data(),
+	                                   record.size()));
+}
+
+/**
+ * \brief Look for the test rejecting a binary record.
+ *
+ * \param filter is the compiled filter.
+ * \param record is the binary record, block size excluded.
+ * \return the description of the rejecting test, or an empty string if the
+ * record is accepted.
+ */
+std::string
+rejectedBy (const RecordFilter& filter,
+            const std::string& record)
+{
+	int32_t testIndex = filter.rejectingTest(BamRecordView(record.data(),
+	                                                       record.size()));
+
+	return testIndex < 0 ? std::string() : filter.describeTest(testIndex);
+}
+
+/**
+ * \brief Compile an expression, expecting it to be rejected.
+ *
+ * \param expression is the filter expression.
+ * \return the error message.
+ */
+std::string
+compileError (const std::string& expression)
+{
+	RecordFilter filter;
+
+	try
+	{
+		filter.configure(expression,
+		                 CONTIGS);
+	}
+	catch (const std::invalid_argument& e)
+	{
+		return e.what();
+	}
+
+	return std::string();
+}
+
+} // namespace
+
+TEST(RecordFilter, AcceptsEverythingWhenEmpty)
+{
+	RecordFilter filter;
+
+	filter.configure("  ",
+	                 CONTIGS);
+	EXPECT_TRUE(filter.isEmpty());
+	EXPECT_TRUE(accepts(filter,
+	                    makeRecord(-1, -1, 0, BamRecordView::FLAG_UNMAPPED, 4)));
+}
+
+TEST(RecordFilter, ReportsParseErrors)
+{
+	EXPECT_NE(compileError("mapq >=").find("at offset 7: expected a mapping quality"),
+	          std::string::npos);
+	EXPECT_NE(compileError("mapq >= 30 && bogus").find("at offset 14: unknown predicate or tag 'bogus'"),
+	          std::string::npos);
+	EXPECT_NE(compileError("(mapq > 1").find("expected ')'"),
+	          std::string::npos);
+	EXPECT_NE(compileError("mapq > 1 mapq").find("unexpected 'mapq'"),
+	          std::string::npos);
+	EXPECT_NE(compileError("CB == 'AAAA").find("at offset 6: unterminated string"),
+	          std::string::npos);
+	EXPECT_NE(compileError("mapq @ 3").find("unexpected character '@'"),
+	          std::string::npos);
+	EXPECT_NE(compileError("flag & 0").find("invalid flag mask"),
+	          std::string::npos);
+	EXPECT_NE(compileError("contig < chr1").find("contigs can only be compared"),
+	          std::string::npos);
+	EXPECT_NE(compileError("contig == chrX").find("unknown contig 'chrX'"),
+	          std::string::npos);
+	EXPECT_NE(compileError("region(chr1:200-100)").find("invalid region 'chr1:200-100'"),
+	          std::string::npos);
+	EXPECT_NE(compileError("region(chrX:1-100)").find("unknown contig in region"),
+	          std::string::npos);
+}
+
+TEST(RecordFilter, EvaluatesCheapTestsFirst)
+{
+	RecordFilter filter;
+
+	filter.configure("has(UB) && CB == 'AAAA' && mapq >= 30",
+	                 CONTIGS);
+	ASSERT_EQ(filter.getProgramSize(), 3u);
+	EXPECT_EQ(filter.describeTest(0), "mapq >= 30");
+	EXPECT_EQ(filter.describeTest(1), "has(UB)");
+	EXPECT_EQ(filter.describeTest(2), "CB == 'AAAA'");
+
+	// A failing cheap test rejects the record before the tags are scanned.
+	EXPECT_EQ(rejectedBy(filter,
+	                     makeRecord(0, 10, 20, 0, 4)),
+	          "mapq >= 30");
+	EXPECT_EQ(rejectedBy(filter,
+	                     makeRecord(0, 10, 40, 0, 4, stringTag("UB", "GGGG") + stringTag("CB", "CCCC"))),
+	          "CB == 'AAAA'");
+	EXPECT_TRUE(accepts(filter,
+	                    makeRecord(0, 10, 40, 0, 4, stringTag("CB", "AAAA") + stringTag("UB", "GGGG"))));
+}
+
+TEST(RecordFilter, LaysOutNegationsAndDisjunctions)
+{
+	RecordFilter filter;
+
+	filter.configure("!(mapq < 30 || duplicate) && (CB == 'AAAA' || NH <= 1)",
+	                 CONTIGS);
+	ASSERT_EQ(filter.getProgramSize(), 4u);
+
+	// Negated tests reject records by succeeding.
+	EXPECT_EQ(rejectedBy(filter,
+	                     makeRecord(0, 10, 20, 0, 4)),
+	          "!(mapq < 30)");
+	EXPECT_EQ(rejectedBy(filter,
+	                     makeRecord(0, 10, 40, BamRecordView::FLAG_DUPLICATE, 4)),
+	          "!(duplicate)");
+
+	// Disjunctions fall through to their next operand, rejecting the record
+	// only when the last one fails.
+	EXPECT_TRUE(accepts(filter,
+	                    makeRecord(0, 10, 40, 0, 4, stringTag("CB", "AAAA"))));
+	EXPECT_TRUE(accepts(filter,
+	                    makeRecord(0, 10, 40, 0, 4, stringTag("CB", "CCCC") + integerTag("NH", 1))));
+	EXPECT_EQ(rejectedBy(filter,
+	                     makeRecord(0, 10, 40, 0, 4, stringTag("CB", "CCCC") + integerTag("NH", 2))),
+	          "NH <= 1");
+
+	// Tests on missing tags fail, both plain and under a negation.
+	EXPECT_FALSE(accepts(filter,
+	                     makeRecord(0, 10, 40, 0, 4)));
+	filter.configure("!(NH > 1)",
+	                 CONTIGS);
+	EXPECT_TRUE(accepts(filter,
+	                    makeRecord(0, 10, 40, 0, 4)));
+	EXPECT_FALSE(accepts(filter,
+	                     makeRecord(0, 10, 40, 0, 4, integerTag("NH", 3))));
+}
+
+TEST(RecordFilter, TestsFlags)
+{
+	RecordFilter filter;
+
+	filter.configure("flag & 0x904",
+	                 CONTIGS);
+	EXPECT_TRUE(accepts(filter,
+	                    makeRecord(0, 10, 40, BamRecordView::FLAG_SUPPLEMENTARY, 4)));
+	EXPECT_FALSE(accepts(filter,
+	                     makeRecord(0, 10, 40, BamRecordView::FLAG_DUPLICATE, 4)));
+	filter.configure("read1 && !reverse",
+	                 CONTIGS);
+	EXPECT_TRUE(accepts(filter,
+	                    makeRecord(0, 10, 40, BamRecordView::FLAG_READ1, 4)));
+	EXPECT_FALSE(accepts(filter,
+	                     makeRecord(0, 10, 40, BamRecordView::FLAG_READ1 | BamRecordView::FLAG_REVERSE, 4)));
+}
+
+TEST(RecordFilter, TestsContigs)
+{
+	RecordFilter filter;
+
+	filter.configure("contig == chr2",
+	                 CONTIGS);
+	EXPECT_TRUE(accepts(filter,
+	                    makeRecord(1, 10, 40, 0, 4)));
+	EXPECT_FALSE(accepts(filter,
+	                     makeRecord(0, 10, 40, 0, 4)));
+	EXPECT_FALSE(accepts(filter,
+	                     makeRecord(-1, -1, 0, BamRecordView::FLAG_UNMAPPED, 4)));
+
+	filter.configure("contig != chrM",
+	                 CONTIGS);
+	EXPECT_TRUE(accepts(filter,
+	                    makeRecord(0, 10, 40, 0, 4)));
+	EXPECT_FALSE(accepts(filter,
+	                     makeRecord(2, 10, 40, 0, 4)));
+	EXPECT_TRUE(accepts(filter,
+	                    makeRecord(-1, -1, 0, BamRecordView::FLAG_UNMAPPED, 4)));
+
+	filter.configure("contig in (chr1, 'chrM')",
+	                 CONTIGS);
+	ASSERT_EQ(filter.getProgramSize(), 1u);
+	EXPECT_TRUE(accepts(filter,
+	                    makeRecord(0, 10, 40, 0, 4)));
+	EXPECT_FALSE(accepts(filter,
+	                     makeRecord(1, 10, 40, 0, 4)));
+	EXPECT_TRUE(accepts(filter,
+	                    makeRecord(2, 10, 40, 0, 4)));
+}
+
+TEST(RecordFilter, TestsRegions)
+{
+	RecordFilter filter;
+
+	// Regions are 1-based and inclusive: chr1:101-200 spans the 0-based
+	// positions from 100 to 199.
+	filter.configure("region(chr1:101-200, chrM)",
+	                 CONTIGS);
+	ASSERT_EQ(filter.getProgramSize(), 2u);
+	EXPECT_TRUE(accepts(filter,
+	                    makeRecord(0, 199, 40, 0, 10)));
+	EXPECT_FALSE(accepts(filter,
+	                     makeRecord(0, 200, 40, 0, 10)));
+	EXPECT_TRUE(accepts(filter,
+	                    makeRecord(0, 91, 40, 0, 10)));
+	EXPECT_FALSE(accepts(filter,
+	                     makeRecord(0, 90, 40, 0, 10)));
+	EXPECT_FALSE(accepts(filter,
+	                     makeRecord(1, 150, 40, 0, 10)));
+	EXPECT_TRUE(accepts(filter,
+	                    makeRecord(2, 16000, 40, 0, 10)));
+	EXPECT_EQ(rejectedBy(filter,
+	                     makeRecord(1, 150, 40, 0, 10)),
+	          "region(chrM)");
+
+	// Regions without an end extend to the end of the contig.
+	filter.configure("region(chr2:1001)",
+	                 CONTIGS);
+	EXPECT_TRUE(accepts(filter,
+	                    makeRecord(1, 1 << 30, 40, 0, 10)));
+	EXPECT_FALSE(accepts(filter,
+	                     makeRecord(1, 990, 40, 0, 10)));
+}
@@ -0,0 +1,280 @@
+/**
+ * \file   tests/units/sam_scanner.cpp
+ * \author Elena Grassi
+ * \author Marilisa Montemurro
+ * \author Emanuele Parisi
+ * \date   February, 2019
+ *
+ * Unit tests of the parallel scanner of SAM files.
+ */
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include <seqan/bam_io.h>
+
+#include "sctools/bam_record_view.h"
+#include "sctools/sam_scanner.h"
+
+#include "test_files.h"
+
+using namespace sctools;
+
+namespace
+{
+
+/**
+ * \brief Struct storing a line visited by the scanner, along with its encoded
+ * record.
+ */
+struct ScannedLine
+{
+	/**
+	 * Text of the line.
+	 */
+	std::string text;
+	/**
+	 * Encoded record, block size included.
+	 */
+	std::string record;
+
+	/**
+	 * \brief Access a view over the encoded record.
+	 *
+	 * \return the view.
+	 */
+	BamRecordView
+	view () const noexcept
+	{
+		return BamRecordView::fromSized(record.data());
+	}
+};
+
+/**
+ * \brief Scan a SAM file, collecting its lines in file order.
+ *
+ * \param scanner is the configured scanner.
+ * \param path is the path to the SAM file.
+ * \return the visited lines.
+ */
+std::vector<ScannedLine>
+scanFile (SamScanner& scanner,
+          const fs::path& path)
+{
+	std::vector<ScannedLine>              lines;
+	std::vector<std::vector<ScannedLine>> chunks(SamScanner::getThreadsCount());
+
+	scanner.scanLines(path,
+	                  [&chunks] (const BamRecordView& record,
+	                             const char* line,
+	                             uint64_t length,
+	                             uint64_t chunkIndex,
+	                             uint64_t)
+	                  {
+		                  // The read name follows the block size and the fixed
+		                  // fields of the record.
+		                  const char* rawRecord = record.readName() - 36;
+		                  uint32_t    blockSize = 0;
+
+		                  std::memcpy(&blockSize,
+		                              rawRecord,
+		                              4);
+		                  chunks[chunkIndex].push_back({std::string(line,
+		                                                            length),
+		                                                std::string(rawRecord,
+		                                                            4 + blockSize)});
+	                  },
+	                  [&chunks, &lines] (uint64_t chunksCount)
+	                  {
+		                  for (auto i = 0ul; i < chunksCount; i++)
+		                  {
+			                  lines.insert(lines.end(),
+			                               chunks[i].begin(),
+			                               chunks[i].end());
+			                  chunks[i].clear();
+		                  }
+	                  });
+
+	return lines;
+}
+
+} // namespace
+
+TEST(SamScanner, EncodesRecordsLikeSeqAn)
+{
+	auto                      path = fs::path(SCTOOLS_TEST_DATA_DIR) / "test_bam.sam";
+	seqan::BamFileIn          bamFileIn;
+	seqan::BamHeader          header;
+	seqan::BamAlignmentRecord record;
+	std::vector<std::string>  contigNames;
+	SamScanner                scanner;
+	uint64_t                  recordsCount = 0;
+
+	ASSERT_TRUE(seqan::open(bamFileIn,
+	                        path.c_str()));
+	seqan::readHeader(header,
+	                  bamFileIn);
+	for (auto i = 0ul; i < seqan::length(seqan::contigNames(seqan::context(bamFileIn))); i++)
+	{
+		const auto& name = seqan::contigNames(seqan::context(bamFileIn))[i];
+
+		contigNames.emplace_back(seqan::begin(name,
+		                                      seqan::Standard()),
+		                         seqan::end(name,
+		                                    seqan::Standard()));
+	}
+
+	// Small chunks spread the lines over several chunks and rounds.
+	scanner.configure(contigNames,
+	                  1024);
+
+	auto lines = scanFile(scanner,
+	                      path);
+
+	while (!seqan::atEnd(bamFileIn))
+	{
+		seqan::readRecord(record,
+		                  bamFileIn);
+		ASSERT_LT(recordsCount, lines.size());
+
+		auto               view   = lines[recordsCount].view();
+		seqan::BamTagsDict tags(record.tags);
+
+		SCOPED_TRACE(lines[recordsCount].text);
+		EXPECT_STREQ(view.readName(), seqan::toCString(record.qName));
+		EXPECT_EQ(view.refId(), record.rID);
+		EXPECT_EQ(view.position(), record.beginPos);
+		EXPECT_EQ(view.mapQuality(), record.mapQ);
+		EXPECT_EQ(view.flag(), record.flag);
+		if (record.beginPos >= 0)
+		{
+			EXPECT_EQ(view.referenceEnd(),
+			          record.beginPos + std::max<int64_t>(seqan::getAlignmentLengthInRef(record),
+			                                              1));
+		}
+
+		// Every optional field is encoded, with the value SeqAn decodes.
+		EXPECT_EQ(static_cast<uint64_t>(std::count(lines[recordsCount].text.begin(),
+		                                           lines[recordsCount].text.end(),
+		                                           '\t')),
+		          10 + seqan::length(tags));
+		for (auto i = 0u; i < seqan::length(tags); i++)
+		{
+			seqan::CharString key  = seqan::getTagKey(tags,
+			                                          i);
+			char              type = seqan::getTagType(tags,
+			                                           i);
+			const char*       tag  = view.findTag(seqan::toCString(key));
+
+			ASSERT_NE(tag, nullptr) << seqan::toCString(key);
+			if (type == 'Z' || type == 'H')
+			{
+				seqan::CharString expected;
+				const char*       value  = nullptr;
+				uint64_t          length = 0;
+
+				ASSERT_TRUE(seqan::extractTagValue(expected,
+				                                   tags,
+				                                   i));
+				ASSERT_TRUE(BamRecordView::tagString(tag,
+				                                     value,
+				                                     length));
+				EXPECT_EQ(std::string(value,
+				                      length),
+				          seqan::toCString(expected));
+			}
+			else if (type != 'B' && type != 'A')
+			{
+				double expected = 0;
+				double value    = 0;
+
+				ASSERT_TRUE(seqan::extractTagValue(expected,
+				                                   tags,
+				                                   i));
+				ASSERT_TRUE(BamRecordView::tagNumber(tag,
+				                                     value));
+				EXPECT_FLOAT_EQ(value, expected) << seqan::toCString(key);
+			}
+		}
+		recordsCount += 1;
+	}
+	EXPECT_EQ(recordsCount, lines.size());
+}
+
+TEST(SamScanner, EncodesUnplacedRecordsAndFieldTypes)
+{
+	tests::TemporaryDirectory directory;
+	SamScanner                scanner;
+	const char*               value  = nullptr;
+	uint64_t                  length = 0;
+	double                    number = 0;
+
+	scanner.configure({"chr1", "chr2"});
+
+	auto lines = scanFile(scanner,
+	                      directory.write("records.sam",
+	                                      "@HD\tVN:1.6\n"
+	                                      "@SQ\tSN:chr1\tLN:1000\n"
+	                                      "r1\t4\t*\t0\t0\t*\t*\t0\t0\tACGT\tIIII\n"
+	                                      "r2\t99\tchr2\t11\t60\t2S3M1D4M\t=\t21\t30\tACGTACGTA\t*\t"
+	                                      "XA:A:q\tXI:i:-70000\tXU:i:4000000000\tXF:f:1.5\t"
+	                                      "XB:B:c,1,2\tXZ:Z:some text\r\n"
+	                                      "\n"));
+
+	ASSERT_EQ(lines.size(), 2u);
+	EXPECT_EQ(lines[0].view().refId(), -1);
+	EXPECT_EQ(lines[0].view().position(), -1);
+	EXPECT_EQ(lines[0].view().flag(), 4u);
+	EXPECT_STREQ(lines[0].view().readName(), "r1");
+
+	auto view = lines[1].view();
+
+	EXPECT_EQ(view.refId(), 1);
+	EXPECT_EQ(view.position(), 10);
+	EXPECT_EQ(view.mapQuality(), 60);
+	EXPECT_EQ(view.referenceEnd(), 18);
+	ASSERT_TRUE(BamRecordView::tagString(view.findTag("XA"),
+	                                     value,
+	                                     length));
+	EXPECT_EQ(std::string(value, length), "q");
+	ASSERT_TRUE(BamRecordView::tagNumber(view.findTag("XI"),
+	                                     number));
+	EXPECT_EQ(number, -70000);
+	ASSERT_TRUE(BamRecordView::tagNumber(view.findTag("XU"),
+	                                     number));
+	EXPECT_EQ(number, 4000000000.0);
+	ASSERT_TRUE(BamRecordView::tagNumber(view.findTag("XF"),
+	                                     number));
+	EXPECT_EQ(number, 1.5);
+	EXPECT_NE(view.findTag("XB"), nullptr);
+	ASSERT_TRUE(BamRecordView::tagString(view.findTag("XZ"),
+	                                     value,
+	                                     length));
+	EXPECT_EQ(std::string(value, length), "some text");
+	EXPECT_EQ(view.findTag("NM"), nullptr);
+}
+
+TEST(SamScanner, RejectsMalformedLines)
+{
+	tests::TemporaryDirectory directory;
+	SamScanner                scanner;
+
+	scanner.configure({"chr1"});
+	for (const char* line : {"r1\t0\tchrX\t1\t60\t4M\t*\t0\t0\tACGT\tIIII\n",
+	                         "r1\t0\tchr1\t1\t60\t4Q\t*\t0\t0\tACGT\tIIII\n",
+	                         "r1\t0\tchr1\t1\t256\t4M\t*\t0\t0\tACGT\tIIII\n",
+	                         "r1\t0\tchr1\t1\t60\t4M\t*\t0\t0\tACGT\tIIII\tNM:i:x\n",
+	                         "r1\t0\tchr1\t1\t60\t4M\t*\t0\n"})
+	{
+		EXPECT_THROW(scanFile(scanner,
+		                      directory.write("malformed.sam",
+		                                      line)),
+		             std::runtime_error) << line;
+	}
+}
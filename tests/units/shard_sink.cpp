@@ -0,0 +1,303 @@
+/**
+ * \file   tests/units/shard_sink.cpp
+ * \author Elena Grassi
+ * \author Marilisa Montemurro
+ * \author Emanuele Parisi
+ * \date   February, 2019
+ *
+ * Unit tests of the sink writing the records of every cell to a fixed number
+ * of shard files.
+ */
+
+#include <cstdint>
+#include <cstring>
+#include <experimental/filesystem>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include <seqan/bam_io.h>
+
+#include "sctools/alignments_reader.h"
+#include "sctools/bam_record_view.h"
+#include "sctools/bgzf.h"
+#include "sctools/compression_backend.h"
+#include "sctools/shard_sink.h"
+
+#include "test_files.h"
+
+namespace fs = std::experimental::filesystem;
+
+using namespace sctools;
+
+namespace
+{
+
+/**
+ * \brief Struct storing a line of the shards manifest.
+ */
+struct ManifestLine
+{
+	/**
+	 * Barcode of the cell.
+	 */
+	std::string barcode;
+	/**
+	 * Name of the shard file.
+	 */
+	std::string shard;
+	/**
+	 * Offset of the first block of the range.
+	 */
+	uint64_t    begin;
+	/**
+	 * Offset past the last block of the range.
+	 */
+	uint64_t    end;
+};
+
+/**
+ * \brief Write a BAM file holding a single reference sequence and no record.
+ *
+ * \param path is the path of the file.
+ */
+void
+writeReference (const fs::path& path)
+{
+	auto          backend = CompressionBackend::create(CompressionBackendType::ZLIB,
+	                                                   6);
+	BgzfWriter    writer;
+	std::ofstream file(path,
+	                   std::ios::binary);
+	const char    header[] = "BAM\1"
+	                         "\0\0\0\0"
+	                         "\1\0\0\0"
+	                         "\4\0\0\0" "chr\0"
+	                         "\350\3\0\0";
+
+	writer.configure(*backend,
+	                 [&file] (const char* block,
+	                          uint64_t size)
+	                 {
+		                 file.write(block,
+		                            size);
+	                 });
+	writer.write(header,
+	             sizeof(header) - 1);
+	writer.close(true);
+}
+
+/**
+ * \brief Build an unmapped record.
+ *
+ * \param name is the read name.
+ * \return the record.
+ */
+seqan::BamAlignmentRecord
+makeRecord (const std::string& name)
+{
+	seqan::BamAlignmentRecord record;
+
+	record.qName = name;
+	record.flag  = 4;
+
+	return record;
+}
+
+/**
+ * \brief Parse the shards manifest.
+ *
+ * \param path is the path of the manifest.
+ * \return the lines of the manifest, header excluded.
+ */
+std::vector<ManifestLine>
+readManifest (const fs::path& path)
+{
+	std::ifstream             manifestReader(path);
+	std::string               line;
+	std::vector<ManifestLine> lines;
+
+	std::getline(manifestReader,
+	             line);
+	EXPECT_EQ(line,
+	          "#barcode\tshard\tbegin\tend");
+	while (std::getline(manifestReader,
+	                    line))
+	{
+		std::istringstream fields(line);
+		ManifestLine       parsed;
+
+		fields >> parsed.barcode >> parsed.shard >> parsed.begin >> parsed.end;
+		lines.emplace_back(parsed);
+	}
+
+	return lines;
+}
+
+/**
+ * \brief Read the names of the records stored in a range of blocks of a
+ * shard file.
+ *
+ * \param path is the path of the shard file.
+ * \param begin is the offset of the first block of the range.
+ * \param end is the offset past the last block of the range.
+ * \return the read names, in file order.
+ */
+std::vector<std::string>
+readRange (const fs::path& path,
+           uint64_t begin,
+           uint64_t end)
+{
+	auto                     backend = CompressionBackend::create(CompressionBackendType::ZLIB,
+	                                                              6);
+	BgzfReader               reader;
+	std::vector<std::string> names;
+	std::string              record;
+
+	reader.configure(path,
+	                 *backend);
+	reader.seek(begin << 16);
+	while (reader.tell() < end << 16)
+	{
+		uint32_t blockSize = 0;
+
+		EXPECT_EQ(reader.read(reinterpret_cast<char*>(&blockSize),
+		                      4),
+		          4u);
+		record.resize(4 + blockSize);
+		std::memcpy(&record[0],
+		            &blockSize,
+		            4);
+		EXPECT_EQ(reader.read(&record[4],
+		                      blockSize),
+		          blockSize);
+
+		auto view = BamRecordView::fromSized(record.data());
+
+		names.emplace_back(view.readName(),
+		                   view.readNameLength());
+	}
+
+	return names;
+}
+
+} // namespace
+
+TEST(ShardSink, AssignsBarcodesToShardsStably)
+{
+	for (const auto& b : {"AAAC", "CCGT", "GTTA", "TTTT"})
+	{
+		EXPECT_LT(ShardSink::shardOf(b,
+		                             7),
+		          7u);
+		EXPECT_EQ(ShardSink::shardOf(b,
+		                             7),
+		          ShardSink::shardOf(b,
+		                             7));
+		EXPECT_EQ(ShardSink::shardOf(b,
+		                             1),
+		          0u);
+	}
+}
+
+TEST(ShardSink, RejectsInvalidConfigurations)
+{
+	tests::TemporaryDirectory directory;
+	ShardSink                 sink;
+	ShardSinkConfig           config;
+	AlignmentsReader          reader;
+
+	config.outputDirPath = directory / "missing";
+	EXPECT_THROW(sink.configure(config),
+	             std::invalid_argument);
+	config.outputDirPath = directory / "shards";
+	config.shardsCount   = 0;
+	fs::create_directory(config.outputDirPath);
+	EXPECT_THROW(sink.configure(config),
+	             std::invalid_argument);
+
+	// Shards copy the binary header of the input file.
+	config.shardsCount = 2;
+	sink.configure(config);
+	reader.configure(SCTOOLS_TEST_DATA_DIR "/test_bam.sam");
+	EXPECT_THROW(sink.begin(reader,
+	                        {"AAAA"}),
+	             std::invalid_argument);
+}
+
+TEST(ShardSink, IndexesTheRecordsOfEveryCell)
+{
+	static const std::vector<std::string> barcodes = {"AAAC", "CCGT", "GTTA", "TTTT", "ACGT"};
+
+	tests::TemporaryDirectory                       directory;
+	ShardSink                                       sink;
+	ShardSinkConfig                                 config;
+	AlignmentsReader                                reader;
+	std::vector<seqan::BamAlignmentRecord>          records;
+	std::map<std::string, std::vector<std::string>> expected;
+	std::map<std::string, std::vector<std::string>> actual;
+
+	config.outputDirPath   = directory / "shards";
+	config.shardsCount     = 3;
+	config.bufferedRecords = 12;
+	config.useIoUring      = false;
+	fs::create_directory(config.outputDirPath);
+	writeReference(directory / "reference.bam");
+	reader.configure(directory / "reference.bam");
+	sink.configure(config);
+	sink.begin(reader,
+	           barcodes);
+
+	// Cells receive records over several batches, so that their shards are
+	// flushed while they are still being written.
+	for (auto batch = 0ul; batch < 6; batch++)
+	{
+		for (auto cellId = 0ul; cellId < barcodes.size(); cellId++)
+		{
+			records.clear();
+			for (auto i = 0ul; i < cellId + batch % 3 + 1; i++)
+			{
+				auto name = barcodes[cellId] + ":" + std::to_string(batch) + ":" + std::to_string(i);
+
+				records.emplace_back(makeRecord(name));
+				expected[barcodes[cellId]].emplace_back(name);
+			}
+			sink.write(cellId,
+			           barcodes[cellId],
+			           records);
+		}
+		records.assign(1,
+		               makeRecord("noise:" + std::to_string(batch)));
+		sink.writeNoise(records);
+		sink.endBatch();
+	}
+	sink.finish(DemultiplexerStatistics());
+	EXPECT_TRUE(fs::exists(config.outputDirPath / "noise.bam"));
+
+	// Every cell is stored in its own shard, within the ranges listed by the
+	// manifest.
+	for (const auto& l : readManifest(config.outputDirPath / "shards_manifest.tsv"))
+	{
+		auto names = readRange(config.outputDirPath / l.shard,
+		                       l.begin,
+		                       l.end);
+
+		EXPECT_EQ(l.shard,
+		          sink.getShardPath(ShardSink::shardOf(l.barcode,
+		                                               3)).filename().string());
+		EXPECT_LT(l.begin,
+		          l.end);
+		actual[l.barcode].insert(actual[l.barcode].end(),
+		                         names.begin(),
+		                         names.end());
+	}
+	EXPECT_EQ(actual,
+	          expected);
+	EXPECT_EQ(sink.getRanges().size(),
+	          readManifest(config.outputDirPath / "shards_manifest.tsv").size());
+}
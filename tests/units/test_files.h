@@ -0,0 +1,137 @@
+/**
+ * \file   tests/units/test_files.h
+ * \author Elena Grassi
+ * \author Marilisa Montemurro
+ * \author Emanuele Parisi
+ * \date   February, 2019
+ *
+ * File containing facilities for creating the files unit tests read.
+ */
+
+#ifndef SCTOOLS_TESTS_UNITS_TEST_FILES_H
+#define SCTOOLS_TESTS_UNITS_TEST_FILES_H
+
+#include <experimental/filesystem>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+
+#include <unistd.h>
+
+#include <zlib.h>
+
+namespace fs = std::experimental::filesystem;
+
+namespace sctools
+{
+namespace tests
+{
+
+/**
+ * \brief Class owning a temporary directory, removed with its content when
+ * the instance is destroyed.
+ */
+class TemporaryDirectory
+{
+
+public:
+
+	/**
+	 * \brief Class constructor, creating the directory.
+	 */
+	TemporaryDirectory ()
+	{
+		std::string pattern = (fs::temp_directory_path() / "sctools_units_XXXXXX").string();
+
+		if (::mkdtemp(&pattern[0]) == nullptr)
+		{
+			throw std::runtime_error("cannot create a temporary directory");
+		}
+		path_ = pattern;
+	}
+
+	/**
+	 * \brief Class copy constructor.
+	 *
+	 * \param other is the object the current instance is initialized from.
+	 */
+	TemporaryDirectory (const TemporaryDirectory& other) = delete;
+
+	/**
+	 * \brief Class copy assignment operator.
+	 *
+	 * \param other is the object the current instance is initialized from.
+	 * \return a reference to the assigned object.
+	 */
+	TemporaryDirectory&
+	operator= (const TemporaryDirectory& other) = delete;
+
+	/**
+	 * \brief Class destructor, removing the directory.
+	 */
+	~TemporaryDirectory ()
+	{
+		std::error_code error;
+
+		fs::remove_all(path_,
+		               error);
+	}
+
+	/**
+	 * \brief Access the path of a file in the directory.
+	 *
+	 * \param name is the name of the file.
+	 * \return the path of the file.
+	 */
+	inline fs::path
+	operator/ (const std::string& name) const
+	{
+		return path_ / name;
+	}
+
+	/**
+	 * \brief Write a file in the directory.
+	 *
+	 * \param name is the name of the file.
+	 * \param content is the content of the file.
+	 * \param compress is true if the file is gzip-compressed.
+	 * \return the path of the file.
+	 */
+	inline fs::path
+	write (const std::string& name,
+	       const std::string& content,
+	       bool compress = false) const
+	{
+		auto path = path_ / name;
+
+		if (compress)
+		{
+			gzFile file = gzopen(path.c_str(),
+			                     "wb");
+
+			gzwrite(file,
+			        content.data(),
+			        content.size());
+			gzclose(file);
+		}
+		else
+		{
+			std::ofstream(path.string(),
+			              std::ios::binary) << content;
+		}
+
+		return path;
+	}
+
+private:
+	/**
+	 * Path of the directory.
+	 */
+	fs::path path_;
+};
+
+} // tests
+} // sctools
+
+#endif // SCTOOLS_TESTS_UNITS_TEST_FILES_H
@@ -0,0 +1,521 @@
+/**
+ * \file   tests/units/umi_deduplicator.cpp
+ * \author Elena Grassi
+ * \author Marilisa Montemurro
+ * \author Emanuele Parisi
+ * \date   February, 2019
+ *
+ * Unit tests of the collapser of the reads of the same molecule.
+ */
+
+#include <cstdint>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include <seqan/bam_io.h>
+
+#include "sctools/umi_deduplicator.h"
+
+using namespace sctools;
+
+namespace
+{
+
+/**
+ * \brief Struct storing a record emitted by the deduplicator.
+ */
+struct Emitted
+{
+	/**
+	 * Identifier of the cell the record belongs to.
+	 */
+	uint64_t    cellId;
+	/**
+	 * Name of the record.
+	 */
+	std::string name;
+};
+
+/**
+ * \brief Build an alignment record.
+ *
+ * \param name is the read name.
+ * \param rID is the reference sequence identifier.
+ * \param beginPos is the alignment position.
+ * \param mapQ is the mapping quality.
+ * \param flag is the alignment flag.
+ * \param cigar is the CIGAR string of the alignment.
+ * \return the record.
+ */
+seqan::BamAlignmentRecord
+makeRecord (const std::string& name,
+            int32_t rID,
+            int32_t beginPos,
+            uint8_t mapQ,
+            uint16_t flag = 0,
+            const std::string& cigar = "")
+{
+	seqan::BamAlignmentRecord record;
+	uint32_t                  count = 0;
+
+	record.qName    = name;
+	record.rID      = rID;
+	record.beginPos = beginPos;
+	record.mapQ     = mapQ;
+	record.flag     = flag;
+	for (auto c : cigar)
+	{
+		if (c >= '0' && c <= '9')
+		{
+			count = 10 * count + (c - '0');
+			continue;
+		}
+		seqan::appendValue(record.cigar,
+		                   seqan::CigarElement<>(c,
+		                                         count));
+		count = 0;
+	}
+
+	return record;
+}
+
+/**
+ * \brief Class feeding records to a deduplicator, and collecting the ones it
+ * emits.
+ */
+class Feeder
+{
+
+public:
+
+	/**
+	 * Deduplicator under test.
+	 */
+	UmiDeduplicator      deduplicator;
+	/**
+	 * Records emitted so far, in emission order.
+	 */
+	std::vector<Emitted> emitted;
+
+	/**
+	 * \brief Class constructor.
+	 *
+	 * \param mergeNeighbours is true if the UMIs one mismatch apart are merged.
+	 */
+	explicit Feeder (bool mergeNeighbours)
+	{
+		deduplicator.configure(mergeNeighbours);
+	}
+
+	/**
+	 * \brief Feed a record to the deduplicator.
+	 *
+	 * \param cellId is the identifier of the cell the record belongs to.
+	 * \param record is the record.
+	 * \param umi is the UMI of the record.
+	 */
+	void
+	add (uint64_t cellId,
+	     const seqan::BamAlignmentRecord& record,
+	     const std::string& umi)
+	{
+		deduplicator.add(cellId,
+		                 record,
+		                 umi,
+		                 collector_());
+	}
+
+	/**
+	 * \brief Emit every record held.
+	 */
+	void
+	flush ()
+	{
+		deduplicator.flush(collector_());
+	}
+
+private:
+	/**
+	 * \brief Build the function collecting the emitted records.
+	 *
+	 * \return the function.
+	 */
+	std::function<void(uint64_t,
+	                   seqan::BamAlignmentRecord&)>
+	collector_ ()
+	{
+		return [this] (uint64_t cellId,
+		               seqan::BamAlignmentRecord& record)
+		       {
+			       emitted.push_back({cellId,
+			                          seqan::toCString(record.qName)});
+		       };
+	}
+};
+
+} // namespace
+
+TEST(UmiDeduplicator, StartsDisabled)
+{
+	UmiDeduplicator deduplicator;
+
+	EXPECT_FALSE(deduplicator.isEnabled());
+	deduplicator.configure(false);
+	EXPECT_TRUE(deduplicator.isEnabled());
+	deduplicator.reset();
+	EXPECT_FALSE(deduplicator.isEnabled());
+}
+
+TEST(UmiDeduplicator, KeepsTheBestReadOfEveryMolecule)
+{
+	Feeder feeder(false);
+
+	feeder.add(0,
+	           makeRecord("r1",
+	                      0,
+	                      100,
+	                      10),
+	           "ACGT");
+	feeder.add(0,
+	           makeRecord("r2",
+	                      0,
+	                      100,
+	                      30),
+	           "ACGT");
+	feeder.add(0,
+	           makeRecord("r3",
+	                      0,
+	                      100,
+	                      20),
+	           "ACGT");
+	feeder.add(0,
+	           makeRecord("r4",
+	                      0,
+	                      101,
+	                      10),
+	           "ACGT");
+	EXPECT_TRUE(feeder.emitted.empty());
+
+	// Forward molecules are emitted once the stream is past their window.
+	feeder.add(0,
+	           makeRecord("r5",
+	                      0,
+	                      100 + UmiDeduplicator::WINDOW + 1,
+	                      10),
+	           "ACGT");
+	ASSERT_EQ(feeder.emitted.size(),
+	          1u);
+	EXPECT_EQ(feeder.emitted[0].name,
+	          "r2");
+	feeder.flush();
+	ASSERT_EQ(feeder.emitted.size(),
+	          3u);
+	EXPECT_EQ(feeder.emitted[1].name,
+	          "r4");
+	EXPECT_EQ(feeder.emitted[2].name,
+	          "r5");
+	EXPECT_EQ(feeder.deduplicator.getMoleculesCount(),
+	          3u);
+	EXPECT_EQ(feeder.deduplicator.getDuplicatesCount(),
+	          2u);
+}
+
+TEST(UmiDeduplicator, SeparatesCellsAndStrands)
+{
+	Feeder feeder(false);
+
+	feeder.add(0,
+	           makeRecord("forward",
+	                      0,
+	                      100,
+	                      10),
+	           "ACGT");
+	feeder.add(0,
+	           makeRecord("reverse",
+	                      0,
+	                      100,
+	                      10,
+	                      16),
+	           "ACGT");
+	feeder.add(1,
+	           makeRecord("other",
+	                      0,
+	                      100,
+	                      10),
+	           "ACGT");
+	feeder.add(1,
+	           makeRecord("otherDuplicate",
+	                      0,
+	                      100,
+	                      5),
+	           "ACGT");
+	feeder.flush();
+	ASSERT_EQ(feeder.emitted.size(),
+	          3u);
+	EXPECT_EQ(feeder.emitted[0].name,
+	          "forward");
+	EXPECT_EQ(feeder.emitted[1].name,
+	          "reverse");
+	EXPECT_EQ(feeder.emitted[2].name,
+	          "other");
+	EXPECT_EQ(feeder.emitted[2].cellId,
+	          1u);
+	EXPECT_EQ(feeder.deduplicator.getDuplicatesCount(),
+	          1u);
+}
+
+TEST(UmiDeduplicator, CollapsesReadsOfTheSameUnclippedEnd)
+{
+	Feeder feeder(false);
+
+	// Forward reads are identified by their unclipped start.
+	feeder.add(0,
+	           makeRecord("forward",
+	                      0,
+	                      100,
+	                      10,
+	                      0,
+	                      "10M"),
+	           "ACGT");
+	feeder.add(0,
+	           makeRecord("forwardClipped",
+	                      0,
+	                      103,
+	                      20,
+	                      0,
+	                      "3S10M"),
+	           "ACGT");
+	feeder.add(0,
+	           makeRecord("forwardShifted",
+	                      0,
+	                      103,
+	                      10,
+	                      0,
+	                      "10M"),
+	           "ACGT");
+
+	// Reverse reads are identified by their unclipped end.
+	feeder.add(0,
+	           makeRecord("reverseLong",
+	                      0,
+	                      200,
+	                      10,
+	                      16,
+	                      "20M"),
+	           "ACGT");
+	feeder.add(0,
+	           makeRecord("reverseClipped",
+	                      0,
+	                      205,
+	                      10,
+	                      16,
+	                      "10M2S"),
+	           "ACGT");
+	feeder.add(0,
+	           makeRecord("reverseShort",
+	                      0,
+	                      210,
+	                      20,
+	                      16,
+	                      "4M2D4M"),
+	           "ACGT");
+	feeder.flush();
+	ASSERT_EQ(feeder.emitted.size(),
+	          4u);
+	EXPECT_EQ(feeder.emitted[0].name,
+	          "forwardClipped");
+	EXPECT_EQ(feeder.emitted[1].name,
+	          "forwardShifted");
+	EXPECT_EQ(feeder.emitted[2].name,
+	          "reverseClipped");
+	EXPECT_EQ(feeder.emitted[3].name,
+	          "reverseShort");
+	EXPECT_EQ(feeder.deduplicator.getMoleculesCount(),
+	          4u);
+	EXPECT_EQ(feeder.deduplicator.getDuplicatesCount(),
+	          2u);
+}
+
+TEST(UmiDeduplicator, EmitsRecordsInCoordinateOrder)
+{
+	Feeder feeder(false);
+
+	// The reverse molecule holds back the records after it until the
+	// stream is past its end.
+	feeder.add(0,
+	           makeRecord("reverse",
+	                      0,
+	                      100,
+	                      10,
+	                      16,
+	                      "500M"),
+	           "ACGT");
+	feeder.add(0,
+	           makeRecord("noUmi",
+	                      0,
+	                      150,
+	                      10),
+	           "");
+	feeder.add(0,
+	           makeRecord("forward",
+	                      0,
+	                      300,
+	                      10,
+	                      0,
+	                      "20M"),
+	           "ACGT");
+	feeder.add(0,
+	           makeRecord("reverseDuplicate",
+	                      0,
+	                      580,
+	                      5,
+	                      16,
+	                      "20M"),
+	           "ACGT");
+	EXPECT_TRUE(feeder.emitted.empty());
+	feeder.add(0,
+	           makeRecord("next",
+	                      0,
+	                      600,
+	                      10,
+	                      0,
+	                      "20M"),
+	           "ACGT");
+	ASSERT_EQ(feeder.emitted.size(),
+	          2u);
+	EXPECT_EQ(feeder.emitted[0].name,
+	          "reverse");
+	EXPECT_EQ(feeder.emitted[1].name,
+	          "noUmi");
+	feeder.flush();
+	ASSERT_EQ(feeder.emitted.size(),
+	          4u);
+	EXPECT_EQ(feeder.emitted[2].name,
+	          "forward");
+	EXPECT_EQ(feeder.emitted[3].name,
+	          "next");
+	EXPECT_EQ(feeder.deduplicator.getDuplicatesCount(),
+	          1u);
+}
+
+TEST(UmiDeduplicator, PassesThroughReadsWithoutMolecule)
+{
+	Feeder feeder(false);
+
+	feeder.add(0,
+	           makeRecord("mapped",
+	                      0,
+	                      100,
+	                      10),
+	           "ACGT");
+	feeder.add(0,
+	           makeRecord("noUmi",
+	                      0,
+	                      100,
+	                      10),
+	           "");
+	ASSERT_EQ(feeder.emitted.size(),
+	          1u);
+	EXPECT_EQ(feeder.emitted[0].name,
+	          "noUmi");
+
+	// Unmapped reads are sorted last, and never count as missing a UMI.
+	feeder.add(0,
+	           makeRecord("unmapped",
+	                      -1,
+	                      -1,
+	                      0,
+	                      4),
+	           "ACGT");
+	ASSERT_EQ(feeder.emitted.size(),
+	          3u);
+	EXPECT_EQ(feeder.emitted[1].name,
+	          "mapped");
+	EXPECT_EQ(feeder.emitted[2].name,
+	          "unmapped");
+	EXPECT_EQ(feeder.deduplicator.getMissingUmiCount(),
+	          1u);
+	EXPECT_EQ(feeder.deduplicator.getMoleculesCount(),
+	          1u);
+}
+
+TEST(UmiDeduplicator, MergesNeighbourUmis)
+{
+	for (auto mergeNeighbours : {false, true})
+	{
+		Feeder feeder(mergeNeighbours);
+		auto   addCopies = [&feeder] (const std::string& umi,
+		                              uint64_t count)
+		{
+			for (auto i = 0ul; i < count; i++)
+			{
+				feeder.add(0,
+				           makeRecord(umi + std::to_string(i),
+				                      0,
+				                      100,
+				                      static_cast<uint8_t>(10 + i)),
+				           umi);
+			}
+		};
+
+		// AAAT is absorbed by the far more abundant AAAA, while AATT is
+		// not absorbed by the hardly more abundant AAAT.
+		addCopies("AAAA",
+		          5);
+		addCopies("AAAT",
+		          2);
+		addCopies("AATT",
+		          3);
+		addCopies("CCCC",
+		          1);
+		feeder.flush();
+		if (mergeNeighbours)
+		{
+			ASSERT_EQ(feeder.emitted.size(),
+			          3u);
+			EXPECT_EQ(feeder.emitted[0].name,
+			          "AAAA4");
+			EXPECT_EQ(feeder.emitted[1].name,
+			          "AATT2");
+			EXPECT_EQ(feeder.emitted[2].name,
+			          "CCCC0");
+		}
+		else
+		{
+			EXPECT_EQ(feeder.emitted.size(),
+			          4u);
+		}
+		EXPECT_EQ(feeder.deduplicator.getMoleculesCount() + feeder.deduplicator.getDuplicatesCount(),
+		          11u);
+	}
+}
+
+TEST(UmiDeduplicator, RejectsUnsortedInput)
+{
+	Feeder feeder(false);
+
+	feeder.add(0,
+	           makeRecord("r1",
+	                      1,
+	                      100,
+	                      10),
+	           "ACGT");
+	EXPECT_THROW(feeder.add(0,
+	                        makeRecord("r2",
+	                                   1,
+	                                   99,
+	                                   10),
+	                        "ACGT"),
+	             std::runtime_error);
+	EXPECT_THROW(feeder.add(0,
+	                        makeRecord("r3",
+	                                   0,
+	                                   200,
+	                                   10),
+	                        "ACGT"),
+	             std::runtime_error);
+}